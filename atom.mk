@@ -76,6 +76,85 @@ include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
+LOCAL_DESTDIR := ./
+LOCAL_MODULE := ratelimit_test
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/utils
+
+LOCAL_SRC_FILES := logserver/logserver_ratelimit.test.c \
+			utils/timer.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_LIBRARIES := libthttp
+
+LOCAL_DESTDIR := ./
+LOCAL_MODULE := buffer_test
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/utils
+
+LOCAL_SRC_FILES := buffer.test.c \
+			utils/json.c \
+			utils/timer.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_LIBRARIES := mbedtls
+
+LOCAL_DESTDIR := ./
+LOCAL_MODULE := resume_test
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/utils
+
+LOCAL_SRC_FILES := resume.test.c \
+			utils/fs.c \
+			utils/tsh.c \
+			utils/pvsignals.c \
+			utils/timer.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_LIBRARIES := libthttp
+
+LOCAL_DESTDIR := ./
+LOCAL_MODULE := catalog_test
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/utils
+
+LOCAL_SRC_FILES := storage_catalog.test.c \
+			paths.c \
+			utils/json.c \
+			utils/fs.c \
+			utils/tsh.c \
+			utils/pvsignals.c \
+			utils/timer.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_DESTDIR := ./
+LOCAL_MODULE := objects_test
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/utils
+
+LOCAL_SRC_FILES := storage_objects.test.c \
+			paths.c \
+			utils/fs.c \
+			utils/tsh.c \
+			utils/pvsignals.c \
+			utils/timer.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
 # keep this as null-op target for backward compatibilityyy
 LOCAL_MODULE := init-dm
 
@@ -22,55 +22,107 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <sys/types.h>
 #include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
 #include "buffer.h"
+#include "utils/json.h"
+#include "utils/timer.h"
 
 #define MODULE_NAME "buffer"
+#ifndef PVTEST
 #define pv_log(level, msg, ...) vlog(MODULE_NAME, level, msg, ##__VA_ARGS__)
+#else
+#define pv_log(level, msg, ...)                                                \
+	printf("%s[%d]: ", MODULE_NAME, level);                                \
+	printf(msg "\n", ##__VA_ARGS__)
+#endif
 #include "log.h"
 
-static int max_items_num = 0;
-static int max_item_size = 0;
+/*
+ * Buffers are kept in power of two size classes, from BUFFER_MIN_SIZE up to
+ * the large size. The classes for the configured size and the large size are
+ * preallocated, the rest grow on demand. The pool as a whole can grow up to
+ * BUFFER_GROWTH times its preallocated size; past that, requests borrow an
+ * idle buffer from a larger class before giving up. Requests larger than the
+ * largest class get a buffer from it, so always check buffer->size.
+ *
+ * Each process that uses the pool has to call pv_buffer_trim_check() from
+ * its loop. Grown buffers that were not needed during the last
+ * BUFFER_TRIM_IDLE_SEC are given back, and everything above the
+ * preallocated reserve is given back when memory runs low.
+ */
 
-static DEFINE_DL_LIST(buffer_list);
-static DEFINE_DL_LIST(buffer_list_double);
+#define BUFFER_MIN_SIZE (4096)
+#define BUFFER_MAX_CLASSES (16)
+#define BUFFER_GROWTH (2)
+#define BUFFER_TRIM_FREE_PCT (10)
+#define BUFFER_TRIM_CHECK_SEC (5)
+#define BUFFER_TRIM_IDLE_SEC (60)
 
-#define __put_buf_back__ __cleanup__(__put_buff)
+// counters shared by all processes forked after init
+struct buffer_stats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t drops;
+	uint32_t high_water;
+};
 
-static struct buffer *__pv_buffer_get(struct dl_list *head)
-{
-	struct buffer *buffer = NULL;
+struct buffer_class {
+	int size;
+	int reserve;
+	int allocated;
+	int in_use;
+	// most buffers in use since the last idle trim
+	int peak;
+	struct buffer_stats *stats;
+	struct dl_list free_list;
+};
 
-	if (dl_list_empty(head))
-		return NULL;
-	buffer = dl_list_first(head, struct buffer, free_list);
-	dl_list_del(&buffer->free_list);
-	dl_list_init(&buffer->free_list);
-	return buffer;
+static struct buffer_class classes[BUFFER_MAX_CLASSES];
+static int classes_num = 0;
+static int max_item_size = 0;
+static int generation = 0;
+static size_t pool_bytes = 0;
+static size_t pool_budget = 0;
+
+static struct buffer_stats *shared_stats = NULL;
+static struct timer trim_timer;
+static struct timer idle_timer;
+
+static void pv_buffer_stat_add(uint32_t *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
 }
 
-struct buffer *pv_buffer_get(bool large)
+static void pv_buffer_stat_max(uint32_t *counter, uint32_t value)
 {
-	if (large)
-		return __pv_buffer_get(&buffer_list_double);
-	return __pv_buffer_get(&buffer_list);
+	uint32_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (cur < value &&
+	       !__atomic_compare_exchange_n(counter, &cur, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
 }
 
-void pv_buffer_drop(struct buffer *buffer)
+static struct buffer_class *pv_buffer_class_by_size(int size)
 {
-	if (!buffer)
-		return;
-	if (!dl_list_empty(&buffer->free_list))
-		return;
-	if (max_item_size == buffer->size)
-		dl_list_add(&buffer_list, &buffer->free_list);
-	else
-		dl_list_add(&buffer_list_double, &buffer->free_list);
+	for (int i = 0; i < classes_num; i++) {
+		if (classes[i].size >= size)
+			return &classes[i];
+	}
+
+	// too large for any class: callers truncate to the buffer size
+	if (classes_num)
+		return &classes[classes_num - 1];
+
+	return NULL;
 }
 
 static struct buffer *pv_buffer_alloc(int buf_size)
@@ -87,57 +139,315 @@ static struct buffer *pv_buffer_alloc(int buf_size)
 			buffer = NULL;
 		} else {
 			buffer->size = buf_size;
+			buffer->gen = generation;
+			dl_list_init(&buffer->free_list);
 		}
 	}
 	return buffer;
 }
 
-static int pv_buffer_init_cache(int items, int size, struct dl_list *head)
+static void pv_buffer_free(struct buffer *buffer)
 {
-	int allocated = 0;
+	free(buffer->buf);
+	free(buffer);
+}
+
+static struct buffer *pv_buffer_class_pop(struct buffer_class *c)
+{
+	struct buffer *buffer = NULL;
+
+	if (dl_list_empty(&c->free_list))
+		return NULL;
+	buffer = dl_list_first(&c->free_list, struct buffer, free_list);
+	dl_list_del(&buffer->free_list);
+	dl_list_init(&buffer->free_list);
+
+	c->in_use++;
+	if (c->in_use > c->peak)
+		c->peak = c->in_use;
+	pv_buffer_stat_max(&c->stats->high_water, c->in_use);
+
+	return buffer;
+}
+
+static struct buffer *pv_buffer_class_grow(struct buffer_class *c)
+{
+	struct buffer *buffer;
+
+	if (pool_bytes + c->size > pool_budget)
+		return NULL;
+
+	buffer = pv_buffer_alloc(c->size);
+	if (!buffer)
+		return NULL;
 
-	if (!dl_list_empty(head)) {
-		struct buffer *item, *tmp;
-		dl_list_for_each_safe(item, tmp, head, struct buffer, free_list)
-		{
-			dl_list_del(&item->free_list);
-			free(item->buf);
-			free(item);
+	c->allocated++;
+	pool_bytes += c->size;
+	dl_list_add(&c->free_list, &buffer->free_list);
+
+	return pv_buffer_class_pop(c);
+}
+
+struct buffer *pv_buffer_get_size(int size)
+{
+	struct buffer_class *c = pv_buffer_class_by_size(size);
+	struct buffer *buffer;
+
+	if (!c)
+		return NULL;
+
+	buffer = pv_buffer_class_pop(c);
+	if (buffer) {
+		pv_buffer_stat_add(&c->stats->hits);
+		return buffer;
+	}
+
+	pv_buffer_stat_add(&c->stats->misses);
+
+	buffer = pv_buffer_class_grow(c);
+	if (buffer)
+		return buffer;
+
+	// out of budget: a bigger idle buffer is better than losing data
+	for (struct buffer_class *l = c + 1; l < classes + classes_num; l++) {
+		buffer = pv_buffer_class_pop(l);
+		if (buffer)
+			return buffer;
+	}
+
+	pv_buffer_stat_add(&c->stats->drops);
+	return NULL;
+}
+
+struct buffer *pv_buffer_get(bool large)
+{
+	return pv_buffer_get_size(large ? max_item_size * 2 : max_item_size);
+}
+
+void pv_buffer_drop(struct buffer *buffer)
+{
+	struct buffer_class *c;
+
+	if (!buffer)
+		return;
+	if (!dl_list_empty(&buffer->free_list))
+		return;
+
+	// handed out before the pool was reinitialized
+	if (buffer->gen != generation) {
+		pv_buffer_free(buffer);
+		return;
+	}
+
+	c = pv_buffer_class_by_size(buffer->size);
+	if (!c || c->size != buffer->size) {
+		pv_buffer_free(buffer);
+		return;
+	}
+
+	c->in_use--;
+	dl_list_add(&c->free_list, &buffer->free_list);
+}
+
+static int pv_buffer_trim_class(struct buffer_class *c, int keep)
+{
+	struct buffer *item, *tmp;
+	int freed = 0;
+
+	dl_list_for_each_safe(item, tmp, &c->free_list, struct buffer,
+			      free_list)
+	{
+		if (c->allocated <= keep)
+			break;
+		dl_list_del(&item->free_list);
+		pv_buffer_free(item);
+		c->allocated--;
+		pool_bytes -= c->size;
+		freed++;
+	}
+
+	return freed;
+}
+
+void pv_buffer_trim(void)
+{
+	int freed = 0;
+
+	for (int i = 0; i < classes_num; i++)
+		freed += pv_buffer_trim_class(&classes[i], classes[i].reserve);
+
+	if (freed) {
+		pv_log(DEBUG, "trimmed %d idle buffers", freed);
+	}
+}
+
+// gives back the grown buffers that were not used for a while
+static void pv_buffer_trim_idle(void)
+{
+	struct buffer_class *c;
+	int freed = 0;
+
+	for (int i = 0; i < classes_num; i++) {
+		c = &classes[i];
+		freed += pv_buffer_trim_class(
+			c, c->peak > c->reserve ? c->peak : c->reserve);
+		c->peak = c->in_use;
+	}
+
+	if (freed) {
+		pv_log(DEBUG, "trimmed %d idle buffers", freed);
+	}
+}
+
+void pv_buffer_trim_check(void)
+{
+	struct sysinfo info;
+
+	if (!timer_current_state(&trim_timer).fin)
+		return;
+	timer_start(&trim_timer, BUFFER_TRIM_CHECK_SEC, 0, RELATIV_TIMER);
+
+	if (timer_current_state(&idle_timer).fin) {
+		timer_start(&idle_timer, BUFFER_TRIM_IDLE_SEC, 0,
+			    RELATIV_TIMER);
+		pv_buffer_trim_idle();
+	}
+
+	if (sysinfo(&info) || !info.totalram)
+		return;
+
+	if ((info.freeram + info.bufferram) * 100 / info.totalram >=
+	    BUFFER_TRIM_FREE_PCT)
+		return;
+
+	pv_buffer_trim();
+}
+
+char *pv_buffer_get_json(void)
+{
+	struct pv_json_ser js;
+
+	pv_json_ser_init(&js, 1024);
+
+	pv_json_ser_object(&js);
+	{
+		pv_json_ser_key(&js, "size");
+		pv_json_ser_number(&js, max_item_size);
+		pv_json_ser_key(&js, "budget");
+		pv_json_ser_number(&js, pool_budget);
+		pv_json_ser_key(&js, "allocated");
+		pv_json_ser_number(&js, pool_bytes);
+		pv_json_ser_key(&js, "classes");
+		pv_json_ser_array(&js);
+		for (int i = 0; i < classes_num; i++) {
+			struct buffer_class *c = &classes[i];
+
+			pv_json_ser_object(&js);
+			pv_json_ser_key(&js, "size");
+			pv_json_ser_number(&js, c->size);
+			pv_json_ser_key(&js, "allocated");
+			pv_json_ser_number(&js, c->allocated);
+			pv_json_ser_key(&js, "in_use");
+			pv_json_ser_number(&js, c->in_use);
+			pv_json_ser_key(&js, "high_water");
+			pv_json_ser_number(&js, c->stats->high_water);
+			pv_json_ser_key(&js, "hits");
+			pv_json_ser_number(&js, c->stats->hits);
+			pv_json_ser_key(&js, "misses");
+			pv_json_ser_number(&js, c->stats->misses);
+			pv_json_ser_key(&js, "drops");
+			pv_json_ser_number(&js, c->stats->drops);
+			pv_json_ser_object_pop(&js);
 		}
+		pv_json_ser_array_pop(&js);
+		pv_json_ser_object_pop(&js);
 	}
 
-	dl_list_init(head);
+	return pv_json_ser_str(&js);
+}
+
+static int pv_buffer_init_cache(struct buffer_class *c, int items)
+{
+	int allocated = 0;
+
 	while (items > 0) {
-		struct buffer *buffer = NULL;
+		struct buffer *buffer = pv_buffer_alloc(c->size);
 
-		if (allocated >= max_items_num)
-			break;
-		buffer = pv_buffer_alloc(size);
 		if (buffer) {
-			dl_list_add(head, &buffer->free_list);
+			dl_list_add(&c->free_list, &buffer->free_list);
 			allocated++;
 		}
 		items--;
 	}
+
+	c->reserve = allocated;
+	c->allocated = allocated;
+	pool_bytes += (size_t)allocated * c->size;
+
 	return allocated;
 }
 
+static void pv_buffer_init_stats(void)
+{
+	size_t len = sizeof(struct buffer_stats) * BUFFER_MAX_CLASSES;
+	static struct buffer_stats local_stats[BUFFER_MAX_CLASSES];
+
+	if (shared_stats && shared_stats != local_stats)
+		munmap(shared_stats, len);
+
+	shared_stats = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared_stats == MAP_FAILED)
+		shared_stats = local_stats;
+
+	memset(shared_stats, 0, len);
+}
+
 void pv_buffer_init(int items, int size)
 {
-	int allocated_cache = 0;
-	int allocated_dcache = 0;
+	int size_class = BUFFER_MIN_SIZE;
 
-	max_items_num = items;
+	// drop whatever is idle from a previous init
+	for (int i = 0; i < classes_num; i++) {
+		classes[i].reserve = 0;
+		pv_buffer_trim_class(&classes[i], 0);
+	}
+
+	generation++;
 	max_item_size = size;
+	pool_bytes = 0;
+
+	pv_buffer_init_stats();
+
+	while (size_class / 2 >= size)
+		size_class /= 2;
+
+	classes_num = 0;
+	while (classes_num < BUFFER_MAX_CLASSES) {
+		struct buffer_class *c = &classes[classes_num];
+
+		memset(c, 0, sizeof(*c));
+		c->size = size_class;
+		c->stats = &shared_stats[classes_num];
+		dl_list_init(&c->free_list);
+		classes_num++;
+
+		if (size_class >= size * 2)
+			break;
+		size_class *= 2;
+	}
 
-	allocated_cache =
-		pv_buffer_init_cache(max_items_num, size, &buffer_list);
+	struct buffer_class *c = pv_buffer_class_by_size(size);
+	struct buffer_class *dc = pv_buffer_class_by_size(size * 2);
 
-	allocated_dcache = pv_buffer_init_cache(max_items_num, size * 2,
-						&buffer_list_double);
+	pv_buffer_init_cache(c, items);
+	pv_buffer_init_cache(dc, items);
+	pool_budget = pool_bytes * BUFFER_GROWTH;
 
-	pv_log(DEBUG, "Allocated %d log buffers of size %d bytes",
-	       allocated_cache, size);
-	pv_log(DEBUG, "Allocated %d log buffers of size %d bytes",
-	       allocated_dcache, size * 2);
+	pv_log(DEBUG, "Allocated %d log buffers of size %d bytes", c->reserve,
+	       c->size);
+	pv_log(DEBUG, "Allocated %d log buffers of size %d bytes", dc->reserve,
+	       dc->size);
+	pv_log(DEBUG, "%d buffer size classes, growing up to %zu bytes",
+	       classes_num, pool_budget);
 }
@@ -29,17 +29,24 @@
 struct buffer {
 	char *buf;
 	int size;
+	int gen;
 	struct dl_list free_list;
 };
 
 #define __drop_buf__ __cleanup__(__drop_buff)
 
 struct buffer *pv_buffer_get(bool large);
+struct buffer *pv_buffer_get_size(int size);
 
 void pv_buffer_drop(struct buffer *);
 
 void pv_buffer_init(int items, int size);
 
+void pv_buffer_trim(void);
+void pv_buffer_trim_check(void);
+
+char *pv_buffer_get_json(void);
+
 static void __drop_buff(struct buffer **buf)
 {
 	if (*buf) {
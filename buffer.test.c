@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PVTEST
+#define PVTEST
+#endif
+
+#include "buffer.c"
+#include "utils/pvtest.h"
+
+// one preallocated buffer of 8 KiB and one of 16 KiB, 48 KiB budget
+#define TEST_SIZE (5000)
+
+static int test_classes(void)
+{
+	struct buffer *b;
+
+	pv_buffer_init(1, TEST_SIZE);
+
+	PVTEST_CHECK(classes_num == 3);
+	PVTEST_CHECK(classes[0].size == 4096);
+	PVTEST_CHECK(classes[1].size == 8192);
+	PVTEST_CHECK(classes[2].size == 16384);
+	PVTEST_CHECK(pool_bytes == 8192 + 16384);
+	PVTEST_CHECK(pool_budget == 2 * pool_bytes);
+
+	// each request gets the smallest class that fits
+	b = pv_buffer_get_size(100);
+	PVTEST_CHECK(b && b->size == 4096);
+	pv_buffer_drop(b);
+
+	b = pv_buffer_get(false);
+	PVTEST_CHECK(b && b->size == 8192);
+	PVTEST_CHECK(classes[1].stats->hits == 1);
+	pv_buffer_drop(b);
+
+	b = pv_buffer_get(true);
+	PVTEST_CHECK(b && b->size == 16384);
+	pv_buffer_drop(b);
+
+	// larger than any class, served from the largest one
+	b = pv_buffer_get_size(1 << 20);
+	PVTEST_CHECK(b && b->size == 16384);
+
+	// dropping twice does not put it twice in the pool
+	pv_buffer_drop(b);
+	pv_buffer_drop(b);
+	PVTEST_CHECK(classes[2].in_use == 0);
+	PVTEST_CHECK(dl_list_len(&classes[2].free_list) == 1);
+
+	return 0;
+}
+
+static int test_budget(void)
+{
+	struct buffer *small[8], *b, *big;
+	int got = 0;
+
+	pv_buffer_init(1, TEST_SIZE);
+
+	// the small class grows until the pool reaches its budget
+	for (int i = 0; i < 8; i++) {
+		small[i] = pv_buffer_get_size(100);
+		if (small[i] && small[i]->size == 4096)
+			got++;
+	}
+	PVTEST_CHECK(got == 6);
+	PVTEST_CHECK(pool_bytes == pool_budget);
+	PVTEST_CHECK(classes[0].stats->misses == 8);
+
+	// past the budget, idle buffers of larger classes are borrowed
+	PVTEST_CHECK(small[6] && small[6]->size == 8192);
+	PVTEST_CHECK(small[7] && small[7]->size == 16384);
+
+	// and nothing is left after that
+	b = pv_buffer_get_size(100);
+	PVTEST_CHECK(!b);
+	PVTEST_CHECK(classes[0].stats->drops == 1);
+
+	big = pv_buffer_get(true);
+	PVTEST_CHECK(!big);
+
+	for (int i = 0; i < 8; i++)
+		pv_buffer_drop(small[i]);
+	PVTEST_CHECK(classes[0].in_use == 0);
+	PVTEST_CHECK(classes[0].stats->high_water == 6);
+
+	// trimming gives back everything above the preallocated reserve
+	pv_buffer_trim();
+	PVTEST_CHECK(classes[0].allocated == 0);
+	PVTEST_CHECK(classes[1].allocated == 1);
+	PVTEST_CHECK(classes[2].allocated == 1);
+	PVTEST_CHECK(pool_bytes == 8192 + 16384);
+
+	return 0;
+}
+
+static int test_trim_idle(void)
+{
+	struct buffer *b[3];
+
+	pv_buffer_init(1, TEST_SIZE);
+
+	for (int i = 0; i < 3; i++)
+		b[i] = pv_buffer_get_size(100);
+	for (int i = 0; i < 3; i++)
+		pv_buffer_drop(b[i]);
+	PVTEST_CHECK(classes[0].allocated == 3);
+
+	// buffers used since the last idle trim are kept
+	pv_buffer_trim_idle();
+	PVTEST_CHECK(classes[0].allocated == 3);
+
+	b[0] = pv_buffer_get_size(100);
+	pv_buffer_drop(b[0]);
+
+	// only the peak of the last period stays
+	pv_buffer_trim_idle();
+	PVTEST_CHECK(classes[0].allocated == 1);
+
+	pv_buffer_trim_idle();
+	PVTEST_CHECK(classes[0].allocated == 0);
+	PVTEST_CHECK(classes[1].allocated == 1);
+
+	return 0;
+}
+
+static int test_reinit(void)
+{
+	struct buffer *b;
+
+	pv_buffer_init(1, TEST_SIZE);
+	b = pv_buffer_get(false);
+	PVTEST_CHECK(b);
+
+	// a buffer from the previous pool is freed instead of kept
+	pv_buffer_init(1, TEST_SIZE);
+	pv_buffer_drop(b);
+	PVTEST_CHECK(classes[1].allocated == 1);
+	PVTEST_CHECK(dl_list_len(&classes[1].free_list) == 1);
+
+	return 0;
+}
+
+int main()
+{
+	int ret = 0;
+
+	printf("=== size classes ===\n");
+	ret |= test_classes();
+	printf("=== budget ===\n");
+	ret |= test_budget();
+	printf("=== idle trim ===\n");
+	ret |= test_trim_idle();
+	printf("=== reinit ===\n");
+	ret |= test_reinit();
+
+	printf("%s\n", ret ? "FAILED" : "OK");
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <linux/limits.h>
+
+#include "chunks.h"
+#include "utils/fs.h"
+#include "utils/str.h"
+
+#define MODULE_NAME "chunks"
+#define pv_log(level, msg, ...) vlog(MODULE_NAME, level, msg, ##__VA_ARGS__)
+#include "log.h"
+
+// appends the chunks listed in buf, seed is set as the file that holds them
+int pv_chunks_parse(struct pv_chunks *chunks, const char *buf,
+		    const char *seed)
+{
+	struct pv_chunk *c, *tmp;
+	const char *line = buf;
+	uintmax_t size;
+	off_t offset = 0;
+	int n, fields, len = chunks->len;
+
+	while (line && *line) {
+		if (chunks->len == chunks->cap) {
+			chunks->cap = chunks->cap ? 2 * chunks->cap : 256;
+			tmp = realloc(chunks->c,
+				      chunks->cap * sizeof(struct pv_chunk));
+			if (!tmp)
+				return -1;
+			chunks->c = tmp;
+		}
+
+		c = &chunks->c[chunks->len];
+		fields = sscanf(line, "%64[0-9a-fA-F] %ju%n", c->id, &size, &n);
+		if (fields != 2 || strlen(c->id) != 64 || !size)
+			return -1;
+
+		c->size = size;
+		c->offset = offset;
+		c->seed = seed;
+		offset += c->size;
+		chunks->len++;
+
+		line = strchr(line + n, '\n');
+		if (line)
+			line++;
+	}
+
+	return chunks->len > len ? 0 : -1;
+}
+
+// appends the chunks of the index kept next to the object in obj_path
+int pv_chunks_load_index(struct pv_chunks *chunks, const char *obj_path)
+{
+	char path[PATH_MAX];
+	char *buf;
+	int ret;
+
+	SNPRINTF_WTRUNC(path, sizeof(path), CHUNK_INDEX_FMT, obj_path);
+	buf = pv_fs_file_load(path, 0);
+	if (!buf)
+		return -1;
+
+	ret = pv_chunks_parse(chunks, buf, obj_path);
+	if (ret)
+		pv_log(WARN, "could not parse chunk index %s", path);
+	free(buf);
+
+	return ret;
+}
+
+static int pv_chunks_cmp(const void *a, const void *b)
+{
+	return strcasecmp(((const struct pv_chunk *)a)->id,
+			  ((const struct pv_chunk *)b)->id);
+}
+
+// sorts by id, needed before pv_chunks_find() and pv_chunks_refs()
+void pv_chunks_sort(struct pv_chunks *chunks)
+{
+	if (chunks->len)
+		qsort(chunks->c, chunks->len, sizeof(struct pv_chunk),
+		      pv_chunks_cmp);
+}
+
+struct pv_chunk *pv_chunks_find(struct pv_chunks *chunks,
+				const struct pv_chunk *c)
+{
+	struct pv_chunk *found;
+
+	if (!chunks->len)
+		return NULL;
+
+	found = bsearch(c, chunks->c, chunks->len, sizeof(struct pv_chunk),
+			pv_chunks_cmp);
+	if (!found || found->size != c->size)
+		return NULL;
+
+	return found;
+}
+
+// number of entries with this id, that is, how many times it is referenced
+int pv_chunks_refs(struct pv_chunks *chunks, const char *id)
+{
+	struct pv_chunk key, *found;
+	int first, last;
+
+	if (!chunks->len)
+		return 0;
+
+	SNPRINTF_WTRUNC(key.id, sizeof(key.id), "%s", id);
+	found = bsearch(&key, chunks->c, chunks->len, sizeof(struct pv_chunk),
+			pv_chunks_cmp);
+	if (!found)
+		return 0;
+
+	first = last = found - chunks->c;
+	while (first > 0 && !pv_chunks_cmp(&chunks->c[first - 1], found))
+		first--;
+	while (last < chunks->len - 1 &&
+	       !pv_chunks_cmp(&chunks->c[last + 1], found))
+		last++;
+
+	return last - first + 1;
+}
+
+void pv_chunks_free(struct pv_chunks *chunks)
+{
+	if (chunks->c)
+		free(chunks->c);
+	chunks->c = NULL;
+	chunks->len = chunks->cap = 0;
+}
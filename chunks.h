@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef PV_CHUNKS_H
+#define PV_CHUNKS_H
+
+#include <sys/types.h>
+
+#define CHUNK_INDEX_FMT "%s.idx"
+#define CHUNK_INDEX_EXT ".idx"
+
+/*
+ * Content-defined chunks of an object, as listed by its index: one
+ * "<sha256> <size>" line per chunk in object order.
+ */
+struct pv_chunk {
+	char id[65];
+	off_t size;
+	off_t offset;
+	// file holding this chunk at offset, NULL if it is not local
+	const char *seed;
+};
+
+struct pv_chunks {
+	struct pv_chunk *c;
+	int len;
+	int cap;
+};
+
+int pv_chunks_parse(struct pv_chunks *chunks, const char *buf,
+		    const char *seed);
+int pv_chunks_load_index(struct pv_chunks *chunks, const char *obj_path);
+void pv_chunks_sort(struct pv_chunks *chunks);
+struct pv_chunk *pv_chunks_find(struct pv_chunks *chunks,
+				const struct pv_chunk *c);
+int pv_chunks_refs(struct pv_chunks *chunks, const char *id);
+void pv_chunks_free(struct pv_chunks *chunks);
+
+#endif /* PV_CHUNKS_H */
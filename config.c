@@ -55,6 +55,7 @@ typedef enum {
 	INIT_MODE,
 	INT,
 	LOG_SERVER_OUTPUT_UPDATE_MASK,
+	LOG_SERVER_SYNC_MODE,
 	SB_MODE,
 	STR,
 	WDT_MODE
@@ -122,6 +123,8 @@ struct pv_config_entry {
 
 // configuration lookup table
 static struct pv_config_entry entries[] = {
+	{ INT, "PH_CLIENT_POOL_IDLE", PH | OEM | RUN, 0, .value.i = 60 },
+	{ INT, "PH_CLIENT_POOL_SIZE", PH | OEM | RUN, 0, .value.i = 4 },
 	{ STR, "PH_CREDS_HOST", PH | OEM, 0, .value.s = CREDS_HOST_DEF },
 	{ STR, "PH_CREDS_ID", PH | OEM, 0, .value.s = NULL },
 	{ INT, "PH_CREDS_PORT", PH | OEM, 0, .value.i = 443 },
@@ -170,18 +173,38 @@ static struct pv_config_entry entries[] = {
 	{ INT, "PV_LIBTHTTP_LOG_LEVEL", PV | OEM | RUN, 0, .value.i = 3 },
 	{ BOOL, "PV_LOG_CAPTURE", PV | OEM, 0, .value.b = true },
 	{ BOOL, "PV_LOG_CAPTURE_DMESG", PV | OEM, 0, .value.b = true },
+	{ INT, "PV_LOG_CURSOR_INTERVAL", PV | OEM | RUN, 0, .value.i = 10 },
 	{ INT, "PV_LOG_BUF_NITEMS", PV | OEM, 0, .value.i = 128 },
 	{ STR, "PV_LOG_DIR", PV, 0, .value.s = LOG_DIR_DEF },
 	{ STR, "PV_LOG_FILETREE_TIMESTAMP_FORMAT", PV | OEM | RUN, 0,
 	  .value.s = NULL },
 	{ INT, "PV_LOG_LEVEL", PV | OEM | RUN, 0, .value.i = 0 },
 	{ BOOL, "PV_LOG_LOGGERS", PV | OEM, 0, .value.b = true },
+	{ INT, "PV_LOG_MAXFILES", PV | OEM | RUN, 0, .value.i = 3 },
 	{ INT, "PV_LOG_MAXSIZE", PV | OEM | RUN, 0,
 	  .value.i = LOG_MAXSIZE_DEF },
 	{ BOOL, "PV_LOG_PUSH", PV | OEM | RUN, 0, .value.b = true },
+	{ BOOL, "PV_LOG_PUSH_COMPRESS", PV | OEM | RUN, 0, .value.b = true },
+	{ INT, "PV_LOG_PUSH_INTERVAL", PV | OEM | RUN, 0, .value.i = 1000 },
+	{ INT, "PV_LOG_PUSH_MAX_LATENCY", PV | OEM | RUN, 0, .value.i = 2000 },
+	{ INT, "PV_LOG_PUSH_MAX_LINES", PV | OEM | RUN, 0, .value.i = 1000 },
+	{ INT, "PV_LOG_PUSH_MAX_SIZE", PV | OEM | RUN, 0, .value.i = 64 },
+	{ BOOL, "PV_LOG_SERVER_COLLAPSE", PV | OEM | RUN, 0, .value.b = false },
+	{ INT, "PV_LOG_SERVER_OPEN_FILES", PV | OEM | RUN, 0, .value.i = 16 },
 	{ LOG_SERVER_OUTPUT_UPDATE_MASK, "PV_LOG_SERVER_OUTPUTS",
 	  PV | OEM | RUN, 0,
 	  .value.i = LOG_SERVER_OUTPUT_FILE_TREE | LOG_SERVER_OUTPUT_UPDATE },
+	{ INT, "PV_LOG_SERVER_RATE_BURST", PV | OEM | RUN, 0, .value.i = 2000 },
+	{ INT, "PV_LOG_SERVER_RATE_LIMIT", PV | OEM | RUN, 0, .value.i = 0 },
+	{ INT, "PV_LOG_SERVER_RING", PV | OEM, 0, .value.i = 128 },
+	{ BOOL, "PV_LOG_SERVER_STREAM", PV | OEM, 0, .value.b = true },
+	{ INT, "PV_LOG_SERVER_STREAM_LATENCY", PV | OEM | RUN, 0,
+	  .value.i = 200 },
+	{ INT, "PV_LOG_SERVER_SYNC_INTERVAL", PV | OEM | RUN, 0,
+	  .value.i = 1000 },
+	{ LOG_SERVER_SYNC_MODE, "PV_LOG_SERVER_SYNC_MODE", PV | OEM | RUN, 0,
+	  .value.i = LOG_SERVER_SYNC_LINE },
+	{ INT, "PV_LOG_SERVER_SYNC_SIZE", PV | OEM | RUN, 0, .value.i = 64 },
 	{ STR, "PV_LOG_SINGLEFILE_TIMESTAMP_FORMAT", PV | OEM | RUN, 0,
 	  .value.s = NULL },
 	{ STR, "PV_LOG_STDOUT_TIMESTAMP_FORMAT", PV | OEM | RUN, 0,
@@ -195,6 +218,7 @@ static struct pv_config_entry entries[] = {
 	{ STR, "PV_POLICY", PV, 0, .value.s = NULL },
 	{ INT, "PV_REVISION_RETRIES", PV | OEM | RUN, 0, .value.i = 10 },
 	{ BOOL, "PV_SECUREBOOT_CHECKSUM", PV, 0, .value.b = true },
+	{ INT, "PV_SECUREBOOT_CHECKSUM_RESCAN", PV, 0, .value.i = 0 },
 	{ BOOL, "PV_SECUREBOOT_HANDLERS", PV, 0, .value.b = true },
 	{ SB_MODE, "PV_SECUREBOOT_MODE", PV, 0, .value.i = SB_LENIENT },
 	{ STR, "PV_SECUREBOOT_OEM_TRUSTORE", PV, 0,
@@ -212,6 +236,7 @@ static struct pv_config_entry entries[] = {
 	{ STR, "PV_STORAGE_LOGTEMPSIZE", PV, 0, .value.s = NULL },
 	{ STR, "PV_STORAGE_MNTPOINT", PV, 0, .value.s = NULL },
 	{ STR, "PV_STORAGE_MNTTYPE", PV, 0, .value.s = NULL },
+	{ BOOL, "PV_STORAGE_OBJECTS_SHARD", PV, 0, .value.b = false },
 	{ BOOL, "PV_STORAGE_PHCONFIG_VOL", PV, 0, .value.b = false },
 	{ INT, "PV_STORAGE_WAIT", PV, 0, .value.i = 5 },
 	{ STR, "PV_SYSTEM_APPARMOR_PROFILES", PV, 0, .value.s = NULL },
@@ -224,7 +249,12 @@ static struct pv_config_entry entries[] = {
 	{ BOOL, "PV_SYSTEM_MOUNT_SECURITYFS", PV, 0, .value.b = false },
 	{ STR, "PV_SYSTEM_RUNDIR", PV, 0, .value.s = SYSTEM_RUNDIR_DEF },
 	{ STR, "PV_SYSTEM_USRDIR", PV, 0, .value.s = SYSTEM_USRDIR_DEF },
+	{ BOOL, "PV_UPDATER_CHUNKS", PV | OEM | RUN, 0, .value.b = true },
 	{ INT, "PV_UPDATER_COMMIT_DELAY", PV | OEM | RUN, 0, .value.i = 25 },
+	{ INT, "PV_UPDATER_DOWNLOAD_JOBS", PV | OEM | RUN, 0, .value.i = 1 },
+	{ INT, "PV_UPDATER_DOWNLOAD_RATE", PV | OEM | RUN, 0, .value.i = 0 },
+	{ STR, "PV_UPDATER_DOWNLOAD_WINDOW", PV | OEM | RUN, 0,
+	  .value.s = NULL },
 	{ INT, "PV_UPDATER_GOALS_TIMEOUT", PV | OEM | RUN, 0, .value.i = 120 },
 	{ BOOL, "PV_UPDATER_USE_TMP_OBJECTS", PV | OEM | RUN, 0,
 	  .value.b = false },
@@ -239,6 +269,8 @@ struct pv_config_alias {
 
 static struct pv_config_alias aliases[] = {
 	// LEGACY CONFIG KEY
+	{ "client.pool.idle", "PH_CLIENT_POOL_IDLE" },
+	{ "client.pool.size", "PH_CLIENT_POOL_SIZE" },
 	{ "creds.host", "PH_CREDS_HOST" },
 	{ "creds.id", "PH_CREDS_ID" },
 	{ "creds.port", "PH_CREDS_PORT" },
@@ -273,14 +305,31 @@ static struct pv_config_alias aliases[] = {
 	{ "libthttp.log.level", "PV_LIBTHTTP_LOG_LEVEL" },
 	{ "log.capture", "PV_LOG_CAPTURE" },
 	{ "log.capture.dmesg", "PV_LOG_CAPTURE_DMESG" },
+	{ "log.cursor.interval", "PV_LOG_CURSOR_INTERVAL" },
 	{ "log.buf_nitems", "PV_LOG_BUF_NITEMS" },
 	{ "log.dir", "PV_LOG_DIR" },
 	{ "log.filetree.timestamp.format", "PV_LOG_FILETREE_TIMESTAMP_FORMAT" },
 	{ "log.level", "PV_LOG_LEVEL" },
 	{ "log.loggers", "PV_LOG_LOGGERS" },
+	{ "log.maxfiles", "PV_LOG_MAXFILES" },
 	{ "log.maxsize", "PV_LOG_MAXSIZE" },
 	{ "log.push", "PV_LOG_PUSH" },
+	{ "log.push.compress", "PV_LOG_PUSH_COMPRESS" },
+	{ "log.push.interval", "PV_LOG_PUSH_INTERVAL" },
+	{ "log.push.max_latency", "PV_LOG_PUSH_MAX_LATENCY" },
+	{ "log.push.max_lines", "PV_LOG_PUSH_MAX_LINES" },
+	{ "log.push.max_size", "PV_LOG_PUSH_MAX_SIZE" },
+	{ "log.server.collapse", "PV_LOG_SERVER_COLLAPSE" },
+	{ "log.server.open_files", "PV_LOG_SERVER_OPEN_FILES" },
 	{ "log.server.outputs", "PV_LOG_SERVER_OUTPUTS" },
+	{ "log.server.rate.burst", "PV_LOG_SERVER_RATE_BURST" },
+	{ "log.server.rate.limit", "PV_LOG_SERVER_RATE_LIMIT" },
+	{ "log.server.ring", "PV_LOG_SERVER_RING" },
+	{ "log.server.stream", "PV_LOG_SERVER_STREAM" },
+	{ "log.server.stream.latency", "PV_LOG_SERVER_STREAM_LATENCY" },
+	{ "log.server.sync.interval", "PV_LOG_SERVER_SYNC_INTERVAL" },
+	{ "log.server.sync.mode", "PV_LOG_SERVER_SYNC_MODE" },
+	{ "log.server.sync.size", "PV_LOG_SERVER_SYNC_SIZE" },
 	{ "log.singlefile.timestamp.format",
 	  "PV_LOG_SINGLEFILE_TIMESTAMP_FORMAT" },
 	{ "log.stdout.timestamp.format", "PV_LOG_STDOUT_TIMESTAMP_FORMAT" },
@@ -291,6 +340,7 @@ static struct pv_config_alias aliases[] = {
 	{ "policy", "PV_POLICY" },
 	{ "revision.retries", "PV_REVISION_RETRIES" },
 	{ "secureboot.checksum", "PV_SECUREBOOT_CHECKSUM" },
+	{ "secureboot.checksum.rescan", "PV_SECUREBOOT_CHECKSUM_RESCAN" },
 	{ "secureboot.handlers", "PV_SECUREBOOT_HANDLERS" },
 	{ "secureboot.mode", "PV_SECUREBOOT_MODE" },
 	{ "secureboot.truststore", "PV_SECUREBOOT_TRUSTSTORE" },
@@ -304,6 +354,7 @@ static struct pv_config_alias aliases[] = {
 	{ "storage.logtempsize", "PV_STORAGE_LOGTEMPSIZE" },
 	{ "storage.mntpoint", "PV_STORAGE_MNTPOINT" },
 	{ "storage.mnttype", "PV_STORAGE_MNTTYPE" },
+	{ "storage.objects.shard", "PV_STORAGE_OBJECTS_SHARD" },
 	{ "storage.wait", "PV_STORAGE_WAIT" },
 	{ "system.apparmor.profiles", "PV_SYSTEM_APPARMOR_PROFILES" },
 	{ "system.confdir", "PV_SYSTEM_CONFDIR" },
@@ -316,7 +367,11 @@ static struct pv_config_alias aliases[] = {
 	{ "system.mount.securityfs", "PV_SYSTEM_MOUNT_SECURITYFS" },
 	{ "system.rundir", "PV_SYSTEM_RUNDIR" },
 	{ "system.usrdir", "PV_SYSTEM_USRDIR" },
+	{ "updater.chunks", "PV_UPDATER_CHUNKS" },
 	{ "updater.commit.delay", "PV_UPDATER_COMMIT_DELAY" },
+	{ "updater.download.jobs", "PV_UPDATER_DOWNLOAD_JOBS" },
+	{ "updater.download.rate", "PV_UPDATER_DOWNLOAD_RATE" },
+	{ "updater.download.window", "PV_UPDATER_DOWNLOAD_WINDOW" },
 	{ "updater.goals.timeout", "PV_UPDATER_GOALS_TIMEOUT" },
 	{ "updater.use_tmp_objects", "PV_UPDATER_USE_TMP_OBJECTS" },
 	{ "wdt.mode", "PV_WDT_MODE" },
@@ -511,6 +566,50 @@ _set_config_by_entry_log_server_outputs(struct pv_config_entry *entry,
 	entry->value.i = server_outputs;
 }
 
+log_server_sync_mode_t pv_config_get_log_server_sync_mode()
+{
+	return pv_config_get_int(PV_LOG_SERVER_SYNC_MODE);
+}
+
+static char *_get_log_server_sync_mode_str(log_server_sync_mode_t mode)
+{
+	switch (mode) {
+	case LOG_SERVER_SYNC_LINE:
+		return "line";
+	case LOG_SERVER_SYNC_PERIODIC:
+		return "periodic";
+	case LOG_SERVER_SYNC_LEVEL:
+		return "level";
+	default:
+		return "unknown";
+	}
+}
+
+char *pv_config_get_log_server_sync_mode_str(void)
+{
+	return _get_log_server_sync_mode_str(
+		pv_config_get_log_server_sync_mode());
+}
+
+static void
+_set_config_by_entry_log_server_sync_mode(struct pv_config_entry *entry,
+					  const char *value)
+{
+	if (!entry)
+		return;
+
+	if (pv_str_matches(value, strlen(value), "line", strlen("line")))
+		entry->value.i = LOG_SERVER_SYNC_LINE;
+	else if (pv_str_matches(value, strlen(value), "periodic",
+				strlen("periodic")))
+		entry->value.i = LOG_SERVER_SYNC_PERIODIC;
+	else if (pv_str_matches(value, strlen(value), "level",
+				strlen("level")))
+		entry->value.i = LOG_SERVER_SYNC_LEVEL;
+	else
+		pv_log(WARN, "unknown log server sync mode '%s'", value);
+}
+
 secureboot_mode_t pv_config_get_secureboot_mode()
 {
 	return pv_config_get_int(PV_SECUREBOOT_MODE);
@@ -798,6 +897,9 @@ static int _set_config_by_entry(struct pv_config_entry *entry,
 	case LOG_SERVER_OUTPUT_UPDATE_MASK:
 		_set_config_by_entry_log_server_outputs(entry, value);
 		break;
+	case LOG_SERVER_SYNC_MODE:
+		_set_config_by_entry_log_server_sync_mode(entry, value);
+		break;
 	case SB_MODE:
 		_set_config_by_entry_secureboot_mode(entry, value);
 		break;
@@ -1153,6 +1255,7 @@ static void _add_config_entry_alias_json(config_index_t ci,
 	case INIT_MODE:
 	case INT:
 	case LOG_SERVER_OUTPUT_UPDATE_MASK:
+	case LOG_SERVER_SYNC_MODE:
 	case SB_MODE:
 	case WDT_MODE:
 		pv_json_ser_number(js, entries[ci].value.i);
@@ -1208,6 +1311,10 @@ static void _format_value_str(char *out, size_t len, config_index_t ci)
 	case LOG_SERVER_OUTPUT_UPDATE_MASK:
 		snprintf(out, len, "%d", entries[ci].value.i);
 		break;
+	case LOG_SERVER_SYNC_MODE:
+		snprintf(out, len, "%s",
+			 _get_log_server_sync_mode_str(entries[ci].value.i));
+		break;
 	case SB_MODE:
 		snprintf(out, len, "%s",
 			 _get_secureboot_mode_str(entries[ci].value.i));
@@ -1299,6 +1406,11 @@ static void _print_config_entry(config_index_t ci)
 		pv_log(INFO, "%s = %d (%s)", key, entries[ci].value.i,
 		       _get_mod_level_str(modified));
 		break;
+	case LOG_SERVER_SYNC_MODE:
+		pv_log(INFO, "%s = '%s' (%s)", key,
+		       _get_log_server_sync_mode_str(entries[ci].value.i),
+		       _get_mod_level_str(modified));
+		break;
 	case SB_MODE:
 		pv_log(INFO, "%s = '%s' (%s)", key,
 		       _get_secureboot_mode_str(entries[ci].value.i),
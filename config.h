@@ -30,6 +30,8 @@
 // GENERIC
 
 typedef enum {
+	PH_CLIENT_POOL_IDLE,
+	PH_CLIENT_POOL_SIZE,
 	PH_CREDS_HOST,
 	PH_CREDS_ID,
 	PH_CREDS_PORT,
@@ -70,14 +72,31 @@ typedef enum {
 	PV_LIBTHTTP_LOG_LEVEL,
 	PV_LOG_CAPTURE,
 	PV_LOG_CAPTURE_DMESG,
+	PV_LOG_CURSOR_INTERVAL,
 	PV_LOG_BUF_NITEMS,
 	PV_LOG_DIR,
 	PV_LOG_FILETREE_TIMESTAMP_FORMAT,
 	PV_LOG_LEVEL,
 	PV_LOG_LOGGERS,
+	PV_LOG_MAXFILES,
 	PV_LOG_MAXSIZE,
 	PV_LOG_PUSH,
+	PV_LOG_PUSH_COMPRESS,
+	PV_LOG_PUSH_INTERVAL,
+	PV_LOG_PUSH_MAX_LATENCY,
+	PV_LOG_PUSH_MAX_LINES,
+	PV_LOG_PUSH_MAX_SIZE,
+	PV_LOG_SERVER_COLLAPSE,
+	PV_LOG_SERVER_OPEN_FILES,
 	PV_LOG_SERVER_OUTPUTS,
+	PV_LOG_SERVER_RATE_BURST,
+	PV_LOG_SERVER_RATE_LIMIT,
+	PV_LOG_SERVER_RING,
+	PV_LOG_SERVER_STREAM,
+	PV_LOG_SERVER_STREAM_LATENCY,
+	PV_LOG_SERVER_SYNC_INTERVAL,
+	PV_LOG_SERVER_SYNC_MODE,
+	PV_LOG_SERVER_SYNC_SIZE,
 	PV_LOG_SINGLEFILE_TIMESTAMP_FORMAT,
 	PV_LOG_STDOUT_TIMESTAMP_FORMAT,
 	PV_LXC_LOG_LEVEL,
@@ -88,6 +107,7 @@ typedef enum {
 	PV_POLICY,
 	PV_REVISION_RETRIES,
 	PV_SECUREBOOT_CHECKSUM,
+	PV_SECUREBOOT_CHECKSUM_RESCAN,
 	PV_SECUREBOOT_HANDLERS,
 	PV_SECUREBOOT_MODE,
 	PV_SECUREBOOT_OEM_TRUSTORE,
@@ -101,6 +121,7 @@ typedef enum {
 	PV_STORAGE_LOGTEMPSIZE,
 	PV_STORAGE_MNTPOINT,
 	PV_STORAGE_MNTTYPE,
+	PV_STORAGE_OBJECTS_SHARD,
 	PV_STORAGE_PHCONFIG_VOL,
 	PV_STORAGE_WAIT,
 	PV_SYSTEM_APPARMOR_PROFILES,
@@ -113,7 +134,11 @@ typedef enum {
 	PV_SYSTEM_MOUNT_SECURITYFS,
 	PV_SYSTEM_RUNDIR,
 	PV_SYSTEM_USRDIR,
+	PV_UPDATER_CHUNKS,
 	PV_UPDATER_COMMIT_DELAY,
+	PV_UPDATER_DOWNLOAD_JOBS,
+	PV_UPDATER_DOWNLOAD_RATE,
+	PV_UPDATER_DOWNLOAD_WINDOW,
 	PV_UPDATER_GOALS_TIMEOUT,
 	PV_UPDATER_USE_TMP_OBJECTS,
 	PV_WDT_MODE,
@@ -165,6 +190,17 @@ typedef enum {
 
 log_server_output_mask_t pv_config_get_log_server_outputs(void);
 
+// LOG SERVER SYNC MODE
+
+typedef enum {
+	LOG_SERVER_SYNC_LINE,
+	LOG_SERVER_SYNC_PERIODIC,
+	LOG_SERVER_SYNC_LEVEL,
+} log_server_sync_mode_t;
+
+log_server_sync_mode_t pv_config_get_log_server_sync_mode(void);
+char *pv_config_get_log_server_sync_mode_str(void);
+
 // SECUREBOOT MODE
 
 typedef enum {
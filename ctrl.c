@@ -55,6 +55,7 @@
 #include "platforms.h"
 #include "updater.h"
 #include "drivers.h"
+#include "buffer.h"
 #include "paths.h"
 #include "utils/math.h"
 #include "utils/fs.h"
@@ -75,6 +76,7 @@
 #define ENDPOINT_USER_META "/user-meta"
 #define ENDPOINT_DEVICE_META "/device-meta"
 #define ENDPOINT_BUILDINFO "/buildinfo"
+#define ENDPOINT_BUFFERS "/buffers"
 #define ENDPOINT_CONFIG "/config"
 #define ENDPOINT_CONFIG2 "/config2"
 #define ENDPOINT_DRIVERS "/drivers"
@@ -671,6 +673,65 @@ static char *pv_ctrl_get_file_name(const char *path, size_t buf_index,
 	return file_name;
 }
 
+// length of path without its query string
+static size_t pv_ctrl_get_path_len(const char *path, size_t path_len)
+{
+	const char *q = memchr(path, '?', path_len);
+
+	return q ? (size_t)(q - path) : path_len;
+}
+
+// copies the value of key from the query string of path into buf
+static int pv_ctrl_get_query_value(const char *path, size_t path_len,
+				   const char *key, char *buf, size_t size)
+{
+	const char *q = memchr(path, '?', path_len), *end = path + path_len;
+	const char *amp, *eq;
+	size_t key_len = strlen(key), len;
+
+	if (!q)
+		return -1;
+
+	for (q++; q < end; q = amp + 1) {
+		amp = memchr(q, '&', end - q);
+		if (!amp)
+			amp = end;
+
+		eq = memchr(q, '=', amp - q);
+		if (!eq || (size_t)(eq - q) != key_len ||
+		    strncmp(q, key, key_len))
+			continue;
+
+		len = amp - eq - 1;
+		if (len >= size)
+			return -1;
+
+		memcpy(buf, eq + 1, len);
+		buf[len] = '\0';
+		return 0;
+	}
+
+	return -1;
+}
+
+static char *pv_ctrl_get_steps_string(const char *path, size_t path_len)
+{
+	char offset[16], limit[16], status[UPDATE_PROGRESS_STATUS_SIZE];
+	bool has_status;
+
+	if (pv_ctrl_get_query_value(path, path_len, "offset", offset,
+				    sizeof(offset)))
+		offset[0] = '\0';
+	if (pv_ctrl_get_query_value(path, path_len, "limit", limit,
+				    sizeof(limit)))
+		limit[0] = '\0';
+	has_status = !pv_ctrl_get_query_value(path, path_len, "status",
+					      status, sizeof(status));
+
+	return pv_storage_get_revisions_string(atoi(offset), atoi(limit),
+					       has_status ? status : NULL);
+}
+
 static void pv_ctrl_process_get_string(int req_fd, char *buf)
 {
 	int res, buf_len;
@@ -822,6 +883,27 @@ static bool pv_ctrl_check_sender_privileged(const char *pname)
 	return plat ? pv_platform_has_role(plat, PLAT_ROLE_MGMT) : false;
 }
 
+/*
+ * Hashes an uploaded object and, if there is one, the object it would
+ * replace in a single checksum batch. Returns 1 if the object in place is
+ * valid, 0 if only the upload is and -1 if none is.
+ */
+static int pv_ctrl_validate_object(char *path, char *tmp_path, char *sha)
+{
+	struct pv_storage_checksum files[2] = {
+		{ .path = tmp_path, .checksum = sha, .ret = -1 },
+		{ .path = path, .checksum = sha, .ret = -1 },
+	};
+	int len = pv_fs_path_exist(path) ? 2 : 1;
+
+	pv_storage_validate_files_checksum(files, len);
+
+	if (len == 2 && !files[1].ret)
+		return 1;
+
+	return files[0].ret ? -1 : 0;
+}
+
 static struct pv_cmd *
 pv_ctrl_process_endpoint_and_reply(int req_fd, const char *method,
 				   size_t method_len, const char *path,
@@ -829,6 +911,7 @@ pv_ctrl_process_endpoint_and_reply(int req_fd, const char *method,
 				   bool expect_continue, char *pname)
 {
 	bool mgmt;
+	int valid;
 	struct pv_cmd *cmd = NULL;
 	struct pantavisor *pv = pv_get_instance();
 	char *file_name = NULL;
@@ -935,16 +1018,15 @@ pv_ctrl_process_endpoint_and_reply(int req_fd, const char *method,
 						     expect_continue,
 						     file_path_tmp) < 0)
 				goto out;
-			if (pv_fs_path_exist(file_path) &&
-			    !pv_storage_validate_file_checksum(file_path,
-							       file_name)) {
+			valid = pv_ctrl_validate_object(
+				file_path, file_path_tmp, file_name);
+			if (valid > 0) {
 				pv_log(WARN,
 				       "object %s already exists and is valid; discarding new object upload",
 				       file_path_tmp);
 				pv_fs_path_remove(file_path_tmp, false);
 
-			} else if (pv_storage_validate_file_checksum(
-					   file_path_tmp, file_name) < 0) {
+			} else if (valid < 0) {
 				pv_log(WARN, "object %s has bad checksum",
 				       file_path_tmp);
 				pv_ctrl_write_error_response(
@@ -974,12 +1056,13 @@ pv_ctrl_process_endpoint_and_reply(int req_fd, const char *method,
 		} else
 			goto err_me;
 	} else if (pv_str_matches(ENDPOINT_STEPS, strlen(ENDPOINT_STEPS), path,
-				  path_len)) {
+				  pv_ctrl_get_path_len(path, path_len))) {
 		if (!strncmp("GET", method, method_len)) {
 			if (!mgmt)
 				goto err_pr;
 			pv_ctrl_process_get_string(
-				req_fd, pv_storage_get_revisions_string());
+				req_fd,
+				pv_ctrl_get_steps_string(path, path_len));
 		} else
 			goto err_me;
 	} else if (pv_str_startswith(ENDPOINT_STEPS, strlen(ENDPOINT_STEPS),
@@ -1051,6 +1134,7 @@ pv_ctrl_process_endpoint_and_reply(int req_fd, const char *method,
 					"Cannot rename commitmsg");
 				goto out;
 			}
+			pv_storage_catalog_update_rev(file_name);
 			pv_ctrl_write_ok_response(req_fd);
 		} else
 			goto err_me;
@@ -1136,6 +1220,15 @@ pv_ctrl_process_endpoint_and_reply(int req_fd, const char *method,
 						   strdup(pv_build_manifest));
 		} else
 			goto err_me;
+	} else if (pv_str_matches(ENDPOINT_BUFFERS, strlen(ENDPOINT_BUFFERS),
+				  path, path_len)) {
+		if (!strncmp("GET", method, method_len)) {
+			if (!mgmt)
+				goto err_pr;
+			pv_ctrl_process_get_string(req_fd,
+						   pv_buffer_get_json());
+		} else
+			goto err_me;
 	} else if (pv_str_startswith(ENDPOINT_USER_META,
 				     strlen(ENDPOINT_USER_META), path)) {
 		metakey = pv_ctrl_get_file_name(
@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+#include <picohttpparser.h>
+
+#include "httpconn.h"
+#include "config.h"
+#include "pantavisor.h"
+#include "utils/fs.h"
+#include "utils/list.h"
+#include "utils/str.h"
+#include "utils/timer.h"
+
+#define MODULE_NAME "httpconn"
+#define pv_log(level, msg, ...) vlog(MODULE_NAME, level, msg, ##__VA_ARGS__)
+#include "log.h"
+
+#define HTTPCONN_BUF_SIZE (16 * 1024)
+#define HTTPCONN_MAX_HEADERS (32)
+#define HTTPCONN_TIMEOUT_MS (30 * 1000)
+
+/*
+ * Keep-alive HTTPS connections for object downloads. libthttp speaks
+ * HTTP/1.0 and does a full TCP and TLS handshake for every request, which
+ * adds up quickly when an update is made of many objects or chunks.
+ *
+ * Here, a connection stays open after a response was read to its end, and
+ * the next request to the same host and port goes through it. The TLS
+ * session is kept when the connection closes, so the next connection
+ * resumes it instead of doing a full handshake. Connections idle for
+ * PH_CLIENT_POOL_IDLE seconds are closed, and no more than
+ * PH_CLIENT_POOL_SIZE hosts are kept, the least recently used going first.
+ *
+ * A forked process closes the connections it inherited without telling the
+ * server, as the parent still uses them, and reseeds its random generator.
+ * The TLS sessions are still good to resume from there.
+ */
+struct pv_httpconn {
+	char *host;
+	int port;
+	bool connected;
+	bool has_session;
+	mbedtls_net_context net;
+	mbedtls_ssl_context ssl;
+	mbedtls_ssl_session session;
+	struct timer idle;
+	// bytes read but not consumed yet
+	unsigned char buf[HTTPCONN_BUF_SIZE];
+	size_t len;
+	struct dl_list list;
+};
+
+struct pv_httpconn_res {
+	int code;
+	bool keep_alive;
+	bool chunked;
+	off_t length;
+};
+
+struct pv_httpconn_pool {
+	bool init;
+	pid_t pid;
+	int len;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+	mbedtls_x509_crt ca;
+	mbedtls_ssl_config conf;
+	struct dl_list conns; // pv_httpconn
+};
+
+static struct pv_httpconn_pool pool = {
+	.conns = DL_LIST_HEAD_INIT(pool.conns),
+};
+
+typedef int (*pv_httpconn_sink_t)(const char *buf, size_t len, void *data);
+
+struct pv_httpconn_file {
+	int fd;
+	pv_httpconn_cb_t cb;
+	void *obj;
+};
+
+struct pv_httpconn_err {
+	char *buf;
+	int size;
+	int len;
+};
+
+static void pv_httpconn_close(struct pv_httpconn *c, bool notify)
+{
+	if (!c->connected)
+		return;
+
+	if (notify)
+		mbedtls_ssl_close_notify(&c->ssl);
+	mbedtls_net_free(&c->net);
+	c->connected = false;
+	c->len = 0;
+}
+
+static void pv_httpconn_free(struct pv_httpconn *c, bool notify)
+{
+	pv_httpconn_close(c, notify);
+
+	dl_list_del(&c->list);
+	pool.len--;
+
+	mbedtls_ssl_free(&c->ssl);
+	mbedtls_ssl_session_free(&c->session);
+	free(c->host);
+	free(c);
+}
+
+static int pv_httpconn_init(const char **crtfiles)
+{
+	struct pv_httpconn *c, *tmp;
+	pid_t pid = getpid();
+
+	if (pool.init && pool.pid == pid)
+		return 0;
+
+	if (pool.init) {
+		dl_list_for_each_safe(c, tmp, &pool.conns, struct pv_httpconn,
+				      list)
+		{
+			pv_httpconn_close(c, false);
+		}
+		pool.pid = pid;
+		return mbedtls_ctr_drbg_reseed(&pool.drbg,
+					       (const unsigned char *)&pid,
+					       sizeof(pid));
+	}
+
+	mbedtls_entropy_init(&pool.entropy);
+	mbedtls_ctr_drbg_init(&pool.drbg);
+	mbedtls_x509_crt_init(&pool.ca);
+	mbedtls_ssl_config_init(&pool.conf);
+
+	if (mbedtls_ctr_drbg_seed(&pool.drbg, mbedtls_entropy_func,
+				  &pool.entropy,
+				  (const unsigned char *)MODULE_NAME,
+				  strlen(MODULE_NAME))) {
+		pv_log(ERROR, "could not seed random generator");
+		goto err;
+	}
+
+	for (const char **crt = crtfiles; crt && *crt; crt++) {
+		if (mbedtls_x509_crt_parse_file(&pool.ca, *crt) < 0)
+			pv_log(WARN, "could not load certificate %s", *crt);
+	}
+
+	if (mbedtls_ssl_config_defaults(&pool.conf, MBEDTLS_SSL_IS_CLIENT,
+					MBEDTLS_SSL_TRANSPORT_STREAM,
+					MBEDTLS_SSL_PRESET_DEFAULT)) {
+		pv_log(ERROR, "could not set up TLS configuration");
+		goto err;
+	}
+
+	mbedtls_ssl_conf_authmode(&pool.conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+	mbedtls_ssl_conf_ca_chain(&pool.conf, &pool.ca, NULL);
+	mbedtls_ssl_conf_rng(&pool.conf, mbedtls_ctr_drbg_random, &pool.drbg);
+	mbedtls_ssl_conf_read_timeout(&pool.conf, HTTPCONN_TIMEOUT_MS);
+
+	pool.init = true;
+	pool.pid = pid;
+
+	return 0;
+err:
+	mbedtls_ssl_config_free(&pool.conf);
+	mbedtls_x509_crt_free(&pool.ca);
+	mbedtls_ctr_drbg_free(&pool.drbg);
+	mbedtls_entropy_free(&pool.entropy);
+	return -1;
+}
+
+static struct pv_httpconn *pv_httpconn_get(const char *host, int port)
+{
+	struct pv_httpconn *c, *tmp;
+
+	dl_list_for_each_safe(c, tmp, &pool.conns, struct pv_httpconn, list)
+	{
+		if (c->port != port || strcmp(c->host, host))
+			continue;
+
+		// most recently used last
+		dl_list_del(&c->list);
+		dl_list_add_tail(&pool.conns, &c->list);
+		return c;
+	}
+
+	if (pool.len >= pv_config_get_int(PH_CLIENT_POOL_SIZE) &&
+	    !dl_list_empty(&pool.conns)) {
+		c = dl_list_first(&pool.conns, struct pv_httpconn, list);
+		pv_log(DEBUG, "dropping connection to %s:%d", c->host,
+		       c->port);
+		pv_httpconn_free(c, true);
+	}
+
+	c = calloc(1, sizeof(struct pv_httpconn));
+	if (!c)
+		return NULL;
+
+	c->host = strdup(host);
+	c->port = port;
+	mbedtls_ssl_init(&c->ssl);
+	mbedtls_ssl_session_init(&c->session);
+	dl_list_init(&c->list);
+	dl_list_add_tail(&pool.conns, &c->list);
+	pool.len++;
+
+	if (!c->host || mbedtls_ssl_setup(&c->ssl, &pool.conf)) {
+		pv_httpconn_free(c, false);
+		return NULL;
+	}
+
+	return c;
+}
+
+static int pv_httpconn_connect(struct pv_httpconn *c)
+{
+	char port[8];
+	int ret;
+
+	SNPRINTF_WTRUNC(port, sizeof(port), "%d", c->port);
+
+	mbedtls_net_init(&c->net);
+	ret = mbedtls_net_connect(&c->net, c->host, port,
+				  MBEDTLS_NET_PROTO_TCP);
+	if (ret) {
+		pv_log(WARN, "could not connect to %s:%d: -0x%04x", c->host,
+		       c->port, -ret);
+		goto err;
+	}
+
+	if (mbedtls_ssl_session_reset(&c->ssl) ||
+	    mbedtls_ssl_set_hostname(&c->ssl, c->host))
+		goto err;
+
+	// a session the server does not know any more just costs a full
+	// handshake
+	if (c->has_session)
+		mbedtls_ssl_set_session(&c->ssl, &c->session);
+
+	mbedtls_ssl_set_bio(&c->ssl, &c->net, mbedtls_net_send, NULL,
+			    mbedtls_net_recv_timeout);
+
+	while ((ret = mbedtls_ssl_handshake(&c->ssl))) {
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+		    ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+			continue;
+
+		pv_log(WARN, "TLS handshake with %s failed: -0x%04x", c->host,
+		       -ret);
+		c->has_session = false;
+		goto err;
+	}
+
+	mbedtls_ssl_session_free(&c->session);
+	mbedtls_ssl_session_init(&c->session);
+	c->has_session = !mbedtls_ssl_get_session(&c->ssl, &c->session);
+
+	c->connected = true;
+	c->len = 0;
+
+	return 0;
+err:
+	mbedtls_net_free(&c->net);
+	return -1;
+}
+
+static int pv_httpconn_write(struct pv_httpconn *c, const char *buf,
+			     size_t len)
+{
+	int ret;
+
+	while (len > 0) {
+		ret = mbedtls_ssl_write(&c->ssl, (const unsigned char *)buf,
+					len);
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+		    ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+// returns the number of bytes read, 0 if the server closed or -1
+static int pv_httpconn_read(struct pv_httpconn *c, unsigned char *buf,
+			    size_t len)
+{
+	int ret;
+
+	do {
+		ret = mbedtls_ssl_read(&c->ssl, buf, len);
+	} while (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+		 ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET ||
+#endif
+		 ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+	if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+		return 0;
+
+	return ret < 0 ? -1 : ret;
+}
+
+static bool pv_httpconn_header_is(struct phr_header *h, const char *name,
+				  char *value, size_t size)
+{
+	if (h->name_len != strlen(name) ||
+	    strncasecmp(h->name, name, h->name_len))
+		return false;
+
+	snprintf(value, size, "%.*s", (int)h->value_len, h->value);
+	return true;
+}
+
+static int pv_httpconn_read_head(struct pv_httpconn *c,
+				 struct pv_httpconn_res *res)
+{
+	struct phr_header headers[HTTPCONN_MAX_HEADERS];
+	size_t num_headers, msg_len, last_len;
+	const char *msg;
+	char value[64];
+	int minor, n, ret;
+
+	c->len = 0;
+	do {
+		if (c->len == sizeof(c->buf))
+			return -1;
+
+		n = pv_httpconn_read(c, c->buf + c->len,
+				     sizeof(c->buf) - c->len);
+		if (n <= 0)
+			return -1;
+
+		last_len = c->len;
+		c->len += n;
+		num_headers = HTTPCONN_MAX_HEADERS;
+		ret = phr_parse_response((const char *)c->buf, c->len, &minor,
+					 &res->code, &msg, &msg_len, headers,
+					 &num_headers, last_len);
+		if (ret == -1)
+			return -1;
+	} while (ret < 0);
+
+	res->keep_alive = minor >= 1;
+	res->chunked = false;
+	res->length = -1;
+
+	for (size_t i = 0; i < num_headers; i++) {
+		struct phr_header *h = &headers[i];
+
+		if (pv_httpconn_header_is(h, "Content-Length", value,
+					  sizeof(value))) {
+			res->length = strtoll(value, NULL, 10);
+		} else if (pv_httpconn_header_is(h, "Transfer-Encoding", value,
+						 sizeof(value))) {
+			res->chunked = !strcasecmp(value, "chunked");
+		} else if (pv_httpconn_header_is(h, "Connection", value,
+						 sizeof(value))) {
+			if (!strcasecmp(value, "close"))
+				res->keep_alive = false;
+			else if (!strcasecmp(value, "keep-alive"))
+				res->keep_alive = true;
+		}
+	}
+
+	// these never have a body
+	if (res->code == 204 || res->code == 304)
+		res->length = 0;
+
+	// a body that ends with the connection cannot be followed by another
+	if (!res->chunked && res->length < 0)
+		res->keep_alive = false;
+
+	// the start of the body may have come with the headers
+	c->len -= ret;
+	memmove(c->buf, c->buf + ret, c->len);
+
+	return 0;
+}
+
+static int pv_httpconn_read_body(struct pv_httpconn *c,
+				 struct pv_httpconn_res *res,
+				 pv_httpconn_sink_t sink, void *data)
+{
+	struct phr_chunked_decoder dec = { .consume_trailer = 1 };
+	off_t left = res->length;
+	ssize_t rest;
+	size_t size;
+	int n;
+
+	while (res->chunked || left) {
+		if (!c->len) {
+			n = pv_httpconn_read(c, c->buf, sizeof(c->buf));
+			if (n < 0)
+				return -1;
+			if (!n)
+				return !res->chunked && left < 0 ? 0 : -1;
+			c->len = n;
+		}
+
+		size = c->len;
+		if (res->chunked) {
+			rest = phr_decode_chunked(&dec, (char *)c->buf, &size);
+			if (rest == -1)
+				return -1;
+		} else {
+			if (left >= 0 && (off_t)size > left)
+				size = left;
+			rest = -2;
+			if (left > 0)
+				left -= size;
+		}
+
+		if (size && sink((const char *)c->buf, size, data))
+			return -1;
+
+		// we do not pipeline, nothing should come after the body
+		if (rest > 0 || (!res->chunked && size < c->len))
+			res->keep_alive = false;
+		c->len = 0;
+
+		if (rest >= 0)
+			break;
+	}
+
+	return 0;
+}
+
+static int pv_httpconn_file_sink(const char *buf, size_t len, void *data)
+{
+	struct pv_httpconn_file *f = data;
+	ssize_t written;
+
+	written = pv_fs_file_write_nointr(f->fd, buf, len);
+	if (f->cb)
+		f->cb(written, len, f->obj);
+
+	return written == (ssize_t)len ? 0 : -1;
+}
+
+static int pv_httpconn_err_sink(const char *buf, size_t len, void *data)
+{
+	struct pv_httpconn_err *e = data;
+	int n = e->size - 1 - e->len;
+
+	if (n > (int)len)
+		n = len;
+	if (n > 0) {
+		memcpy(e->buf + e->len, buf, n);
+		e->len += n;
+		e->buf[e->len] = '\0';
+	}
+
+	return 0;
+}
+
+static int pv_httpconn_parse_url(const char *url, char *host, size_t size,
+				 int *port, const char **path)
+{
+	const char *start, *end, *colon;
+
+	// SSL is mandatory
+	if (strncmp(url, "https://", 8))
+		return -1;
+
+	start = url + 8;
+	*path = strchr(start, '/');
+	if (!*path)
+		*path = start + strlen(start);
+
+	*port = 443;
+	end = *path;
+	colon = memchr(start, ':', end - start);
+	if (colon) {
+		*port = strtol(colon + 1, NULL, 10);
+		end = colon;
+	}
+
+	if (end == start || (size_t)(end - start) >= size || *port <= 0)
+		return -1;
+
+	memcpy(host, start, end - start);
+	host[end - start] = '\0';
+
+	return 0;
+}
+
+/*
+ * GETs url into fd, from offset on if it is not 0. Returns the HTTP status
+ * code, 0 if the response did not come through in full, or -1 if no request
+ * could be sent. For error codes, the start of the body is left in err.
+ */
+int pv_httpconn_get_file(const char *url, const char **crtfiles, off_t offset,
+			 int fd, pv_httpconn_cb_t cb, void *obj, char *err,
+			 int err_len)
+{
+	struct pv_httpconn_res res = { 0 };
+	struct pv_httpconn_file file = { .fd = fd, .cb = cb, .obj = obj };
+	struct pv_httpconn_err error = { .buf = err, .size = err_len };
+	struct pv_httpconn *c;
+	char host[256], range[64] = { 0 };
+	const char *path;
+	char *req = NULL;
+	bool reused;
+	int port, len, code;
+
+	if (err && err_len > 0)
+		err[0] = '\0';
+
+	if (pv_httpconn_parse_url(url, host, sizeof(host), &port, &path)) {
+		pv_log(WARN, "object url (%s) is invalid", url);
+		return -1;
+	}
+
+	if (pv_httpconn_init(crtfiles))
+		return -1;
+
+	c = pv_httpconn_get(host, port);
+	if (!c)
+		return -1;
+
+	if (offset)
+		SNPRINTF_WTRUNC(range, sizeof(range),
+				"Range: bytes=%jd-\r\n", (intmax_t)offset);
+
+	len = asprintf(&req,
+		       "GET %s HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "User-Agent: %s\r\n"
+		       "Connection: keep-alive\r\n"
+		       "%s\r\n",
+		       *path ? path : "/", host, pv_user_agent, range);
+	if (len < 0)
+		return -1;
+
+	while (true) {
+		reused = c->connected;
+		code = -1;
+		if (!reused && pv_httpconn_connect(c))
+			goto out;
+
+		code = 0;
+		if (!pv_httpconn_write(c, req, len) &&
+		    !pv_httpconn_read_head(c, &res))
+			break;
+
+		pv_httpconn_close(c, false);
+
+		// the server may have closed a connection that was idle, that
+		// is worth another try on a new one
+		if (!reused)
+			goto out;
+		pv_log(DEBUG, "connection to %s:%d was closed, reconnecting",
+		       c->host, c->port);
+	}
+
+	if (res.code == 200 || res.code == 206) {
+		if (pv_httpconn_read_body(c, &res, pv_httpconn_file_sink,
+					  &file))
+			goto fail;
+	} else if (err && err_len > 0) {
+		if (pv_httpconn_read_body(c, &res, pv_httpconn_err_sink,
+					  &error))
+			goto fail;
+	} else {
+		res.keep_alive = false;
+	}
+
+	code = res.code;
+	if (!res.keep_alive)
+		pv_httpconn_close(c, true);
+	timer_start(&c->idle, pv_config_get_int(PH_CLIENT_POOL_IDLE), 0,
+		    RELATIV_TIMER);
+	goto out;
+
+fail:
+	code = 0;
+	pv_httpconn_close(c, false);
+out:
+	free(req);
+	return code;
+}
+
+void pv_httpconn_expire(void)
+{
+	struct pv_httpconn *c, *tmp;
+
+	if (!pool.init || pool.pid != getpid())
+		return;
+
+	dl_list_for_each_safe(c, tmp, &pool.conns, struct pv_httpconn, list)
+	{
+		if (!timer_current_state(&c->idle).fin)
+			continue;
+
+		pv_log(DEBUG, "closing idle connection to %s:%d", c->host,
+		       c->port);
+		pv_httpconn_free(c, true);
+	}
+}
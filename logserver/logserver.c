@@ -39,6 +39,9 @@
 
 #include "logserver_out.h"
 #include "logserver_utils.h"
+#include "logserver_fdcache.h"
+#include "logserver_ring.h"
+#include "logserver_ratelimit.h"
 #include "logserver_null.h"
 #include "logserver_filetree.h"
 #include "logserver_singlefile.h"
@@ -50,6 +53,7 @@
 #include "utils/json.h"
 #include "utils/system.h"
 #include "utils/list.h"
+#include "utils/math.h"
 #include "utils/socket.h"
 #include "utils/pvsignals.h"
 #include "pvctl_utils.h"
@@ -60,14 +64,21 @@
 #include "paths.h"
 #include "config.h"
 #include "wdt.h"
+#include "metadata.h"
 
 #include "log.h"
 
 #define PH_LOGGER_MAX_EPOLL_FD (50)
 #define LOGSERVER_FLAG_STOP (1 << 0)
 #define LOGSERVER_BACKLOG (20)
-#define LOGSERVER_MAX_EV (5)
+#define LOGSERVER_MAX_EV (16)
 #define LOGSERVER_MAX_HEADER_LEN (50)
+#define LOGSERVER_LOG_BUF_LEN (4096)
+#define LOGSERVER_FALLBACK_BUF_LEN (512)
+#define LOGSERVER_STREAM_BATCH_SIZE (16 * 1024)
+#define LOGSERVER_STREAM_MAX_READS (64)
+#define LOGSERVER_STREAM_RETRY_SEC (5)
+#define LOGSERVER_META_INTERVAL_SEC (30)
 
 #define MODULE_NAME "logserver"
 
@@ -85,6 +96,15 @@ struct logserver_msg {
 	char buf[0];
 };
 
+/*
+ * messages sent through the stream socket are packed back to back in a single
+ * packet. Each frame is padded to keep the next header aligned and to leave
+ * room for the NUL that outputs write right after the log data.
+ */
+#define LOGSERVER_FRAME_LEN(len)                                               \
+	((sizeof(struct logserver_msg) + (len) + sizeof(int)) &                \
+	 ~(sizeof(int) - 1))
+
 struct logserver_fd {
 	char *platform;
 	char *src;
@@ -100,6 +120,7 @@ struct logserver {
 	int epfd;
 	int logsock;
 	int fdsock;
+	int streamsock;
 	int active_out;
 	char *running_rev;
 	char *updated_rev;
@@ -108,7 +129,29 @@ struct logserver {
 	// tmp store for fd returned by connect
 	// only if was sent to the fd_sock
 	struct dl_list tmplst;
+	// long lived stream connections
+	struct dl_list strlst;
 	struct dl_list outputs;
+	// shared with the main process
+	struct logserver_ring ring;
+	// drain deadline of the batch waiting in the ring
+	struct timer ring_deadline;
+	bool ring_pending;
+};
+
+struct logserver_client {
+	int fd;
+	pid_t pid;
+	uint64_t retry;
+	bool flushing;
+	int len;
+	struct timer deadline;
+	char batch[LOGSERVER_STREAM_BATCH_SIZE];
+};
+
+static struct logserver_client logserver_client = {
+	.fd = -1,
+	.pid = -1,
 };
 
 static struct logserver logserver = {
@@ -117,6 +160,8 @@ static struct logserver logserver = {
 	.epfd = -1,
 	.logsock = -1,
 	.fdsock = -1,
+	.streamsock = -1,
+	.ring = { .evfd = -1 },
 	.active_out = LOG_SERVER_OUTPUT_NULL_SINK,
 	.running_rev = NULL,
 	.updated_rev = NULL,
@@ -167,6 +212,10 @@ static int pv_log(int level, char *msg, ...)
 
 	if (logserver.pid == 0) {
 		struct buffer *pv_buffer = pv_buffer_get(true);
+		if (!pv_buffer) {
+			va_end(args);
+			return -1;
+		}
 		char *buf = pv_buffer->buf;
 		int buf_len;
 
@@ -246,6 +295,9 @@ static int logserver_msg_parse_data(struct logserver_msg *msg,
 
 static void logserver_rename_update(const char *rev)
 {
+	// make sure no cached fd keeps writing to the old path
+	logserver_fdcache_invalidate(rev);
+
 	char path_tmp[PATH_MAX];
 	pv_paths_storage_trail_pv_file(path_tmp, PATH_MAX, rev, LOGS_TMP_FNAME);
 
@@ -256,6 +308,76 @@ static void logserver_rename_update(const char *rev)
 	pv_fs_path_rename(path_tmp, path_perm);
 }
 
+static void logserver_add_log(struct logserver_log *log)
+{
+	log->running_rev = logserver.running_rev;
+	log->updated_rev = logserver.updated_rev;
+
+	logserver_log_msg_data(log, 0);
+}
+
+// logs coming from outside the logserver go through the rate limiter
+static void logserver_add_log_limited(struct logserver_log *log)
+{
+	if (logserver_ratelimit_pass(log, logserver_add_log))
+		logserver_add_log(log);
+}
+
+static void logserver_consume_ring(void)
+{
+	logserver.ring_pending = false;
+	logserver_ring_consume(&logserver.ring, logserver_add_log_limited);
+
+	uint32_t dropped = logserver_ring_take_dropped(&logserver.ring);
+	if (dropped)
+		pv_log(WARN, "%u log messages dropped because log ring was full",
+		       dropped);
+}
+
+/*
+ * The ring is the batch of the main process: its records are drained
+ * together PV_LOG_SERVER_STREAM_LATENCY ms after the first one came in,
+ * unless the writer asked for them to be drained straight away.
+ */
+static void logserver_kick_ring(void)
+{
+	int ms = pv_config_get_int(PV_LOG_SERVER_STREAM_LATENCY);
+
+	if (logserver_ring_take_flush(&logserver.ring) || ms <= 0) {
+		logserver_consume_ring();
+		return;
+	}
+
+	if (logserver.ring_pending)
+		return;
+
+	timer_start(&logserver.ring_deadline, ms / 1000, (ms % 1000) * 1000000,
+		    RELATIV_TIMER);
+	logserver.ring_pending = true;
+}
+
+static void logserver_flush_ring(bool force)
+{
+	if (!logserver.ring_pending)
+		return;
+
+	if (force || timer_current_state(&logserver.ring_deadline).fin)
+		logserver_consume_ring();
+}
+
+static int logserver_ring_timeout(void)
+{
+	if (!logserver.ring_pending)
+		return -1;
+
+	struct timer_state tstate =
+		timer_current_state(&logserver.ring_deadline);
+	if (tstate.fin)
+		return 0;
+
+	return tstate.sec * 1000 + tstate.nsec / 1000000 + 1;
+}
+
 static int logserver_process_cmd(const struct logserver_log *log,
 				 pid_t sender_pid)
 {
@@ -266,6 +388,9 @@ static int logserver_process_cmd(const struct logserver_log *log,
 		return -1;
 	}
 
+	// logs written to the ring before the command belong before it
+	logserver_consume_ring();
+
 	int tokc;
 	jsmntok_t *tokv = NULL;
 	jsmnutil_parse_json(log->data.buf, &tokv, &tokc);
@@ -279,6 +404,7 @@ static int logserver_process_cmd(const struct logserver_log *log,
 	switch (cmd_code) {
 	case LOG_CMD_EXIT:
 		pv_log(DEBUG, "exit command received");
+		logserver_fdcache_sync(true);
 		logserver.flags = LOGSERVER_FLAG_STOP;
 		break;
 	case LOG_CMD_START_UPDATE:
@@ -299,8 +425,11 @@ static int logserver_process_cmd(const struct logserver_log *log,
 	case LOG_CMD_TRANSITION:
 		pv_log(DEBUG, "transition command received with revision '%s'",
 		       data);
-		if (logserver.running_rev)
+		logserver_fdcache_sync(true);
+		if (logserver.running_rev) {
+			logserver_fdcache_invalidate(logserver.running_rev);
 			free(logserver.running_rev);
+		}
 		logserver.running_rev = strdup(data);
 		break;
 	case LOG_CMD_NULL:
@@ -329,7 +458,8 @@ static int logserver_handle_msg(struct logserver_msg *msg, pid_t sender_pid)
 
 	switch (msg->code) {
 	case LOG_PROTOCOL_LEGACY:
-		ret = logserver_log_msg_data(&log, 0);
+		logserver_add_log_limited(&log);
+		ret = 0;
 		break;
 	case LOG_PROTOCOL_CMD:
 		ret = logserver_process_cmd(&log, sender_pid);
@@ -511,12 +641,34 @@ static struct logserver_fd *logserver_get_fd(int sockfd)
 	return logserver_fd_new(platform, src, fd, loglevel);
 }
 
+static int logserver_wait_timeout(void)
+{
+	int timeouts[] = {
+		logserver_fdcache_sync_timeout(),
+		logserver_ratelimit_timeout(),
+		logserver_ring_timeout(),
+	};
+	int timeout = -1;
+
+	for (int i = 0; i < ARRAY_LEN(timeouts); i++) {
+		if (timeouts[i] < 0)
+			continue;
+		if (timeout < 0 || timeouts[i] < timeout)
+			timeout = timeouts[i];
+	}
+
+	return timeout;
+}
+
 static int logserver_epoll_wait(struct epoll_event *ev)
 {
 	int ready = 0;
 	errno = 0;
 	do {
-		ready = epoll_wait(logserver.epfd, ev, LOGSERVER_MAX_EV, -1);
+		// wake up in time for pending group commits, rate reports and
+		// ring batches
+		ready = epoll_wait(logserver.epfd, ev, LOGSERVER_MAX_EV,
+				   logserver_wait_timeout());
 
 		if (errno != 0 && errno != EINTR) {
 			pv_log(ERROR, "error calling epoll_wait: %s",
@@ -544,6 +696,8 @@ static void logserver_remove_fd(int fd)
 
 	} else if (logserver_list_exists(&logserver.tmplst, fd))
 		logserver_list_del(&logserver.tmplst, fd, NULL);
+	else if (logserver_list_exists(&logserver.strlst, fd))
+		logserver_list_del(&logserver.strlst, fd, NULL);
 
 	logserver_epoll_del(fd);
 	close(fd);
@@ -570,6 +724,60 @@ static void logserver_consume_log_data(int fd)
 	pv_buffer_drop(buffer);
 }
 
+static void logserver_handle_batch(char *buf, ssize_t len, pid_t sender_pid)
+{
+	ssize_t off = 0;
+
+	while (len - off >= (ssize_t)sizeof(struct logserver_msg)) {
+		struct logserver_msg *msg = (struct logserver_msg *)(buf + off);
+
+		if (msg->len < 0 ||
+		    (ssize_t)(sizeof(*msg) + msg->len) > len - off) {
+			pv_log(WARN, "malformed log batch, dropping %zd bytes",
+			       len - off);
+			return;
+		}
+
+		logserver_handle_msg(msg, sender_pid);
+		off += LOGSERVER_FRAME_LEN(msg->len);
+	}
+}
+
+static void logserver_consume_stream(int fd)
+{
+	// extra room for the NUL written after the last message of a batch
+	static char buf[LOGSERVER_STREAM_BATCH_SIZE + sizeof(int)];
+	pid_t sender_pid = pv_socket_get_sender_pid(fd);
+	ssize_t len;
+
+	// drain as many batches as the client queued since last wakeup
+	for (int i = 0; i < LOGSERVER_STREAM_MAX_READS; i++) {
+		errno = 0;
+		len = recv(fd, buf, LOGSERVER_STREAM_BATCH_SIZE,
+			   MSG_DONTWAIT | MSG_TRUNC);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (len <= 0) {
+			pv_log(DEBUG, "stream fd (%d) closed: %s", fd,
+			       strerror(errno));
+			logserver_remove_fd(fd);
+			return;
+		}
+
+		if (len > LOGSERVER_STREAM_BATCH_SIZE) {
+			pv_log(WARN, "dropping oversized log batch of %zd bytes",
+			       len);
+			continue;
+		}
+
+		logserver_handle_batch(buf, len, sender_pid);
+	}
+}
+
 static void logserver_consume_fd(int fd)
 {
 	struct buffer *buffer = pv_buffer_get(true);
@@ -597,7 +805,7 @@ static void logserver_consume_fd(int fd)
 			.data.len = size,
 		};
 
-		logserver_log_msg_data(&d, 0);
+		logserver_add_log_limited(&d);
 	} else if (errno != EAGAIN) {
 		pv_log(DEBUG,
 		       "dead fd subscribed found (%d) trying to read: %s",
@@ -660,14 +868,21 @@ static void logserver_loop()
 	struct epoll_event ev[LOGSERVER_MAX_EV];
 	int n_events = logserver_epoll_wait(ev);
 
+	logserver_flush_ring(false);
+	logserver_fdcache_sync(false);
+	logserver_ratelimit_flush(false, logserver_add_log);
+	pv_buffer_trim_check();
+
 	if (n_events < 1) {
 		return;
 	}
 
 	int logsock = logserver.logsock;
 	int fdsock = logserver.fdsock;
+	int streamsock = logserver.streamsock;
 	struct dl_list *tmplst = &logserver.tmplst;
 	struct dl_list *fdlst = &logserver.fdlst;
+	struct dl_list *strlst = &logserver.strlst;
 
 	int curfd = -1;
 	int curev = 0;
@@ -684,7 +899,8 @@ static void logserver_loop()
 			continue;
 		}
 
-		if (curfd == logsock || curfd == fdsock) {
+		if (curfd == logsock || curfd == fdsock ||
+		    curfd == streamsock) {
 			int fd = logserver_accept_connection(curfd);
 			if (fd < 0) {
 				continue;
@@ -703,10 +919,22 @@ static void logserver_loop()
 					logserver_fd_free(lfd);
 					logserver_remove_fd(fd);
 				}
+			} else if (curfd == streamsock) {
+				struct logserver_fd *lfd =
+					logserver_fd_new(NULL, NULL, fd, ALL);
+
+				if (logserver_list_add(strlst, lfd) != 0) {
+					logserver_fd_free(lfd);
+					logserver_remove_fd(fd);
+				}
 			}
 		} else if (logserver_list_exists(tmplst, curfd)) {
 			logserver_process_fd(curfd);
 			logserver_remove_fd(curfd);
+		} else if (logserver_list_exists(strlst, curfd)) {
+			logserver_consume_stream(curfd);
+		} else if (curfd == logserver.ring.evfd) {
+			logserver_kick_ring();
 		} else {
 			bool sub = logserver_list_exists(fdlst, curfd);
 
@@ -744,10 +972,10 @@ static int logserver_open_client_socket(const char *fname)
 	return fd;
 }
 
-static int logserver_open_server_socket(const char *fname)
+static int logserver_open_server_socket(const char *fname, int type)
 {
 	struct sockaddr_un addr = { 0 };
-	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int fd = socket(AF_UNIX, type, 0);
 	if (fd == -1) {
 		pv_log(ERROR, "unable to open control socket: %d", errno);
 		return -1;
@@ -791,6 +1019,7 @@ static void logserver_drop_fds(struct dl_list *lst)
 
 static pid_t logserver_start_service(const char *running_revision)
 {
+	char path[PATH_MAX];
 	sigset_t oldmask;
 	logserver.cmd_pid = getpid();
 	if (pvsignals_block_chld(&oldmask)) {
@@ -815,6 +1044,10 @@ static pid_t logserver_start_service(const char *running_revision)
 			free(logserver.running_rev);
 		logserver.running_rev = strdup(running_revision);
 
+		// finish the compressions a reboot cut short
+		pv_paths_pv_log(path, PATH_MAX, "");
+		logserver_utils_requeue_rotated(path);
+
 		pv_log(DEBUG, "starting logserver loop");
 
 		while (!(logserver.flags & LOGSERVER_FLAG_STOP)) {
@@ -823,6 +1056,10 @@ static pid_t logserver_start_service(const char *running_revision)
 
 		logserver_drop_fds(&logserver.fdlst);
 		logserver_drop_fds(&logserver.tmplst);
+		logserver_drop_fds(&logserver.strlst);
+		logserver_flush_ring(true);
+		logserver_ratelimit_flush(true, logserver_add_log);
+		logserver_fdcache_invalidate(NULL);
 
 		_exit(EXIT_SUCCESS);
 	}
@@ -939,16 +1176,40 @@ int pv_logserver_init(const char *rev)
 		return -1;
 	}
 
-	logserver.logsock = logserver_open_server_socket(LOGCTRL_FNAME);
+	logserver.logsock =
+		logserver_open_server_socket(LOGCTRL_FNAME, SOCK_STREAM);
 	if (logserver.logsock < 0)
 		pv_log(WARN,
 		       "could not initialize log socket, logs will not be captured");
 
-	logserver.fdsock = logserver_open_server_socket(LOGFD_FNAME);
+	logserver.fdsock = logserver_open_server_socket(LOGFD_FNAME, SOCK_STREAM);
 	if (logserver.fdsock < 0)
 		pv_log(WARN,
 		       "could not open fd socket, some containers logs will be lost");
 
+	if (pv_config_get_bool(PV_LOG_SERVER_STREAM)) {
+		logserver.streamsock = logserver_open_server_socket(
+			LOGSTREAM_FNAME, SOCK_SEQPACKET);
+		if (logserver.streamsock < 0 ||
+		    logserver_epoll_add(logserver.streamsock) == -1)
+			pv_log(WARN,
+			       "could not init stream socket, falling back to log socket");
+	}
+
+	if (logserver_ratelimit_init())
+		pv_log(WARN, "could not share log rate limit stats: %s",
+		       strerror(errno));
+
+	int ring_size = pv_config_get_int(PV_LOG_SERVER_RING);
+	if (ring_size > 0) {
+		if (logserver_ring_init(&logserver.ring, ring_size * 1024) ||
+		    logserver_epoll_add(logserver.ring.evfd) == -1) {
+			pv_log(WARN,
+			       "could not init log ring, falling back to sockets");
+			logserver_ring_free(&logserver.ring);
+		}
+	}
+
 	if (logserver_epoll_add(logserver.logsock) == -1) {
 		pv_log(WARN,
 		       "could not init log socket, logs will not be captured");
@@ -963,6 +1224,7 @@ int pv_logserver_init(const char *rev)
 
 	dl_list_init(&logserver.fdlst);
 	dl_list_init(&logserver.tmplst);
+	dl_list_init(&logserver.strlst);
 	logserver_start_service(rev);
 	pv_log(DEBUG, "started log service with pid %d", (int)logserver.pid);
 
@@ -975,6 +1237,10 @@ out:
 		close(logserver.logsock);
 	if (logserver.fdsock >= 0)
 		close(logserver.fdsock);
+	if (logserver.streamsock >= 0)
+		close(logserver.streamsock);
+	logserver_ring_free(&logserver.ring);
+	logserver_ratelimit_free();
 	if (logserver.epfd >= 0)
 		close(logserver.epfd);
 
@@ -1019,6 +1285,167 @@ static int logserver_msg_fill(struct logserver_log *log,
 	}
 	return 0;
 }
+static void logserver_client_close(void)
+{
+	if (logserver_client.fd >= 0)
+		close(logserver_client.fd);
+	logserver_client.fd = -1;
+}
+
+static int logserver_client_connect(void)
+{
+	pid_t pid = getpid();
+
+	// do not share the connection with a forked child
+	if (logserver_client.pid != pid) {
+		logserver_client_close();
+		logserver_client.pid = pid;
+		logserver_client.retry = 0;
+	}
+
+	if (logserver_client.fd >= 0)
+		return logserver_client.fd;
+
+	// reconnect lazily, without blocking the caller on retries
+	if (timer_get_current_time_sec(RELATIV_TIMER) < logserver_client.retry)
+		return -1;
+
+	struct sockaddr_un addr = { 0 };
+	addr.sun_family = AF_UNIX;
+	pv_paths_pv_file(addr.sun_path, sizeof(addr.sun_path) - 1,
+			 LOGSTREAM_FNAME);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto err;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		goto err;
+	}
+
+	logserver_client.fd = fd;
+	return fd;
+err:
+	logserver_client.retry = timer_get_current_time_sec(RELATIV_TIMER) +
+				 LOGSERVER_STREAM_RETRY_SEC;
+	return -1;
+}
+
+static int logserver_client_send(const char *buf, int len)
+{
+	int fd = logserver_client_connect();
+	if (fd < 0)
+		return -1;
+
+	ssize_t written;
+	do {
+		written = send(fd, buf, len, MSG_NOSIGNAL);
+	} while (written < 0 && errno == EINTR);
+
+	if (written != len) {
+		logserver_client_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+static void logserver_client_fallback(const char *buf, int len)
+{
+	char path[PATH_MAX] = { 0 };
+	pv_paths_pv_file(path, PATH_MAX, LOGCTRL_FNAME);
+
+	int off = 0;
+	while (len - off >= (int)sizeof(struct logserver_msg)) {
+		struct logserver_msg *msg = (struct logserver_msg *)(buf + off);
+		pvctl_write_to_path(path, (char *)msg, sizeof(*msg) + msg->len);
+		off += LOGSERVER_FRAME_LEN(msg->len);
+	}
+}
+
+void pv_logserver_flush(void)
+{
+	if (getpid() != logserver.cmd_pid || !logserver_client.len ||
+	    logserver_client.flushing)
+		return;
+
+	logserver_client.flushing = true;
+
+	if (logserver_client_send(logserver_client.batch,
+				  logserver_client.len))
+		logserver_client_fallback(logserver_client.batch,
+					  logserver_client.len);
+
+	logserver_client.len = 0;
+	logserver_client.flushing = false;
+}
+
+void pv_logserver_update_meta(void)
+{
+	static struct logserver_ratelimit_stats last;
+	static struct timer next;
+	struct logserver_ratelimit_stats stats;
+	char value[128];
+
+	if (getpid() != logserver.cmd_pid || !timer_current_state(&next).fin)
+		return;
+
+	if (!logserver_ratelimit_get_stats(&stats) ||
+	    !memcmp(&stats, &last, sizeof(stats)))
+		return;
+
+	// every change is saved to storage, so do not follow floods line by line
+	timer_start(&next, LOGSERVER_META_INTERVAL_SEC, 0, RELATIV_TIMER);
+
+	snprintf(value, sizeof(value),
+		 "{\"dropped\":%u,\"suppressed\":%u,\"throttled\":%u}",
+		 stats.dropped, stats.suppressed, stats.throttled);
+	pv_metadata_add_devmeta(DEVMETA_KEY_PV_LOG_RATELIMIT, value);
+
+	last = stats;
+}
+
+static void logserver_client_queue(struct logserver_msg *msg, int level)
+{
+	int len = sizeof(*msg) + msg->len;
+	int frame = LOGSERVER_FRAME_LEN(msg->len);
+
+	if (frame > LOGSERVER_STREAM_BATCH_SIZE || logserver_client.flushing) {
+		pv_logserver_flush();
+		logserver_client_fallback((char *)msg, len);
+		return;
+	}
+
+	// only the process that owns the logserver batches, so short lived
+	// children never leave messages behind. It only gets here with the
+	// ring disabled, and flushes what is left before blocking
+	if (getpid() != logserver.cmd_pid) {
+		if (logserver_client_send((char *)msg, len))
+			logserver_client_fallback((char *)msg, len);
+		return;
+	}
+
+	if (logserver_client.len + frame > LOGSERVER_STREAM_BATCH_SIZE)
+		pv_logserver_flush();
+
+	if (!logserver_client.len) {
+		int ms = pv_config_get_int(PV_LOG_SERVER_STREAM_LATENCY);
+		timer_start(&logserver_client.deadline, ms / 1000,
+			    (ms % 1000) * 1000000, RELATIV_TIMER);
+	}
+
+	char *dst = logserver_client.batch + logserver_client.len;
+	memcpy(dst, msg, len);
+	memset(dst + len, 0, frame - len);
+	logserver_client.len += frame;
+
+	// important messages must reach the logserver straight away
+	if (level <= ERROR ||
+	    timer_current_state(&logserver_client.deadline).fin)
+		pv_logserver_flush();
+}
+
 int pv_logserver_send_vlog(bool is_platform, char *platform, char *src,
 			   int level, const char *msg, va_list args)
 {
@@ -1035,14 +1462,35 @@ int pv_logserver_send_vlog(bool is_platform, char *platform, char *src,
 	if ((level != FATAL) && (level > pv_config_get_int(PV_LOG_LEVEL)))
 		return 0;
 
-	struct buffer *log_buf = pv_buffer_get(true);
-	if (!log_buf)
-		return -1;
-
-	log.data.buf = (char *)log_buf->buf;
-	log.data.len = log_buf->size;
+	// most lines are short, only take a large buffer for the long ones.
+	// Without a pool buffer the line still reaches the console
+	struct buffer *log_buf = pv_buffer_get_size(LOGSERVER_LOG_BUF_LEN);
+	char fallback[LOGSERVER_FALLBACK_BUF_LEN];
+	char *buf = log_buf ? log_buf->buf : fallback;
+	int size = log_buf ? log_buf->size : (int)sizeof(fallback);
+
+	va_list retry;
+	va_copy(retry, args);
+
+	log.data.len = vsnprintf(buf, size, msg, args);
+	if (log_buf && log.data.len >= size) {
+		struct buffer *large = pv_buffer_get(true);
+
+		if (large && large->size > size) {
+			pv_buffer_drop(log_buf);
+			log_buf = large;
+			buf = log_buf->buf;
+			size = log_buf->size;
+			log.data.len = vsnprintf(buf, size, msg, retry);
+		} else {
+			pv_buffer_drop(large);
+		}
+	}
+	va_end(retry);
 
-	log.data.len = vsnprintf(log.data.buf, log.data.len, msg, args);
+	log.data.buf = buf;
+	if (log.data.len >= size)
+		log.data.len = size - 1;
 
 	if (((pv_config_get_log_server_outputs() & LOG_SERVER_OUTPUT_STDOUT) &&
 	     (logserver.pid < 0)) ||
@@ -1057,7 +1505,22 @@ int pv_logserver_send_vlog(bool is_platform, char *platform, char *src,
 		return 0;
 	}
 
-	struct buffer *msg_buf = pv_buffer_get(true);
+	// the main process hands its logs over through shared memory, so it
+	// never blocks on the logserver
+	if (!is_platform && logserver.ring.hdr &&
+	    getpid() == logserver.cmd_pid) {
+		// important messages must reach the logserver straight away
+		int len = logserver_ring_write(&logserver.ring, level, log.tsec,
+					       log.time, platform, src,
+					       log.data.buf, log.data.len,
+					       level <= ERROR);
+		pv_buffer_drop(log_buf);
+		return len;
+	}
+
+	struct buffer *msg_buf = pv_buffer_get_size(
+		sizeof(struct logserver_msg) + 2 * LOGSERVER_MAX_HEADER_LEN +
+		16 + log.data.len);
 	if (!msg_buf) {
 		pv_buffer_drop(log_buf);
 		return -1;
@@ -1068,11 +1531,15 @@ int pv_logserver_send_vlog(bool is_platform, char *platform, char *src,
 
 	int len = logserver_msg_fill(&log, lsmsg);
 
-	char path[PATH_MAX] = { 0 };
-	pv_paths_pv_file(path, PATH_MAX, LOGCTRL_FNAME);
+	if (!is_platform && pv_config_get_bool(PV_LOG_SERVER_STREAM)) {
+		logserver_client_queue(lsmsg, level);
+	} else {
+		char path[PATH_MAX] = { 0 };
+		pv_paths_pv_file(path, PATH_MAX, LOGCTRL_FNAME);
 
-	pvctl_write_to_path(is_platform ? PLATFORM_LOG_CTRL_PATH : path,
-			    (char *)lsmsg, lsmsg->len + sizeof(*lsmsg));
+		pvctl_write_to_path(is_platform ? PLATFORM_LOG_CTRL_PATH : path,
+				    (char *)lsmsg, lsmsg->len + sizeof(*lsmsg));
+	}
 
 	pv_buffer_drop(log_buf);
 	pv_buffer_drop(msg_buf);
@@ -1118,6 +1585,13 @@ static void pv_logserver_close(void)
 		logserver_close_socket(logserver.fdsock, LOGFD_FNAME);
 		logserver.fdsock = -1;
 	}
+	if (logserver.streamsock >= 0) {
+		pv_log(DEBUG, "closing streamsock...");
+		logserver_close_socket(logserver.streamsock, LOGSTREAM_FNAME);
+		logserver.streamsock = -1;
+	}
+	logserver_ring_free(&logserver.ring);
+	logserver_ratelimit_free();
 
 	if (logserver.epfd >= 0) {
 		pv_log(DEBUG, "closing epfd...");
@@ -1142,6 +1616,9 @@ static void pv_logserver_send_cmd(log_cmd_code_t code, const char *data)
 	log.data.len = snprintf(log.data.buf, log.data.len,
 				"{\"code\":%d,\"data\":\"%s\"}", code, data);
 
+	// keep commands ordered with the logs queued before them
+	pv_logserver_flush();
+
 	char msg_buf[CMD_BUF_SIZE];
 	memset(msg_buf, 0, CMD_BUF_SIZE);
 
@@ -1185,6 +1662,7 @@ void pv_logserver_stop(void)
 
 	pv_system_kill_force(logserver.pid);
 	logserver.pid = -1;
+	logserver_client_close();
 
 	pv_logserver_close();
 	pv_logserver_delete_outputs();
@@ -39,6 +39,8 @@ int pv_logserver_send_log(bool is_platform, char *platform, char *src,
 int pv_logserver_send_vlog(bool is_platform, char *platform, char *src,
 			   int level, const char *msg, va_list args);
 
+void pv_logserver_flush(void);
+void pv_logserver_update_meta(void);
 void pv_logserver_transition(const char *rev);
 void pv_logserver_stop(void);
 
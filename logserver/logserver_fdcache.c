@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include "logserver_fdcache.h"
+#include "logserver_utils.h"
+#include "config.h"
+#include "log.h"
+
+static DEFINE_DL_LIST(fdcache);
+
+static bool str_eq(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return !strcmp(a, b);
+}
+
+static char *str_dup(const char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
+static void fdcache_entry_sync(struct logserver_fdcache_entry *entry)
+{
+	if (!entry->dirty)
+		return;
+
+	fdatasync(entry->fd);
+	entry->dirty = 0;
+}
+
+static void fdcache_entry_free(struct logserver_fdcache_entry *entry)
+{
+	if (!entry)
+		return;
+
+	if (entry->fd >= 0) {
+		fdcache_entry_sync(entry);
+		close(entry->fd);
+	}
+	if (entry->rev)
+		free(entry->rev);
+	if (entry->plat)
+		free(entry->plat);
+	if (entry->src)
+		free(entry->src);
+	if (entry->path)
+		free(entry->path);
+	free(entry);
+}
+
+static void fdcache_evict(void)
+{
+	int max = pv_config_get_int(PV_LOG_SERVER_OPEN_FILES);
+	if (max < 1)
+		max = 1;
+
+	while ((int)dl_list_len(&fdcache) >= max) {
+		struct logserver_fdcache_entry *last = dl_list_last(
+			&fdcache, struct logserver_fdcache_entry, list);
+		dl_list_del(&last->list);
+		fdcache_entry_free(last);
+	}
+}
+
+static void fdcache_rotate(struct logserver_fdcache_entry *entry)
+{
+	if (entry->size < pv_config_get_int(PV_LOG_MAXSIZE))
+		return;
+
+	fdcache_entry_sync(entry);
+
+	int fd = logserver_utils_rotate_logfile(entry->path, entry->fd);
+	if (fd < 0)
+		return;
+
+	entry->fd = fd;
+	entry->size = 0;
+}
+
+struct logserver_fdcache_entry *
+logserver_fdcache_get(int out, const char *rev, const char *plat,
+		      const char *src)
+{
+	if (!rev)
+		return NULL;
+
+	struct logserver_fdcache_entry *it, *tmp;
+	dl_list_for_each_safe(it, tmp, &fdcache, struct logserver_fdcache_entry,
+			      list)
+	{
+		if (it->out != out || !str_eq(it->rev, rev) ||
+		    !str_eq(it->plat, plat) || !str_eq(it->src, src))
+			continue;
+
+		// O_SYNC is set at open, so reopen if the sync mode changed
+		if (it->mode != pv_config_get_log_server_sync_mode()) {
+			dl_list_del(&it->list);
+			fdcache_entry_free(it);
+			return NULL;
+		}
+
+		// most recently used entries stay at the head
+		dl_list_del(&it->list);
+		dl_list_add(&fdcache, &it->list);
+
+		fdcache_rotate(it);
+		return it;
+	}
+
+	return NULL;
+}
+
+struct logserver_fdcache_entry *
+logserver_fdcache_open(int out, const char *rev, const char *plat,
+		       const char *src, const char *path)
+{
+	struct logserver_fdcache_entry *entry;
+	struct stat st;
+
+	if (!rev || !path)
+		return NULL;
+
+	log_server_sync_mode_t mode = pv_config_get_log_server_sync_mode();
+	int fd = logserver_utils_open_logfile(path);
+	if (fd < 0)
+		return NULL;
+
+	entry = calloc(1, sizeof(struct logserver_fdcache_entry));
+	if (!entry) {
+		close(fd);
+		return NULL;
+	}
+
+	entry->out = out;
+	entry->fd = fd;
+	entry->mode = mode;
+	entry->rev = str_dup(rev);
+	entry->plat = str_dup(plat);
+	entry->src = str_dup(src);
+	entry->path = strdup(path);
+	if (fstat(fd, &st) == 0)
+		entry->size = st.st_size;
+
+	fdcache_evict();
+	dl_list_add(&fdcache, &entry->list);
+
+	return entry;
+}
+
+void logserver_fdcache_written(struct logserver_fdcache_entry *entry, int len,
+			       int lvl)
+{
+	if (!entry || len <= 0)
+		return;
+
+	entry->size += len;
+
+	// files are opened with O_SYNC in line mode
+	if (entry->mode == LOG_SERVER_SYNC_LINE)
+		return;
+
+	if (!entry->dirty) {
+		int ms = pv_config_get_int(PV_LOG_SERVER_SYNC_INTERVAL);
+		timer_start(&entry->sync, ms / 1000, (ms % 1000) * 1000000,
+			    RELATIV_TIMER);
+	}
+
+	entry->dirty += len;
+
+	if ((entry->mode == LOG_SERVER_SYNC_LEVEL && lvl <= ERROR) ||
+	    entry->dirty >= pv_config_get_int(PV_LOG_SERVER_SYNC_SIZE) * 1024)
+		fdcache_entry_sync(entry);
+}
+
+void logserver_fdcache_sync(bool force)
+{
+	struct logserver_fdcache_entry *it, *tmp;
+	dl_list_for_each_safe(it, tmp, &fdcache, struct logserver_fdcache_entry,
+			      list)
+	{
+		if (!it->dirty)
+			continue;
+
+		if (force || timer_current_state(&it->sync).fin)
+			fdcache_entry_sync(it);
+	}
+}
+
+int logserver_fdcache_sync_timeout(void)
+{
+	int timeout = -1;
+
+	struct logserver_fdcache_entry *it, *tmp;
+	dl_list_for_each_safe(it, tmp, &fdcache, struct logserver_fdcache_entry,
+			      list)
+	{
+		if (!it->dirty)
+			continue;
+
+		struct timer_state tstate = timer_current_state(&it->sync);
+		if (tstate.fin)
+			return 0;
+
+		int ms = tstate.sec * 1000 + tstate.nsec / 1000000 + 1;
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+
+	return timeout;
+}
+
+void logserver_fdcache_invalidate(const char *rev)
+{
+	struct logserver_fdcache_entry *it, *tmp;
+	dl_list_for_each_safe(it, tmp, &fdcache, struct logserver_fdcache_entry,
+			      list)
+	{
+		if (rev && !str_eq(it->rev, rev))
+			continue;
+
+		dl_list_del(&it->list);
+		fdcache_entry_free(it);
+	}
+}
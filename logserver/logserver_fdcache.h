@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LOGSERVER_FDCACHE_H
+#define LOGSERVER_FDCACHE_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "utils/list.h"
+#include "utils/timer.h"
+#include "config.h"
+
+struct logserver_fdcache_entry {
+	int out;
+	char *rev;
+	char *plat;
+	char *src;
+	char *path;
+	int fd;
+	log_server_sync_mode_t mode;
+	off_t size;
+	off_t dirty;
+	struct timer sync;
+	struct dl_list list;
+};
+
+struct logserver_fdcache_entry *
+logserver_fdcache_get(int out, const char *rev, const char *plat,
+		      const char *src);
+struct logserver_fdcache_entry *
+logserver_fdcache_open(int out, const char *rev, const char *plat,
+		       const char *src, const char *path);
+void logserver_fdcache_written(struct logserver_fdcache_entry *entry, int len,
+			       int lvl);
+
+void logserver_fdcache_sync(bool force);
+int logserver_fdcache_sync_timeout(void);
+
+void logserver_fdcache_invalidate(const char *rev);
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "logserver_filetree.h"
 #include "logserver_utils.h"
+#include "logserver_fdcache.h"
 #include "config.h"
 #include "paths.h"
 #include "utils/fs.h"
@@ -65,30 +66,38 @@ static int add_log(struct logserver_out *out, const struct logserver_log *log)
 		return 0;
 
 	bool is_pv = !strncmp(log->plat, MAIN_PLATFORM, strlen(MAIN_PLATFORM));
+	const char *src = is_pv ? "pantavisor.log" : log->src;
 
-	char *path = create_dir(log, is_pv);
-	if (!path)
-		return -1;
+	struct logserver_fdcache_entry *entry =
+		logserver_fdcache_get(out->id, log->running_rev, log->plat, src);
 
-	int fd = logserver_utils_open_logfile(path);
+	if (!entry) {
+		char *path = create_dir(log, is_pv);
+		if (!path)
+			return -1;
 
-	if (fd < 0) {
-		WARN_ONCE("Error opening file %s/%s, errno = %d\n", platform,
-			  source, errno);
+		entry = logserver_fdcache_open(out->id, log->running_rev,
+					       log->plat, src, path);
+		if (!entry) {
+			WARN_ONCE("Error opening file %s/%s, errno = %d\n",
+				  platform, source, errno);
+
+			free(path);
+			return -1;
+		}
 
 		free(path);
-		return -1;
 	}
 
 	int len = 0;
 
 	if (is_pv)
-		len = logserver_utils_print_pvfmt(fd, log, "pantavisor", true);
+		len = logserver_utils_print_pvfmt(entry->fd, log, "pantavisor",
+						  true);
 	else
-		len = logserver_utils_print_raw(fd, log);
+		len = logserver_utils_print_raw(entry->fd, log);
 
-	close(fd);
-	free(path);
+	logserver_fdcache_written(entry, len, log->lvl);
 
 	return len;
 }
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "logserver_ratelimit.h"
+#include "logserver.h"
+#include "utils/list.h"
+#include "utils/timer.h"
+#include "config.h"
+#include "log.h"
+
+/*
+ * Each platform and source gets a token bucket: every line takes a token and
+ * tokens come back at PV_LOG_SERVER_RATE_LIMIT per second, up to
+ * PV_LOG_SERVER_RATE_BURST. Lines that find the bucket empty are dropped and
+ * reported every RATELIMIT_REPORT_MS. Limiting is off while the rate is 0,
+ * which is the default. If PV_LOG_SERVER_COLLAPSE is set,
+ * identical consecutive messages with the same level from the same source
+ * are collapsed into a "last message repeated N times" line. Pantavisor's
+ * own logs are never limited nor collapsed.
+ */
+
+#define RATELIMIT_REPEAT_MS (1000)
+#define RATELIMIT_REPORT_MS (10000)
+#define RATELIMIT_IDLE_MS (60000)
+#define RATELIMIT_MSG_LEN (256)
+
+struct ratelimit_entry {
+	char *plat;
+	char *src;
+	// tokens are kept in thousandths so partial refills are not lost
+	uint64_t tokens;
+	uint64_t refill;
+	uint64_t seen;
+	// last message, to detect repeats
+	uint64_t hash;
+	int len;
+	int lvl;
+	bool lf;
+	uint32_t repeats;
+	uint64_t repeat_deadline;
+	uint32_t dropped;
+	uint64_t report_deadline;
+	bool throttled;
+	struct dl_list list;
+};
+
+static DEFINE_DL_LIST(ratelimit);
+
+static struct logserver_ratelimit_stats *ratelimit_stats = NULL;
+
+#define RATELIMIT_STAT_ADD(field, n)                                           \
+	do {                                                                   \
+		if (ratelimit_stats)                                           \
+			__atomic_add_fetch(&ratelimit_stats->field, n,         \
+					   __ATOMIC_RELAXED);                  \
+	} while (0)
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool str_eq(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return !strcmp(a, b);
+}
+
+static uint64_t ratelimit_hash(int lvl, const char *buf, int len)
+{
+	// FNV-1a, seeded with the level
+	uint64_t hash = 14695981039346656037ULL;
+
+	hash ^= (unsigned char)lvl;
+	hash *= 1099511628211ULL;
+
+	for (int i = 0; i < len; i++) {
+		hash ^= (unsigned char)buf[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static int ratelimit_count_lines(const char *buf, int len)
+{
+	const char *end = buf + len;
+	int lines = 0;
+
+	for (const char *p = buf; (p = memchr(p, '\n', end - p)); p++)
+		lines++;
+
+	// unterminated data still counts as a line
+	if (buf[len - 1] != '\n')
+		lines++;
+
+	return lines;
+}
+
+static void ratelimit_entry_free(struct ratelimit_entry *entry)
+{
+	if (entry->plat)
+		free(entry->plat);
+	if (entry->src)
+		free(entry->src);
+	free(entry);
+}
+
+static struct ratelimit_entry *ratelimit_get(const char *plat, const char *src,
+					     uint64_t now)
+{
+	struct ratelimit_entry *it, *tmp;
+
+	dl_list_for_each_safe(it, tmp, &ratelimit, struct ratelimit_entry, list)
+	{
+		if (str_eq(it->plat, plat) && str_eq(it->src, src))
+			return it;
+	}
+
+	it = calloc(1, sizeof(struct ratelimit_entry));
+	if (!it)
+		return NULL;
+
+	if (plat)
+		it->plat = strdup(plat);
+	if (src)
+		it->src = strdup(src);
+	it->tokens = (uint64_t)pv_config_get_int(PV_LOG_SERVER_RATE_BURST) *
+		     1000;
+	it->refill = now;
+
+	dl_list_init(&it->list);
+	dl_list_add(&ratelimit, &it->list);
+
+	return it;
+}
+
+static bool ratelimit_take(struct ratelimit_entry *entry, int rate, int lines,
+			   uint64_t now)
+{
+	int burst = pv_config_get_int(PV_LOG_SERVER_RATE_BURST);
+	uint64_t max = (uint64_t)(burst > rate ? burst : rate) * 1000;
+	uint64_t cost = (uint64_t)lines * 1000;
+
+	entry->tokens += (now - entry->refill) * rate;
+	entry->refill = now;
+	if (entry->tokens > max)
+		entry->tokens = max;
+
+	// a single read larger than the bucket still gets through when full
+	if (cost > max)
+		cost = max;
+
+	if (entry->tokens < cost)
+		return false;
+
+	entry->tokens -= cost;
+	return true;
+}
+
+static void ratelimit_emit(const char *plat, const char *src, int lvl,
+			   char *buf, int len, logserver_ratelimit_emit_t emit)
+{
+	struct logserver_log log = {
+		.code = LOG_PROTOCOL_LEGACY,
+		.lvl = lvl,
+		.tsec = timer_get_current_time_sec(RELATIV_TIMER),
+		.time = time(NULL),
+		.plat = (char *)plat,
+		.src = (char *)src,
+		.data.buf = buf,
+		.data.len = len,
+	};
+
+	emit(&log);
+}
+
+static void ratelimit_emit_repeats(struct ratelimit_entry *entry,
+				   logserver_ratelimit_emit_t emit)
+{
+	char msg[RATELIMIT_MSG_LEN];
+	int len;
+
+	if (!entry->repeats)
+		return;
+
+	len = snprintf(msg, sizeof(msg), "last message repeated %u times%s",
+		       entry->repeats, entry->lf ? "\n" : "");
+	entry->repeats = 0;
+
+	ratelimit_emit(entry->plat, entry->src, entry->lvl, msg, len, emit);
+}
+
+static void ratelimit_report(struct ratelimit_entry *entry, uint64_t now,
+			     logserver_ratelimit_emit_t emit)
+{
+	// main process logs come without platform nor source
+	const char *plat = entry->plat ? entry->plat : PV_PLATFORM_STR;
+	const char *src = entry->src ? entry->src : "";
+	char msg[RATELIMIT_MSG_LEN];
+	int len;
+
+	if (entry->dropped) {
+		len = snprintf(msg, sizeof(msg),
+			       "%s:%s is over the log rate limit, "
+			       "%u lines dropped",
+			       plat, src, entry->dropped);
+		entry->dropped = 0;
+		entry->report_deadline = now + RATELIMIT_REPORT_MS;
+		ratelimit_emit(PV_PLATFORM_STR, "logserver", WARN, msg, len,
+			       emit);
+		return;
+	}
+
+	len = snprintf(msg, sizeof(msg),
+		       "%s:%s is back under the log rate limit", plat, src);
+	entry->throttled = false;
+	if (ratelimit_stats)
+		__atomic_sub_fetch(&ratelimit_stats->throttled, 1,
+				   __ATOMIC_RELAXED);
+	ratelimit_emit(PV_PLATFORM_STR, "logserver", INFO, msg, len, emit);
+}
+
+bool logserver_ratelimit_pass(const struct logserver_log *log,
+			      logserver_ratelimit_emit_t emit)
+{
+	int rate = pv_config_get_int(PV_LOG_SERVER_RATE_LIMIT);
+	bool collapse = pv_config_get_bool(PV_LOG_SERVER_COLLAPSE);
+
+	if ((rate <= 0 && !collapse) || !log->data.buf || log->data.len <= 0)
+		return true;
+
+	if (str_eq(log->plat, PV_PLATFORM_STR))
+		return true;
+
+	uint64_t now = now_ms();
+	struct ratelimit_entry *entry = ratelimit_get(log->plat, log->src, now);
+	if (!entry)
+		return true;
+
+	entry->seen = now;
+
+	if (collapse) {
+		uint64_t hash =
+			ratelimit_hash(log->lvl, log->data.buf, log->data.len);
+
+		if (entry->len == log->data.len && entry->lvl == log->lvl &&
+		    entry->hash == hash) {
+			if (!entry->repeats)
+				entry->repeat_deadline =
+					now + RATELIMIT_REPEAT_MS;
+			entry->repeats++;
+			RATELIMIT_STAT_ADD(suppressed, 1);
+			return false;
+		}
+
+		ratelimit_emit_repeats(entry, emit);
+		entry->hash = hash;
+		entry->len = log->data.len;
+		entry->lvl = log->lvl;
+		entry->lf = log->data.buf[log->data.len - 1] == '\n';
+	}
+
+	if (rate <= 0)
+		return true;
+
+	int lines = ratelimit_count_lines(log->data.buf, log->data.len);
+	if (ratelimit_take(entry, rate, lines, now))
+		return true;
+
+	if (!entry->throttled) {
+		entry->throttled = true;
+		entry->report_deadline = now + RATELIMIT_REPORT_MS;
+		RATELIMIT_STAT_ADD(throttled, 1);
+	}
+	entry->dropped += lines;
+	RATELIMIT_STAT_ADD(dropped, lines);
+
+	return false;
+}
+
+void logserver_ratelimit_flush(bool force, logserver_ratelimit_emit_t emit)
+{
+	struct ratelimit_entry *it, *tmp;
+	uint64_t now = now_ms();
+
+	dl_list_for_each_safe(it, tmp, &ratelimit, struct ratelimit_entry, list)
+	{
+		if (it->repeats && (force || now >= it->repeat_deadline))
+			ratelimit_emit_repeats(it, emit);
+
+		if (it->throttled &&
+		    (force ? it->dropped > 0 : now >= it->report_deadline))
+			ratelimit_report(it, now, emit);
+
+		// forget sources that went quiet
+		if (!it->repeats && !it->throttled &&
+		    now - it->seen >= RATELIMIT_IDLE_MS) {
+			dl_list_del(&it->list);
+			ratelimit_entry_free(it);
+		}
+	}
+}
+
+int logserver_ratelimit_timeout(void)
+{
+	struct ratelimit_entry *it, *tmp;
+	uint64_t now = now_ms();
+	uint64_t next = UINT64_MAX;
+
+	dl_list_for_each_safe(it, tmp, &ratelimit, struct ratelimit_entry, list)
+	{
+		if (it->repeats && it->repeat_deadline < next)
+			next = it->repeat_deadline;
+		if (it->throttled && it->report_deadline < next)
+			next = it->report_deadline;
+	}
+
+	if (next == UINT64_MAX)
+		return -1;
+
+	return next > now ? next - now : 0;
+}
+
+int logserver_ratelimit_init(void)
+{
+	void *mem = mmap(NULL, sizeof(struct logserver_ratelimit_stats),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+			 0);
+	if (mem == MAP_FAILED)
+		return -1;
+
+	memset(mem, 0, sizeof(struct logserver_ratelimit_stats));
+	ratelimit_stats = mem;
+
+	return 0;
+}
+
+void logserver_ratelimit_free(void)
+{
+	struct ratelimit_entry *it, *tmp;
+
+	dl_list_for_each_safe(it, tmp, &ratelimit, struct ratelimit_entry, list)
+	{
+		dl_list_del(&it->list);
+		ratelimit_entry_free(it);
+	}
+
+	if (ratelimit_stats)
+		munmap(ratelimit_stats,
+		       sizeof(struct logserver_ratelimit_stats));
+	ratelimit_stats = NULL;
+}
+
+bool logserver_ratelimit_get_stats(struct logserver_ratelimit_stats *stats)
+{
+	if (!ratelimit_stats)
+		return false;
+
+	stats->dropped =
+		__atomic_load_n(&ratelimit_stats->dropped, __ATOMIC_RELAXED);
+	stats->suppressed =
+		__atomic_load_n(&ratelimit_stats->suppressed, __ATOMIC_RELAXED);
+	stats->throttled =
+		__atomic_load_n(&ratelimit_stats->throttled, __ATOMIC_RELAXED);
+
+	return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LOGSERVER_RATELIMIT_H
+#define LOGSERVER_RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "logserver_out.h"
+
+// totals shared with the main process for device metadata
+struct logserver_ratelimit_stats {
+	uint32_t dropped;
+	uint32_t suppressed;
+	uint32_t throttled;
+};
+
+typedef void (*logserver_ratelimit_emit_t)(struct logserver_log *log);
+
+int logserver_ratelimit_init(void);
+void logserver_ratelimit_free(void);
+
+bool logserver_ratelimit_pass(const struct logserver_log *log,
+			      logserver_ratelimit_emit_t emit);
+void logserver_ratelimit_flush(bool force, logserver_ratelimit_emit_t emit);
+int logserver_ratelimit_timeout(void);
+
+bool logserver_ratelimit_get_stats(struct logserver_ratelimit_stats *stats);
+
+#endif
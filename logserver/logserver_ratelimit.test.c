@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PVTEST
+#define PVTEST
+#endif
+
+#include "logserver_ratelimit.c"
+#include "utils/pvtest.h"
+
+static int test_rate = 0;
+static int test_burst = 0;
+static bool test_collapse = false;
+
+int pv_config_get_int(config_index_t ci)
+{
+	if (ci == PV_LOG_SERVER_RATE_LIMIT)
+		return test_rate;
+	if (ci == PV_LOG_SERVER_RATE_BURST)
+		return test_burst;
+	return 0;
+}
+
+bool pv_config_get_bool(config_index_t ci)
+{
+	if (ci == PV_LOG_SERVER_COLLAPSE)
+		return test_collapse;
+	return false;
+}
+
+static int emitted = 0;
+static char last[RATELIMIT_MSG_LEN];
+
+static void test_emit(struct logserver_log *log)
+{
+	emitted++;
+	snprintf(last, sizeof(last), "%.*s", log->data.len, log->data.buf);
+}
+
+static bool test_pass(const char *plat, int lvl, const char *msg)
+{
+	struct logserver_log log = {
+		.lvl = lvl,
+		.plat = (char *)plat,
+		.src = "test",
+		.data.buf = (char *)msg,
+		.data.len = strlen(msg),
+	};
+
+	return logserver_ratelimit_pass(&log, test_emit);
+}
+
+static void test_reset(int rate, int burst, bool collapse)
+{
+	logserver_ratelimit_free();
+	test_rate = rate;
+	test_burst = burst;
+	test_collapse = collapse;
+	emitted = 0;
+	last[0] = '\0';
+}
+
+static int test_bucket(void)
+{
+	struct ratelimit_entry *entry;
+
+	test_reset(10, 5, false);
+
+	entry = ratelimit_get("plat", "src", 1000);
+	PVTEST_CHECK(entry);
+	PVTEST_CHECK(ratelimit_get("plat", "src", 1000) == entry);
+	PVTEST_CHECK(ratelimit_get("plat", "other", 1000) != entry);
+
+	// the burst is taken at once, then nothing is left
+	for (int i = 0; i < 5; i++)
+		PVTEST_CHECK(ratelimit_take(entry, 10, 1, 1000));
+	PVTEST_CHECK(!ratelimit_take(entry, 10, 1, 1000));
+
+	// 10 lines per second give one token back every 100 ms
+	PVTEST_CHECK(!ratelimit_take(entry, 10, 1, 1050));
+	PVTEST_CHECK(ratelimit_take(entry, 10, 1, 1100));
+	PVTEST_CHECK(!ratelimit_take(entry, 10, 1, 1100));
+
+	// partial refills add up
+	PVTEST_CHECK(!ratelimit_take(entry, 10, 1, 1150));
+	PVTEST_CHECK(ratelimit_take(entry, 10, 1, 1200));
+
+	// refills stop at the burst, or at one second of rate if larger
+	for (int i = 0; i < 10; i++)
+		PVTEST_CHECK(ratelimit_take(entry, 10, 1, 61200));
+	PVTEST_CHECK(!ratelimit_take(entry, 10, 1, 61200));
+
+	// a read larger than the bucket still gets through when it is full
+	PVTEST_CHECK(ratelimit_take(entry, 10, 100, 71200));
+	PVTEST_CHECK(!ratelimit_take(entry, 10, 1, 71200));
+
+	return 0;
+}
+
+static int test_limit(void)
+{
+	struct logserver_ratelimit_stats stats;
+	int passed = 0;
+
+	test_reset(0, 0, false);
+	PVTEST_CHECK(!logserver_ratelimit_init());
+
+	// off by default
+	for (int i = 0; i < 100; i++)
+		PVTEST_CHECK(test_pass("plat", INFO, "line\n"));
+
+	test_reset(1, 3, false);
+	PVTEST_CHECK(!logserver_ratelimit_init());
+
+	for (int i = 0; i < 10; i++)
+		passed += test_pass("plat", INFO, "line\n");
+	PVTEST_CHECK(passed == 3);
+
+	// two lines in one read take two tokens
+	test_reset(1, 3, false);
+	PVTEST_CHECK(!logserver_ratelimit_init());
+	PVTEST_CHECK(test_pass("plat", INFO, "one\ntwo\n"));
+	PVTEST_CHECK(test_pass("plat", INFO, "three"));
+	PVTEST_CHECK(!test_pass("plat", INFO, "four\n"));
+
+	PVTEST_CHECK(logserver_ratelimit_get_stats(&stats));
+	PVTEST_CHECK(stats.dropped == 1);
+	PVTEST_CHECK(stats.throttled == 1);
+
+	// pantavisor logs are never limited
+	for (int i = 0; i < 10; i++)
+		PVTEST_CHECK(test_pass(PV_PLATFORM_STR, INFO, "line\n"));
+
+	// dropped lines are reported when flushing
+	logserver_ratelimit_flush(true, test_emit);
+	PVTEST_CHECK(emitted == 1);
+	PVTEST_CHECK(strstr(last, "1 lines dropped"));
+
+	return 0;
+}
+
+static int test_collapse_repeats(void)
+{
+	struct logserver_ratelimit_stats stats;
+
+	test_reset(0, 0, true);
+	PVTEST_CHECK(!logserver_ratelimit_init());
+
+	PVTEST_CHECK(test_pass("plat", INFO, "same\n"));
+	PVTEST_CHECK(!test_pass("plat", INFO, "same\n"));
+	PVTEST_CHECK(!test_pass("plat", INFO, "same\n"));
+	PVTEST_CHECK(emitted == 0);
+
+	// another level is another message
+	PVTEST_CHECK(test_pass("plat", WARN, "same\n"));
+	PVTEST_CHECK(emitted == 1);
+	PVTEST_CHECK(!strcmp(last, "last message repeated 2 times\n"));
+
+	PVTEST_CHECK(!test_pass("plat", WARN, "same\n"));
+	logserver_ratelimit_flush(true, test_emit);
+	PVTEST_CHECK(emitted == 2);
+	PVTEST_CHECK(!strcmp(last, "last message repeated 1 times\n"));
+
+	// nothing is pending after the flush
+	logserver_ratelimit_flush(true, test_emit);
+	PVTEST_CHECK(emitted == 2);
+	PVTEST_CHECK(logserver_ratelimit_timeout() == -1);
+
+	PVTEST_CHECK(logserver_ratelimit_get_stats(&stats));
+	PVTEST_CHECK(stats.suppressed == 3);
+
+	// pantavisor logs are never collapsed
+	PVTEST_CHECK(test_pass(PV_PLATFORM_STR, INFO, "same\n"));
+	PVTEST_CHECK(test_pass(PV_PLATFORM_STR, INFO, "same\n"));
+
+	return 0;
+}
+
+int main()
+{
+	int ret = 0;
+
+	printf("=== token bucket ===\n");
+	ret |= test_bucket();
+	printf("=== rate limit ===\n");
+	ret |= test_limit();
+	printf("=== collapse ===\n");
+	ret |= test_collapse_repeats();
+
+	logserver_ratelimit_free();
+
+	printf("%s\n", ret ? "FAILED" : "OK");
+
+	return ret ? 1 : 0;
+}
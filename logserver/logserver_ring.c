@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "logserver_ring.h"
+
+/*
+ * Single producer, single consumer ring shared between pantavisor and the
+ * logserver. head and tail are free running byte counters, so the data area
+ * size must be a power of two. Records never wrap: if one does not fit at the
+ * end of the data area, a padding record fills the gap.
+ *
+ * The consumer is only woken up by the first record written to an empty
+ * ring, so it can schedule a drain of the whole batch later on. Records
+ * written with flush set, or that fill half of the ring, raise the flush flag
+ * to ask for the batch to be drained straight away.
+ */
+
+#define RING_ALIGN(len) (((len) + 7) & ~7)
+#define RING_PAD (-1)
+#define RING_MAP_LEN(size)                                                     \
+	(RING_ALIGN(sizeof(struct logserver_ring_hdr)) + (size))
+
+struct logserver_ring_hdr {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+	uint32_t flush;
+};
+
+struct logserver_ring_rec {
+	uint32_t len;
+	int32_t lvl;
+	uint64_t tsec;
+	int64_t time;
+	uint32_t plat_len;
+	uint32_t src_len;
+	uint32_t data_len;
+	uint32_t reserved;
+	char buf[0];
+};
+
+int logserver_ring_init(struct logserver_ring *ring, uint32_t size)
+{
+	// round down to a power of two
+	while (size & (size - 1))
+		size &= size - 1;
+
+	if (size < 4096)
+		return -1;
+
+	// mapped before the logserver is forked, so both processes share it
+	void *mem = mmap(NULL, RING_MAP_LEN(size), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+
+	ring->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->evfd < 0) {
+		munmap(mem, RING_MAP_LEN(size));
+		return -1;
+	}
+
+	ring->size = size;
+	ring->hdr = mem;
+	ring->data = (char *)mem + RING_ALIGN(sizeof(struct logserver_ring_hdr));
+	memset(ring->hdr, 0, sizeof(struct logserver_ring_hdr));
+
+	return 0;
+}
+
+void logserver_ring_free(struct logserver_ring *ring)
+{
+	if (!ring->hdr)
+		return;
+
+	close(ring->evfd);
+	munmap(ring->hdr, RING_MAP_LEN(ring->size));
+	ring->evfd = -1;
+	ring->hdr = NULL;
+	ring->data = NULL;
+	ring->size = 0;
+}
+
+static void ring_drop(struct logserver_ring *ring)
+{
+	__atomic_add_fetch(&ring->hdr->dropped, 1, __ATOMIC_RELAXED);
+}
+
+int logserver_ring_write(struct logserver_ring *ring, int lvl, uint64_t tsec,
+			 time_t time, const char *plat, const char *src,
+			 const char *data, int len, bool flush)
+{
+	if (!ring->hdr)
+		return -1;
+
+	uint32_t plat_len = plat ? strlen(plat) : 0;
+	uint32_t src_len = src ? strlen(src) : 0;
+	uint32_t overhead = sizeof(struct logserver_ring_rec) + plat_len +
+			    src_len + 3;
+
+	// a single record never takes more than half of the ring
+	if (overhead + len > ring->size / 2) {
+		if (overhead >= ring->size / 2) {
+			ring_drop(ring);
+			return -1;
+		}
+		len = ring->size / 2 - overhead;
+	}
+
+	uint32_t need = RING_ALIGN(overhead + len);
+	uint32_t head = ring->hdr->head;
+	uint32_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+	uint32_t avail = ring->size - (head - tail);
+	uint32_t off = head & (ring->size - 1);
+	uint32_t contig = ring->size - off;
+	uint32_t pad = need > contig ? contig : 0;
+
+	// never wait for the consumer: account the loss instead
+	if (avail < pad + need) {
+		ring_drop(ring);
+		return -1;
+	}
+
+	struct logserver_ring_rec *rec;
+
+	if (pad) {
+		rec = (struct logserver_ring_rec *)(ring->data + off);
+		rec->len = pad;
+		rec->lvl = RING_PAD;
+		off = 0;
+	}
+
+	rec = (struct logserver_ring_rec *)(ring->data + off);
+	rec->len = need;
+	rec->lvl = lvl;
+	rec->tsec = tsec;
+	rec->time = time;
+	rec->plat_len = plat_len;
+	rec->src_len = src_len;
+	rec->data_len = len;
+
+	char *p = rec->buf;
+	memcpy(p, plat, plat_len);
+	p[plat_len] = '\0';
+	p += plat_len + 1;
+	memcpy(p, src, src_len);
+	p[src_len] = '\0';
+	p += src_len + 1;
+	memcpy(p, data, len);
+	p[len] = '\0';
+
+	__atomic_store_n(&ring->hdr->head, head + pad + need, __ATOMIC_SEQ_CST);
+
+	// crossing half of the ring is worth a drain before the deadline
+	if (head - tail < ring->size / 2 &&
+	    head + pad + need - tail >= ring->size / 2)
+		flush = true;
+	if (flush)
+		__atomic_store_n(&ring->hdr->flush, 1, __ATOMIC_SEQ_CST);
+
+	// only wake up the consumer if it already drained everything before
+	// this record or it has to drain now; otherwise it will find the
+	// record in the same pass
+	if (flush ||
+	    __atomic_load_n(&ring->hdr->tail, __ATOMIC_SEQ_CST) == head) {
+		uint64_t one = 1;
+		if (write(ring->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			return -1;
+	}
+
+	return len;
+}
+
+bool logserver_ring_take_flush(struct logserver_ring *ring)
+{
+	uint64_t count;
+
+	if (!ring->hdr)
+		return false;
+
+	// reset the eventfd counter before looking at the flag, so a flush
+	// raised after this wakes us up again
+	if (read(ring->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return true;
+
+	return __atomic_exchange_n(&ring->hdr->flush, 0, __ATOMIC_SEQ_CST);
+}
+
+int logserver_ring_consume(struct logserver_ring *ring,
+			   void (*cb)(struct logserver_log *log))
+{
+	uint64_t count;
+	int n = 0;
+
+	if (!ring->hdr)
+		return 0;
+
+	// reset the eventfd counter and the flag, all is drained below
+	if (read(ring->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -1;
+	__atomic_store_n(&ring->hdr->flush, 0, __ATOMIC_SEQ_CST);
+
+	uint32_t tail = ring->hdr->tail;
+	uint32_t head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		struct logserver_ring_rec *rec =
+			(struct logserver_ring_rec *)(ring->data +
+						      (tail & (ring->size - 1)));
+
+		if (rec->lvl != RING_PAD) {
+			struct logserver_log log = {
+				.code = LOG_PROTOCOL_LEGACY,
+				.lvl = rec->lvl,
+				.tsec = rec->tsec,
+				.tnano = 0,
+				.time = rec->time,
+				.plat = rec->buf,
+				.src = rec->buf + rec->plat_len + 1,
+				.data.buf = rec->buf + rec->plat_len +
+					    rec->src_len + 2,
+				.data.len = rec->data_len,
+			};
+			cb(&log);
+			n++;
+		}
+
+		tail += rec->len;
+
+		if (tail == head) {
+			__atomic_store_n(&ring->hdr->tail, tail,
+					 __ATOMIC_SEQ_CST);
+			head = __atomic_load_n(&ring->hdr->head,
+					       __ATOMIC_SEQ_CST);
+		}
+	}
+
+	return n;
+}
+
+uint32_t logserver_ring_take_dropped(struct logserver_ring *ring)
+{
+	if (!ring->hdr)
+		return 0;
+
+	return __atomic_exchange_n(&ring->hdr->dropped, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LOGSERVER_RING_H
+#define LOGSERVER_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "logserver_out.h"
+
+struct logserver_ring_hdr;
+
+struct logserver_ring {
+	int evfd;
+	uint32_t size;
+	struct logserver_ring_hdr *hdr;
+	char *data;
+};
+
+int logserver_ring_init(struct logserver_ring *ring, uint32_t size);
+void logserver_ring_free(struct logserver_ring *ring);
+
+int logserver_ring_write(struct logserver_ring *ring, int lvl, uint64_t tsec,
+			 time_t time, const char *plat, const char *src,
+			 const char *data, int len, bool flush);
+bool logserver_ring_take_flush(struct logserver_ring *ring);
+int logserver_ring_consume(struct logserver_ring *ring,
+			   void (*cb)(struct logserver_log *log));
+uint32_t logserver_ring_take_dropped(struct logserver_ring *ring);
+
+#endif
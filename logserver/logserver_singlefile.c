@@ -22,6 +22,7 @@
 
 #include "logserver_singlefile.h"
 #include "logserver_utils.h"
+#include "logserver_fdcache.h"
 #include "config.h"
 #include "paths.h"
 #include "utils/fs.h"
@@ -57,22 +58,30 @@ static int add_log(struct logserver_out *out, const struct logserver_log *log)
 	if (log->lvl > pv_config_get_int(PV_LOG_LEVEL))
 		return 0;
 
-	char *path = create_dir(log);
-	if (!path)
-		return -1;
+	struct logserver_fdcache_entry *entry =
+		logserver_fdcache_get(out->id, log->running_rev, NULL, NULL);
 
-	int fd = logserver_utils_open_logfile(path);
-	if (fd < 0) {
-		WARN_ONCE("Error opening file %s, errno = %d\n", path, errno);
-		free(path);
+	if (!entry) {
+		char *path = create_dir(log);
+		if (!path)
+			return -1;
+
+		entry = logserver_fdcache_open(out->id, log->running_rev, NULL,
+					       NULL, path);
+		if (!entry) {
+			WARN_ONCE("Error opening file %s, errno = %d\n", path,
+				  errno);
+			free(path);
 
-		return -1;
+			return -1;
+		}
+
+		free(path);
 	}
 
-	int len = logserver_utils_print_json_fmt(fd, log);
+	int len = logserver_utils_print_json_fmt(entry->fd, log);
 
-	close(fd);
-	free(path);
+	logserver_fdcache_written(entry, len, log->lvl);
 
 	return len;
 }
@@ -22,6 +22,7 @@
 
 #include "logserver_update.h"
 #include "logserver_utils.h"
+#include "logserver_fdcache.h"
 #include "log.h"
 #include "config.h"
 #include "paths.h"
@@ -55,24 +56,32 @@ static int add_log(struct logserver_out *out, const struct logserver_log *log)
 	if (log->lvl > ERROR)
 		return 0;
 
-	char *path = create_dir(log);
-	if (!path)
-		return -1;
+	struct logserver_fdcache_entry *entry =
+		logserver_fdcache_get(out->id, log->updated_rev, NULL, NULL);
 
-	int fd = logserver_utils_open_logfile(path);
-	if (fd < 0) {
-		WARN_ONCE("Error opening file %s, errno = %d\n", path, errno);
-		free(path);
+	if (!entry) {
+		char *path = create_dir(log);
+		if (!path)
+			return -1;
+
+		entry = logserver_fdcache_open(out->id, log->updated_rev, NULL,
+					       NULL, path);
+		if (!entry) {
+			WARN_ONCE("Error opening file %s, errno = %d\n", path,
+				  errno);
+			free(path);
 
-		return -1;
+			return -1;
+		}
+
+		free(path);
 	}
 
 	char *json = logserver_utils_jsonify_log(log);
-	int len = dprintf(fd, "%s\n", json);
+	int len = dprintf(entry->fd, "%s\n", json);
 
-	close(fd);
+	logserver_fdcache_written(entry, len, log->lvl);
 	free(json);
-	free(path);
 
 	return len;
 }
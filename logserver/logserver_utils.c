@@ -30,6 +30,7 @@
 #include "utils/fs.h"
 #include "log.h"
 #include "utils/json.h"
+#include "utils/pvzlib.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -38,9 +39,12 @@
 #include <inttypes.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <ftw.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <linux/limits.h>
 #include <libgen.h>
+#include <zlib.h>
 
 static int get_data_line(const struct logserver_data *data,
 			 struct logserver_data *line, int sep)
@@ -108,55 +112,202 @@ static char *format_dmesg_log(const char *str, int len)
 	return formatted;
 }
 
-static int compress_log(const char *path)
+static int gzip_log(const char *raw, const char *path_gz)
 {
-	// TODO: this maybe could be configurable
-	const int LOGSERVER_MAXFILES = 3;
+	char tmp[PATH_MAX] = { 0 };
+	int ret = -1;
 
+	snprintf(tmp, PATH_MAX, "%s.tmp", path_gz);
+
+	FILE *src = fopen(raw, "r");
+	FILE *dst = fopen(tmp, "w");
+	if (!src || !dst)
+		goto out;
+
+	if (pv_zlib_gzip(src, dst, Z_DEFAULT_COMPRESSION) != Z_OK)
+		goto out;
+
+	if (fflush(dst) || fsync(fileno(dst)))
+		goto out;
+
+	ret = 0;
+out:
+	if (src)
+		fclose(src);
+	if (dst)
+		fclose(dst);
+
+	if (ret) {
+		unlink(tmp);
+		return ret;
+	}
+
+	pv_fs_path_rename(tmp, path_gz);
+	unlink(raw);
+
+	return 0;
+}
+
+static void compress_log(const char *raw, const char *path_gz)
+{
+	pid_t pid = fork();
+
+	// compress in a worker so the logserver keeps consuming logs. If we
+	// cannot fork, we do it here
+	if (pid < 0)
+		gzip_log(raw, path_gz);
+	else if (pid == 0)
+		_exit(gzip_log(raw, path_gz) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static bool str_ends_with(const char *str, const char *suffix)
+{
+	size_t len = strlen(str);
+	size_t slen = strlen(suffix);
+
+	return len >= slen && !strcmp(str + len - slen, suffix);
+}
+
+static time_t requeue_start;
+
+static int requeue_raw(const char *fpath, const struct stat *sb, int type,
+		       struct FTW *ftwbuf)
+{
+	char path_gz[PATH_MAX] = { 0 };
+	struct stat st;
+
+	// leave alone what rotations started after us are working on
+	if (type != FTW_F || sb->st_ctime >= requeue_start)
+		return 0;
+
+	// a worker killed mid-compression leaves its temporary file behind
+	if (str_ends_with(fpath, ".gz.tmp")) {
+		unlink(fpath);
+		return 0;
+	}
+
+	if (!str_ends_with(fpath, ".gz.raw"))
+		return 0;
+
+	snprintf(path_gz, PATH_MAX, "%.*s", (int)(strlen(fpath) - 4), fpath);
+
+	// the compressed file is there, only the raw one was not removed
+	if (!stat(path_gz, &st)) {
+		unlink(fpath);
+		return 0;
+	}
+
+	gzip_log(fpath, path_gz);
+
+	return 0;
+}
+
+void logserver_utils_requeue_rotated(const char *dir)
+{
+	if (!dir)
+		return;
+
+	requeue_start = time(NULL);
+
+	// same as with rotations, do not hold the logserver up
+	pid_t pid = fork();
+	if (pid < 0)
+		nftw(dir, requeue_raw, 16, FTW_PHYS);
+	else if (pid == 0)
+		_exit(nftw(dir, requeue_raw, 16, FTW_PHYS) ? EXIT_FAILURE :
+							     EXIT_SUCCESS);
+}
+
+static int rotate_log(const char *path)
+{
+	// includes compressed files and the ones waiting to be compressed,
+	// but not the temporary files the compression workers write into
 	char pattern[PATH_MAX] = { 0 };
-	snprintf(pattern, PATH_MAX, "%s.*.gz", path);
+	snprintf(pattern, PATH_MAX, "%s.*.gz*", path);
 
 	glob_t glist;
 	int r = glob(pattern, 0, NULL, &glist);
 	if (r != 0 && r != GLOB_NOMATCH)
 		return -1;
 
+	size_t *idx = calloc(glist.gl_pathc + 1, sizeof(size_t));
+	if (!idx) {
+		globfree(&glist);
+		return -1;
+	}
+
 	// looking for the newest file
 	size_t max = 0;
 	for (size_t i = 0; i < glist.gl_pathc; ++i) {
-		char str[PATH_MAX] = { 0 };
-		strncpy(str, glist.gl_pathv[i], PATH_MAX - 1);
-		str[strlen(str) - 3] = '\0';
-		size_t n = strtoumax(strrchr(str, '.') + 1, NULL, 10);
-		if (n > max)
-			max = n;
+		if (!str_ends_with(glist.gl_pathv[i], ".gz") &&
+		    !str_ends_with(glist.gl_pathv[i], ".gz.raw"))
+			continue;
+
+		idx[i] = strtoumax(glist.gl_pathv[i] + strlen(path) + 1, NULL,
+				   10);
+		if (idx[i] > max)
+			max = idx[i];
 	}
 	// next file
 	++max;
 
-	// only keep maxfile files
-	if ((int)glist.gl_pathc >= LOGSERVER_MAXFILES) {
-		char delete_path[PATH_MAX] = { 0 };
-		snprintf(delete_path, PATH_MAX, "%s.%zd.gz", path,
-			 max - LOGSERVER_MAXFILES);
-		pv_fs_path_remove(delete_path, false);
+	// only keep maxfile files. Raw files still belong to a worker, they
+	// are removed once compressed in a later rotation
+	int maxfiles = pv_config_get_int(PV_LOG_MAXFILES);
+	if (maxfiles < 0)
+		maxfiles = 0;
+	for (size_t i = 0; i < glist.gl_pathc; ++i) {
+		if (!str_ends_with(glist.gl_pathv[i], ".gz"))
+			continue;
+
+		if (idx[i] + (size_t)maxfiles <= max)
+			pv_fs_path_remove(glist.gl_pathv[i], false);
 	}
 
+	free(idx);
 	globfree(&glist);
 
+	if (!maxfiles)
+		return pv_fs_path_remove(path, false);
+
+	// the hot file is renamed right away and compressed later
+	char raw[PATH_MAX] = { 0 };
+	snprintf(raw, PATH_MAX, "%s.%zd.gz.raw", path, max);
+	if (pv_fs_path_rename(path, raw) != 0)
+		return -1;
+
 	char path_gz[PATH_MAX] = { 0 };
-	snprintf(path_gz, PATH_MAX, "%s.%zd", path, max);
-	pv_fs_file_gzip(path, path_gz);
+	snprintf(path_gz, PATH_MAX, "%s.%zd.gz", path, max);
+	compress_log(raw, path_gz);
 
 	return 0;
 }
 
+int logserver_utils_rotate_logfile(const char *path, int fd)
+{
+	if (rotate_log(path) != 0)
+		return -1;
+
+	// if the new file cannot be opened, keep writing to the rotated one
+	int new_fd = logserver_utils_open_logfile(path);
+	if (new_fd < 0)
+		return -1;
+
+	close(fd);
+
+	return new_fd;
+}
+
 int logserver_utils_open_logfile(const char *path)
 {
 	if (!path)
 		return -1;
 
-	int fd = open(path, O_CREAT | O_SYNC | O_RDWR | O_APPEND, 0644);
+	int flags = O_CREAT | O_RDWR | O_APPEND;
+	if (pv_config_get_log_server_sync_mode() == LOG_SERVER_SYNC_LINE)
+		flags |= O_SYNC;
+
+	int fd = open(path, flags, 0644);
 
 	struct stat st;
 	if (fstat(fd, &st) != 0)
@@ -165,12 +316,11 @@ int logserver_utils_open_logfile(const char *path)
 	if (st.st_size < pv_config_get_int(PV_LOG_MAXSIZE))
 		return fd;
 
-	if (compress_log(path) == 0) {
-		ftruncate(fd, 0);
-		lseek(fd, 0, SEEK_SET);
-	}
+	int new_fd = logserver_utils_rotate_logfile(path, fd);
+	if (new_fd < 0)
+		return fd;
 
-	return fd;
+	return new_fd;
 }
 
 static int print_pvfmt_log(int fd, const struct logserver_log *log,
@@ -28,6 +28,8 @@
 #include <stdbool.h>
 
 int logserver_utils_open_logfile(const char *path);
+int logserver_utils_rotate_logfile(const char *path, int fd);
+void logserver_utils_requeue_rotated(const char *dir);
 int logserver_utils_print_pvfmt(int fd, const struct logserver_log *log,
 				const char *src, bool lf);
 int logserver_utils_print_json_fmt(int fd, const struct logserver_log *log);
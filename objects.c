@@ -108,10 +108,8 @@ char *pv_objects_get_list_string()
 	char *json = calloc(len, sizeof(char));
 	unsigned int size_object;
 
-	pv_paths_storage_object(path, PATH_MAX, "");
-
 	dl_list_init(&objects);
-	pv_storage_get_subdir(path, "", &objects);
+	pv_storage_get_objects(&objects);
 
 	// open json
 	json[0] = '[';
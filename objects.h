@@ -38,6 +38,23 @@ struct pv_object {
 	char *relpath;
 	off_t size;
 	char *sha256;
+	// optional zstd patch that rebuilds this object from delta_base
+	char *delta_base;
+	char *delta_geturl;
+	char *delta_sha256;
+	off_t delta_size;
+	// optional chunk index and the store its chunks can be fetched from
+	char *chunks_geturl;
+	char *chunks_sha256;
+	char *chunks_store;
+	// verified chunk index and the bytes of it not found locally
+	char *chunks_index;
+	off_t chunks_size;
+	// optional gzip or zstd compressed copy of this object
+	char *comp_format;
+	char *comp_geturl;
+	char *comp_sha256;
+	off_t comp_size;
 	struct pv_platform *plat;
 	struct dl_list list;
 	bool uploaded;
@@ -65,6 +82,26 @@ static inline void pv_object_free(struct pv_object *obj)
 		free(obj->relpath);
 	if (obj->sha256)
 		free(obj->sha256);
+	if (obj->delta_base)
+		free(obj->delta_base);
+	if (obj->delta_geturl)
+		free(obj->delta_geturl);
+	if (obj->delta_sha256)
+		free(obj->delta_sha256);
+	if (obj->chunks_geturl)
+		free(obj->chunks_geturl);
+	if (obj->chunks_sha256)
+		free(obj->chunks_sha256);
+	if (obj->chunks_store)
+		free(obj->chunks_store);
+	if (obj->chunks_index)
+		free(obj->chunks_index);
+	if (obj->comp_format)
+		free(obj->comp_format);
+	if (obj->comp_geturl)
+		free(obj->comp_geturl);
+	if (obj->comp_sha256)
+		free(obj->comp_sha256);
 
 	free(obj);
 }
@@ -63,12 +63,13 @@
 trest_ptr *client = 0;
 char *endpoint = 0;
 
-static void ph_client_free()
+// stale clients failed to auth and are not handed out again by the pool
+static void ph_client_free(bool stale)
 {
 	if (!client)
 		return;
 
-	trest_free(client);
+	pv_trest_client_put(client, stale);
 	client = NULL;
 }
 
@@ -80,7 +81,7 @@ static int ph_client_init(struct pantavisor *pv)
 	if (client)
 		goto auth;
 
-	client = pv_get_trest_client(pv, NULL);
+	client = pv_trest_client_get(pv, NULL);
 
 	if (!client)
 		return 0;
@@ -88,13 +89,13 @@ static int ph_client_init(struct pantavisor *pv)
 auth:
 	status = trest_update_auth(client);
 	if (status != TREST_AUTH_STATUS_OK) {
-		ph_client_free();
+		ph_client_free(true);
 		return 0;
 	}
 
 	const char *id = pv_config_get_str(PH_CREDS_ID);
 	if (!id) {
-		ph_client_free();
+		ph_client_free(false);
 		return 0;
 	}
 
@@ -227,7 +228,7 @@ struct pv_connection *pv_get_instance_connection()
 
 void pv_ph_release_client(struct pantavisor *pv)
 {
-	ph_client_free();
+	ph_client_free(false);
 
 	if (endpoint) {
 		free(endpoint);
@@ -257,7 +258,7 @@ int pv_ph_device_get_meta(struct pantavisor *pv)
 	} else if (!res->code && res->status != TREST_AUTH_STATUS_OK) {
 		pv_log(WARN, "HTTP request GET %s could not auth (status=%d)",
 		       buf, res->status);
-		ph_client_free();
+		ph_client_free(true);
 	} else if (res->code != THTTP_STATUS_OK) {
 		pv_log(WARN,
 		       "request GET %s returned HTTP error (code=%d; body='%s')",
@@ -297,7 +298,7 @@ int pv_ph_device_exists(struct pantavisor *pv)
 	} else if (!res->code && res->status != TREST_AUTH_STATUS_OK) {
 		pv_log(WARN, "HTTP request GET %s could not auth (status=%d)",
 		       endpoint, res->status);
-		ph_client_free();
+		ph_client_free(true);
 	} else if (res->code != THTTP_STATUS_OK) {
 		pv_log(WARN,
 		       "HTTP request GET %s returned HTTP error (code=%d; body='%s')",
@@ -505,7 +506,7 @@ int pv_ph_device_is_owned(struct pantavisor *pv, char **c)
 	} else if (!res->code && res->status != TREST_AUTH_STATUS_OK) {
 		pv_log(WARN, "HTTP request GET %s could not auth (status=%d)",
 		       endpoint, res->status);
-		ph_client_free();
+		ph_client_free(true);
 	} else if (res->code != THTTP_STATUS_OK) {
 		pv_log(WARN,
 		       "HTTP request GET %s returned HTTP error (code=%d; body='%s')",
@@ -576,7 +577,7 @@ int pv_ph_upload_metadata(struct pantavisor *pv, char *metadata)
 	} else if (!res->code && res->status != TREST_AUTH_STATUS_OK) {
 		pv_log(WARN, "HTTP request PATCH %s could not auth (status=%d)",
 		       endpoint, res->status);
-		ph_client_free();
+		ph_client_free(true);
 	} else if (res->code != THTTP_STATUS_OK) {
 		pv_log(WARN,
 		       "HTTP request PATCH %s returned HTTP error (code=%d; body='%s')",
@@ -45,6 +45,8 @@
 #include "volumes.h"
 #include "disk/disk.h"
 #include "pantahub.h"
+#include "trestclient.h"
+#include "httpconn.h"
 #include "bootloader.h"
 #include "ctrl.h"
 #include "version.h"
@@ -59,6 +61,7 @@
 #include "signature.h"
 #include "paths.h"
 #include "ph_logger.h"
+#include "buffer.h"
 #include "logserver/logserver.h"
 #include "mount.h"
 #include "debug.h"
@@ -616,12 +619,28 @@ static pv_state_t _pv_wait(struct pantavisor *pv)
 	// update network info in devmeta
 	pv_network_update_meta(pv);
 
+	// report dropped and collapsed logs in devmeta
+	pv_logserver_update_meta();
+
 	// check if we need to run garbage collector
 	pv_storage_gc_run_threshold();
 
+	// move objects still in the flat pool layout into their shards
+	pv_storage_objects_migrate();
+
+	// give idle log buffers back if memory is running low
+	pv_buffer_trim_check();
+
+	// close hub clients and connections nobody used for a while
+	pv_trest_client_expire();
+	pv_httpconn_expire();
+
 	// check state of debug tools
 	pv_debug_check_ssh_running();
 
+	// do not keep batched logs pending while we block
+	pv_logserver_flush();
+
 	// receive new command. Set 2 secs as the select max blocking time, so we can do the
 	// rest of WAIT operations
 	pv->cmd = pv_ctrl_socket_wait(pv->ctrl_fd, 2);
@@ -749,8 +768,13 @@ static pv_state_t _pv_command(struct pantavisor *pv)
 			next_state = PV_STATE_UPDATE;
 		break;
 	case CMD_RUN_GC:
+		if (cmd->payload && !strcmp(cmd->payload, "dry-run")) {
+			pv_log(DEBUG, "garbage collector dry run received");
+			pv_storage_gc_dry_run();
+			break;
+		}
 		pv_log(DEBUG, "run garbage collector received. Running...");
-		pv_storage_gc_run();
+		pv_storage_gc_run_full();
 		break;
 	case CMD_ENABLE_SSH:
 		pv_log(DEBUG, "enable SSH command received");
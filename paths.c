@@ -22,6 +22,9 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <string.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
 
 #include "paths.h"
 #include "utils/str.h"
@@ -136,11 +139,85 @@ void pv_paths_storage_file(char *buf, size_t size, const char *name)
 }
 
 #define PV_OBJECT_PATHF "%s/objects/%s"
+#define PV_OBJECT_SHARD_PATHF "%s/objects/%.2s/%s"
+
+/*
+ * Objects are sharded by the first two characters of their name, so
+ * <sha> and <sha>.tmp and friends end up in the same subdirectory. The
+ * layout of the pool is looked up once per boot:
+ * - flat: sharding was never enabled;
+ * - sharded: SHARDED_FNAME was left once every object was moved;
+ * - mixed: objects are being moved, both places have to be checked.
+ */
+typedef enum {
+	OBJECTS_LAYOUT_UNKNOWN,
+	OBJECTS_LAYOUT_FLAT,
+	OBJECTS_LAYOUT_MIXED,
+	OBJECTS_LAYOUT_SHARDED,
+} objects_layout_t;
+
+static objects_layout_t objects_layout = OBJECTS_LAYOUT_UNKNOWN;
+
+void pv_paths_storage_object_layout_init(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	pv_paths_storage_file(path, PATH_MAX, SHARDED_FNAME);
+	if (!stat(path, &st)) {
+		objects_layout = OBJECTS_LAYOUT_SHARDED;
+		return;
+	}
+
+	// a migration that was started has to be found, even if disabled
+	pv_paths_storage_object_flat(path, PATH_MAX, "00");
+	if (pv_config_get_bool(PV_STORAGE_OBJECTS_SHARD) || !stat(path, &st))
+		objects_layout = OBJECTS_LAYOUT_MIXED;
+	else
+		objects_layout = OBJECTS_LAYOUT_FLAT;
+}
+
+void pv_paths_storage_object_set_sharded(void)
+{
+	objects_layout = OBJECTS_LAYOUT_SHARDED;
+}
 
 void pv_paths_storage_object(char *buf, size_t size, const char *sha)
+{
+	char flat[PATH_MAX];
+	struct stat st;
+
+	if (objects_layout == OBJECTS_LAYOUT_UNKNOWN)
+		pv_paths_storage_object_layout_init();
+
+	// the pool itself and names too short to be sharded
+	if (objects_layout == OBJECTS_LAYOUT_FLAT || strlen(sha) < 2) {
+		pv_paths_storage_object_flat(buf, size, sha);
+		return;
+	}
+
+	SNPRINTF_WTRUNC(buf, size, PV_OBJECT_SHARD_PATHF,
+			pv_config_get_str(PV_STORAGE_MNTPOINT), sha, sha);
+	if (objects_layout == OBJECTS_LAYOUT_SHARDED || !stat(buf, &st))
+		return;
+
+	pv_paths_storage_object_flat(flat, sizeof(flat), sha);
+	if (!stat(flat, &st))
+		SNPRINTF_WTRUNC(buf, size, "%s", flat);
+}
+
+void pv_paths_storage_object_flat(char *buf, size_t size, const char *name)
 {
 	SNPRINTF_WTRUNC(buf, size, PV_OBJECT_PATHF,
-			pv_config_get_str(PV_STORAGE_MNTPOINT), sha);
+			pv_config_get_str(PV_STORAGE_MNTPOINT), name);
+}
+
+#define PV_CHUNK_PATHF "%s/" CHUNKS_DNAME "/%.2s/%s"
+
+void pv_paths_storage_chunk(char *buf, size_t size, const char *sha)
+{
+	SNPRINTF_WTRUNC(buf, size, PV_CHUNK_PATHF,
+			pv_config_get_str(PV_STORAGE_MNTPOINT), sha, sha);
 }
 
 #define PV_TRAILS_PATHF "%s/trails/%s"
@@ -31,6 +31,7 @@
 #define PVCTRL_FNAME "pv-ctrl"
 #define LOGCTRL_FNAME "pv-ctrl-log"
 #define LOGFD_FNAME "pv-fd-log"
+#define LOGSTREAM_FNAME "pv-ctrl-log-stream"
 #define PHCONFIG_DNAME "phconfig"
 #define UNCLAIMED_FNAME "phconfig/unclaimed.config"
 #define PANTAHUB_FNAME "phconfig/pantahub.config"
@@ -70,9 +71,19 @@ void pv_paths_storage_dropbear(char *buf, size_t size);
 
 #define COREPV_FNAME "corepv"
 #define PVMOUNTED_FNAME ".pvmounted"
+#define VERIFIED_FNAME ".pvverified"
+#define SHARDED_FNAME ".pvsharded"
+#define CATALOG_FNAME ".pvcatalog"
 
 void pv_paths_storage_file(char *buf, size_t size, const char *name);
 void pv_paths_storage_object(char *buf, size_t size, const char *sha);
+void pv_paths_storage_object_flat(char *buf, size_t size, const char *name);
+void pv_paths_storage_object_layout_init(void);
+void pv_paths_storage_object_set_sharded(void);
+
+#define CHUNKS_DNAME "chunks"
+
+void pv_paths_storage_chunk(char *buf, size_t size, const char *sha);
 
 #define DONE_FNAME "done"
 #define PROGRESS_FNAME "progress"
@@ -19,12 +19,17 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/xattr.h>
+#include <sys/inotify.h>
 #include <sys/un.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -36,11 +41,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdarg.h>
-#include <libgen.h>
 #include <string.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <stdio.h>
 #include <errno.h>
+#include <zlib.h>
 
 #include "../state.h"
 #include "../trestclient.h"
@@ -54,6 +61,8 @@
 #include "utils/str.h"
 #include "utils/tsh.h"
 #include "utils/pvsignals.h"
+#include "utils/timer.h"
+#include "utils/pvzlib.h"
 #include "json.h"
 #include "fs.h"
 #include "buffer.h"
@@ -79,21 +88,80 @@
  */
 #define PH_LOGGER_MAX_EPOLL_FD (50)
 
+#define PH_LOGGER_EXCLUDE "*.gz*"
+#define PH_LOGGER_EXCLUDE_CURSORS ".ph_logger.cursors*"
+#define PH_LOGGER_INOTIFY_MASK                                                 \
+	(IN_CREATE | IN_MODIFY | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define PH_LOGGER_INOTIFY_SIZE                                                 \
+	(16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define PH_LOGGER_RESCAN_MS (1000)
+
+#define PH_LOGGER_CURSORS_FNAME ".ph_logger.cursors"
+#define PH_LOGGER_HASH_SIZE (256)
+// journal records allowed on top of the tracked files before compacting
+#define PH_LOGGER_COMPACT_SLACK (64)
+
 static struct pantavisor *pv_global;
 
-struct ph_logger_fragment {
-	struct dl_list list;
-	char *json_frag;
+/*
+ * Append-only journal of the upload positions of the log files of a
+ * revision. Each record is "<pos> <path relative to the revision>" and the
+ * last record of a path wins.
+ */
+struct ph_logger_journal {
+	char *rev;
+	char *path;
+	int fd;
+	int records;
+	int files;
+	// no journal yet, positions are taken from the old xattrs
+	bool migrate;
+	struct dl_list list; // ph_logger_journal
 };
 
-static DEFINE_DL_LIST(frag_list);
-
 struct ph_logger_file {
 	char *path;
 	off_t pos;
+	// last position recorded in the journal
+	off_t saved_pos;
+	// position up to which lines are in the batch, if in_batch
+	off_t batch_pos;
+	bool in_batch;
+	int fd;
+	bool pending;
+	struct ph_logger_journal *journal;
+	struct dl_list hlist; // ph_logger_file in hash bucket
 	struct dl_list list; // ph_logger_file
 };
 
+/*
+ * JSON array of log lines from any number of files, sent in one request once
+ * PV_LOG_PUSH_MAX_SIZE, PV_LOG_PUSH_MAX_LINES or PV_LOG_PUSH_MAX_LATENCY is
+ * reached.
+ */
+struct ph_logger_batch {
+	char *buf;
+	size_t len;
+	size_t size;
+	int lines;
+	struct timer deadline;
+};
+
+struct ph_logger_watch {
+	int wd;
+	char *path;
+	struct dl_list list; // ph_logger_watch
+};
+
+struct ph_logger_tail {
+	char *revision;
+	char root[PATH_MAX];
+	int offset;
+	int ifd;
+	bool rescan;
+	struct dl_list watches; // ph_logger_watch
+};
+
 struct ph_logger {
 	int flags;
 	int epoll_fd;
@@ -104,6 +172,12 @@ struct ph_logger {
 	pid_t range_service;
 	pid_t push_service;
 	struct dl_list files; // ph_logger_file
+	struct dl_list buckets[PH_LOGGER_HASH_SIZE]; // ph_logger_file
+	struct dl_list journals; // ph_logger_journal
+	struct timer checkpoint;
+	bool dirty;
+	struct ph_logger_batch batch;
+	bool no_compress;
 };
 
 static struct ph_logger ph_logger = { .epoll_fd = -1,
@@ -113,31 +187,6 @@ static struct ph_logger ph_logger = { .epoll_fd = -1,
 				      .range_service = -1,
 				      .push_service = -1 };
 
-static struct ph_logger_fragment *__ph_logger_alloc_frag(char *json_frag,
-							 bool do_frag_dup)
-{
-	struct ph_logger_fragment *frag = NULL;
-
-	if (!json_frag)
-		return NULL;
-	frag = (struct ph_logger_fragment *)calloc(1, sizeof(*frag));
-	if (frag) {
-		if (do_frag_dup)
-			frag->json_frag = strdup(json_frag);
-		else
-			frag->json_frag = json_frag;
-		if (!frag->json_frag) {
-			free(frag);
-			frag = NULL;
-		}
-	}
-	return frag;
-}
-static struct ph_logger_fragment *ph_logger_alloc_frag(char *json_frag)
-{
-	return __ph_logger_alloc_frag(json_frag, false);
-}
-
 static int ph_logger_get_connection(struct ph_logger *ph_logger)
 {
 	if (ph_logger->pv_conn)
@@ -145,7 +194,7 @@ static int ph_logger_get_connection(struct ph_logger *ph_logger)
 
 	ph_logger->pv_conn = pv_get_instance_connection();
 	if (ph_logger->client) {
-		trest_free(ph_logger->client);
+		pv_trest_client_put(ph_logger->client, true);
 		ph_logger->client = NULL;
 	}
 out:
@@ -167,9 +216,58 @@ static void sigchld_handler(int signum)
 		;
 }
 
-static int ph_logger_push_logs_endpoint(struct ph_logger *ph_logger, char *logs)
+/*
+ * Returns an fd to the gzip compressed logs or -1 on error.
+ */
+static int ph_logger_gzip_logs(char *logs, size_t len, size_t *gz_len)
+{
+	FILE *src = NULL, *dst = NULL;
+	int fd = -1;
+
+	src = fmemopen(logs, len, "r");
+	dst = tmpfile();
+	if (!src || !dst)
+		goto out;
+
+	if (pv_zlib_gzip(src, dst, Z_DEFAULT_COMPRESSION) != Z_OK ||
+	    fflush(dst))
+		goto out;
+
+	*gz_len = ftell(dst);
+	fd = dup(fileno(dst));
+	if (fd >= 0)
+		lseek(fd, 0, SEEK_SET);
+out:
+	if (src)
+		fclose(src);
+	if (dst)
+		fclose(dst);
+
+	return fd;
+}
+
+/*
+ * Tells whether a rejected request was about its gzip body: either the
+ * media type is not supported or a bad request that names the encoding.
+ */
+static bool ph_logger_gzip_rejected(trest_response_ptr res)
 {
-	int ret = -1;
+	if (res->code == 415)
+		return true;
+
+	if (res->code != 400 || !res->body)
+		return false;
+
+	return strcasestr(res->body, "encoding") ||
+	       strcasestr(res->body, "gzip");
+}
+
+static int ph_logger_push_logs_endpoint(struct ph_logger *ph_logger,
+					char *logs, size_t len)
+{
+	int ret = -1, fd = -1;
+	bool retry_plain;
+	size_t gz_len = 0;
 	trest_auth_status_enum status = TREST_AUTH_STATUS_NOTAUTH;
 	trest_request_ptr req = NULL;
 	trest_response_ptr res = NULL;
@@ -177,7 +275,7 @@ static int ph_logger_push_logs_endpoint(struct ph_logger *ph_logger, char *logs)
 	if (ph_logger->client)
 		goto auth;
 
-	ph_logger->client = pv_get_trest_client(pv_global, ph_logger->pv_conn);
+	ph_logger->client = pv_trest_client_get(pv_global, ph_logger->pv_conn);
 
 	if (!ph_logger->client) {
 		goto out;
@@ -187,27 +285,67 @@ auth:
 	if (status != TREST_AUTH_STATUS_OK) {
 		goto out;
 	}
-	req = trest_make_request(THTTP_METHOD_POST, "/logs/", logs);
-	if (!req) {
-		goto out;
-	}
-	res = trest_do_json_request(ph_logger->client, req);
-	if (!res) {
-		pv_log(WARN,
-		       "HTTP request POST /logs/ could not be initialized");
-	} else if (!res->code && res->status != TREST_AUTH_STATUS_OK) {
-		pv_log(WARN,
-		       "HTTP request POST /logs/ could not auth (status=%d)",
-		       res->status);
-	} else if (res->code != THTTP_STATUS_OK) {
-		pv_log(WARN,
-		       "HTTP request POST /logs/ returned HTTP error (code=%d; body='%s')",
-		       res->code, res->body);
-	} else {
-		ret = 0;
-	}
+
+	do {
+		retry_plain = false;
+
+		if (pv_config_get_bool(PV_LOG_PUSH_COMPRESS) &&
+		    !ph_logger->no_compress)
+			fd = ph_logger_gzip_logs(logs, len, &gz_len);
+
+		if (fd >= 0) {
+			char *headers[] = { "Content-Encoding: gzip" };
+
+			req = trest_make_request(THTTP_METHOD_POST, "/logs/",
+						 NULL);
+			if (req) {
+				req->thttpreq.fd = fd;
+				req->thttpreq.len = gz_len;
+				thttp_add_headers(&req->thttpreq, headers, 1);
+			}
+		} else {
+			req = trest_make_request(THTTP_METHOD_POST, "/logs/",
+						 logs);
+		}
+		if (!req) {
+			goto out;
+		}
+		res = trest_do_json_request(ph_logger->client, req);
+		if (!res) {
+			pv_log(WARN,
+			       "HTTP request POST /logs/ could not be initialized");
+		} else if (!res->code && res->status != TREST_AUTH_STATUS_OK) {
+			pv_log(WARN,
+			       "HTTP request POST /logs/ could not auth (status=%d)",
+			       res->status);
+		} else if (fd >= 0 && ph_logger_gzip_rejected(res)) {
+			// the server does not take compressed bodies
+			pv_log(WARN,
+			       "HTTP request POST /logs/ rejected gzip body (code=%d), disabling compression",
+			       res->code);
+			ph_logger->no_compress = true;
+			retry_plain = true;
+		} else if (res->code != THTTP_STATUS_OK) {
+			pv_log(WARN,
+			       "HTTP request POST /logs/ returned HTTP error (code=%d; body='%s')",
+			       res->code, res->body);
+		} else {
+			ret = 0;
+		}
+
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+		trest_request_free(req);
+		req = NULL;
+		if (res)
+			trest_response_free(res);
+		res = NULL;
+	} while (retry_plain);
 
 out:
+	if (fd >= 0)
+		close(fd);
 	if (req)
 		trest_request_free(req);
 	if (res)
@@ -229,323 +367,569 @@ static char *strnchr(char *src, char ch, int len)
 	return NULL;
 }
 
+static unsigned int _hash_log_file(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while (*path)
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
+
+	return hash % PH_LOGGER_HASH_SIZE;
+}
+
 struct ph_logger_file *_search_log_file(const char *path)
 {
 	struct ph_logger_file *f, *tmp;
-	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file, list)
+	struct dl_list *bucket = &ph_logger.buckets[_hash_log_file(path)];
+	dl_list_for_each_safe(f, tmp, bucket, struct ph_logger_file, hlist)
 	{
-		if (pv_str_matches(path, strlen(path), f->path, strlen(f->path)))
+		if (!strcmp(path, f->path))
 			return f;
 	}
 
 	return NULL;
 }
 
-static void _save_log_file_pos(off_t pos, const char *path)
+static struct ph_logger_file *_new_log_file(const char *path,
+					    struct ph_logger_journal *j)
 {
-	// try to get file info from memory
 	struct ph_logger_file *f;
-	f = _search_log_file(path);
-	// if not, we create a new entry
-	if (!f) {
-		pv_log(DEBUG, "log file '%s' not yet stored in memory. Saving new file...", path);
-		f = calloc(1, sizeof(struct ph_logger_file));
-		if (f) {
-			f->path = strdup(path);
-			dl_list_add(&ph_logger.files, &f->list);
-		}
-	}
-	if (!f) {
+
+	f = calloc(1, sizeof(struct ph_logger_file));
+	if (f)
+		f->path = strdup(path);
+	if (!f || !f->path) {
 		pv_log(ERROR, "could not initialize log file: %s", strerror(errno));
+		if (f)
+			free(f);
+		return NULL;
+	}
+	f->fd = -1;
+	f->saved_pos = -1;
+	f->journal = j;
+	if (j)
+		j->files++;
+	dl_list_add(&ph_logger.files, &f->list);
+	dl_list_add(&ph_logger.buckets[_hash_log_file(path)], &f->hlist);
+
+	return f;
+}
+
+static bool _journal_enabled(void)
+{
+	// logs in volatile storage do not need persistent positions
+	return !pv_config_get_str(PV_STORAGE_LOGTEMPSIZE);
+}
+
+static void _load_journal(struct ph_logger_journal *j, const char *root)
+{
+	char path[PATH_MAX], *line = NULL;
+	size_t size = 0;
+	long long pos;
+	int n;
+
+	FILE *fp = fopen(j->path, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			j->migrate = true;
 		return;
 	}
 
-	// update pos value in memory
-	f->pos = pos;
+	while (getline(&line, &size, fp) > 0) {
+		if (sscanf(line, "%lld %n", &pos, &n) != 1)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+
+		SNPRINTF_WTRUNC(path, sizeof(path), "%s/%s", root, line + n);
+		struct ph_logger_file *f = _search_log_file(path);
+		if (!f)
+			f = _new_log_file(path, j);
+		if (!f)
+			continue;
+
+		f->pos = f->saved_pos = pos;
+		j->records++;
+	}
+
+	if (line)
+		free(line);
+	fclose(fp);
+}
+
+static struct ph_logger_journal *_get_journal(const char *rev)
+{
+	struct ph_logger_journal *j, *tmp;
+	char root[PATH_MAX], path[PATH_MAX];
+
+	if (!_journal_enabled())
+		return NULL;
 
-	// save pos in xattr if possible by config
-	if (!pv_config_get_str(PV_STORAGE_LOGTEMPSIZE)) {
-		char value[MAX_DEC_STRING_SIZE_OF_TYPE(pos)]; // max PRI64
-		SNPRINTF_WTRUNC(value, sizeof(value), "%" PRId64, pos);
-		if (setxattr(path, PH_LOGGER_POS_XATTR, value, strlen(value), 0))
-			pv_log(WARN, "xattr could not be saved in '%s': %s", path, strerror(errno));
+	dl_list_for_each_safe(j, tmp, &ph_logger.journals,
+			      struct ph_logger_journal, list)
+	{
+		if (!strcmp(rev, j->rev))
+			return j;
 	}
+
+	j = calloc(1, sizeof(struct ph_logger_journal));
+	if (!j)
+		return NULL;
+
+	pv_paths_pv_log(path, PATH_MAX, "");
+	SNPRINTF_WTRUNC(root, sizeof(root), "%s/%s", path, rev);
+	SNPRINTF_WTRUNC(path, sizeof(path), "%s/%s", root,
+			PH_LOGGER_CURSORS_FNAME);
+
+	j->rev = strdup(rev);
+	j->path = strdup(path);
+	j->fd = -1;
+	dl_list_add(&ph_logger.journals, &j->list);
+
+	_load_journal(j, root);
+
+	return j;
 }
 
 #define MAX_XATTR_SIZE 32
 
-static off_t _load_log_file_pos(const char *path)
+static struct ph_logger_file *_get_log_file(const char *path, const char *rev)
 {
-	// first, try to get pos from memory
+	// first, try to get file info from memory
 	struct ph_logger_file *f;
 	f = _search_log_file(path);
 	if (f)
-		return f->pos;
+		return f;
+
+	// the journal of the revision might know about it
+	struct ph_logger_journal *j = _get_journal(rev);
+	f = _search_log_file(path);
+	if (f)
+		return f;
 
-	pv_log(DEBUG, "unknown file found in '%s'", path);
+	pv_log(DEBUG, "log file '%s' not yet stored in memory. Saving new file...", path);
+	f = _new_log_file(path, j);
+	if (!f)
+		return NULL;
 
-	// if not in memory, try to get it from xattr if possible
+	// without journal, try to get pos from the xattr stored by older versions
 	char dst[MAX_XATTR_SIZE] = { 0 };
-	off_t pos = 0;
-	if (!pv_config_get_str(PV_STORAGE_LOGTEMPSIZE)) {
-		pv_log(DEBUG, "log file is persistent. Trying to get xattr...", path);
-		if (getxattr(path, PH_LOGGER_POS_XATTR, dst, MAX_XATTR_SIZE) > 0)
-			sscanf(dst, "%" PRId64, &pos);
-		else {
-			if (errno == ENODATA)
-				// if xattr does not yet exist for that path, we save it with pos 0
-				_save_log_file_pos(pos, path);
-			else
-				pv_log(WARN, "xattr could not be loaded: %s", strerror(errno));
+	if (j && j->migrate &&
+	    getxattr(path, PH_LOGGER_POS_XATTR, dst, MAX_XATTR_SIZE - 1) > 0) {
+		pv_log(DEBUG, "migrating position of '%s' from xattr", path);
+		sscanf(dst, "%" PRId64, &f->pos);
+		ph_logger.dirty = true;
+	}
+
+	return f;
+}
+
+static void _set_log_file_pos(struct ph_logger_file *f, off_t pos)
+{
+	f->pos = pos;
+	if (f->journal && f->pos != f->saved_pos)
+		ph_logger.dirty = true;
+}
+
+/*
+ * Forget the open fd and position of a path whose file has been replaced,
+ * such as after a rotation.
+ */
+static void _reset_log_file(struct ph_logger_file *f)
+{
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+	f->pending = false;
+	// lines of the old file in the batch must not move the new position
+	f->in_batch = false;
+	f->batch_pos = 0;
+	_set_log_file_pos(f, 0);
+}
+
+static void _close_log_files(void)
+{
+	struct ph_logger_file *f, *tmp;
+	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file, list)
+	{
+		if (f->fd >= 0)
+			close(f->fd);
+		f->fd = -1;
+	}
+}
+
+static int _write_journal_records(FILE *fp, struct ph_logger_journal *j,
+				  bool all)
+{
+	char root[PATH_MAX];
+	struct ph_logger_file *f, *tmp;
+	int n = 0;
+
+	pv_paths_pv_log(root, PATH_MAX, "");
+	int offset = strlen(root) + strlen(j->rev) + 2;
+
+	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file,
+			      list)
+	{
+		if (f->journal != j || (!all && f->pos == f->saved_pos) ||
+		    (int)strlen(f->path) <= offset)
+			continue;
+
+		fprintf(fp, "%lld %s\n", (long long)f->pos, f->path + offset);
+		n++;
+	}
+
+	return n;
+}
+
+static void _commit_journal_records(struct ph_logger_journal *j)
+{
+	struct ph_logger_file *f, *tmp;
+	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file,
+			      list)
+	{
+		if (f->journal == j)
+			f->saved_pos = f->pos;
+	}
+}
+
+/*
+ * Rewrite the journal with one record per file.
+ */
+static int _compact_journal(struct ph_logger_journal *j)
+{
+	char tmp[PATH_MAX];
+	int ret = -1, n;
+
+	SNPRINTF_WTRUNC(tmp, sizeof(tmp), "%s.tmp", j->path);
+
+	FILE *fp = fopen(tmp, "w");
+	if (!fp)
+		return -1;
+
+	n = _write_journal_records(fp, j, true);
+	if (fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+
+	if (rename(tmp, j->path))
+		goto out;
+
+	if (j->fd >= 0)
+		close(j->fd);
+	j->fd = -1;
+	j->records = n;
+	ret = 0;
+out:
+	if (ret)
+		unlink(tmp);
+	return ret;
+}
+
+static int _append_journal(struct ph_logger_journal *j)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	int ret = -1;
+
+	FILE *fp = open_memstream(&buf, &len);
+	if (!fp)
+		return -1;
+	int n = _write_journal_records(fp, j, false);
+	fclose(fp);
+
+	if (!n) {
+		ret = 0;
+		goto out;
+	}
+
+	if (j->fd < 0)
+		j->fd = open(j->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			     0644);
+	if (j->fd < 0)
+		goto out;
+
+	if (pv_fs_file_write_nointr(j->fd, buf, len) != (ssize_t)len ||
+	    fdatasync(j->fd))
+		goto out;
+
+	j->records += n;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Persist the positions that changed since the last checkpoint in the
+ * journals, compacting the ones that grew too much.
+ */
+static void ph_logger_checkpoint(void)
+{
+	struct ph_logger_journal *j, *tmp;
+	bool failed = false;
+	int ret;
+
+	if (!ph_logger.dirty)
+		return;
+
+	dl_list_for_each_safe(j, tmp, &ph_logger.journals,
+			      struct ph_logger_journal, list)
+	{
+		if (j->records > 2 * j->files + PH_LOGGER_COMPACT_SLACK)
+			ret = _compact_journal(j);
+		else
+			ret = _append_journal(j);
+
+		if (ret) {
+			pv_log(WARN, "could not save log positions in '%s': %s",
+			       j->path, strerror(errno));
+			failed = true;
+			continue;
 		}
+
+		_commit_journal_records(j);
+		j->migrate = false;
 	}
 
+	ph_logger.dirty = failed;
+	timer_start(&ph_logger.checkpoint,
+		    pv_config_get_int(PV_LOG_CURSOR_INTERVAL), 0,
+		    RELATIV_TIMER);
+}
+
+static void ph_logger_checkpoint_timeout(void)
+{
+	if (timer_current_state(&ph_logger.checkpoint).fin)
+		ph_logger_checkpoint();
+}
+
+static bool ph_logger_batch_full(struct ph_logger_batch *batch)
+{
+	if (!batch->lines)
+		return false;
+
+	return (batch->len >=
+		(size_t)pv_config_get_int(PV_LOG_PUSH_MAX_SIZE) * 1024) ||
+	       (batch->lines >= pv_config_get_int(PV_LOG_PUSH_MAX_LINES));
+}
+
+/*
+ * A batch is sent when full or when its oldest line has waited for
+ * PV_LOG_PUSH_MAX_LATENCY.
+ */
+static bool ph_logger_batch_ready(struct ph_logger_batch *batch)
+{
+	if (!batch->lines)
+		return false;
+
+	return ph_logger_batch_full(batch) ||
+	       timer_current_state(&batch->deadline).fin;
+}
+
+static int ph_logger_batch_reserve(struct ph_logger_batch *batch, size_t len)
+{
+	if (batch->len + len <= batch->size)
+		return 0;
+
+	size_t size = batch->size ? batch->size : 4096;
+	while (size < batch->len + len)
+		size *= 2;
+
+	char *buf = realloc(batch->buf, size);
+	if (!buf)
+		return -1;
+
+	batch->buf = buf;
+	batch->size = size;
+
+	return 0;
+}
+
+static int ph_logger_batch_add(struct ph_logger_batch *batch, const char *line,
+			       int len, char *platform, char *source, char *rev)
+{
+	const char *lvl = pv_log_level_name(INFO);
+	size_t head = sizeof(PH_LOGGER_JSON_HEAD) + strlen(lvl) +
+		      strlen(source) + strlen(platform) + strlen(rev);
+
+	// worst case escaping plus the array characters
+	if (ph_logger_batch_reserve(batch, head + len * 6 + 8))
+		return -1;
+
+	if (!batch->lines) {
+		int ms = pv_config_get_int(PV_LOG_PUSH_MAX_LATENCY);
+		timer_start(&batch->deadline, ms / 1000, (ms % 1000) * 1000000,
+			    RELATIV_TIMER);
+	}
+
+	char *dst = batch->buf + batch->len;
+	int n = sprintf(dst, "%c" PH_LOGGER_JSON_HEAD, batch->lines ? ',' : '[',
+			lvl, source, platform, rev);
+	n += pv_json_format_to(dst + n, line, len);
+	n += sprintf(dst + n, PH_LOGGER_JSON_TAIL);
+
+	batch->len += n;
+	batch->lines++;
+
 	return 0;
 }
 
+/*
+ * Send the batch and commit the positions of the files it contains. On error
+ * the batch is kept so it can be retried, possibly with more lines.
+ * Returns 1 if something was sent, 0 if the batch was empty or -1 on error.
+ */
+static int ph_logger_batch_send(struct ph_logger_batch *batch)
+{
+	if (!batch->lines)
+		return 0;
+
+	// close the array without counting it, more lines might come
+	batch->buf[batch->len] = ']';
+	batch->buf[batch->len + 1] = '\0';
+
+	if (ph_logger_push_logs_endpoint(&ph_logger, batch->buf,
+					 batch->len + 1))
+		return -1;
+
+	pv_log(DEBUG, "pushed %d log lines in %zu bytes", batch->lines,
+	       batch->len + 1);
+
+	struct ph_logger_file *f, *tmp;
+	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file,
+			      list)
+	{
+		if (!f->in_batch)
+			continue;
+
+		_set_log_file_pos(f, f->batch_pos);
+		f->in_batch = false;
+	}
+
+	batch->len = 0;
+	batch->lines = 0;
+
+	ph_logger_checkpoint_timeout();
+
+	return 1;
+}
+
 /*
  * The log files contains each line ending in a '\n'
- * Read 4K block of filename, seek to the last saved position in
- * xattr of the filename and push the log line to PH.
+ * Read blocks of filename, starting from the last saved position or from
+ * where the current batch stopped, and add complete log lines to the batch.
  * If a new line isn't found, it's probably not written yet so wait
  * for it to appear and try again later.
+ * Returns 1 if the batch got full before the end of the file, 0 if all
+ * complete lines are in the batch or -1 on error.
  */
 static int ph_logger_push_from_file(const char *filename, char *platform,
 				    char *source, char *rev)
 {
-	int ret = 0;
-	off_t pos = 0;
-	int offset = 0;
-	off_t read_pos = 0;
-	struct stat st;
-	int fd = -1;
-	char *buf = NULL;
-	int bytes_read = 0;
-	int nr_frags = 0;
-	int len_frags = 0;
+	struct ph_logger_batch *batch = &ph_logger.batch;
+	struct ph_logger_file *f = NULL;
 	struct buffer *log_buff = NULL;
-	struct buffer *large_buff = NULL;
+	struct stat st;
+	off_t pos;
+	int ret = 0;
 
-	large_buff = pv_buffer_get(true);
-	if (!large_buff) {
-		ret = -1;
-		goto out;
-	}
+	f = _get_log_file(filename, rev);
+	if (!f)
+		return -1;
 
 	log_buff = pv_buffer_get(false);
-	if (!log_buff) {
-		ret = -1;
-		goto out;
-	}
-	buf = log_buff->buf;
+	if (!log_buff)
+		return -1;
 
-	pos = _load_log_file_pos(filename);
-#ifdef DEBUG
-	if (!dl_list_empty(&frag_list)) {
-		pv_log(WARN, "frag list must be empty");
-	}
-#endif
-	dl_list_init(&frag_list);
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
+	// keep the file open between pushes
+	if (f->fd < 0)
+		f->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (f->fd < 0) {
 		pv_log(ERROR, "open failed for %s: %s", filename,
 		       strerror(errno));
 		ret = -1;
 		goto out;
 	}
 
-	if (lseek(fd, pos, SEEK_SET) == (off_t)-1) {
-		pv_log(ERROR, "Unable to seek to position %lld for %s", pos,
-		       filename);
-		goto close_fd;
-	}
+	pos = f->in_batch ? f->batch_pos : f->pos;
 
-	read_pos = lseek(fd, 0, SEEK_CUR);
+	/*
+	 * The stored position was larger
+	 * then the current size of the file.
+	 * We assume it was truncated hence read from the
+	 * beginning.
+	 */
+	if (!fstat(f->fd, &st) && st.st_size < pos)
+		pos = 0;
+
+	while (1) {
+		char *buf = log_buff->buf;
+		ssize_t bytes_read =
+			pread(f->fd, buf, log_buff->size, pos);
+		if (bytes_read <= 0)
+			break;
 
-	if (!fstat(fd, &st)) {
 		/*
-		 * The stored position was larger
-		 * then the current size of the file.
-		 * We assume it was truncated hence read from the
-		 * beginning.
+		 * we've to get rid of all NULL bytes in buf
+		 * otherwise the json escaping would see the line shorter
 		 */
-		if (st.st_size < read_pos) {
-			lseek(fd, 0, SEEK_SET);
-			read_pos = 0;
-		}
-	}
-
-	bytes_read = pv_fs_file_read_nointr(fd, buf, log_buff->size);
-	/*
-	 * we've to get rid of all NULL bytes in buf
-	 * otherwise the pv_json_format won't really work as it'll
-	 * see the length of the string short.
-	 */
-	pv_str_replace_char(buf, bytes_read, '\0', ' ');
-	while (bytes_read > 0) {
-		char *newline_at = NULL;
-		char *src = buf + offset;
-		char *formatted_json = NULL;
-		char *json_holder = NULL;
-
-		json_holder = large_buff->buf;
-		newline_at = strnchr(src, '\n', bytes_read);
-		if (newline_at) {
-			int len = newline_at - src + 1;
-			/*
-			 * Use json_holder temporarily to
-			 * get the source name and platform 
-			 * name.
-			 */
-			SNPRINTF_WTRUNC(json_holder, len, "%.*s", len - 1, src);
-			offset += len;
-			bytes_read -= offset;
-			json_holder[len - 1] = '\0';
-		} else {
-			/* No new line found, there can be 2 cases here,
-			 * either we've read a full log_buf->size and found no newline
-			 * in which case there's nothing else we can do but dump
-			 * it. But if bytes_read are != log_buf->size then we can
-			 * safely assume we might get a new line later and in this
-			 * case we simply bail out.
-			 */
-			if (bytes_read == log_buff->size) {
-				SNPRINTF_WTRUNC(json_holder, bytes_read + 1,
-						"%.*s", bytes_read, src);
-				offset += bytes_read;
-				json_holder[bytes_read] = '\0';
-				bytes_read = 0;
+		pv_str_replace_char(buf, bytes_read, '\0', ' ');
+
+		int offset = 0;
+		while (offset < bytes_read) {
+			char *src = buf + offset;
+			int avail = bytes_read - offset;
+			char *newline_at = strnchr(src, '\n', avail);
+			int len;
+
+			if (newline_at) {
+				len = newline_at - src;
+			} else if (!offset && bytes_read == log_buff->size) {
+				/*
+				 * We've read a full log_buf->size and found
+				 * no newline, so there's nothing else we can
+				 * do but dump it.
+				 */
+				len = avail;
 			} else {
 				/*
-				 * A small file will not be pushed out
-				 * if it doesn't contain a '\n'. Similarly a large file's
-				 * last chunk log_buf->size may not be pushed out as it's
-				 * similar to the case of small file.
-				 * The reason being we can't differentiate between a slow
-				 * growing file and a file that doesn't grow at all.
+				 * A file's last chunk may not be pushed out
+				 * if it doesn't contain a '\n'. The reason
+				 * being we can't differentiate between a slow
+				 * growing file and a file that doesn't grow
+				 * at all.
 				 */
 				break;
 			}
-		}
-#ifdef DEBUG
-		pv_log(DEBUG, "buf strlen = %d for file %s\n",
-		       strlen(json_holder), filename);
-#endif
-		formatted_json =
-			pv_json_format(json_holder, strlen(json_holder));
-		if (formatted_json) {
-			struct ph_logger_fragment *frag = NULL;
-			char *__json_frag = NULL;
-			int frag_len = 0;
-
-			frag_len = sizeof(PH_LOGGER_JSON_FORMAT) +
-				   strlen(pv_log_level_name(INFO)) +
-				   strlen(source) + strlen(platform) +
-				   strlen(rev) + strlen(formatted_json) +
-				   /*largest 64 bit is 19 digits*/
-				   19 +
-				   /*largest 32 bit is 10 digits.
-				 * sizeof accomodates for null
-				 */
-				   10;
-			__json_frag = calloc(frag_len, sizeof(char));
-			if (__json_frag) {
-				char *shrinked = NULL;
-
-				SNPRINTF_WTRUNC(__json_frag, frag_len,
-						PH_LOGGER_JSON_FORMAT,
-						(uint64_t)0, (uint32_t)0,
-						pv_log_level_name(INFO), source,
-						platform, rev, formatted_json);
-				shrinked = realloc(__json_frag,
-						   strlen(__json_frag) + 1);
-				if (shrinked)
-					__json_frag = shrinked;
-				frag = ph_logger_alloc_frag(__json_frag);
-				dl_list_add_tail(&frag_list, &frag->list);
-				nr_frags++;
-				len_frags += strlen(frag->json_frag);
-				pos = read_pos + offset;
-			} else {
-				/*Bail out on the first error*/
+
+			if (ph_logger_batch_full(batch)) {
+				ret = 1;
+				goto out;
+			}
+
+			if (len &&
+			    ph_logger_batch_add(batch, src, len, platform,
+						source, rev)) {
 				pv_log(ERROR, "alloc error for filename %s",
 				       filename);
-				bytes_read = 0;
+				ret = -1;
+				goto out;
 			}
-			free(formatted_json);
-		} else if (strlen(json_holder)) { /*we actually failed to create json*/
-			/*
-			 * Dont' try for next block if this block
-			 * couldn't be json escaped.
-			 */
-			pv_log(ERROR, "json format error for filename %s",
-			       filename);
-			bytes_read = 0;
-		} else {
-			pos = read_pos + offset;
-			_save_log_file_pos(pos, filename);
-		}
-	}
-close_fd:
-	close(fd);
-	if (!dl_list_empty(&frag_list)) {
-		struct ph_logger_fragment *item, *tmp;
-		char *json_frag_array = NULL;
-		int off = 0;
-		int avail = 0;
-		int written = 0;
-		/*
-		 * Each fragment will need to be separated by ',' thus
-		 * we'll need nr_frags - 1 bytes in addition to size
-		 * of each of the frags. The whole bundle needs to be
-		 * inside '[' ']'. Thus
-		 * bytes_reqd = nr_frags - 1 + 2 + len_frags + 1 (for null).
-		 */
-		avail = nr_frags + len_frags + 2;
-		json_frag_array = calloc(avail, sizeof(char));
-		if (json_frag_array) {
-			off = snprintf(json_frag_array, 2, "[");
-			avail -= off;
-		}
 
-		dl_list_for_each_safe(item, tmp, &frag_list,
-				      struct ph_logger_fragment, list)
-		{
-			if (json_frag_array) {
-				written = snprintf(json_frag_array + off, avail,
-						   "%s", item->json_frag);
-				avail -= written;
-				off += written;
-			}
-			dl_list_del(&item->list);
-			/*
-			 * Is there another item if so add , in
-			 * json.
-			 */
-			if (!dl_list_empty(&frag_list) && json_frag_array) {
-				written = snprintf(json_frag_array + off, avail,
-						   ",");
-				avail -= written;
-				off += written;
-			}
-			free(item->json_frag);
-			free(item);
-		}
-		if (json_frag_array) {
-			SNPRINTF_WTRUNC(json_frag_array + off, avail, "]");
-			// set ret to 1, something pending to be sent
-			ret = 1;
-			if (!ph_logger_push_logs_endpoint(&ph_logger, json_frag_array))
-				_save_log_file_pos(pos, filename);
-			// in case of error while sending, we return -1
-			else
-				ret = -1;
-			free(json_frag_array);
+			offset += newline_at ? len + 1 : len;
+			f->batch_pos = pos + offset;
+			f->in_batch = true;
 		}
+
+		if (!offset)
+			break;
+		pos += offset;
 	}
+
 out:
 	pv_buffer_drop(log_buff);
-	pv_buffer_drop(large_buff);
 	return ret;
 }
 
@@ -585,64 +969,435 @@ static int ph_logger_push_from_file_parse_info(char *buf, int len,
 	return -1;
 }
 
-static int ph_logger_push_revision(char *revision)
+static bool ph_logger_excluded(const char *name)
+{
+	return !fnmatch(PH_LOGGER_EXCLUDE, name, 0) ||
+	       !fnmatch(PH_LOGGER_EXCLUDE_CURSORS, name, 0);
+}
+
+typedef int (*ph_logger_walk_cb_t)(char *path, bool is_dir, void *opaque);
+
+/*
+ * Recursively call cb for every directory and regular log file below path.
+ * Stops as soon as cb returns a negative value.
+ */
+static int ph_logger_walk(const char *path, ph_logger_walk_cb_t cb,
+			  void *opaque)
+{
+	char child[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	int ret = 0;
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		SNPRINTF_WTRUNC(child, sizeof(child), "%s/%s", path,
+				de->d_name);
+
+		unsigned char type = de->d_type;
+		if (type == DT_UNKNOWN && !lstat(child, &st)) {
+			if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
+
+		if (type == DT_DIR) {
+			ret = cb(child, true, opaque);
+			if (ret >= 0)
+				ret = ph_logger_walk(child, cb, opaque);
+		} else if (type == DT_REG && !ph_logger_excluded(de->d_name)) {
+			ret = cb(child, false, opaque);
+		}
+
+		if (ret < 0)
+			break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int ph_logger_get_offset(char *revision)
 {
-	char find_cmd[1024], path[PATH_MAX];
-	FILE *find_fp = NULL;
-	int offset_bytes = 0;
-	int result = 0;
+	char path[PATH_MAX], root[PATH_MAX];
 
 	/*
 	 * Figure out how much to move
-	 * ahead in the returned result set for
-	 * each file path returned. We need to move forward
+	 * ahead in each file path. We need to move forward
 	 * PH_LOGGER_DIR/<revision>/ characters to get to the
 	 * actual file path.
 	 */
+	pv_paths_pv_log(path, PATH_MAX, "");
+	SNPRINTF_WTRUNC(root, sizeof(root), "%s/%s/", path, revision);
+
+	return strlen(root);
+}
+
+struct ph_logger_push {
+	char *revision;
+	int offset;
+	int result;
+};
+
+/*
+ * Add the lines of a file to the batch, sending it every time it gets full.
+ * Returns 1 if something was sent, 0 if not or -1 on error.
+ */
+static int ph_logger_push_file(char *path, char *revision, int offset)
+{
+	int ret, result = 0;
+
+	while ((ret = ph_logger_push_from_file_parse_info(
+			path, strlen(path), revision, offset)) > 0) {
+		if (ph_logger_batch_send(&ph_logger.batch) < 0)
+			return -1;
+		result = 1;
+	}
+
+	return ret < 0 ? ret : result;
+}
+
+static int ph_logger_push_cb(char *path, bool is_dir, void *opaque)
+{
+	struct ph_logger_push *push = opaque;
+
+	if (is_dir)
+		return 0;
+
+	int ret = ph_logger_push_file(path, push->revision, push->offset);
+	// if there was something to send for al least one file, return 1
+	if (ret > 0)
+		push->result = 1;
+	// if we got an error while pushing any of the files, return -1
+	else if (ret < 0)
+		push->result = ret;
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Lines that do not fill a batch are left in it, so they can be sent
+ * together with the ones of the next revision.
+ */
+static int ph_logger_push_revision(char *revision)
+{
+	char path[PATH_MAX], root[PATH_MAX];
+	struct ph_logger_push push = {
+		.revision = revision,
+		.offset = ph_logger_get_offset(revision),
+		.result = 0,
+	};
 
 	pv_paths_pv_log(path, PATH_MAX, "");
-	SNPRINTF_WTRUNC(find_cmd, sizeof(find_cmd), "%s/%s/", path, revision);
-	offset_bytes = strlen(find_cmd);
+	SNPRINTF_WTRUNC(root, sizeof(root), "%s/%s", path, revision);
 
-	SNPRINTF_WTRUNC(find_cmd, sizeof(find_cmd),
-			"find %s/%s -type f ! -name '*.gz*' 2>/dev/null", path,
-			revision);
-	find_fp = popen(find_cmd, "r");
-
-	if (find_fp) {
-		char *buf = NULL;
-		size_t size = 0;
-
-		while (!feof(find_fp)) {
-			ssize_t nr_read = 0;
-
-			nr_read = getline(&buf, &size, find_fp);
-			if (nr_read > 0) {
-				int ret = -1;
-
-				/*Get rid of '\n'*/
-				buf[nr_read - 1] = '\0';
-				ret = ph_logger_push_from_file_parse_info(
-					buf, nr_read, revision, offset_bytes);
-				// if there was something to send for al least one file, return 1
-				if (ret > 0)
-					result = 1;
-				// if we got an error while pushing any of the files, return -1
-				else if (ret < 0) {
-					result = ret;
-					break;
+	ph_logger_walk(root, ph_logger_push_cb, &push);
+
+	if (push.result >= 0 && ph_logger_batch_ready(&ph_logger.batch)) {
+		int ret = ph_logger_batch_send(&ph_logger.batch);
+		if (ret)
+			push.result = ret;
+	}
+
+	return push.result;
+}
+
+static struct ph_logger_watch *ph_logger_tail_search_watch(
+	struct ph_logger_tail *tail, int wd)
+{
+	struct ph_logger_watch *w, *tmp;
+	dl_list_for_each_safe(w, tmp, &tail->watches, struct ph_logger_watch,
+			      list)
+	{
+		if (w->wd == wd)
+			return w;
+	}
+
+	return NULL;
+}
+
+static int ph_logger_tail_watch(struct ph_logger_tail *tail, const char *path)
+{
+	if (tail->ifd < 0)
+		return 0;
+
+	int wd = inotify_add_watch(tail->ifd, path, PH_LOGGER_INOTIFY_MASK);
+	if (wd < 0) {
+		pv_log(DEBUG, "could not watch '%s': %s", path,
+		       strerror(errno));
+		return -1;
+	}
+
+	// the same directory always gets the same watch descriptor
+	if (ph_logger_tail_search_watch(tail, wd))
+		return 0;
+
+	struct ph_logger_watch *w = calloc(1, sizeof(struct ph_logger_watch));
+	if (!w)
+		return -1;
+
+	w->wd = wd;
+	w->path = strdup(path);
+	if (!w->path) {
+		free(w);
+		return -1;
+	}
+	dl_list_add(&tail->watches, &w->list);
+
+	return 0;
+}
+
+static int ph_logger_tail_add_cb(char *path, bool is_dir, void *opaque)
+{
+	struct ph_logger_tail *tail = opaque;
+
+	if (is_dir) {
+		ph_logger_tail_watch(tail, path);
+		return 0;
+	}
+
+	struct ph_logger_file *f = _get_log_file(path, tail->revision);
+	if (f)
+		f->pending = true;
+
+	return 0;
+}
+
+static void ph_logger_tail_scan(struct ph_logger_tail *tail)
+{
+	// the revision directory might not have been created yet
+	if (ph_logger_tail_watch(tail, tail->root) ||
+	    ph_logger_walk(tail->root, ph_logger_tail_add_cb, tail))
+		return;
+
+	// without inotify, we have no other choice than rescanning
+	tail->rescan = tail->ifd < 0;
+}
+
+static void ph_logger_tail_read(struct ph_logger_tail *tail)
+{
+	char buf[PH_LOGGER_INOTIFY_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	char path[PATH_MAX];
+	ssize_t len;
+
+	while ((len = read(tail->ifd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				tail->rescan = true;
+				continue;
+			}
+
+			struct ph_logger_watch *w =
+				ph_logger_tail_search_watch(tail, ev->wd);
+			if (!w)
+				continue;
+
+			if (ev->mask & IN_IGNORED) {
+				dl_list_del(&w->list);
+				free(w->path);
+				free(w);
+				continue;
+			}
+
+			if (!ev->len)
+				continue;
+
+			SNPRINTF_WTRUNC(path, sizeof(path), "%s/%s", w->path,
+					ev->name);
+
+			if (ev->mask & IN_ISDIR) {
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					ph_logger_tail_watch(tail, path);
+					ph_logger_walk(path,
+						       ph_logger_tail_add_cb,
+						       tail);
 				}
-			} else {
-				break;
+				continue;
 			}
+
+			if (ph_logger_excluded(ev->name))
+				continue;
+
+			struct ph_logger_file *f = _search_log_file(path);
+
+			// a new file took the place of the one we had open
+			if (f && (ev->mask & (IN_CREATE | IN_MOVED_TO |
+					      IN_MOVED_FROM | IN_DELETE)))
+				_reset_log_file(f);
+
+			if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+				continue;
+
+			if (!f)
+				f = _get_log_file(path, tail->revision);
+			if (f)
+				f->pending = true;
 		}
-		if (buf)
-			free(buf);
-		pclose(find_fp);
 	}
+}
+
+/*
+ * Add the pending files to the batch and send it if ready.
+ * Returns 1 if something was sent, 0 if not or -1 on error.
+ */
+static int ph_logger_tail_push(struct ph_logger_tail *tail)
+{
+	struct ph_logger_file *f, *tmp;
+	int ret, result = 0;
+
+	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file,
+			      list)
+	{
+		if (!f->pending)
+			continue;
+
+		ret = ph_logger_push_file(f->path, tail->revision,
+					  tail->offset);
+		if (ret < 0)
+			return ret;
+		else if (ret > 0)
+			result = 1;
+		f->pending = false;
+	}
+
+	if (ph_logger_batch_ready(&ph_logger.batch)) {
+		ret = ph_logger_batch_send(&ph_logger.batch);
+		if (ret)
+			result = ret;
+	}
+
 	return result;
 }
 
+static bool ph_logger_tail_pending(void)
+{
+	struct ph_logger_file *f, *tmp;
+	dl_list_for_each_safe(f, tmp, &ph_logger.files, struct ph_logger_file,
+			      list)
+	{
+		if (f->pending)
+			return true;
+	}
+
+	return false;
+}
+
+static int ph_logger_timer_ms(struct timer *t)
+{
+	struct timer_state tstate = timer_current_state(t);
+	if (tstate.fin)
+		return 0;
+
+	return tstate.sec * 1000 + tstate.nsec / 1000000;
+}
+
+/*
+ * Push the logs of the running revision as they are written. Files are kept
+ * open and we only wake up when inotify reports new data, waiting at least
+ * PV_LOG_PUSH_INTERVAL between passes so lines are grouped together.
+ */
+static void ph_logger_tail_revision(char *revision)
+{
+	char path[PATH_MAX];
+	struct ph_logger_batch *batch = &ph_logger.batch;
+	struct ph_logger_tail tail = {
+		.revision = revision,
+		.offset = ph_logger_get_offset(revision),
+		.rescan = true,
+	};
+	struct timer interval;
+	int sleep_secs = 0;
+
+	dl_list_init(&tail.watches);
+	pv_paths_pv_log(path, PATH_MAX, "");
+	SNPRINTF_WTRUNC(tail.root, sizeof(tail.root), "%s/%s", path,
+			revision);
+
+	tail.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (tail.ifd < 0)
+		pv_log(WARN, "could not init inotify, polling logs instead: %s",
+		       strerror(errno));
+
+	timer_start(&interval, 0, 0, RELATIV_TIMER);
+
+	while (!(ph_logger.flags & PH_LOGGER_FLAG_STOP)) {
+		pv_buffer_trim_check();
+
+		if (tail.rescan)
+			ph_logger_tail_scan(&tail);
+
+		int timeout = -1;
+		int nfds = tail.ifd < 0 ? 0 : 1;
+		bool pending = ph_logger_tail_pending();
+		bool waiting = !timer_current_state(&interval).fin;
+
+		// while waiting for the interval or a retry, let the kernel
+		// queue and merge the events instead of waking up for each
+		// written line
+		if ((pending || batch->lines) && waiting) {
+			timeout = ph_logger_timer_ms(&interval);
+			nfds = 0;
+		} else if (pending)
+			timeout = 0;
+		else if (batch->lines)
+			timeout = ph_logger_timer_ms(&batch->deadline);
+		else if (tail.rescan)
+			timeout = PH_LOGGER_RESCAN_MS;
+
+		// do not leave updated positions out of the journal for long
+		if (ph_logger.dirty) {
+			int ms = ph_logger_timer_ms(&ph_logger.checkpoint);
+			if (timeout < 0 || ms < timeout)
+				timeout = ms;
+		}
+
+		struct pollfd pfd = { .fd = tail.ifd, .events = POLLIN };
+		int ret = poll(&pfd, nfds, timeout);
+		if (ret < 0 && errno != EINTR) {
+			pv_log(ERROR, "poll failed: %s", strerror(errno));
+			sleep(1);
+			continue;
+		}
+
+		ph_logger_checkpoint_timeout();
+
+		if (tail.ifd >= 0)
+			ph_logger_tail_read(&tail);
+
+		if (!timer_current_state(&interval).fin ||
+		    (!pending && !ph_logger_batch_ready(batch)))
+			continue;
+
+		ret = ph_logger_tail_push(&tail);
+		if (ret < 0) {
+			// increment sleep time until 10
+			sleep_secs++;
+			sleep_secs = (sleep_secs > 10 ? 10 : sleep_secs);
+			timer_start(&interval, sleep_secs, 0, RELATIV_TIMER);
+		} else {
+			// wait for the next lines to come
+			int ms = pv_config_get_int(PV_LOG_PUSH_INTERVAL);
+			sleep_secs = 0;
+			timer_start(&interval, ms / 1000,
+				    (ms % 1000) * 1000000, RELATIV_TIMER);
+		}
+	}
+
+	ph_logger_checkpoint();
+}
+
 static void log_libthttp(int level, const char *fmt, va_list args)
 {
 	if (level > pv_config_get_int(PV_LIBTHTTP_LOG_LEVEL))
@@ -654,7 +1409,6 @@ static void log_libthttp(int level, const char *fmt, va_list args)
 static pid_t ph_logger_start_push_service(char *revision)
 {
 	pid_t helper_pid = -1;
-	int sleep_secs = 0;
 	sigset_t oldmask;
 
 	if (pvsignals_block_chld(&oldmask)) {
@@ -667,6 +1421,7 @@ static pid_t ph_logger_start_push_service(char *revision)
 	if (helper_pid == 0) {
 		close(ph_logger.epoll_fd);
 		signal(SIGCHLD, SIG_DFL);
+		signal(SIGTERM, sigterm_handler);
 		if (pvsignals_setmask(&oldmask)) {
 			pv_log(ERROR,
 			       "Unable to reset sigmask in ph_logger helper child: %s",
@@ -679,20 +1434,7 @@ static pid_t ph_logger_start_push_service(char *revision)
 		       getpid(), getppid());
 		pv_log(DEBUG, "Push service pushing logs for rev %s", revision);
 		thttp_set_log_func(log_libthttp);
-		while (1) {
-			// if nothing to push or error while pushing, sleep
-			if (ph_logger_push_revision(revision) <= 0) {
-				// increment sleep time until 10
-				sleep_secs++;
-				sleep_secs =
-					(sleep_secs > 10 ? 10 : sleep_secs);
-				sleep(sleep_secs);
-				// if we have more things to push, just decrement sleep time
-			} else {
-				sleep_secs--;
-				sleep_secs = (sleep_secs < 0 ? 0 : sleep_secs);
-			}
-		}
+		ph_logger_tail_revision(revision);
 		_exit(0);
 	}
 
@@ -708,41 +1450,40 @@ static pid_t ph_logger_start_push_service(char *revision)
 
 static int ph_logger_get_max_revision(struct pantavisor *pv)
 {
-	const char *cmd_fmt = "find %s -type d -mindepth 1 -maxdepth 1";
-	char cmd[PATH_MAX], path[PATH_MAX];
-	FILE *fp = NULL;
-	char *buf = NULL;
-	size_t buf_size = 0;
+	char path[PATH_MAX], child[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
 	int max_revision = 0;
+	DIR *dir;
 
 	pv_paths_pv_log(path, PATH_MAX, "");
-	SNPRINTF_WTRUNC(cmd, PATH_MAX, cmd_fmt, path);
 
-	fp = popen(cmd, "r");
-	if (!fp)
-		goto out;
-	while (!feof(fp)) {
-		ssize_t ret = 0;
-
-		ret = getline(&buf, &buf_size, fp);
-		if (ret > 0) {
-			char *rev_dir = NULL;
-			int this_rev = -1;
-
-			//Throw away null byte.
-			buf[ret - 1] = '\0';
-			rev_dir = basename(buf);
-			sscanf(rev_dir, "%d", &this_rev);
-			if (this_rev > max_revision)
-				max_revision = this_rev;
-		} else {
-			break;
+	dir = opendir(path);
+	if (!dir)
+		return max_revision;
+
+	while ((de = readdir(dir))) {
+		int this_rev = -1;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		unsigned char type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			SNPRINTF_WTRUNC(child, sizeof(child), "%s/%s", path,
+					de->d_name);
+			if (!lstat(child, &st) && S_ISDIR(st.st_mode))
+				type = DT_DIR;
 		}
+		if (type != DT_DIR)
+			continue;
+
+		sscanf(de->d_name, "%d", &this_rev);
+		if (this_rev > max_revision)
+			max_revision = this_rev;
 	}
-	if (buf)
-		free(buf);
-	pclose(fp);
-out:
+
+	closedir(dir);
 	return max_revision;
 }
 
@@ -766,6 +1507,7 @@ static pid_t ph_logger_start_range_service(struct pantavisor *pv,
 	range_service = fork();
 	if (range_service == 0) {
 		signal(SIGCHLD, SIG_DFL);
+		signal(SIGTERM, sigterm_handler);
 		if (pvsignals_setmask(&oldmask)) {
 			pv_log(ERROR,
 			       "Unable to reset sigmask in ph_logger range service child: %s",
@@ -779,7 +1521,10 @@ static pid_t ph_logger_start_range_service(struct pantavisor *pv,
 		       "Initialized range service with pid %d by process with pid %d",
 		       getpid(), getppid());
 		thttp_set_log_func(log_libthttp);
-		while (current_rev >= 0) {
+		while (current_rev >= 0 &&
+		       !(ph_logger.flags & PH_LOGGER_FLAG_STOP)) {
+			pv_buffer_trim_check();
+
 			// skip current revision.
 			if (atoi(avoid_rev) == current_rev) {
 				current_rev--;
@@ -795,6 +1540,7 @@ static pid_t ph_logger_start_range_service(struct pantavisor *pv,
 			free(rev);
 			// if nothing else to send, go to previous revision
 			if (result == 0) {
+				_close_log_files();
 				current_rev--;
 				sleep_secs--;
 				sleep_secs = (sleep_secs < 0 ? 0 : sleep_secs);
@@ -812,6 +1558,14 @@ static pid_t ph_logger_start_range_service(struct pantavisor *pv,
 				sleep_secs = (sleep_secs < 0 ? 0 : sleep_secs);
 			}
 		}
+		// send what is left from the oldest revisions
+		while (!(ph_logger.flags & PH_LOGGER_FLAG_STOP) &&
+		       ph_logger_batch_send(&ph_logger.batch) < 0) {
+			sleep_secs++;
+			sleep_secs = (sleep_secs > 10 ? 10 : sleep_secs);
+			sleep(sleep_secs);
+		}
+		ph_logger_checkpoint();
 		pv_log(INFO, "Range service stopped normally");
 		_exit(EXIT_SUCCESS);
 	}
@@ -902,14 +1656,30 @@ void ph_logger_stop_force()
 void ph_logger_init()
 {
 	dl_list_init(&ph_logger.files);
+	dl_list_init(&ph_logger.journals);
+	for (int i = 0; i < PH_LOGGER_HASH_SIZE; i++)
+		dl_list_init(&ph_logger.buckets[i]);
 }
 
 static void _ph_logger_free_file(struct ph_logger_file *f)
 {
+	if (f->fd >= 0)
+		close(f->fd);
 	if (f->path)
 		free(f->path);
 }
 
+static void _ph_logger_free_journal(struct ph_logger_journal *j)
+{
+	if (j->fd >= 0)
+		close(j->fd);
+	if (j->rev)
+		free(j->rev);
+	if (j->path)
+		free(j->path);
+	free(j);
+}
+
 void ph_logger_close()
 {
 	struct ph_logger_file *f, *tmp;
@@ -917,6 +1687,15 @@ void ph_logger_close()
 	{
 		pv_log(DEBUG, "removing file '%s'", f->path);
 		dl_list_del(&f->list);
+		dl_list_del(&f->hlist);
 		_ph_logger_free_file(f);
 	}
+
+	struct ph_logger_journal *j, *jtmp;
+	dl_list_for_each_safe(j, jtmp, &ph_logger.journals,
+			      struct ph_logger_journal, list)
+	{
+		dl_list_del(&j->list);
+		_ph_logger_free_journal(j);
+	}
 }
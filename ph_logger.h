@@ -25,10 +25,11 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include "../pantavisor.h"
-#define PH_LOGGER_JSON_FORMAT                                                  \
-	"{ \"tsec\": %" PRId64 ", \"tnano\": %" PRId32 ",\
-\"lvl\": \"%s\", \"src\": \"%s\",\"plat\":\"%s\",\
-\"rev\": \"%s\" , \"msg\": \"%s\" }"
+// a log line is PH_LOGGER_JSON_HEAD, the escaped message and PH_LOGGER_JSON_TAIL
+#define PH_LOGGER_JSON_HEAD                                                    \
+	"{ \"tsec\": 0, \"tnano\": 0, \"lvl\": \"%s\", \"src\": \"%s\",\
+\"plat\":\"%s\", \"rev\": \"%s\" , \"msg\": \""
+#define PH_LOGGER_JSON_TAIL "\" }"
 
 #define PH_LOGGER_POS_XATTR "trusted.ph.logger.pos"
 
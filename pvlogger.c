@@ -25,6 +25,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <signal.h>
 #include <logger.h>
 #include <libgen.h>
 
@@ -40,6 +41,8 @@
 #include "utils/fs.h"
 #include "utils/str.h"
 #include "utils/math.h"
+#include "utils/timer.h"
+#include "buffer.h"
 #include "paths.h"
 #include "logserver/logserver.h"
 
@@ -57,6 +60,10 @@ struct pv_log_info *pv_log_info = NULL;
 
 static int logger_pos = PV_LOG_BUF_START_OFFSET;
 
+// last position stored in the xattr
+static off_t logger_saved_pos = -1;
+static struct timer logger_checkpoint;
+
 static const char *pv_logger_get_logfile(struct pv_log_info *log_info)
 {
 	return log_info->logfile ? log_info->logfile : "/var/log/messages";
@@ -102,14 +109,38 @@ static int set_logger_xattr(struct log *log)
 		return 0;
 	SNPRINTF_WTRUNC(place_holder, sizeof(place_holder), "%" PRId64, pos);
 
-	return setxattr(fname, PV_LOGGER_POS_XATTR, place_holder,
-			strlen(place_holder), 0);
+	if (setxattr(fname, PV_LOGGER_POS_XATTR, place_holder,
+		     strlen(place_holder), 0))
+		return -1;
+
+	logger_saved_pos = pos;
+	return 0;
 }
 
-static int pvlogger_flush(struct log *log, char *buf, int buflen)
+/*
+ * Every xattr write is a metadata commit, so only store the position if it
+ * changed and PV_LOG_CURSOR_INTERVAL has passed since the last one.
+ */
+static void pvlogger_checkpoint(struct log *log, bool force)
 {
-	int ret = 0;
+	off_t pos = ftello(log->backing_file);
+
+	if (pos < 0 || pos == logger_saved_pos)
+		return;
+
+	if (!force && !timer_current_state(&logger_checkpoint).fin)
+		return;
+
+	if (set_logger_xattr(log) < 0)
+		pv_log(DEBUG, "Setting xattr failed: %s", strerror(errno));
 
+	timer_start(&logger_checkpoint,
+		    pv_config_get_int(PV_LOG_CURSOR_INTERVAL), 0,
+		    RELATIV_TIMER);
+}
+
+static int pvlogger_flush(struct log *log, char *buf, int buflen)
+{
 	while (buflen > 0) {
 		int avail_buflen = PV_LOG_BUF_SIZE - 1 - logger_pos;
 		char *new_line_at = NULL;
@@ -160,13 +191,16 @@ static int pvlogger_flush(struct log *log, char *buf, int buflen)
 			logger_pos = PV_LOG_BUF_START_OFFSET;
 		}
 	}
-	ret = set_logger_xattr(log);
-	if (ret < 0)
-		pv_log(DEBUG, "Setting xattr failed, return code is %d ", ret);
+	pvlogger_checkpoint(log, false);
 	return 0;
 }
 
-static int stop_logger = 0;
+static volatile sig_atomic_t stop_logger = 0;
+
+static void sigterm_handler(int signum)
+{
+	stop_logger = 1;
+}
 
 static int get_logger_xattr(struct log *log)
 {
@@ -202,6 +236,7 @@ static int pvlogger_start(struct log *log, int was_init_ok)
 	pv_log(DEBUG, "pvlogger %s seeking to position %" PRId64 "\n",
 	       module_name, stored_pos);
 	fseek(log->backing_file, stored_pos, SEEK_SET);
+	logger_saved_pos = stored_pos;
 out:
 	return was_init_ok;
 }
@@ -275,6 +310,9 @@ int start_pvlogger(struct pv_log_info *log_info, const char *platform)
 
 	if (!pv_log_info) /*We can't even try and log cuz it maybe for lxc.*/
 		return 0;
+	// the position is checkpointed once the loop below ends
+	signal(SIGTERM, sigterm_handler);
+
 	logfile = pv_logger_get_logfile(pv_log_info);
 	tv.tv_sec = 2;
 	tv.tv_usec = 0;
@@ -293,6 +331,8 @@ init_again:
 	pv_log(INFO, "pvlogger %s has been setup", module_name);
 	ret = log_init(&default_log, pv_logger_get_logfile(pv_log_info));
 	while (ret != LOG_OK) {
+		if (stop_logger)
+			goto out;
 		ret = wait_for_logfile(pv_logger_get_logfile(pv_log_info));
 		if (ret == LOG_OK)
 			goto init_again;
@@ -310,13 +350,20 @@ init_again:
 
 	while (!stop_logger) {
 		if (log_flush_pv(&default_log) < 0) {
+			if (stop_logger)
+				break;
 			pv_log(WARN, "Stopping pvlogger %s", module_name);
+			pvlogger_checkpoint(&default_log, true);
 			log_stop(&default_log);
 			goto init_again;
 		}
+		pvlogger_checkpoint(&default_log, false);
+		pv_buffer_trim_check();
 		tv.tv_sec = 2;
 		tv.tv_usec = 0;
 	}
+	pvlogger_checkpoint(&default_log, true);
+out:
 	pv_log(WARN, "Exiting, pv_logger %s", module_name);
 	return 0;
 }
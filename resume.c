@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "resume.h"
+#include "utils/fs.h"
+#include "utils/str.h"
+
+#define MODULE_NAME "resume"
+#ifndef PVTEST
+#define pv_log(level, msg, ...) vlog(MODULE_NAME, level, msg, ##__VA_ARGS__)
+#else
+#define pv_log(level, msg, ...)                                                \
+	printf("%s[%d]: ", MODULE_NAME, level);                                \
+	printf(msg "\n", ##__VA_ARGS__)
+#endif
+#include "log.h"
+
+#define RESUME_OBJ_FMT "%s.resume"
+
+/*
+ * Only the length is kept, as the layout of the sha256 context depends on how
+ * mbedtls was built.
+ */
+#define RESUME_HEADER_FMT "pv-resume 1 %ju\n"
+
+// ctx has to be initialized already
+void pv_resume_reset(struct pv_resume *r)
+{
+	r->len = 0;
+	mbedtls_sha256_free(&r->ctx);
+	mbedtls_sha256_init(&r->ctx);
+	mbedtls_sha256_starts(&r->ctx, 0);
+}
+
+// hashes the first len bytes of fd
+static int pv_resume_rehash(struct pv_resume *r, int fd, off_t len)
+{
+	unsigned char buf[4096];
+	ssize_t bytes;
+	size_t count;
+
+	while (r->len < len) {
+		count = len - r->len < (off_t)sizeof(buf) ? len - r->len :
+							     sizeof(buf);
+		bytes = pread(fd, buf, count, r->len);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return -1;
+		mbedtls_sha256_update(&r->ctx, buf, bytes);
+		r->len += bytes;
+	}
+
+	return 0;
+}
+
+void pv_resume_load(struct pv_resume *r, const char *obj_path, int fd)
+{
+	char path[PATH_MAX];
+	char *buf;
+	uintmax_t len;
+	struct stat st;
+
+	pv_resume_reset(r);
+
+	SNPRINTF_WTRUNC(path, sizeof(path), RESUME_OBJ_FMT, obj_path);
+	buf = pv_fs_file_load(path, 64);
+	if (!buf)
+		return;
+
+	if (sscanf(buf, RESUME_HEADER_FMT, &len) != 1 || fstat(fd, &st) ||
+	    (off_t)len > st.st_size)
+		goto out;
+
+	if (pv_resume_rehash(r, fd, len)) {
+		pv_log(WARN, "could not hash partial object %s: %s", obj_path,
+		       strerror(errno));
+		pv_resume_reset(r);
+	}
+
+out:
+	free(buf);
+}
+
+void pv_resume_save(struct pv_resume *r, const char *obj_path)
+{
+	char path[PATH_MAX];
+	char buf[64];
+
+	SNPRINTF_WTRUNC(path, sizeof(path), RESUME_OBJ_FMT, obj_path);
+	SNPRINTF_WTRUNC(buf, sizeof(buf), RESUME_HEADER_FMT,
+			(uintmax_t)r->len);
+
+	if (pv_fs_file_save(path, buf, 0644)) {
+		pv_log(WARN, "could not save resume state in %s: %s", path,
+		       strerror(errno));
+	}
+}
+
+void pv_resume_remove(const char *obj_path)
+{
+	char path[PATH_MAX];
+
+	SNPRINTF_WTRUNC(path, sizeof(path), RESUME_OBJ_FMT, obj_path);
+	pv_fs_path_remove(path, false);
+}
+
+// hash whatever was written after the resume point
+int pv_resume_update(struct pv_resume *r, int fd)
+{
+	unsigned char buf[4096];
+	ssize_t bytes;
+
+	while ((bytes = pread(fd, buf, sizeof(buf), r->len)) > 0) {
+		mbedtls_sha256_update(&r->ctx, buf, bytes);
+		r->len += bytes;
+	}
+
+	return bytes < 0 ? -1 : 0;
+}
+
+// the server ignored our Range and sent the whole object after the part we had
+int pv_resume_discard(struct pv_resume *r, int fd)
+{
+	unsigned char buf[4096];
+	off_t rd = r->len, wr = 0;
+	ssize_t bytes;
+
+	while ((bytes = pread(fd, buf, sizeof(buf), rd)) > 0) {
+		if (pwrite(fd, buf, bytes, wr) != bytes)
+			return -1;
+		rd += bytes;
+		wr += bytes;
+	}
+
+	if (bytes < 0 || ftruncate(fd, wr))
+		return -1;
+
+	pv_resume_reset(r);
+	return 0;
+}
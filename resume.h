@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef PV_RESUME_H
+#define PV_RESUME_H
+
+#include <sys/types.h>
+
+#include <mbedtls/sha256.h>
+
+/*
+ * A partial download keeps its temporary file and, next to it, how many bytes
+ * of it made it to disk. The next attempt hashes those bytes again and
+ * continues from there with a Range request, even after a restart.
+ */
+struct pv_resume {
+	off_t len;
+	mbedtls_sha256_context ctx;
+};
+
+void pv_resume_reset(struct pv_resume *r);
+void pv_resume_load(struct pv_resume *r, const char *obj_path, int fd);
+void pv_resume_save(struct pv_resume *r, const char *obj_path);
+void pv_resume_remove(const char *obj_path);
+int pv_resume_update(struct pv_resume *r, int fd);
+int pv_resume_discard(struct pv_resume *r, int fd);
+
+#endif /* PV_RESUME_H */
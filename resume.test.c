@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PVTEST
+#define PVTEST
+#endif
+
+#include <fcntl.h>
+
+#include "resume.c"
+#include "utils/pvtest.h"
+
+#define TEST_LEN (10000)
+
+static char dir[] = "/tmp/pv-resume-XXXXXX";
+static char obj[PATH_MAX];
+static char data[TEST_LEN];
+
+static void test_sha(const void *buf, size_t len, unsigned char *sha)
+{
+	mbedtls_sha256_context ctx;
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+	mbedtls_sha256_update(&ctx, buf, len);
+	mbedtls_sha256_finish(&ctx, sha);
+	mbedtls_sha256_free(&ctx);
+}
+
+// checks that r holds len bytes and their hash
+static int test_state(struct pv_resume *r, off_t len)
+{
+	unsigned char want[32], got[32];
+	mbedtls_sha256_context ctx;
+
+	PVTEST_CHECK(r->len == len);
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_clone(&ctx, &r->ctx);
+	mbedtls_sha256_finish(&ctx, got);
+	mbedtls_sha256_free(&ctx);
+
+	test_sha(data, len, want);
+	PVTEST_CHECK(!memcmp(want, got, sizeof(got)));
+
+	return 0;
+}
+
+static int test_open(off_t len)
+{
+	int fd = open(obj, O_CREAT | O_RDWR | O_TRUNC, 0644);
+
+	if (fd >= 0 && pwrite(fd, data, len, 0) != len) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int test_save_load(void)
+{
+	struct pv_resume r;
+	int fd;
+
+	mbedtls_sha256_init(&r.ctx);
+
+	fd = test_open(4000);
+	PVTEST_CHECK(fd >= 0);
+
+	// nothing saved yet
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	// the progress callback hashes what was written after the last call
+	PVTEST_CHECK(!pv_resume_update(&r, fd));
+	PVTEST_CHECK(!test_state(&r, 4000));
+	PVTEST_CHECK(pwrite(fd, data + 4000, 3000, 4000) == 3000);
+	PVTEST_CHECK(!pv_resume_update(&r, fd));
+	PVTEST_CHECK(!test_state(&r, 7000));
+
+	pv_resume_save(&r, obj);
+	pv_resume_reset(&r);
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	// only the saved length is rehashed, later bytes are not trusted
+	PVTEST_CHECK(pwrite(fd, data + 7000, 1000, 7000) == 1000);
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 7000));
+
+	pv_resume_remove(obj);
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	close(fd);
+	mbedtls_sha256_free(&r.ctx);
+
+	return 0;
+}
+
+static int test_bad_state(void)
+{
+	char path[PATH_MAX];
+	struct pv_resume r;
+	int fd;
+
+	mbedtls_sha256_init(&r.ctx);
+	SNPRINTF_WTRUNC(path, sizeof(path), RESUME_OBJ_FMT, obj);
+
+	fd = test_open(1000);
+	PVTEST_CHECK(fd >= 0);
+
+	// longer than the partial object
+	PVTEST_CHECK(!pv_fs_file_save(path, "pv-resume 1 2000\n", 0644));
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	// unknown format
+	PVTEST_CHECK(!pv_fs_file_save(path, "pv-resume 0 500\n", 0644));
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	PVTEST_CHECK(!pv_fs_file_save(path, "garbage", 0644));
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	PVTEST_CHECK(!pv_fs_file_save(path, "pv-resume 1 500\n", 0644));
+	pv_resume_load(&r, obj, fd);
+	PVTEST_CHECK(!test_state(&r, 500));
+
+	pv_resume_remove(obj);
+	close(fd);
+	mbedtls_sha256_free(&r.ctx);
+
+	return 0;
+}
+
+static int test_discard(void)
+{
+	struct pv_resume r;
+	struct stat st;
+	char buf[TEST_LEN];
+	int fd;
+
+	mbedtls_sha256_init(&r.ctx);
+
+	// 3000 bytes we had, then the whole object from a server that
+	// ignored the Range header
+	fd = test_open(3000);
+	PVTEST_CHECK(fd >= 0);
+	pv_resume_reset(&r);
+	PVTEST_CHECK(!pv_resume_update(&r, fd));
+	PVTEST_CHECK(pwrite(fd, data, TEST_LEN, 3000) == TEST_LEN);
+
+	PVTEST_CHECK(!pv_resume_discard(&r, fd));
+	PVTEST_CHECK(!test_state(&r, 0));
+
+	PVTEST_CHECK(!fstat(fd, &st));
+	PVTEST_CHECK(st.st_size == TEST_LEN);
+	PVTEST_CHECK(pread(fd, buf, TEST_LEN, 0) == TEST_LEN);
+	PVTEST_CHECK(!memcmp(buf, data, TEST_LEN));
+
+	PVTEST_CHECK(!pv_resume_update(&r, fd));
+	PVTEST_CHECK(!test_state(&r, TEST_LEN));
+
+	close(fd);
+	mbedtls_sha256_free(&r.ctx);
+
+	return 0;
+}
+
+int main()
+{
+	int ret = 0;
+
+	for (int i = 0; i < TEST_LEN; i++)
+		data[i] = i * 7 + i / 251;
+
+	if (!mkdtemp(dir)) {
+		printf("could not create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	SNPRINTF_WTRUNC(obj, sizeof(obj), "%s/object.tmp", dir);
+
+	printf("=== save and load ===\n");
+	ret |= test_save_load();
+	printf("=== bad state ===\n");
+	ret |= test_bad_state();
+	printf("=== ignored range ===\n");
+	ret |= test_discard();
+
+	pv_fs_path_remove(dir, true);
+
+	printf("%s\n", ret ? "FAILED" : "OK");
+
+	return ret ? 1 : 0;
+}
@@ -1289,19 +1289,24 @@ static char *pv_state_get_novalidate_list(struct pv_state *state)
 
 bool pv_state_validate_checksum(struct pv_state *s)
 {
-	struct pv_object *o;
+	struct pv_object *o, **objs = NULL;
 	struct pv_json *j;
 	char *validate_list = NULL;
 	bool ret = false;
+	int count = 0;
 
 	if (getenv("pv_quickboot") ||
 	    !pv_config_get_bool(PV_SECUREBOOT_CHECKSUM)) {
 		pv_log(DEBUG, "state objects and JSONs checksum disabled");
-		ret = true;
-		goto out;
+		return true;
 	}
 
 	validate_list = pv_state_get_novalidate_list(s);
+	pv_storage_verified_load();
+
+	objs = calloc(dl_list_len(&s->objects) + 1, sizeof(struct pv_object *));
+	if (!objs)
+		goto out;
 
 	if (validate_list)
 		pv_log(DEBUG, "no validation list: %s", validate_list);
@@ -1324,16 +1329,15 @@ bool pv_state_validate_checksum(struct pv_state *s)
 			continue;
 		}
 
-		if (!pv_storage_validate_trails_object_checksum(s->rev, o->name,
-								o->id)) {
-			pv_log(ERROR,
-			       "trails object %s with checksum %s failed",
-			       o->name, o->id);
-			goto out;
-		}
+		objs[count++] = o;
 	}
 	pv_objects_iter_end;
 
+	if (!pv_storage_validate_trails_objects_checksum(s->rev, objs, count)) {
+		pv_log(ERROR, "trails objects checksum failed");
+		goto out;
+	}
+
 	pv_jsons_iter_begin(s, j)
 	{
 		if (!pv_storage_validate_trails_json_value(s->rev, j->name,
@@ -1347,6 +1351,9 @@ bool pv_state_validate_checksum(struct pv_state *s)
 
 	ret = true;
 out:
+	pv_storage_verified_save();
+	if (objs)
+		free(objs);
 	if (validate_list)
 		free(validate_list);
 	return ret;
@@ -38,14 +38,18 @@
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/statfs.h>
+#include <sys/mman.h>
 
 #include <mbedtls/sha256.h>
 
 #include <jsmn/jsmnutil.h>
 
 #include "updater.h"
+#include "chunks.h"
 #include "objects.h"
 #include "storage.h"
+#include "storage_catalog.h"
+#include "storage_objects.h"
 #include "state.h"
 #include "bootloader.h"
 #include "init.h"
@@ -73,14 +77,15 @@ static int pv_storage_gc_objects(struct pantavisor *pv)
 {
 	int reclaimed = 0;
 	char path[PATH_MAX];
+	char id[PATH_MAX];
+	char *ext;
 	struct stat st;
 	struct pv_path *o, *tmp;
 	struct dl_list objects;
 
 	dl_list_init(&objects);
 
-	pv_paths_storage_object(path, PATH_MAX, "");
-	if (pv_storage_get_subdir(path, "", &objects))
+	if (pv_storage_get_objects(&objects))
 		goto out;
 
 	dl_list_for_each_safe(o, tmp, &objects, struct pv_path, list)
@@ -97,12 +102,27 @@ static int pv_storage_gc_objects(struct pantavisor *pv)
 		if (st.st_nlink > 1)
 			continue;
 
-		// do not remove objects belonging to an ongoing update
-		if (pv->update) {
-			if (pv_objects_id_in_step(pv->update->pending, o->path))
+		SNPRINTF_WTRUNC(id, sizeof(id), "%s", o->path);
+		ext = strchr(id, '.');
+		if (ext)
+			*ext = '\0';
+
+		// chunk indexes go away with their object
+		if (ext && !strcmp(o->path + (ext - id), ".idx")) {
+			char obj_path[PATH_MAX];
+			struct stat obj_st;
+
+			pv_paths_storage_object(obj_path, PATH_MAX, id);
+			if (!stat(obj_path, &obj_st))
 				continue;
 		}
 
+		// do not remove objects belonging to an ongoing update, nor
+		// their partial downloads (<id>.tmp, <id>.delta, <id>.gz)
+		if (pv->update &&
+		    pv_objects_id_in_step(pv->update->pending, id))
+			continue;
+
 		reclaimed += st.st_size;
 		pv_fs_path_remove(path, false);
 		pv_log(DEBUG, "removed unused object '%s', reclaimed %lu bytes",
@@ -114,22 +134,6 @@ out:
 	return reclaimed;
 }
 
-void pv_storage_rm_rev(const char *rev)
-{
-	char path[PATH_MAX] = { 0 };
-
-	pv_log(DEBUG, "removing revision %s from disk", rev);
-
-	pv_paths_storage_trail(path, PATH_MAX, rev);
-	pv_fs_path_remove(path, true);
-
-	pv_paths_pv_log(path, PATH_MAX, rev);
-	pv_fs_path_remove(path, true);
-
-	pv_paths_storage_disks_rev(path, PATH_MAX, rev);
-	pv_fs_path_remove(path, true);
-}
-
 int pv_storage_get_subdir(const char *path, const char *prefix,
 			  struct dl_list *subdirs)
 {
@@ -176,33 +180,637 @@ out:
 	return ret;
 }
 
-void pv_storage_free_subdir(struct dl_list *subdirs)
+void pv_storage_free_subdir(struct dl_list *subdirs)
+{
+	struct pv_path *p, *tmp;
+
+	dl_list_for_each_safe(p, tmp, subdirs, struct pv_path, list)
+	{
+		dl_list_del(&p->list);
+		free(p->path);
+		free(p);
+	}
+}
+
+int pv_storage_get_revisions(struct dl_list *revisions)
+{
+	char path[PATH_MAX];
+	int ret = -1;
+
+	pv_paths_storage_trail(path, PATH_MAX, "");
+
+	if (pv_storage_get_subdir(path, "locals/", revisions) ||
+	    pv_storage_get_subdir(path, "", revisions))
+		goto out;
+
+	ret = 0;
+
+out:
+	return ret;
+}
+
+bool pv_storage_is_rev_dir(const char *rev)
+{
+	int len = strlen(rev) + 1;
+
+	return strncmp(rev, "..", len) && strncmp(rev, ".", len) &&
+	       strncmp(rev, "current", len) && strncmp(rev, "locals", len) &&
+	       strncmp(rev, "locals/..", len) && strncmp(rev, "locals/.", len);
+}
+
+/*
+ * Object reference index: the object ids found in the state JSON of each
+ * revision on disk and, for each id, how many of those revisions use it.
+ * It is built the first time it is needed and then kept up to date as
+ * revisions are installed and removed, so the collector only has to look
+ * at objects whose count dropped to zero instead of the whole pool.
+ */
+struct pv_storage_ref {
+	char *id;
+	int count;
+};
+
+struct pv_storage_rev_refs {
+	char *rev;
+	char **ids;
+	int len;
+	struct dl_list list;
+};
+
+struct pv_storage_refs {
+	bool init;
+	// sorted by id
+	struct pv_storage_ref *refs;
+	int len;
+	int cap;
+	// pv_storage_rev_refs
+	struct dl_list revs;
+	// pv_path with the ids whose count dropped to zero
+	struct dl_list unused;
+};
+
+static struct pv_storage_refs refs = {
+	.revs = DL_LIST_HEAD_INIT(refs.revs),
+	.unused = DL_LIST_HEAD_INIT(refs.unused),
+};
+
+static int pv_storage_id_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// returns the position of id, or where it should be inserted
+static int pv_storage_ref_pos(const char *id, bool *found)
+{
+	int lo = 0, hi = refs.len, mid, c;
+
+	*found = false;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(refs.refs[mid].id, id);
+		if (!c) {
+			*found = true;
+			return mid;
+		}
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int pv_storage_ref_get(const char *id)
+{
+	struct pv_storage_ref *tmp;
+	bool found;
+	int pos = pv_storage_ref_pos(id, &found);
+
+	if (found) {
+		refs.refs[pos].count++;
+		return 0;
+	}
+
+	if (refs.len == refs.cap) {
+		int cap = refs.cap ? refs.cap * 2 : 256;
+
+		tmp = realloc(refs.refs, cap * sizeof(struct pv_storage_ref));
+		if (!tmp)
+			return -1;
+		refs.refs = tmp;
+		refs.cap = cap;
+	}
+
+	memmove(&refs.refs[pos + 1], &refs.refs[pos],
+		(refs.len - pos) * sizeof(struct pv_storage_ref));
+	refs.refs[pos].id = strdup(id);
+	refs.refs[pos].count = 1;
+	refs.len++;
+
+	return 0;
+}
+
+static void pv_storage_ref_put(const char *id)
+{
+	struct pv_path *p;
+	bool found;
+	int pos = pv_storage_ref_pos(id, &found);
+
+	if (!found || --refs.refs[pos].count > 0)
+		return;
+
+	p = calloc(1, sizeof(struct pv_path));
+	if (p) {
+		p->path = refs.refs[pos].id;
+		dl_list_add_tail(&refs.unused, &p->list);
+	} else
+		free(refs.refs[pos].id);
+
+	memmove(&refs.refs[pos], &refs.refs[pos + 1],
+		(refs.len - pos - 1) * sizeof(struct pv_storage_ref));
+	refs.len--;
+}
+
+// object ids referenced by the state JSON of rev, sorted and unique
+char **pv_storage_get_rev_ids(const char *rev, int *len)
+{
+	char *json, *value, **ids = NULL;
+	jsmntok_t *tokv = NULL;
+	jsmntok_t **keys = NULL, **k;
+	int tokc, n = 0, count;
+
+	*len = 0;
+
+	json = pv_storage_get_state_json(rev);
+	if (!json)
+		return NULL;
+
+	if (jsmnutil_parse_json(json, &tokv, &tokc) < 0)
+		goto out;
+
+	keys = jsmnutil_get_object_keys(json, tokv);
+	if (!keys)
+		goto out;
+
+	count = jsmnutil_object_key_count(json, tokv);
+	ids = calloc(count + 1, sizeof(char *));
+	if (!ids)
+		goto out;
+
+	for (k = keys; *k; k++) {
+		if ((*k + 1)->type != JSMN_STRING)
+			continue;
+
+		value = strndup(json + (*k + 1)->start,
+				(*k + 1)->end - (*k + 1)->start);
+		if (!value)
+			continue;
+
+		if (pv_is_sha256_hex_string(value))
+			ids[n++] = value;
+		else
+			free(value);
+	}
+
+	qsort(ids, n, sizeof(char *), pv_storage_id_cmp);
+
+	// drop objects used more than once in the same revision
+	for (int i = 0; i < n; i++) {
+		if (*len && !strcmp(ids[*len - 1], ids[i]))
+			free(ids[i]);
+		else
+			ids[(*len)++] = ids[i];
+	}
+
+out:
+	if (keys)
+		jsmnutil_tokv_free(keys);
+	if (tokv)
+		free(tokv);
+	free(json);
+
+	return ids;
+}
+
+static struct pv_storage_rev_refs *pv_storage_refs_find_rev(const char *rev)
+{
+	struct pv_storage_rev_refs *r;
+
+	dl_list_for_each(r, &refs.revs, struct pv_storage_rev_refs, list)
+	{
+		if (!strcmp(r->rev, rev))
+			return r;
+	}
+
+	return NULL;
+}
+
+static void pv_storage_refs_add(const char *rev)
+{
+	struct pv_storage_rev_refs *r;
+
+	if (pv_storage_refs_find_rev(rev))
+		return;
+
+	r = calloc(1, sizeof(struct pv_storage_rev_refs));
+	if (!r)
+		return;
+
+	r->rev = strdup(rev);
+	r->ids = pv_storage_get_rev_ids(rev, &r->len);
+	for (int i = 0; i < r->len; i++)
+		pv_storage_ref_get(r->ids[i]);
+
+	dl_list_add_tail(&refs.revs, &r->list);
+}
+
+static void pv_storage_refs_rm(const char *rev)
+{
+	struct pv_storage_rev_refs *r = pv_storage_refs_find_rev(rev);
+
+	if (!r)
+		return;
+
+	for (int i = 0; i < r->len; i++) {
+		pv_storage_ref_put(r->ids[i]);
+		free(r->ids[i]);
+	}
+
+	dl_list_del(&r->list);
+	free(r->ids);
+	free(r->rev);
+	free(r);
+}
+
+static void pv_storage_refs_free(void)
+{
+	struct pv_storage_rev_refs *r, *tmp;
+
+	dl_list_for_each_safe(r, tmp, &refs.revs, struct pv_storage_rev_refs,
+			      list)
+	{
+		pv_storage_refs_rm(r->rev);
+	}
+
+	pv_storage_free_subdir(&refs.unused);
+	free(refs.refs);
+	refs.refs = NULL;
+	refs.len = refs.cap = 0;
+	refs.init = false;
+}
+
+static int pv_storage_refs_init(void)
+{
+	struct dl_list revisions; // pv_path
+	struct pv_path *r, *tmp;
+
+	if (refs.init)
+		return 0;
+
+	dl_list_init(&revisions);
+	if (pv_storage_get_revisions(&revisions)) {
+		pv_storage_free_subdir(&revisions);
+		return -1;
+	}
+
+	dl_list_for_each_safe(r, tmp, &revisions, struct pv_path, list)
+	{
+		if (pv_storage_is_rev_dir(r->path))
+			pv_storage_refs_add(r->path);
+	}
+
+	pv_storage_free_subdir(&revisions);
+
+	pv_log(DEBUG, "indexed %d objects used by %d revisions", refs.len,
+	       dl_list_len(&refs.revs));
+	refs.init = true;
+
+	return 0;
+}
+
+void pv_storage_refs_add_rev(const char *rev)
+{
+	// the whole index is built on first use
+	if (refs.init)
+		pv_storage_refs_add(rev);
+}
+
+void pv_storage_rm_rev(const char *rev)
+{
+	char path[PATH_MAX] = { 0 };
+
+	pv_log(DEBUG, "removing revision %s from disk", rev);
+
+	pv_storage_refs_rm(rev);
+
+	pv_paths_storage_trail(path, PATH_MAX, rev);
+	pv_fs_path_remove(path, true);
+
+	pv_paths_pv_log(path, PATH_MAX, rev);
+	pv_fs_path_remove(path, true);
+
+	pv_paths_storage_disks_rev(path, PATH_MAX, rev);
+	pv_fs_path_remove(path, true);
+
+	pv_storage_catalog_rm_rev(rev);
+}
+
+// removes, or just measures, the objects that are no longer referenced
+static off_t pv_storage_gc_unused(struct pantavisor *pv, bool dry_run)
+{
+	off_t reclaimed = 0;
+	char path[PATH_MAX];
+	char idx[PATH_MAX];
+	struct stat st;
+	struct pv_path *p, *tmp;
+	bool found;
+
+	dl_list_for_each_safe(p, tmp, &refs.unused, struct pv_path, list)
+	{
+		dl_list_del(&p->list);
+
+		// referenced again by a revision installed since
+		pv_storage_ref_pos(p->path, &found);
+		if (found)
+			goto next;
+
+		// still needed by an ongoing update
+		if (pv->update &&
+		    pv_objects_id_in_step(pv->update->pending, p->path))
+			goto next;
+
+		// still linked from a revision missing from the index
+		pv_paths_storage_object(path, PATH_MAX, p->path);
+		if (stat(path, &st) || (!dry_run && st.st_nlink > 1))
+			goto next;
+
+		reclaimed += st.st_size;
+		if (!dry_run) {
+			pv_fs_path_remove(path, false);
+			pv_log(DEBUG,
+			       "removed unused object '%s', reclaimed %jd bytes",
+			       path, (intmax_t)st.st_size);
+		}
+
+		// chunk indexes go away with their object
+		SNPRINTF_WTRUNC(idx, sizeof(idx), "%s.idx", path);
+		if (!stat(idx, &st)) {
+			reclaimed += st.st_size;
+			if (!dry_run)
+				pv_fs_path_remove(idx, false);
+		}
+next:
+		free(p->path);
+		free(p);
+	}
+
+	return reclaimed;
+}
+
+// chunks listed by the indexes of local objects and of the ongoing update
+static void pv_storage_chunks_refs(struct pantavisor *pv,
+				   struct pv_chunks *refs)
+{
+	char path[PATH_MAX];
+	struct pv_path *o, *tmp;
+	struct pv_object *obj = NULL;
+	struct dl_list objects;
+	struct stat st;
+	size_t len;
+
+	dl_list_init(&objects);
+	pv_storage_get_objects(&objects);
+
+	dl_list_for_each_safe(o, tmp, &objects, struct pv_path, list)
+	{
+		len = strlen(o->path);
+		if (len <= strlen(CHUNK_INDEX_EXT) ||
+		    strcmp(o->path + len - strlen(CHUNK_INDEX_EXT),
+			   CHUNK_INDEX_EXT))
+			continue;
+
+		o->path[len - strlen(CHUNK_INDEX_EXT)] = '\0';
+		pv_paths_storage_object(path, PATH_MAX, o->path);
+		if (!stat(path, &st))
+			pv_chunks_load_index(refs, path);
+	}
+	pv_storage_free_subdir(&objects);
+
+	if (pv->update) {
+		pv_objects_iter_begin(pv->update->pending, obj)
+		{
+			if (obj->chunks_index)
+				pv_chunks_parse(refs, obj->chunks_index, NULL);
+		}
+		pv_objects_iter_end;
+	}
+
+	pv_chunks_sort(refs);
+}
+
+/*
+ * Removes the chunks of the chunk store, and their partial downloads, that
+ * no index references anymore. An index holds one reference per entry, so
+ * a chunk goes once the last object listing it is gone.
+ */
+static off_t pv_storage_gc_chunks(struct pantavisor *pv)
+{
+	off_t reclaimed = 0;
+	char path[PATH_MAX];
+	char id[65];
+	struct stat st;
+	struct pv_path *c, *tmp;
+	struct pv_chunks refs = { 0 };
+	struct dl_list chunks;
+
+	dl_list_init(&chunks);
+	pv_paths_storage_file(path, PATH_MAX, CHUNKS_DNAME);
+	pv_storage_get_objects_dir(path, true, &chunks);
+	if (dl_list_empty(&chunks))
+		return 0;
+
+	pv_storage_chunks_refs(pv, &refs);
+
+	dl_list_for_each_safe(c, tmp, &chunks, struct pv_path, list)
+	{
+		// <id>, <id>.tmp or <id>.resume
+		SNPRINTF_WTRUNC(id, sizeof(id), "%.64s", c->path);
+		if (pv_chunks_refs(&refs, id))
+			continue;
+
+		pv_paths_storage_chunk(path, PATH_MAX, c->path);
+		if (stat(path, &st))
+			continue;
+
+		reclaimed += st.st_size;
+		pv_fs_path_remove(path, false);
+		pv_log(DEBUG, "removed unused chunk '%s', reclaimed %jd bytes",
+		       path, (intmax_t)st.st_size);
+	}
+
+	pv_storage_free_subdir(&chunks);
+	pv_chunks_free(&refs);
+
+	return reclaimed;
+}
+
+struct pv_storage_gc_rev {
+	char *rev;
+	time_t time;
+};
+
+static int pv_storage_gc_rev_cmp(const void *a, const void *b)
+{
+	const struct pv_storage_gc_rev *ra = a, *rb = b;
+
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+
+	return strcmp(ra->rev, rb->rev);
+}
+
+/*
+ * Revisions that can be removed, oldest first. Age is taken from the
+ * state JSON, which is written when the revision is put on disk.
+ */
+static struct pv_storage_gc_rev *pv_storage_gc_get_revs(int *len)
+{
+	struct pantavisor *pv = pv_get_instance();
+	struct pv_state *s = pv->state, *u = NULL;
+	struct pv_storage_gc_rev *revs = NULL;
+	struct dl_list revisions; // pv_path
+	struct pv_path *r, *tmp;
+	char path[PATH_MAX];
+	struct stat st;
+	int n;
+
+	*len = 0;
+
+	if (pv->update)
+		u = pv->update->pending;
+
+	dl_list_init(&revisions);
+
+	if (pv_storage_get_revisions(&revisions)) {
+		pv_log(ERROR, "error parsings revs on disk for GC");
+		goto out;
+	}
+
+	revs = calloc(dl_list_len(&revisions) + 1,
+		      sizeof(struct pv_storage_gc_rev));
+	if (!revs)
+		goto out;
+
+	dl_list_for_each_safe(r, tmp, &revisions, struct pv_path, list)
+	{
+		n = strlen(r->path) + 1;
+		// dont reclaim current, locals, update, last booted up revisions or factory if configured
+		if (!pv_storage_is_rev_dir(r->path) ||
+		    (s && !strncmp(r->path, s->rev, n)) ||
+		    (u && !strncmp(r->path, u->rev, n)) ||
+		    !strncmp(r->path, pv_bootloader_get_done(), n) ||
+		    (pv_config_get_bool(PV_STORAGE_GC_KEEP_FACTORY) &&
+		     !strncmp(r->path, "0", n)))
+			continue;
+
+		pv_paths_storage_trail_pvr_file(path, PATH_MAX, r->path,
+						JSON_FNAME);
+		revs[*len].rev = r->path;
+		revs[*len].time = stat(path, &st) ? 0 : st.st_mtime;
+		r->path = NULL;
+		(*len)++;
+	}
+
+	qsort(revs, *len, sizeof(struct pv_storage_gc_rev),
+	      pv_storage_gc_rev_cmp);
+
+out:
+	pv_storage_free_subdir(&revisions);
+	return revs;
+}
+
+/*
+ * Removes revisions, oldest first, until needed bytes are free (all of them
+ * if needed is 0) and then the objects nothing references anymore. The
+ * whole pool is only scanned for orphans on the first run after boot, when
+ * asked to, or if removing revisions was not enough. A dry run leaves
+ * storage untouched and publishes what would be removed as device meta.
+ */
+static off_t pv_storage_gc(off_t needed, bool full, bool dry_run)
 {
-	struct pv_path *p, *tmp;
+	struct pantavisor *pv = pv_get_instance();
+	struct pv_storage_gc_rev *revs;
+	struct pv_json_ser js;
+	off_t available = 0, reclaimed = 0, bytes;
+	bool fresh = !refs.init;
+	char *json;
+	int len;
 
-	dl_list_for_each_safe(p, tmp, subdirs, struct pv_path, list)
-	{
-		dl_list_del(&p->list);
-		free(p->path);
-		free(p);
+	if (pv_storage_refs_init()) {
+		pv_log(ERROR, "could not index objects for GC");
+		return -1;
 	}
-}
 
-static int pv_storage_get_revisions(struct dl_list *revisions)
-{
-	char path[PATH_MAX];
-	int ret = -1;
+	revs = pv_storage_gc_get_revs(&len);
+	if (!revs)
+		return -1;
 
-	pv_paths_storage_trail(path, PATH_MAX, "");
+	if (needed)
+		available = pv_storage_get_free();
 
-	if (pv_storage_get_subdir(path, "locals/", revisions) ||
-	    pv_storage_get_subdir(path, "", revisions))
-		goto out;
+	pv_json_ser_init(&js, 512);
+	pv_json_ser_object(&js);
+	pv_json_ser_key(&js, "revisions");
+	pv_json_ser_array(&js);
+
+	for (int i = 0; i < len; i++) {
+		if (needed && available + reclaimed >= needed)
+			break;
+
+		if (dry_run)
+			pv_storage_refs_rm(revs[i].rev);
+		else
+			pv_storage_rm_rev(revs[i].rev);
+
+		bytes = pv_storage_gc_unused(pv, dry_run);
+		reclaimed += bytes;
+		pv_log(INFO, "%s revision %s, %jd bytes of objects",
+		       dry_run ? "GC would remove" : "GC removed", revs[i].rev,
+		       (intmax_t)bytes);
+
+		pv_json_ser_object(&js);
+		pv_json_ser_key(&js, "rev");
+		pv_json_ser_string(&js, revs[i].rev);
+		pv_json_ser_key(&js, "reclaimed");
+		pv_json_ser_number(&js, bytes);
+		pv_json_ser_object_pop(&js);
+	}
 
-	ret = 0;
+	pv_json_ser_array_pop(&js);
+	pv_json_ser_key(&js, "reclaimed");
+	pv_json_ser_number(&js, reclaimed);
+	pv_json_ser_object_pop(&js);
+	json = pv_json_ser_str(&js);
 
-out:
-	return ret;
+	if (dry_run) {
+		pv_metadata_add_devmeta("storage.gc", json);
+		// the index was modified as if revisions were gone
+		pv_storage_refs_free();
+	} else {
+		if (full || fresh ||
+		    (needed && available + reclaimed < needed))
+			reclaimed += pv_storage_gc_objects(pv);
+		// chunks are only referenced by the indexes left after that
+		reclaimed += pv_storage_gc_chunks(pv);
+	}
+
+	free(json);
+	for (int i = 0; i < len; i++)
+		free(revs[i].rev);
+	free(revs);
+
+	return reclaimed;
 }
 
 struct pv_storage {
@@ -276,56 +884,33 @@ off_t pv_storage_get_free()
 
 int pv_storage_gc_run()
 {
-	int reclaimed = 0, len;
-	struct pv_state *s = 0, *u = 0;
-	struct dl_list revisions; // pv_path
-	struct pv_path *r, *tmp;
-	struct pantavisor *pv = pv_get_instance();
+	off_t reclaimed = pv_storage_gc(0, false, false);
 
-	if (pv->state)
-		s = pv->state;
-
-	if (pv->update)
-		u = pv->update->pending;
-
-	dl_list_init(&revisions);
-
-	if (pv_storage_get_revisions(&revisions)) {
-		pv_log(ERROR, "error parsings revs on disk for GC");
-		return -1;
-	}
+	if (reclaimed > 0)
+		pv_log(DEBUG, "total reclaimed: %jd bytes",
+		       (intmax_t)reclaimed);
 
-	// check all revisions in list
-	dl_list_for_each_safe(r, tmp, &revisions, struct pv_path, list)
-	{
-		len = strlen(r->path) + 1;
-		// dont reclaim current, locals, update, last booted up revisions or factory if configured
-		if (!strncmp(r->path, "..", len) ||
-		    !strncmp(r->path, ".", len) ||
-		    !strncmp(r->path, "current", len) ||
-		    !strncmp(r->path, "locals", len) ||
-		    !strncmp(r->path, "locals/..", len) ||
-		    !strncmp(r->path, "locals/.", len) ||
-		    (s && !strncmp(r->path, s->rev, len)) ||
-		    (u && !strncmp(r->path, u->rev, len)) ||
-		    !strncmp(r->path, pv_bootloader_get_done(), len) ||
-		    (pv_config_get_bool(PV_STORAGE_GC_KEEP_FACTORY) &&
-		     !strncmp(r->path, "0", len)))
-			continue;
+	return reclaimed;
+}
 
-		// unlink the given revision from local storage
-		pv_storage_rm_rev(r->path);
-	}
+int pv_storage_gc_run_full()
+{
+	off_t reclaimed = pv_storage_gc(0, true, false);
 
-	pv_storage_free_subdir(&revisions);
+	if (reclaimed > 0)
+		pv_log(DEBUG, "total reclaimed: %jd bytes",
+		       (intmax_t)reclaimed);
 
-	// get rid of orphaned objects
-	reclaimed = pv_storage_gc_objects(pv);
+	return reclaimed;
+}
 
-	if (reclaimed)
-		pv_log(DEBUG, "total reclaimed: %d bytes", reclaimed);
+void pv_storage_gc_dry_run()
+{
+	off_t reclaimable = pv_storage_gc(0, false, true);
 
-	return reclaimed;
+	if (reclaimable >= 0)
+		pv_log(INFO, "GC could reclaim %jd bytes from revisions",
+		       (intmax_t)reclaimable);
 }
 
 off_t pv_storage_gc_run_needed(off_t needed)
@@ -336,7 +921,7 @@ off_t pv_storage_gc_run_needed(off_t needed)
 		pv_log(WARN,
 		       "%d B needed but only %d B available. Freeing up space...",
 		       needed, available);
-		pv_storage_gc_run();
+		pv_storage_gc(needed, false, false);
 
 		available = pv_storage_get_free();
 
@@ -422,11 +1007,13 @@ out:
 	free(storage);
 }
 
+#define CHECKSUM_BUF_SIZE (128 * 1024)
+
 int pv_storage_validate_file_checksum(char *path, char *checksum)
 {
 	int fd, ret = -1, bytes;
 	mbedtls_sha256_context sha256_ctx;
-	unsigned char buf[4096];
+	unsigned char *buf;
 	unsigned char cloud_sha[32];
 	unsigned char local_sha[32];
 	char *tmp_sha;
@@ -436,15 +1023,26 @@ int pv_storage_validate_file_checksum(char *path, char *checksum)
 	if (fd < 0)
 		return ret;
 
+	buf = malloc(CHECKSUM_BUF_SIZE);
+	if (!buf)
+		goto out;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
 	mbedtls_sha256_init(&sha256_ctx);
 	mbedtls_sha256_starts(&sha256_ctx, 0);
 
-	while ((bytes = read(fd, buf, 4096)) > 0)
+	while ((bytes = read(fd, buf, CHECKSUM_BUF_SIZE)) > 0)
 		mbedtls_sha256_update(&sha256_ctx, buf, bytes);
 
 	mbedtls_sha256_finish(&sha256_ctx, local_sha);
 	mbedtls_sha256_free(&sha256_ctx);
 
+	if (bytes < 0) {
+		pv_log(WARN, "could not read %s: %s", path, strerror(errno));
+		goto out;
+	}
+
 	// signed to unsigned
 	tmp_sha = checksum;
 	for (int i = 0, j = 0; j < 32; i = i + 2, j++) {
@@ -453,7 +1051,7 @@ int pv_storage_validate_file_checksum(char *path, char *checksum)
 		cloud_sha[j] = strtoul(byte, NULL, 16);
 	}
 
-	if (strncmp((char *)cloud_sha, (char *)local_sha, 32)) {
+	if (memcmp(cloud_sha, local_sha, 32)) {
 		pv_log(WARN, "sha256 mismatch in %s", path);
 		goto out;
 	}
@@ -461,36 +1059,433 @@ int pv_storage_validate_file_checksum(char *path, char *checksum)
 	ret = 0;
 
 out:
+	if (buf)
+		free(buf);
 	close(fd);
 
 	return ret;
 }
 
-static bool pv_storage_validate_objects_object_checksum(char *checksum)
+static void pv_storage_validate_files_stripe(struct pv_storage_checksum *files,
+					     int *results, int len, int first,
+					     int step)
+{
+	for (int i = first; i < len; i += step) {
+		struct pv_storage_checksum *f = &files[i];
+
+		results[i] = pv_storage_validate_file_checksum(f->path,
+							       f->checksum);
+	}
+}
+
+/*
+ * Hashes a batch of files on one worker process per online CPU. Workers
+ * leave their results in a shared mapping and exit; the write end of a
+ * common pipe is closed by the kernel as each of them goes away, so EOF on
+ * the read end tells us all are done without having to wait for them,
+ * which init's SIGCHLD handler would race with. Returns the number of
+ * files that failed, or -1 if the batch could not be run.
+ */
+int pv_storage_validate_files_checksum(struct pv_storage_checksum *files,
+				       int len)
+{
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int fds[2], *results, failed = 0;
+	char c;
+	pid_t pid;
+
+	if (len <= 0)
+		return 0;
+
+	if (workers > len)
+		workers = len;
+	if (workers < 1)
+		workers = 1;
+
+	results = mmap(NULL, sizeof(int) * len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		pv_log(ERROR, "could not map checksum results: %s",
+		       strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < len; i++)
+		results[i] = -1;
+
+	if (workers == 1 || pipe(fds)) {
+		pv_storage_validate_files_stripe(files, results, len, 0, 1);
+		goto out;
+	}
+
+	pv_log(DEBUG, "validating %d files with %d workers", len, workers);
+
+	for (int w = 0; w < workers; w++) {
+		pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			pv_storage_validate_files_stripe(files, results, len, w,
+							 workers);
+			_exit(0);
+		}
+
+		// do the share of a worker we could not start ourselves
+		if (pid < 0)
+			pv_storage_validate_files_stripe(files, results, len,
+							 w, workers);
+	}
+
+	close(fds[1]);
+	while (read(fds[0], &c, 1) < 0 && errno == EINTR)
+		;
+	close(fds[0]);
+
+out:
+	for (int i = 0; i < len; i++) {
+		files[i].ret = results[i];
+		if (results[i])
+			failed++;
+	}
+
+	munmap(results, sizeof(int) * len);
+
+	return failed;
+}
+
+/*
+ * Files that passed checksum validation are remembered in VERIFIED_FNAME
+ * together with their inode identity. A file is only hashed again if any of
+ * dev, inode, size, mtime or ctime changed. ctime cannot be set from user
+ * space, so rewriting a file always invalidates its entry. The file is not
+ * signed, so the cache is only used if PV_SECUREBOOT_CHECKSUM_RESCAN is set.
+ * Then about one in that many boots ignores it and hashes everything again.
+ * The cache is only written back when its entries changed.
+ */
+#define VERIFIED_HEADER "pv-verified 2\n"
+#define VERIFIED_ENTRY_FMT "%64s %ju %ju %jd %jd.%ld %jd.%ld\n"
+
+struct pv_storage_verified {
+	char sha[65];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	bool used;
+};
+
+// sorted up to verified_sorted, new entries are appended after that
+static struct pv_storage_verified *verified = NULL;
+static int verified_len = 0;
+static int verified_sorted = 0;
+static int verified_cap = 0;
+static bool verified_enabled = false;
+static bool verified_rescan = false;
+static bool verified_dirty = false;
+
+static void pv_storage_verified_free(void)
+{
+	free(verified);
+	verified = NULL;
+	verified_len = 0;
+	verified_sorted = 0;
+	verified_cap = 0;
+	verified_enabled = false;
+	verified_rescan = false;
+	verified_dirty = false;
+}
+
+static int pv_storage_verified_cmp(const void *a, const void *b)
+{
+	const struct pv_storage_verified *va = a, *vb = b;
+	int ret = strcmp(va->sha, vb->sha);
+
+	if (ret)
+		return ret;
+	if (va->dev != vb->dev)
+		return va->dev < vb->dev ? -1 : 1;
+	if (va->ino != vb->ino)
+		return va->ino < vb->ino ? -1 : 1;
+
+	return 0;
+}
+
+static bool pv_storage_verified_is_same(struct pv_storage_verified *v,
+					struct stat *st)
+{
+	return v->size == st->st_size &&
+	       v->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       v->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	       v->ctime.tv_sec == st->st_ctim.tv_sec &&
+	       v->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static struct pv_storage_verified *
+pv_storage_verified_lookup(const char *sha, struct stat *st)
+{
+	struct pv_storage_verified key;
+
+	SNPRINTF_WTRUNC(key.sha, sizeof(key.sha), "%s", sha);
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+
+	return bsearch(&key, verified, verified_sorted,
+		       sizeof(struct pv_storage_verified),
+		       pv_storage_verified_cmp);
+}
+
+static bool pv_storage_verified_find(const char *sha, struct stat *st)
 {
+	struct pv_storage_verified *v;
+
+	if (verified_rescan)
+		return false;
+
+	v = pv_storage_verified_lookup(sha, st);
+	if (!v || !pv_storage_verified_is_same(v, st))
+		return false;
+
+	v->used = true;
+	return true;
+}
+
+static void pv_storage_verified_set(struct pv_storage_verified *v,
+				    struct stat *st)
+{
+	v->size = st->st_size;
+	v->mtime = st->st_mtim;
+	v->ctime = st->st_ctim;
+	v->used = true;
+}
+
+static void pv_storage_verified_append(const char *sha, struct stat *st)
+{
+	struct pv_storage_verified *v;
+	int cap;
+
+	if (verified_len == verified_cap) {
+		cap = verified_cap ? verified_cap * 2 : 64;
+		v = realloc(verified, cap * sizeof(struct pv_storage_verified));
+		if (!v)
+			return;
+		verified = v;
+		verified_cap = cap;
+	}
+
+	v = &verified[verified_len++];
+	memset(v, 0, sizeof(struct pv_storage_verified));
+	SNPRINTF_WTRUNC(v->sha, sizeof(v->sha), "%s", sha);
+	v->dev = st->st_dev;
+	v->ino = st->st_ino;
+	pv_storage_verified_set(v, st);
+}
+
+static void pv_storage_verified_add(const char *sha, struct stat *st)
+{
+	struct pv_storage_verified *v;
+
+	if (!verified_enabled)
+		return;
+
+	v = pv_storage_verified_lookup(sha, st);
+	if (v && pv_storage_verified_is_same(v, st)) {
+		v->used = true;
+		return;
+	}
+
+	if (v)
+		pv_storage_verified_set(v, st);
+	else
+		pv_storage_verified_append(sha, st);
+	verified_dirty = true;
+}
+
+void pv_storage_verified_load(void)
+{
+	struct stat st;
+	intmax_t mtime, ctime;
+	uintmax_t dev, ino;
+	intmax_t size;
+	long mnsec, cnsec;
+	char sha[65];
+	char path[PATH_MAX];
+	char header[sizeof(VERIFIED_HEADER)];
+	int rescan = pv_config_get_int(PV_SECUREBOOT_CHECKSUM_RESCAN);
+	struct timespec now;
+	FILE *f;
+
+	pv_storage_verified_free();
+	if (rescan <= 0)
+		return;
+
+	verified_enabled = true;
+
+	// boot time jitter is enough to spread full validations
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_nsec / 1000) % rescan == 0) {
+		pv_log(INFO, "full checksum validation of objects");
+		verified_rescan = true;
+	}
+
+	pv_paths_storage_file(path, PATH_MAX, VERIFIED_FNAME);
+	f = fopen(path, "r");
+	if (!f) {
+		verified_dirty = true;
+		return;
+	}
+
+	if (!fgets(header, sizeof(header), f) ||
+	    strcmp(header, VERIFIED_HEADER)) {
+		verified_dirty = true;
+		goto out;
+	}
+
+	while (fscanf(f, VERIFIED_ENTRY_FMT, sha, &dev, &ino, &size, &mtime,
+		      &mnsec, &ctime, &cnsec) == 8) {
+		memset(&st, 0, sizeof(st));
+		st.st_dev = dev;
+		st.st_ino = ino;
+		st.st_size = size;
+		st.st_mtim.tv_sec = mtime;
+		st.st_mtim.tv_nsec = mnsec;
+		st.st_ctim.tv_sec = ctime;
+		st.st_ctim.tv_nsec = cnsec;
+		pv_storage_verified_append(sha, &st);
+		verified[verified_len - 1].used = false;
+	}
+
+	qsort(verified, verified_len, sizeof(struct pv_storage_verified),
+	      pv_storage_verified_cmp);
+	verified_sorted = verified_len;
+
+	pv_log(DEBUG, "loaded verified checksum cache with %d entries",
+	       verified_len);
+out:
+	fclose(f);
+}
+
+void pv_storage_verified_save(void)
+{
+	struct pv_storage_verified *v;
 	char path[PATH_MAX];
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f;
+
+	if (!verified_enabled)
+		goto out;
+
+	// entries of files that were not validated this time are dropped
+	for (int i = 0; i < verified_len; i++) {
+		if (!verified[i].used)
+			verified_dirty = true;
+	}
+	if (!verified_dirty)
+		goto out;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		goto out;
+
+	fputs(VERIFIED_HEADER, f);
+	for (int i = 0; i < verified_len; i++) {
+		v = &verified[i];
+		if (!v->used)
+			continue;
+		fprintf(f, VERIFIED_ENTRY_FMT, v->sha, (uintmax_t)v->dev,
+			(uintmax_t)v->ino, (intmax_t)v->size,
+			(intmax_t)v->mtime.tv_sec, v->mtime.tv_nsec,
+			(intmax_t)v->ctime.tv_sec, v->ctime.tv_nsec);
+	}
+	fclose(f);
+
+	pv_paths_storage_file(path, PATH_MAX, VERIFIED_FNAME);
+	if (pv_fs_file_save(path, buf, 0644))
+		pv_log(WARN, "could not save %s: %s", path, strerror(errno));
+out:
+	if (buf)
+		free(buf);
+	pv_storage_verified_free();
+}
+
+static int pv_storage_checksum_add(struct pv_storage_checksum *files,
+				   int *len, char *path, char *checksum,
+				   struct stat *st)
+{
+	if (stat(path, st)) {
+		pv_log(ERROR, "could not stat %s: %s", path, strerror(errno));
+		return -1;
+	}
 
-	pv_paths_storage_object(path, PATH_MAX, checksum);
-	pv_log(DEBUG, "validating checksum for object %s", path);
-	return !pv_storage_validate_file_checksum(path, checksum);
+	if (pv_storage_verified_find(checksum, st))
+		return 0;
+
+	files[*len].path = strdup(path);
+	if (!files[*len].path)
+		return -1;
+	files[*len].checksum = checksum;
+	files[*len].st = *st;
+	files[*len].ret = -1;
+	(*len)++;
+
+	return 0;
 }
 
-bool pv_storage_validate_trails_object_checksum(const char *rev,
-						const char *name,
-						char *checksum)
+/*
+ * Validates the pool objects of a revision and their trail files. Trail
+ * files that are hard links to the pool object are not hashed twice, and
+ * everything that is not in the verified cache is hashed in parallel.
+ */
+bool pv_storage_validate_trails_objects_checksum(const char *rev,
+						 struct pv_object **objs,
+						 int count)
 {
+	struct pv_storage_checksum *files;
 	char path[PATH_MAX];
+	struct stat obj_st, st;
+	bool ret = true;
+	int len = 0, failed;
+
+	if (count <= 0)
+		return true;
 
-	// validate object in pool to match
-	if (!pv_storage_validate_objects_object_checksum(checksum)) {
-		pv_log(ERROR, "object %s with checksum %s failed", name,
-		       checksum);
+	files = calloc(count * 2, sizeof(struct pv_storage_checksum));
+	if (!files)
 		return false;
+
+	for (int i = 0; i < count; i++) {
+		pv_paths_storage_object(path, PATH_MAX, objs[i]->id);
+		if (pv_storage_checksum_add(files, &len, path, objs[i]->id,
+					    &obj_st)) {
+			ret = false;
+			continue;
+		}
+
+		// trail files are usually hard links to the pool object
+		pv_paths_storage_trail_file(path, PATH_MAX, rev, objs[i]->name);
+		if (stat(path, &st) == 0 && st.st_dev == obj_st.st_dev &&
+		    st.st_ino == obj_st.st_ino)
+			continue;
+
+		if (pv_storage_checksum_add(files, &len, path, objs[i]->id,
+					    &st))
+			ret = false;
 	}
 
-	pv_paths_storage_trail_file(path, PATH_MAX, rev, name);
-	pv_log(DEBUG, "validating checksum for object in trail %s", path);
-	return !pv_storage_validate_file_checksum(path, checksum);
+	failed = ret ? pv_storage_validate_files_checksum(files, len) : -1;
+
+	for (int i = 0; i < len; i++) {
+		if (!files[i].ret)
+			pv_storage_verified_add(files[i].checksum,
+						&files[i].st);
+		else if (failed > 0)
+			pv_log(ERROR, "%s with checksum %s failed",
+			       files[i].path, files[i].checksum);
+		free(files[i].path);
+	}
+	free(files);
+
+	return ret && !failed;
 }
 
 bool pv_storage_validate_trails_json_value(const char *rev, const char *name,
@@ -587,132 +1582,6 @@ out:
 	return ret;
 }
 
-static char *pv_storage_get_file_date(const char *path)
-{
-	struct stat st;
-	struct tm *nowtm;
-	char *date = calloc(32, sizeof(char));
-
-	stat(path, &st);
-
-	nowtm = localtime(&st.st_mtim.tv_sec);
-	strftime(date, 32, "%Y-%m-%dT%H:%M:%SZ", nowtm);
-
-	return date;
-}
-
-char *pv_storage_get_revisions_string()
-{
-	int len = 1, line_len;
-	char path[PATH_MAX];
-	char *json = calloc(len, sizeof(char)), *progress = NULL, *date = NULL,
-	     *commitmsg = NULL, *esc_commitmsg = NULL;
-	struct dl_list revisions; // pv_path
-	struct pv_path *r, *tmp;
-
-	dl_list_init(&revisions);
-	if (pv_storage_get_revisions(&revisions)) {
-		pv_log(ERROR, "error parsings revs on disk for ctrl");
-		goto out;
-	}
-
-	// open json
-	json[0] = '[';
-
-	if (dl_list_empty(&revisions)) {
-		len++;
-		goto out;
-	}
-
-	// fill up revision list in json
-	dl_list_for_each_safe(r, tmp, &revisions, struct pv_path, list)
-	{
-		// dont list current or locals dir
-		if (!strncmp(r->path, "..", strlen("..") + 1) ||
-		    !strncmp(r->path, ".", strlen(".") + 1) ||
-		    !strncmp(r->path, "current", strlen("current") + 1) ||
-		    !strncmp(r->path, "locals", strlen("locals") + 1) ||
-		    !strncmp(r->path, "locals/..", strlen("locals/..") + 1) ||
-		    !strncmp(r->path, "locals/.", strlen("locals/.") + 1))
-			continue;
-
-		// get revision progress
-		pv_paths_storage_trail_pv_file(path, PATH_MAX, r->path,
-					       PROGRESS_FNAME);
-		progress = pv_fs_file_load(path, 512);
-		if (!progress || !strlen(progress)) {
-			progress = calloc(3, sizeof(char));
-			sprintf(progress, "{}");
-		}
-
-		// get revision date
-		pv_paths_storage_trail(path, PATH_MAX, r->path);
-		date = pv_storage_get_file_date(path);
-
-		// get revision commit message
-		pv_paths_storage_trail_pv_file(path, PATH_MAX, r->path,
-					       COMMITMSG_FNAME);
-		commitmsg = pv_fs_file_load(path, 512);
-		if (commitmsg)
-			esc_commitmsg =
-				pv_json_format(commitmsg, strlen(commitmsg));
-
-		if (!commitmsg || !esc_commitmsg) {
-			esc_commitmsg = calloc(1, sizeof(char));
-			esc_commitmsg[0] = '\0';
-		}
-		if (commitmsg) {
-			free(commitmsg);
-			commitmsg = NULL;
-		}
-
-		// add new revision line to json
-		line_len = strlen(r->path) + strlen(esc_commitmsg) +
-			   strlen(date) + strlen(progress) + 52;
-		json = realloc(json, len + line_len + 1);
-		SNPRINTF_WTRUNC(
-			&json[len], line_len + 1,
-			"{\"name\":\"%s\", \"date\":\"%s\", \"commitmsg\":\"%s\", \"progress\":%s},",
-			r->path, date, esc_commitmsg, progress);
-		len += line_len;
-
-		if (progress) {
-			free(progress);
-			progress = NULL;
-		}
-		if (esc_commitmsg) {
-			free(esc_commitmsg);
-			esc_commitmsg = NULL;
-		}
-		if (date) {
-			free(date);
-			date = NULL;
-		}
-	}
-
-out:
-	len += 1;
-	json = realloc(json, len);
-	// close json
-	json[len - 2] = ']';
-	json[len - 1] = '\0';
-
-	// free temporary revision list
-	dl_list_for_each_safe(r, tmp, &revisions, struct pv_path, list)
-	{
-		free(r->path);
-		dl_list_del(&r->list);
-		free(r);
-	}
-
-	if (progress)
-		free(progress);
-	if (commitmsg)
-		free(commitmsg);
-
-	return json;
-}
-
 void pv_storage_set_rev_done(const char *rev)
 {
 	char path[PATH_MAX];
@@ -748,6 +1617,8 @@ void pv_storage_set_rev_progress(const char *rev, const char *progress)
 	if (pv_fs_file_save(path, progress, 0644) < 0)
 		pv_log(WARN, "could not save file %s: %s", path,
 		       strerror(errno));
+
+	pv_storage_catalog_update_rev(rev);
 }
 
 char *pv_storage_get_rev_progress(const char *rev)
@@ -1133,6 +2004,8 @@ static int pv_storage_init(struct pv_init *this)
 	if (pv_fs_file_save(path, "", 0444) < 0)
 		pv_log(WARN, "could not save %s: %s", path, strerror(errno));
 
+	pv_storage_objects_init();
+
 	return 0;
 }
 
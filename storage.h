@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #define PREFIX_LOCAL_REV "locals/"
 #define SIZE_LOCAL_REV 64
@@ -45,25 +46,48 @@ void pv_storage_set_rev_progress(const char *rev, const char *progress);
 char *pv_storage_get_rev_progress(const char *rev);
 void pv_storage_init_trail_pvr(void);
 void pv_storage_rm_rev(const char *rev);
+void pv_storage_refs_add_rev(const char *rev);
 void pv_storage_set_active(struct pantavisor *pv);
 int pv_storage_update_factory(const char *rev);
 int pv_storage_make_config(struct pantavisor *pv);
 bool pv_storage_is_revision_local(const char *rev);
-char *pv_storage_get_revisions_string(void);
+char *pv_storage_get_revisions_string(int offset, int limit,
+				      const char *status);
+void pv_storage_catalog_update_rev(const char *rev);
+void pv_storage_catalog_size_rev(const char *rev);
+
+int pv_storage_get_revisions(struct dl_list *revisions);
+bool pv_storage_is_rev_dir(const char *rev);
+char **pv_storage_get_rev_ids(const char *rev, int *len);
 
 int pv_storage_get_subdir(const char *path, const char *prefix,
 			  struct dl_list *subdirs);
 void pv_storage_free_subdir(struct dl_list *subdirs);
+int pv_storage_get_objects(struct dl_list *objects);
+void pv_storage_objects_migrate(void);
+
+struct pv_storage_checksum {
+	char *path;
+	char *checksum;
+	struct stat st;
+	int ret;
+};
 
 int pv_storage_validate_file_checksum(char *path, char *checksum);
-bool pv_storage_validate_trails_object_checksum(const char *rev,
-						const char *name,
-						char *checksum);
+int pv_storage_validate_files_checksum(struct pv_storage_checksum *files,
+				       int len);
+void pv_storage_verified_load(void);
+void pv_storage_verified_save(void);
+bool pv_storage_validate_trails_objects_checksum(const char *rev,
+						 struct pv_object **objs,
+						 int count);
 bool pv_storage_validate_trails_json_value(const char *rev, const char *name,
 					   char *val);
 
 off_t pv_storage_get_free(void);
 int pv_storage_gc_run(void);
+int pv_storage_gc_run_full(void);
+void pv_storage_gc_dry_run(void);
 off_t pv_storage_gc_run_needed(off_t needed);
 void pv_storage_gc_defer_run_threshold(void);
 void pv_storage_gc_run_threshold(void);
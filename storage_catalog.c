@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/limits.h>
+#include <sys/stat.h>
+
+#include <jsmn/jsmnutil.h>
+
+#include "objects.h"
+#include "storage.h"
+#include "storage_catalog.h"
+#include "paths.h"
+#include "utils/json.h"
+#include "utils/fs.h"
+#include "utils/str.h"
+
+#define MODULE_NAME "catalog"
+#define pv_log(level, msg, ...) vlog(MODULE_NAME, level, msg, ##__VA_ARGS__)
+#include "log.h"
+
+/*
+ * Revision catalog: what GET /steps lists for each revision, kept in
+ * CATALOG_FNAME so the listing does not have to open several files per
+ * revision. Entries are updated in memory when progress or commit messages
+ * are saved and dropped when revisions are removed. The file is written back
+ * at most once every CATALOG_SAVE_INTERVAL seconds. The size of a revision
+ * is only measured when its entry is created and when it is installed.
+ *
+ * Each entry keeps the mtime of the .pv directory of its revision, where
+ * progress and commit messages are renamed into. The mtimes of the trails
+ * and locals directories are stored too: if a revision shows up or goes away
+ * behind our back, they change, and only the revisions that are new or whose
+ * .pv directory changed are read again. The same check is done once after
+ * loading the file, as it may lag behind the last changes.
+ */
+#define CATALOG_HEADER_FMT "pv-catalog 2 %jd.%ld %jd.%ld\n"
+#define CATALOG_ENTRY_FMT "%s\t%jd\t%s\t%jd\t%jd.%ld\t%s\t%s\n"
+#define CATALOG_SAVE_INTERVAL 30
+
+struct pv_storage_catalog_entry {
+	char *rev;
+	time_t date;
+	char *status;
+	off_t size;
+	struct timespec mtime; // of the .pv directory
+	char *commitmsg; // JSON escaped
+	char *progress; // JSON, on one line
+	bool seen;
+	struct dl_list list;
+};
+
+struct pv_storage_catalog {
+	bool init;
+	bool dirty;
+	time_t saved;
+	struct timespec trails;
+	struct timespec locals;
+	// walked with dl_list_for_each_safe, dl_list_for_each on a static
+	// head trips -Warray-bounds
+	struct dl_list entries; // pv_storage_catalog_entry
+};
+
+static struct pv_storage_catalog catalog = {
+	.entries = DL_LIST_HEAD_INIT(catalog.entries),
+};
+
+static void
+pv_storage_catalog_entry_free(struct pv_storage_catalog_entry *e)
+{
+	dl_list_del(&e->list);
+	free(e->rev);
+	free(e->status);
+	free(e->commitmsg);
+	free(e->progress);
+	free(e);
+}
+
+static void pv_storage_catalog_free(void)
+{
+	struct pv_storage_catalog_entry *e, *tmp;
+
+	dl_list_for_each_safe(e, tmp, &catalog.entries,
+			      struct pv_storage_catalog_entry, list)
+	{
+		pv_storage_catalog_entry_free(e);
+	}
+
+	catalog.init = false;
+	catalog.dirty = false;
+}
+
+static struct pv_storage_catalog_entry *
+pv_storage_catalog_find(const char *rev)
+{
+	struct pv_storage_catalog_entry *e, *tmp;
+
+	dl_list_for_each_safe(e, tmp, &catalog.entries,
+			      struct pv_storage_catalog_entry, list)
+	{
+		if (!strcmp(e->rev, rev))
+			return e;
+	}
+
+	return NULL;
+}
+
+static bool pv_storage_catalog_mtime_eq(struct timespec *a,
+					struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static void pv_storage_catalog_get_mtimes(struct timespec *trails,
+					  struct timespec *locals)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	memset(trails, 0, sizeof(struct timespec));
+	memset(locals, 0, sizeof(struct timespec));
+
+	pv_paths_storage_trail(path, PATH_MAX, "");
+	if (!stat(path, &st))
+		*trails = st.st_mtim;
+
+	pv_paths_storage_trail(path, PATH_MAX, "locals");
+	if (!stat(path, &st))
+		*locals = st.st_mtim;
+}
+
+static void pv_storage_catalog_get_rev_mtime(const char *rev,
+					     struct timespec *mtime)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	memset(mtime, 0, sizeof(struct timespec));
+
+	pv_paths_storage_trail_pv_file(path, PATH_MAX, rev, "");
+	if (!stat(path, &st))
+		*mtime = st.st_mtim;
+}
+
+static bool pv_storage_catalog_is_stale(void)
+{
+	struct timespec trails, locals;
+
+	pv_storage_catalog_get_mtimes(&trails, &locals);
+
+	return !pv_storage_catalog_mtime_eq(&trails, &catalog.trails) ||
+	       !pv_storage_catalog_mtime_eq(&locals, &catalog.locals);
+}
+
+static void pv_storage_catalog_save(void)
+{
+	struct pv_storage_catalog_entry *e, *tmp;
+	char path[PATH_MAX];
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return;
+
+	fprintf(f, CATALOG_HEADER_FMT, (intmax_t)catalog.trails.tv_sec,
+		catalog.trails.tv_nsec, (intmax_t)catalog.locals.tv_sec,
+		catalog.locals.tv_nsec);
+	dl_list_for_each_safe(e, tmp, &catalog.entries,
+			      struct pv_storage_catalog_entry, list)
+	{
+		fprintf(f, CATALOG_ENTRY_FMT, e->rev, (intmax_t)e->date,
+			e->status, (intmax_t)e->size, (intmax_t)e->mtime.tv_sec,
+			e->mtime.tv_nsec, e->commitmsg, e->progress);
+	}
+	fclose(f);
+
+	pv_paths_storage_file(path, PATH_MAX, CATALOG_FNAME);
+	if (pv_fs_file_save(path, buf, 0644)) {
+		pv_log(WARN, "could not save %s: %s", path, strerror(errno));
+	} else {
+		catalog.dirty = false;
+	}
+
+	free(buf);
+}
+
+// writes the catalog if it changed and the last write is old enough
+static void pv_storage_catalog_flush(void)
+{
+	struct timespec now;
+
+	if (!catalog.dirty)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (catalog.saved && now.tv_sec - catalog.saved < CATALOG_SAVE_INTERVAL)
+		return;
+
+	pv_storage_catalog_save();
+	catalog.saved = now.tv_sec;
+}
+
+static off_t pv_storage_catalog_get_size(const char *rev)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	off_t size = 0;
+	char **ids;
+	int len;
+
+	ids = pv_storage_get_rev_ids(rev, &len);
+	for (int i = 0; i < len; i++) {
+		pv_paths_storage_object(path, PATH_MAX, ids[i]);
+		if (!stat(path, &st))
+			size += st.st_size;
+		free(ids[i]);
+	}
+	free(ids);
+
+	return size;
+}
+
+// refreshes the entry of rev from the files in its trail
+static struct pv_storage_catalog_entry *
+pv_storage_catalog_load_rev(const char *rev)
+{
+	struct pv_storage_catalog_entry *e;
+	char path[PATH_MAX];
+	char *progress, *commitmsg, *status = NULL;
+	jsmntok_t *tokv = NULL;
+	struct stat st;
+	int tokc;
+
+	e = pv_storage_catalog_find(rev);
+	if (!e) {
+		e = calloc(1, sizeof(struct pv_storage_catalog_entry));
+		if (!e)
+			return NULL;
+		e->rev = strdup(rev);
+		e->size = pv_storage_catalog_get_size(rev);
+		dl_list_add_tail(&catalog.entries, &e->list);
+	}
+
+	// taken first, so changes made while we read show up next time
+	pv_storage_catalog_get_rev_mtime(rev, &e->mtime);
+
+	// get revision progress, on a single line
+	pv_paths_storage_trail_pv_file(path, PATH_MAX, rev, PROGRESS_FNAME);
+	progress = pv_fs_file_load(path, 512);
+	if (!progress || !strlen(progress)) {
+		free(progress);
+		progress = strdup("{}");
+	}
+	for (char *c = progress; c && *c; c++) {
+		if (*c == '\n' || *c == '\r' || *c == '\t')
+			*c = ' ';
+	}
+
+	if (progress && jsmnutil_parse_json(progress, &tokv, &tokc) > 0)
+		status = pv_json_get_value(progress, "status", tokv, tokc);
+	if (tokv)
+		free(tokv);
+	if (!status)
+		status = strdup("");
+
+	// get revision date
+	pv_paths_storage_trail(path, PATH_MAX, rev);
+	e->date = stat(path, &st) ? 0 : st.st_mtim.tv_sec;
+
+	// get revision commit message
+	pv_paths_storage_trail_pv_file(path, PATH_MAX, rev, COMMITMSG_FNAME);
+	commitmsg = pv_fs_file_load(path, 512);
+	free(e->commitmsg);
+	e->commitmsg = NULL;
+	if (commitmsg)
+		e->commitmsg = pv_json_format(commitmsg, strlen(commitmsg));
+	if (!e->commitmsg)
+		e->commitmsg = strdup("");
+	free(commitmsg);
+
+	free(e->status);
+	e->status = status;
+	free(e->progress);
+	e->progress = progress;
+	catalog.dirty = true;
+
+	return e;
+}
+
+/*
+ * Brings the catalog in line with the revisions on disk. Only the revisions
+ * that are new or whose .pv directory changed are read again.
+ */
+static void pv_storage_catalog_refresh(void)
+{
+	struct pv_storage_catalog_entry *e, *tmp;
+	struct dl_list revisions; // pv_path
+	struct timespec mtime;
+	struct pv_path *r, *rtmp;
+
+	pv_log(DEBUG, "refreshing revision catalog");
+
+	// taken first, so changes made while we scan show up next time
+	pv_storage_catalog_get_mtimes(&catalog.trails, &catalog.locals);
+
+	dl_list_init(&revisions);
+	if (pv_storage_get_revisions(&revisions)) {
+		pv_log(ERROR, "error parsings revs on disk for catalog");
+		goto out;
+	}
+
+	dl_list_for_each_safe(e, tmp, &catalog.entries,
+			      struct pv_storage_catalog_entry, list)
+	{
+		e->seen = false;
+	}
+
+	dl_list_for_each_safe(r, rtmp, &revisions, struct pv_path, list)
+	{
+		if (!pv_storage_is_rev_dir(r->path))
+			continue;
+
+		e = pv_storage_catalog_find(r->path);
+		if (e)
+			pv_storage_catalog_get_rev_mtime(r->path, &mtime);
+		if (!e || !pv_storage_catalog_mtime_eq(&mtime, &e->mtime))
+			e = pv_storage_catalog_load_rev(r->path);
+		if (!e)
+			continue;
+
+		// keep the order revisions are listed on disk
+		e->seen = true;
+		dl_list_del(&e->list);
+		dl_list_add_tail(&catalog.entries, &e->list);
+	}
+
+	dl_list_for_each_safe(e, tmp, &catalog.entries,
+			      struct pv_storage_catalog_entry, list)
+	{
+		if (e->seen)
+			continue;
+		pv_storage_catalog_entry_free(e);
+		catalog.dirty = true;
+	}
+
+	catalog.init = true;
+out:
+	pv_storage_free_subdir(&revisions);
+}
+
+static char *pv_storage_catalog_next_field(char **line)
+{
+	char *field = *line, *tab;
+
+	if (!field)
+		return NULL;
+
+	tab = strchr(field, '\t');
+	if (tab) {
+		*tab = '\0';
+		*line = tab + 1;
+	} else
+		*line = NULL;
+
+	return field;
+}
+
+static int pv_storage_catalog_load(void)
+{
+	struct pv_storage_catalog_entry *e;
+	char path[PATH_MAX];
+	char *buf, *line, *next, *field[7], *nsec;
+	intmax_t tsec, lsec;
+	long tnsec, lnsec;
+	int i;
+
+	pv_storage_catalog_free();
+
+	pv_paths_storage_file(path, PATH_MAX, CATALOG_FNAME);
+	buf = pv_fs_file_load(path, 0);
+	if (!buf)
+		return -1;
+
+	if (sscanf(buf, CATALOG_HEADER_FMT, &tsec, &tnsec, &lsec, &lnsec) !=
+	    4) {
+		free(buf);
+		return -1;
+	}
+	catalog.trails.tv_sec = tsec;
+	catalog.trails.tv_nsec = tnsec;
+	catalog.locals.tv_sec = lsec;
+	catalog.locals.tv_nsec = lnsec;
+
+	line = strchr(buf, '\n');
+	while (line && *(++line)) {
+		next = strchr(line, '\n');
+		if (next)
+			*next = '\0';
+
+		for (i = 0; i < 7; i++)
+			field[i] = pv_storage_catalog_next_field(&line);
+
+		e = calloc(1, sizeof(struct pv_storage_catalog_entry));
+		if (!e || !field[6]) {
+			free(e);
+			pv_log(WARN, "bad entry in revision catalog");
+			break;
+		}
+
+		e->rev = strdup(field[0]);
+		e->date = strtoll(field[1], NULL, 10);
+		e->status = strdup(field[2]);
+		e->size = strtoll(field[3], NULL, 10);
+		e->mtime.tv_sec = strtoll(field[4], &nsec, 10);
+		if (*nsec == '.')
+			e->mtime.tv_nsec = strtol(nsec + 1, NULL, 10);
+		e->commitmsg = strdup(field[5]);
+		e->progress = strdup(field[6]);
+		dl_list_add_tail(&catalog.entries, &e->list);
+
+		line = next;
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+static void pv_storage_catalog_sync(void)
+{
+	// the file may lag behind, check every entry once after loading it
+	if (!catalog.init) {
+		pv_storage_catalog_load();
+		pv_storage_catalog_refresh();
+	} else if (pv_storage_catalog_is_stale())
+		pv_storage_catalog_refresh();
+
+	pv_storage_catalog_flush();
+}
+
+void pv_storage_catalog_update_rev(const char *rev)
+{
+	if (!rev)
+		return;
+
+	pv_storage_catalog_sync();
+	pv_storage_catalog_load_rev(rev);
+	pv_storage_catalog_flush();
+}
+
+// objects are all in place once the revision is installed
+void pv_storage_catalog_size_rev(const char *rev)
+{
+	struct pv_storage_catalog_entry *e;
+
+	if (!rev)
+		return;
+
+	pv_storage_catalog_sync();
+	e = pv_storage_catalog_find(rev);
+	if (!e)
+		return;
+
+	e->size = pv_storage_catalog_get_size(rev);
+	catalog.dirty = true;
+	pv_storage_catalog_flush();
+}
+
+void pv_storage_catalog_rm_rev(const char *rev)
+{
+	struct pv_storage_catalog_entry *e;
+
+	if (!catalog.init)
+		return;
+
+	e = pv_storage_catalog_find(rev);
+	if (e) {
+		pv_storage_catalog_entry_free(e);
+		catalog.dirty = true;
+	}
+
+	pv_storage_catalog_flush();
+}
+
+/*
+ * Lists the revisions in the catalog as JSON, skipping the first offset
+ * ones and returning at most limit of them (all if limit is 0). If status
+ * is set, only revisions whose progress has that status are listed.
+ */
+char *pv_storage_get_revisions_string(int offset, int limit,
+				      const char *status)
+{
+	struct pv_storage_catalog_entry *e, *tmp;
+	char date[32];
+	char *json = NULL;
+	size_t size = 0;
+	struct tm tm;
+	int n = 0;
+	FILE *f;
+
+	pv_storage_catalog_sync();
+
+	f = open_memstream(&json, &size);
+	if (!f)
+		return NULL;
+
+	fputc('[', f);
+	dl_list_for_each_safe(e, tmp, &catalog.entries,
+			      struct pv_storage_catalog_entry, list)
+	{
+		if (status && strcmp(e->status, status))
+			continue;
+
+		if (offset > 0) {
+			offset--;
+			continue;
+		}
+
+		if (limit > 0 && n >= limit)
+			break;
+
+		date[0] = '\0';
+		if (localtime_r(&e->date, &tm))
+			strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ",
+				 &tm);
+
+		fprintf(f,
+			"%s{\"name\":\"%s\", \"date\":\"%s\", \"commitmsg\":\"%s\", \"size\":%jd, \"progress\":%s}",
+			n ? "," : "", e->rev, date, e->commitmsg,
+			(intmax_t)e->size, e->progress);
+		n++;
+	}
+	fputc(']', f);
+	fclose(f);
+
+	return json;
+}
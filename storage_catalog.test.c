@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PVTEST
+#define PVTEST
+#endif
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "storage_catalog.c"
+#include "utils/pvtest.h"
+
+static char dir[] = "/tmp/pv-catalog-XXXXXX";
+
+char *pv_config_get_str(config_index_t ci)
+{
+	if (ci == PV_STORAGE_MNTPOINT)
+		return dir;
+	return "";
+}
+
+bool pv_config_get_bool(config_index_t ci)
+{
+	return false;
+}
+
+void __log(char *module, int level, const char *fmt, ...)
+{
+}
+
+// what the catalog needs from storage.c, revisions are listed in name order
+int pv_storage_get_revisions(struct dl_list *revisions)
+{
+	char path[PATH_MAX];
+	struct dirent **dirs;
+	struct pv_path *r;
+	int n;
+
+	pv_paths_storage_trail(path, PATH_MAX, "");
+	n = scandir(path, &dirs, NULL, alphasort);
+	if (n < 0)
+		return -1;
+
+	for (int i = 0; i < n; i++) {
+		r = calloc(1, sizeof(struct pv_path));
+		if (r) {
+			r->path = strdup(dirs[i]->d_name);
+			dl_list_add_tail(revisions, &r->list);
+		}
+		free(dirs[i]);
+	}
+	free(dirs);
+
+	return 0;
+}
+
+bool pv_storage_is_rev_dir(const char *rev)
+{
+	return strcmp(rev, ".") && strcmp(rev, "..") && strcmp(rev, "locals");
+}
+
+char **pv_storage_get_rev_ids(const char *rev, int *len)
+{
+	*len = 0;
+	return NULL;
+}
+
+void pv_storage_free_subdir(struct dl_list *subdirs)
+{
+	struct pv_path *r, *tmp;
+
+	dl_list_for_each_safe(r, tmp, subdirs, struct pv_path, list)
+	{
+		dl_list_del(&r->list);
+		free(r->path);
+		free(r);
+	}
+}
+
+static int test_rev(const char *rev, const char *status)
+{
+	char path[PATH_MAX], progress[128];
+
+	pv_paths_storage_trail_pv_file(path, PATH_MAX, rev, "");
+	if (pv_fs_mkdir_p(path, 0755))
+		return -1;
+
+	if (!status)
+		return 0;
+
+	pv_paths_storage_trail_pv_file(path, PATH_MAX, rev, PROGRESS_FNAME);
+	snprintf(progress, sizeof(progress),
+		 "{\"status\":\"%s\",\n\"progress\":100}", status);
+
+	return pv_fs_file_save(path, progress, 0644);
+}
+
+// file timestamps can be coarse, changes have to be seen as such
+static void test_tick(void)
+{
+	usleep(20000);
+}
+
+// the names listed for offset, limit and status, comma separated
+static char *test_names(int offset, int limit, const char *status)
+{
+	static char names[256];
+	char *json, *name, *end;
+	int len = 0;
+
+	names[0] = '\0';
+	json = pv_storage_get_revisions_string(offset, limit, status);
+	if (!json)
+		return NULL;
+
+	for (name = strstr(json, "\"name\":\""); name;
+	     name = strstr(end, "\"name\":\"")) {
+		name += strlen("\"name\":\"");
+		end = strchr(name, '"');
+		if (!end)
+			break;
+		len += snprintf(names + len, sizeof(names) - len, "%s%.*s",
+				len ? "," : "", (int)(end - name), name);
+	}
+	free(json);
+
+	return names;
+}
+
+static int test_list(void)
+{
+	char *json;
+
+	PVTEST_CHECK(!strcmp(test_names(0, 0, NULL), "1,2,3,4,5,6"));
+
+	// progress is kept on one line
+	json = pv_storage_get_revisions_string(0, 1, NULL);
+	PVTEST_CHECK(json && !strchr(json, '\n'));
+	free(json);
+
+	return 0;
+}
+
+static int test_offset_limit(void)
+{
+	PVTEST_CHECK(!strcmp(test_names(2, 0, NULL), "3,4,5,6"));
+	PVTEST_CHECK(!strcmp(test_names(0, 2, NULL), "1,2"));
+	PVTEST_CHECK(!strcmp(test_names(2, 2, NULL), "3,4"));
+	PVTEST_CHECK(!strcmp(test_names(5, 2, NULL), "6"));
+	PVTEST_CHECK(!strcmp(test_names(6, 0, NULL), ""));
+	PVTEST_CHECK(!strcmp(test_names(100, 10, NULL), ""));
+
+	// negative values mean no offset and no limit
+	PVTEST_CHECK(!strcmp(test_names(-1, -1, NULL), "1,2,3,4,5,6"));
+
+	return 0;
+}
+
+static int test_status(void)
+{
+	PVTEST_CHECK(!strcmp(test_names(0, 0, "DONE"), "1,3,5"));
+	PVTEST_CHECK(!strcmp(test_names(0, 0, "ERROR"), "2"));
+	PVTEST_CHECK(!strcmp(test_names(0, 0, "UPDATED"), ""));
+
+	// offset and limit count matching revisions only
+	PVTEST_CHECK(!strcmp(test_names(1, 1, "DONE"), "3"));
+	PVTEST_CHECK(!strcmp(test_names(1, 0, "DONE"), "3,5"));
+
+	// revisions without progress have an empty status
+	PVTEST_CHECK(!strcmp(test_names(0, 0, ""), "6"));
+
+	return 0;
+}
+
+static int test_changes(void)
+{
+	char path[PATH_MAX];
+
+	// as done by pv_storage_set_rev_progress()
+	PVTEST_CHECK(!test_rev("2", "DONE"));
+	pv_storage_catalog_update_rev("2");
+	PVTEST_CHECK(!strcmp(test_names(0, 0, "DONE"), "1,2,3,5"));
+
+	// new and removed revisions change the mtime of trails
+	test_tick();
+	PVTEST_CHECK(!test_rev("7", "DONE"));
+	pv_paths_storage_trail(path, PATH_MAX, "4");
+	PVTEST_CHECK(!pv_fs_path_remove(path, true));
+	PVTEST_CHECK(!strcmp(test_names(0, 0, NULL), "1,2,3,5,6,7"));
+
+	pv_paths_storage_trail(path, PATH_MAX, "6");
+	PVTEST_CHECK(!pv_fs_path_remove(path, true));
+	pv_storage_catalog_rm_rev("6");
+	PVTEST_CHECK(!strcmp(test_names(3, 2, NULL), "5,7"));
+
+	return 0;
+}
+
+static int test_reload(void)
+{
+	char path[PATH_MAX];
+	char *before, *after;
+
+	before = pv_storage_get_revisions_string(0, 0, NULL);
+	PVTEST_CHECK(before);
+
+	pv_storage_catalog_save();
+	pv_paths_storage_file(path, PATH_MAX, CATALOG_FNAME);
+	PVTEST_CHECK(pv_fs_path_exist(path));
+
+	// listed from the file, nothing changed on disk
+	pv_storage_catalog_free();
+	after = pv_storage_get_revisions_string(0, 0, NULL);
+	PVTEST_CHECK(after && !strcmp(before, after));
+	free(after);
+
+	// a file from before the revisions changed is brought up to date,
+	// progress saved behind our back is found by the mtime of .pv
+	test_tick();
+	PVTEST_CHECK(!test_rev("1", "ERROR"));
+	PVTEST_CHECK(!test_rev("8", "ERROR"));
+	pv_storage_catalog_free();
+	PVTEST_CHECK(!strcmp(test_names(0, 0, "ERROR"), "1,8"));
+
+	free(before);
+
+	return 0;
+}
+
+int main()
+{
+	const char *status[] = { "DONE", "ERROR", "DONE", "WONTGO", "DONE",
+				 NULL };
+	char rev[8];
+	int ret = 0;
+
+	if (!mkdtemp(dir)) {
+		printf("could not create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	for (int i = 0; i < 6; i++) {
+		snprintf(rev, sizeof(rev), "%d", i + 1);
+		if (test_rev(rev, status[i])) {
+			printf("could not create revision %s\n", rev);
+			ret = -1;
+		}
+	}
+
+	printf("=== list ===\n");
+	ret |= test_list();
+	printf("=== offset and limit ===\n");
+	ret |= test_offset_limit();
+	printf("=== status ===\n");
+	ret |= test_status();
+	printf("=== changes ===\n");
+	ret |= test_changes();
+	printf("=== reload ===\n");
+	ret |= test_reload();
+
+	pv_storage_catalog_free();
+	pv_fs_path_remove(dir, true);
+
+	printf("%s\n", ret ? "FAILED" : "OK");
+
+	return ret ? 1 : 0;
+}
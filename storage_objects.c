@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/limits.h>
+#include <sys/stat.h>
+
+#include "objects.h"
+#include "storage.h"
+#include "storage_objects.h"
+#include "paths.h"
+#include "utils/fs.h"
+#include "utils/str.h"
+
+#define MODULE_NAME "storage"
+#define pv_log(level, msg, ...) vlog(MODULE_NAME, level, msg, ##__VA_ARGS__)
+#include "log.h"
+
+static bool pv_storage_is_object_shard(const char *name)
+{
+	return strlen(name) == 2 && isxdigit(name[0]) && isxdigit(name[1]);
+}
+
+static bool pv_storage_is_dir(const char *dir, struct dirent *d)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (d->d_type != DT_UNKNOWN)
+		return d->d_type == DT_DIR;
+
+	SNPRINTF_WTRUNC(path, sizeof(path), "%s/%s", dir, d->d_name);
+
+	return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+int pv_storage_get_objects_dir(const char *dir, bool top,
+			       struct dl_list *objects)
+{
+	char path[PATH_MAX];
+	struct pv_path *o;
+	struct dirent *d;
+	int ret = 0;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return -1;
+
+	while ((d = readdir(dp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		if (pv_storage_is_dir(dir, d)) {
+			if (!top || !pv_storage_is_object_shard(d->d_name))
+				continue;
+
+			SNPRINTF_WTRUNC(path, sizeof(path), "%s/%s", dir,
+					d->d_name);
+			if (pv_storage_get_objects_dir(path, false, objects)) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		o = calloc(1, sizeof(struct pv_path));
+		if (!o) {
+			ret = -1;
+			break;
+		}
+		o->path = strdup(d->d_name);
+		dl_list_init(&o->list);
+		dl_list_add_tail(objects, &o->list);
+	}
+	closedir(dp);
+
+	return ret;
+}
+
+/*
+ * Names of the files in the object pool, both in their shards and still in
+ * the flat layout. pv_paths_storage_object() finds them by name either way.
+ */
+int pv_storage_get_objects(struct dl_list *objects)
+{
+	char path[PATH_MAX];
+
+	pv_paths_storage_object_flat(path, PATH_MAX, "");
+
+	return pv_storage_get_objects_dir(path, true, objects);
+}
+
+// shards are only created if PV_STORAGE_OBJECTS_SHARD is enabled
+void pv_storage_objects_init(void)
+{
+	char path[PATH_MAX];
+	char shard[3];
+
+	if (pv_config_get_bool(PV_STORAGE_OBJECTS_SHARD)) {
+		for (int i = 0; i < 256; i++) {
+			SNPRINTF_WTRUNC(shard, sizeof(shard), "%02x", i);
+			pv_paths_storage_object_flat(path, PATH_MAX, shard);
+			if (pv_fs_mkdir_p(path, 0755))
+				pv_log(WARN, "could not create %s: %s", path,
+				       strerror(errno));
+		}
+	}
+
+	pv_paths_storage_object_layout_init();
+}
+
+#define OBJECTS_MIGRATE_BATCH 64
+
+/*
+ * Moves objects left in the flat pool layout into their shards, a few at a
+ * time so the main loop is not held up. Renames keep the inode, so trail
+ * hard links are not affected. Nothing is moved while an update is in
+ * progress, as its objects paths were resolved already. Once the flat pool
+ * is empty, SHARDED_FNAME is left so later boots do not look there anymore.
+ */
+void pv_storage_objects_migrate(void)
+{
+	static bool migrated = false;
+	struct pantavisor *pv = pv_get_instance();
+	char dir[PATH_MAX], src[PATH_MAX], dst[PATH_MAX];
+	struct dirent *d;
+	int moved = 0;
+	DIR *dp;
+
+	if (migrated || pv->update ||
+	    !pv_config_get_bool(PV_STORAGE_OBJECTS_SHARD))
+		return;
+
+	pv_paths_storage_file(src, PATH_MAX, SHARDED_FNAME);
+	if (pv_fs_path_exist(src)) {
+		migrated = true;
+		return;
+	}
+
+	pv_paths_storage_object_flat(dir, PATH_MAX, "");
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	while ((d = readdir(dp)) && moved < OBJECTS_MIGRATE_BATCH) {
+		if (d->d_name[0] == '.' || strlen(d->d_name) < 2 ||
+		    pv_storage_is_dir(dir, d))
+			continue;
+
+		pv_paths_storage_object_flat(src, PATH_MAX, d->d_name);
+		SNPRINTF_WTRUNC(dst, sizeof(dst), "%s%.2s/%s", dir, d->d_name,
+				d->d_name);
+		if (rename(src, dst)) {
+			pv_log(WARN, "could not move %s to %s: %s", src, dst,
+			       strerror(errno));
+			continue;
+		}
+		moved++;
+	}
+	closedir(dp);
+
+	if (moved) {
+		pv_fs_path_sync(dir);
+		pv_log(DEBUG, "moved %d objects into their shards", moved);
+		return;
+	}
+
+	pv_paths_storage_file(src, PATH_MAX, SHARDED_FNAME);
+	if (pv_fs_file_save(src, "", 0444) < 0) {
+		pv_log(WARN, "could not save %s: %s", src, strerror(errno));
+		return;
+	}
+
+	pv_log(INFO, "object pool is sharded");
+	pv_paths_storage_object_set_sharded();
+	migrated = true;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2025 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PVTEST
+#define PVTEST
+#endif
+
+#include <unistd.h>
+
+#include "storage_objects.c"
+#include "updater.h"
+#include "utils/pvtest.h"
+
+#define TEST_OBJECTS (70)
+
+static char dir[] = "/tmp/pv-objects-XXXXXX";
+static bool test_shard = false;
+static struct pantavisor test_pv;
+
+char *pv_config_get_str(config_index_t ci)
+{
+	if (ci == PV_STORAGE_MNTPOINT)
+		return dir;
+	return "";
+}
+
+bool pv_config_get_bool(config_index_t ci)
+{
+	if (ci == PV_STORAGE_OBJECTS_SHARD)
+		return test_shard;
+	return false;
+}
+
+struct pantavisor *pv_get_instance(void)
+{
+	return &test_pv;
+}
+
+void __log(char *module, int level, const char *fmt, ...)
+{
+}
+
+// unique for each i, spread over the shards
+static void test_sha(char *sha, int i)
+{
+	snprintf(sha, 65, "%08x%056x", i * 0x9e3779b1u, i);
+}
+
+static int test_object(const char *path)
+{
+	return pv_fs_file_save(path, "object", 0644);
+}
+
+static bool test_path_is(const char *sha, const char *fmt)
+{
+	char path[PATH_MAX], want[PATH_MAX];
+
+	pv_paths_storage_object(path, PATH_MAX, sha);
+	snprintf(want, sizeof(want), fmt, dir, sha, sha);
+
+	return !strcmp(path, want);
+}
+
+static int test_count_objects(void)
+{
+	struct dl_list objects;
+	struct pv_path *o, *tmp;
+	int n = 0;
+
+	dl_list_init(&objects);
+	if (pv_storage_get_objects(&objects))
+		return -1;
+
+	dl_list_for_each_safe(o, tmp, &objects, struct pv_path, list)
+	{
+		dl_list_del(&o->list);
+		free(o->path);
+		free(o);
+		n++;
+	}
+
+	return n;
+}
+
+static int test_reset(bool shard)
+{
+	char path[PATH_MAX];
+
+	test_shard = shard;
+	pv_paths_storage_object_flat(path, PATH_MAX, "");
+	pv_fs_path_remove(path, true);
+	pv_paths_storage_file(path, PATH_MAX, SHARDED_FNAME);
+	pv_fs_path_remove(path, false);
+
+	pv_paths_storage_object_flat(path, PATH_MAX, "");
+	return pv_fs_mkdir_p(path, 0755);
+}
+
+static int test_flat(void)
+{
+	char sha[65], path[PATH_MAX];
+
+	PVTEST_CHECK(!test_reset(false));
+	pv_storage_objects_init();
+
+	pv_paths_storage_object_flat(path, PATH_MAX, "00");
+	PVTEST_CHECK(!pv_fs_path_exist(path));
+
+	// never sharded, objects are only looked for in the pool
+	test_sha(sha, 0);
+	PVTEST_CHECK(test_path_is(sha, "%s/objects/%s"));
+	pv_paths_storage_object(path, PATH_MAX, sha);
+	PVTEST_CHECK(!test_object(path));
+	PVTEST_CHECK(test_path_is(sha, "%s/objects/%s"));
+	PVTEST_CHECK(test_count_objects() == 1);
+
+	// and nothing is moved
+	pv_storage_objects_migrate();
+	PVTEST_CHECK(test_path_is(sha, "%s/objects/%s"));
+
+	return 0;
+}
+
+static int test_mixed(void)
+{
+	char flat[65], sharded[65], missing[65], path[PATH_MAX];
+
+	PVTEST_CHECK(!test_reset(true));
+	test_sha(flat, 1);
+	pv_paths_storage_object_flat(path, PATH_MAX, flat);
+	PVTEST_CHECK(!test_object(path));
+
+	pv_storage_objects_init();
+	pv_paths_storage_object_flat(path, PATH_MAX, "00");
+	PVTEST_CHECK(pv_fs_path_exist(path));
+	pv_paths_storage_object_flat(path, PATH_MAX, "ff");
+	PVTEST_CHECK(pv_fs_path_exist(path));
+
+	// objects are found where they are, new ones go to their shard
+	test_sha(sharded, 2);
+	pv_paths_storage_object(path, PATH_MAX, sharded);
+	PVTEST_CHECK(!test_object(path));
+	PVTEST_CHECK(test_path_is(sharded, "%s/objects/%.2s/%s"));
+	PVTEST_CHECK(test_path_is(flat, "%s/objects/%s"));
+	test_sha(missing, 3);
+	PVTEST_CHECK(test_path_is(missing, "%s/objects/%.2s/%s"));
+
+	// names too short to be sharded stay in the pool
+	PVTEST_CHECK(test_path_is("a", "%s/objects/%s"));
+
+	// both layouts are listed, other directories are not
+	pv_paths_storage_object_flat(path, PATH_MAX, "tmp");
+	PVTEST_CHECK(!pv_fs_mkdir_p(path, 0755));
+	PVTEST_CHECK(test_count_objects() == 2);
+
+	// a started migration is found even if sharding was disabled since
+	test_shard = false;
+	pv_paths_storage_object_layout_init();
+	PVTEST_CHECK(test_path_is(sharded, "%s/objects/%.2s/%s"));
+	PVTEST_CHECK(test_path_is(flat, "%s/objects/%s"));
+
+	return 0;
+}
+
+static int test_migrate(void)
+{
+	char sha[65], path[PATH_MAX], trail[PATH_MAX];
+	struct stat before, after;
+	int left;
+
+	PVTEST_CHECK(!test_reset(true));
+	for (int i = 0; i < TEST_OBJECTS; i++) {
+		test_sha(sha, i);
+		pv_paths_storage_object_flat(path, PATH_MAX, sha);
+		PVTEST_CHECK(!test_object(path));
+	}
+	pv_paths_storage_object_flat(path, PATH_MAX, ".hidden");
+	PVTEST_CHECK(!test_object(path));
+
+	// a trail hard link to the first object
+	test_sha(sha, 0);
+	pv_paths_storage_object_flat(path, PATH_MAX, sha);
+	pv_paths_storage_file(trail, PATH_MAX, "link");
+	PVTEST_CHECK(!link(path, trail));
+	PVTEST_CHECK(!stat(path, &before));
+
+	pv_storage_objects_init();
+
+	// nothing moves while an update is in progress
+	test_pv.update = calloc(1, sizeof(struct pv_update));
+	PVTEST_CHECK(test_pv.update);
+	pv_storage_objects_migrate();
+	PVTEST_CHECK(test_path_is(sha, "%s/objects/%s"));
+	free(test_pv.update);
+	test_pv.update = NULL;
+
+	// a batch at a time
+	pv_storage_objects_migrate();
+	left = 0;
+	for (int i = 0; i < TEST_OBJECTS; i++) {
+		test_sha(sha, i);
+		pv_paths_storage_object_flat(path, PATH_MAX, sha);
+		if (pv_fs_path_exist(path))
+			left++;
+	}
+	PVTEST_CHECK(left == TEST_OBJECTS - OBJECTS_MIGRATE_BATCH);
+
+	pv_storage_objects_migrate();
+	PVTEST_CHECK(test_count_objects() == TEST_OBJECTS + 1);
+	pv_paths_storage_file(path, PATH_MAX, SHARDED_FNAME);
+	PVTEST_CHECK(!pv_fs_path_exist(path));
+
+	// the pool is empty, it is marked as sharded
+	pv_storage_objects_migrate();
+	PVTEST_CHECK(pv_fs_path_exist(path));
+
+	for (int i = 0; i < TEST_OBJECTS; i++) {
+		test_sha(sha, i);
+		PVTEST_CHECK(test_path_is(sha, "%s/objects/%.2s/%s"));
+		pv_paths_storage_object(path, PATH_MAX, sha);
+		PVTEST_CHECK(pv_fs_path_exist(path));
+	}
+
+	// renamed, so the trail still links the same file
+	test_sha(sha, 0);
+	pv_paths_storage_object(path, PATH_MAX, sha);
+	PVTEST_CHECK(!stat(path, &after));
+	PVTEST_CHECK(before.st_ino == after.st_ino && after.st_nlink == 2);
+
+	// hidden files are left alone
+	pv_paths_storage_object_flat(path, PATH_MAX, ".hidden");
+	PVTEST_CHECK(pv_fs_path_exist(path));
+
+	// later boots do not look in the pool anymore
+	pv_paths_storage_object_layout_init();
+	test_sha(sha, TEST_OBJECTS);
+	pv_paths_storage_object_flat(path, PATH_MAX, sha);
+	PVTEST_CHECK(!test_object(path));
+	PVTEST_CHECK(test_path_is(sha, "%s/objects/%.2s/%s"));
+
+	return 0;
+}
+
+int main()
+{
+	int ret = 0;
+
+	if (!mkdtemp(dir)) {
+		printf("could not create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	printf("=== flat ===\n");
+	ret |= test_flat();
+	printf("=== mixed ===\n");
+	ret |= test_mixed();
+	printf("=== migrate ===\n");
+	ret |= test_migrate();
+
+	pv_fs_path_remove(dir, true);
+
+	printf("%s\n", ret ? "FAILED" : "OK");
+
+	return ret ? 1 : 0;
+}
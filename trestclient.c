@@ -33,6 +33,8 @@
 
 #include "trestclient.h"
 #include "pantahub.h"
+#include "utils/list.h"
+#include "utils/timer.h"
 #include "utils/tsh.h"
 #include "utils/str.h"
 
@@ -43,6 +45,27 @@
 #define PANTAVISOR_EXTERNAL_LOGIN_HANDLER_FMT "/btools/%s.login"
 #define PV_TRESTCLIENT_MAX_READ 4096
 
+/*
+ * Authenticated clients are shared by everyone talking to the same host with
+ * the same credentials, so the login token is not thrown away after each
+ * use. Requests still open their own connection, as libthttp does not keep
+ * them alive; object downloads, which are most of the traffic, go through
+ * httpconn.c instead. Unused clients are freed once they have been idle for
+ * PH_CLIENT_POOL_IDLE seconds.
+ */
+struct pv_trest_pool_entry {
+	char *key;
+	trest_ptr client;
+	int refs;
+	bool stale;
+	struct timer idle;
+	struct dl_list list;
+};
+
+static struct dl_list pool = DL_LIST_HEAD_INIT(pool);
+static pid_t pool_pid = 0;
+static int pool_len = 0;
+
 static struct trest_response *external_login_handler(trest_ptr self, void *data)
 {
 	char loginhandler_cmd[PATH_MAX];
@@ -260,3 +283,137 @@ trest_ptr pv_get_trest_client(struct pantavisor *pv, struct pv_connection *conn)
 err:
 	return NULL;
 }
+
+static void pv_trest_pool_entry_free(struct pv_trest_pool_entry *e)
+{
+	dl_list_del(&e->list);
+	pool_len--;
+
+	if (e->client)
+		trest_free(e->client);
+	if (e->key)
+		free(e->key);
+	free(e);
+}
+
+static void pv_trest_pool_check_pid(void)
+{
+	pid_t pid = getpid();
+
+	if (pool_pid == pid)
+		return;
+
+	// clients inherited through fork() share their sockets and TLS state
+	// with the parent, so they are forgotten without being closed
+	dl_list_init(&pool);
+	pool_len = 0;
+	pool_pid = pid;
+}
+
+static struct pv_trest_pool_entry *pv_trest_pool_search(trest_ptr client)
+{
+	struct pv_trest_pool_entry *e, *tmp;
+
+	dl_list_for_each_safe(e, tmp, &pool, struct pv_trest_pool_entry, list)
+	{
+		if (e->client == client)
+			return e;
+	}
+
+	return NULL;
+}
+
+trest_ptr pv_trest_client_get(struct pantavisor *pv,
+			      struct pv_connection *conn)
+{
+	struct pv_trest_pool_entry *e, *tmp;
+	trest_ptr client;
+	char key[PATH_MAX];
+	const char *prn = pv_config_get_str(PH_CREDS_PRN);
+
+	pv_trest_pool_check_pid();
+
+	SNPRINTF_WTRUNC(key, sizeof(key), "%s:%d:%s",
+			pv_config_get_str(PH_CREDS_HOST),
+			pv_config_get_int(PH_CREDS_PORT), prn ? prn : "");
+
+	dl_list_for_each_safe(e, tmp, &pool, struct pv_trest_pool_entry, list)
+	{
+		if (e->stale || strcmp(e->key, key))
+			continue;
+
+		e->refs++;
+		return e->client;
+	}
+
+	client = pv_get_trest_client(pv, conn);
+	if (!client)
+		return NULL;
+
+	// a full pool just hands out a client that is freed on release
+	if (pool_len >= pv_config_get_int(PH_CLIENT_POOL_SIZE))
+		return client;
+
+	e = calloc(1, sizeof(struct pv_trest_pool_entry));
+	if (!e)
+		return client;
+
+	e->key = strdup(key);
+	e->client = client;
+	e->refs = 1;
+	dl_list_init(&e->list);
+	dl_list_add_tail(&pool, &e->list);
+	pool_len++;
+
+	pv_log(DEBUG, "new client for %s added to pool (%d clients)", key,
+	       pool_len);
+
+	return client;
+}
+
+void pv_trest_client_put(trest_ptr client, bool stale)
+{
+	struct pv_trest_pool_entry *e;
+
+	if (!client)
+		return;
+
+	pv_trest_pool_check_pid();
+
+	e = pv_trest_pool_search(client);
+	if (!e) {
+		trest_free(client);
+		return;
+	}
+
+	// stale clients are not handed out again and go away with last user
+	if (stale)
+		e->stale = true;
+
+	if (--e->refs > 0)
+		return;
+
+	if (e->stale) {
+		pv_trest_pool_entry_free(e);
+		return;
+	}
+
+	timer_start(&e->idle, pv_config_get_int(PH_CLIENT_POOL_IDLE), 0,
+		    RELATIV_TIMER);
+}
+
+void pv_trest_client_expire(void)
+{
+	struct pv_trest_pool_entry *e, *tmp;
+
+	pv_trest_pool_check_pid();
+
+	dl_list_for_each_safe(e, tmp, &pool, struct pv_trest_pool_entry, list)
+	{
+		if (e->refs > 0 || !timer_current_state(&e->idle).fin)
+			continue;
+
+		pv_log(DEBUG, "freeing idle client for %s", e->key);
+		pv_trest_pool_entry_free(e);
+	}
+}
@@ -28,4 +28,9 @@
 trest_ptr pv_get_trest_client(struct pantavisor *pv,
 			      struct pv_connection *conn);
 
+trest_ptr pv_trest_client_get(struct pantavisor *pv,
+			      struct pv_connection *conn);
+void pv_trest_client_put(trest_ptr client, bool stale);
+void pv_trest_client_expire(void);
+
 #endif /* PV_TRESTCLIENT_H */
@@ -19,19 +19,32 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/statfs.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <mtd/mtd-user.h>
+#include <linux/fs.h>
 #include <inttypes.h>
+#include <stddef.h>
+#include <zlib.h>
 
 #include <thttp.h>
 #include <mbedtls/sha256.h>
@@ -39,10 +52,16 @@
 #include <jsmn/jsmnutil.h>
 
 #include "trestclient.h"
+#include "httpconn.h"
 #include "updater.h"
+#include "chunks.h"
 #include "paths.h"
+#include "resume.h"
 #include "utils/str.h"
 #include "utils/fs.h"
+#include "utils/tsh.h"
+#include "utils/pvsignals.h"
+#include "utils/pvzlib.h"
 #include "objects.h"
 #include "parser/parser.h"
 #include "bootloader.h"
@@ -63,6 +82,18 @@
 
 #define VOLATILE_TMP_OBJ_PATH "/tmp/object-XXXXXX"
 #define MMC_TMP_OBJ_FMT "%s.tmp"
+#define DELTA_OBJ_FMT "%s.delta"
+#define COMP_OBJ_FMT "%s.%s"
+
+// rebuilds an object from its base object and a zstd --patch-from patch
+#define DELTA_ZSTD_CMD "zstd -d -q -c --long=31 --patch-from=%s %s"
+#define COMP_ZSTD_CMD "zstd -d -q -c --long=31 %s"
+
+#define HTTP_STATUS_PARTIAL_CONTENT (206)
+#define HTTP_STATUS_RANGE (416)
+
+#define TRAIL_DOWNLOAD_MAX_JOBS (16)
+#define TRAIL_DOWNLOAD_POLL_MS (1000)
 
 typedef int (*token_iter_f)(void *d1, void *d2, char *buf, jsmntok_t *tok,
 			    int c);
@@ -148,7 +179,7 @@ static int trail_remote_init(struct pantavisor *pv)
 	if (pv->remote || !id)
 		return 0;
 
-	client = pv_get_trest_client(pv, NULL);
+	client = pv_trest_client_get(pv, NULL);
 
 	if (!client) {
 		pv_log(INFO, "unable to create device client");
@@ -192,7 +223,7 @@ static int trail_remote_init(struct pantavisor *pv)
 
 err:
 	if (client)
-		free(client);
+		pv_trest_client_put(client, status != TREST_AUTH_STATUS_OK);
 	if (remote)
 		free(remote);
 	if (endpoint_trail)
@@ -275,11 +306,15 @@ static void pv_update_free_progress(struct pv_update_progress *progress)
 		free(progress->logs);
 }
 
+static uint64_t trail_rate_get(bool *throttled);
+
 static void pv_update_fill_progress(struct pv_update_progress *progress,
 				    struct pv_update *update)
 {
 	struct pv_update_progress *p = progress;
 	struct pv_update *u = update;
+	uint64_t rate;
+	bool throttled;
 
 	SNPRINTF_WTRUNC(p->data, sizeof(p->data), "%d", u->retries);
 
@@ -428,8 +463,25 @@ static void pv_update_fill_progress(struct pv_update_progress *progress,
 		break;
 	case UPDATE_DOWNLOAD_PROGRESS:
 		SNPRINTF_WTRUNC(p->status, sizeof(p->status), "DOWNLOADING");
-		SNPRINTF_WTRUNC(p->msg, sizeof(p->msg), "Retry %d of %d",
-				update->retries, revision_retries);
+		rate = trail_rate_get(&throttled);
+		if (pv_config_get_int(PV_UPDATER_DOWNLOAD_RATE) > 0)
+			SNPRINTF_WTRUNC(
+				p->msg, sizeof(p->msg),
+				"Retry %d of %d, %s at %ju of %d KiB/s",
+				update->retries, revision_retries,
+				throttled ? "throttled" : "downloading",
+				(uintmax_t)(rate / 1024),
+				pv_config_get_int(PV_UPDATER_DOWNLOAD_RATE));
+		else
+			SNPRINTF_WTRUNC(p->msg, sizeof(p->msg),
+					"Retry %d of %d", update->retries,
+					revision_retries);
+		p->progress = 0;
+		p->total = &update->total;
+		break;
+	case UPDATE_DOWNLOAD_PAUSED:
+		SNPRINTF_WTRUNC(p->status, sizeof(p->status), "QUEUED");
+		SNPRINTF_WTRUNC(p->msg, sizeof(p->msg), "%s", u->msg);
 		p->progress = 0;
 		p->total = &update->total;
 		break;
@@ -986,19 +1038,15 @@ static void trail_log_trest_err(trest_response_ptr tres)
 	__trail_log_resp_err(tres->body, tres->json_tokv, tres->json_tokc);
 }
 
-#define SHA256_STR_SIZE ((256 / 4) + 1)
-
+// valid tells if the object matches its id, see trail_put_objects
 static int trail_put_object(struct pantavisor *pv, struct pv_object *o,
-			    const char **crtfiles)
+			    bool valid, const char **crtfiles)
 {
 	int ret = -1;
-	int fd, bytes;
-	int size, pos, i, str_size;
+	int fd;
+	int size, str_size;
 	char *signed_puturl = NULL;
-	char sha_str[SHA256_STR_SIZE];
 	char body[512];
-	unsigned char buf[4096];
-	unsigned char local_sha[32];
 	struct stat st;
 	trest_request_ptr treq = 0;
 	trest_response_ptr tres = 0;
@@ -1018,37 +1066,18 @@ static int trail_put_object(struct pantavisor *pv, struct pv_object *o,
 	stat(o->objpath, &st);
 	size = st.st_size;
 
-	mbedtls_sha256_context sha256_ctx;
-
-	mbedtls_sha256_init(&sha256_ctx);
-	mbedtls_sha256_starts(&sha256_ctx, 0);
-
-	while ((bytes = read(fd, buf, 4096)) > 0) {
-		mbedtls_sha256_update(&sha256_ctx, buf, bytes);
-	}
-
-	mbedtls_sha256_finish(&sha256_ctx, local_sha);
-	mbedtls_sha256_free(&sha256_ctx);
-
-	pos = 0;
-	i = 0;
-	while (i < 32) {
-		pos += snprintf(sha_str + pos, 3, "%02x", local_sha[i]);
-		i++;
-	}
-
 	SNPRINTF_WTRUNC(body, sizeof(body),
 			"{ \"objectname\": \"%s\","
 			" \"size\": \"%d\","
 			" \"sha256sum\": \"%s\""
 			" }",
-			o->name, size, sha_str);
+			o->name, size, o->id);
 
 	pv_log(INFO, "syncing '%s'", o->id);
 
-	if (strncmp(o->id, sha_str, SHA256_STR_SIZE)) {
+	if (!valid) {
 		pv_log(INFO,
-		       "sha256 mismatch, probably writable image, skipping",
+		       "sha256 mismatch in %s, probably writable image, skipping",
 		       o->objpath);
 		goto out;
 	}
@@ -1178,8 +1207,10 @@ out:
 
 static int trail_put_objects(struct pantavisor *pv)
 {
-	int ret = 0;
+	int ret = 0, len = 0;
+	bool valid;
 	struct pv_object *curr = NULL;
+	struct pv_storage_checksum *files;
 	const char **crtfiles = pv_ph_get_certs(pv);
 
 	pv_objects_iter_begin(pv->state, curr)
@@ -1190,15 +1221,39 @@ static int trail_put_objects(struct pantavisor *pv)
 
 	pv_log(DEBUG, "first boot: %d objects found, syncing", ret);
 
+	files = calloc(ret, sizeof(struct pv_storage_checksum));
+	if (!files)
+		return ret;
+
+	// hash all objects that are still to be pushed in one batch
+	pv_objects_iter_begin(pv->state, curr)
+	{
+		if (curr->uploaded)
+			continue;
+		files[len].path = curr->objpath;
+		files[len].checksum = curr->id;
+		len++;
+	}
+	pv_objects_iter_end;
+
+	if (pv_storage_validate_files_checksum(files, len) < 0)
+		goto out;
+
 	// push all
+	len = 0;
 	pv_objects_iter_begin(pv->state, curr)
 	{
-		if (trail_put_object(pv, curr, crtfiles) < 0)
+		valid = true;
+		if (!curr->uploaded)
+			valid = !files[len++].ret;
+		if (trail_put_object(pv, curr, valid, crtfiles) < 0)
 			break;
 		ret--;
 	}
 	pv_objects_iter_end;
 
+out:
+	free(files);
 	return ret;
 }
 
@@ -1282,7 +1337,8 @@ int pv_updater_check_for_updates(struct pantavisor *pv)
 	}
 
 	// if an update is going, we might come from a download retry
-	if (pv->update && pv->update->status == UPDATE_RETRY_DOWNLOAD)
+	if (pv->update && (pv->update->status == UPDATE_RETRY_DOWNLOAD ||
+			   pv->update->status == UPDATE_DOWNLOAD_PAUSED))
 		return 1;
 
 	// if claimed and synced, go check for new updates directly
@@ -1321,6 +1377,10 @@ static int pv_update_check_download_retry(struct pv_update *update)
 	if (!update)
 		return -1;
 
+	// waiting for the download window does not consume retries
+	if (update->status == UPDATE_DOWNLOAD_PAUSED)
+		return 0;
+
 	struct timer_state timer_state =
 		timer_current_state(&update->retry_timer);
 
@@ -1356,6 +1416,8 @@ static void pv_trail_remote_free(struct trail_remote *trail)
 		free(trail->endpoint_trail_pending);
 	if (trail->endpoint_trail_new)
 		free(trail->endpoint_trail_new);
+	if (trail->client)
+		pv_trest_client_put(trail->client, false);
 
 	free(trail);
 }
@@ -1418,6 +1480,8 @@ int pv_update_finish(struct pantavisor *pv)
 		pv_update_set_status(u, UPDATE_UPDATED);
 		break;
 	// WONTGO
+	case UPDATE_DOWNLOAD_PAUSED:
+		return ret;
 	case UPDATE_RETRY_DOWNLOAD:
 		if (u->retries <= pv_config_get_int(PV_REVISION_RETRIES))
 			return ret;
@@ -1463,6 +1527,85 @@ out:
 	return ret;
 }
 
+/*
+ * The hub can offer a patch against an object we already have instead of the
+ * whole object. Only patches that say they are zstd are understood, anything
+ * else is ignored and the object is downloaded in full.
+ */
+static void trail_download_get_delta_meta(struct pv_object *o,
+					  trest_response_ptr res)
+{
+	char *format, *size;
+
+	format = pv_json_get_value(res->body, "delta-format", res->json_tokv,
+				   res->json_tokc);
+	if (!format) {
+		if (strstr(res->body, "\"delta-base\"")) {
+			pv_log(DEBUG, "ignoring delta without a format");
+		}
+		return;
+	}
+	if (strcmp(format, "zstd")) {
+		pv_log(DEBUG, "ignoring delta in unknown format '%s'", format);
+		free(format);
+		return;
+	}
+	free(format);
+
+	o->delta_base = pv_json_get_value(res->body, "delta-base",
+					  res->json_tokv, res->json_tokc);
+	o->delta_sha256 = pv_json_get_value(res->body, "delta-sha256sum",
+					    res->json_tokv, res->json_tokc);
+	o->delta_geturl = pv_json_get_value(res->body, "delta-signed-geturl",
+					    res->json_tokv, res->json_tokc);
+	if (o->delta_geturl)
+		o->delta_geturl =
+			unescape_utf8_to_apvii(o->delta_geturl, "\\u0026", '&');
+
+	size = pv_json_get_value(res->body, "delta-size", res->json_tokv,
+				 res->json_tokc);
+	if (size) {
+		o->delta_size = atoll(size);
+		free(size);
+	}
+}
+
+// a compressed copy of the object, gzip or zstd, can be offered too
+static void trail_download_get_comp_meta(struct pv_object *o,
+					 trest_response_ptr res)
+{
+	char *size;
+
+	o->comp_format = pv_json_get_value(res->body, "compressed-format",
+					   res->json_tokv, res->json_tokc);
+	if (!o->comp_format)
+		return;
+
+	if (strcmp(o->comp_format, "gzip") && strcmp(o->comp_format, "zstd")) {
+		pv_log(DEBUG, "ignoring compressed object in format '%s'",
+		       o->comp_format);
+		free(o->comp_format);
+		o->comp_format = NULL;
+		return;
+	}
+
+	o->comp_sha256 = pv_json_get_value(res->body, "compressed-sha256sum",
+					   res->json_tokv, res->json_tokc);
+	o->comp_geturl = pv_json_get_value(res->body,
+					   "compressed-signed-geturl",
+					   res->json_tokv, res->json_tokc);
+	if (o->comp_geturl)
+		o->comp_geturl =
+			unescape_utf8_to_apvii(o->comp_geturl, "\\u0026", '&');
+
+	size = pv_json_get_value(res->body, "compressed-size", res->json_tokv,
+				 res->json_tokc);
+	if (size) {
+		o->comp_size = atoll(size);
+		free(size);
+	}
+}
+
 static int trail_download_get_meta(struct pantavisor *pv, struct pv_object *o)
 {
 	int ret = 0;
@@ -1517,6 +1660,20 @@ static int trail_download_get_meta(struct pantavisor *pv, struct pv_object *o)
 	url = unescape_utf8_to_apvii(url, "\\u0026", '&');
 	o->geturl = url;
 
+	trail_download_get_delta_meta(o, res);
+
+	o->chunks_geturl = pv_json_get_value(res->body, "chunks-signed-geturl",
+					     res->json_tokv, res->json_tokc);
+	if (o->chunks_geturl)
+		o->chunks_geturl = unescape_utf8_to_apvii(o->chunks_geturl,
+							  "\\u0026", '&');
+	o->chunks_sha256 = pv_json_get_value(res->body, "chunks-sha256sum",
+					     res->json_tokv, res->json_tokc);
+	o->chunks_store = pv_json_get_value(res->body, "chunks-store-url",
+					    res->json_tokv, res->json_tokc);
+
+	trail_download_get_comp_meta(o, res);
+
 	// FIXME:
 	// if (verify_url(url)) ret = 1;
 	ret = 1;
@@ -1550,21 +1707,303 @@ static int obj_is_kernel_pvk(struct pantavisor *pv, struct pv_object *obj)
 	return 0;
 }
 
+/*
+ * PV_UPDATER_DOWNLOAD_WINDOW restricts downloads to a daily "HH:MM-HH:MM"
+ * window in local time; the window can wrap around midnight. Returns the
+ * seconds left until the window opens, or 0 if downloads are allowed now.
+ */
+static int trail_download_window_wait(void)
+{
+	const char *window = pv_config_get_str(PV_UPDATER_DOWNLOAD_WINDOW);
+	int sh, sm, eh, em, start, end, now;
+	struct tm tm;
+	time_t t;
+
+	if (!window || !*window)
+		return 0;
+
+	if (sscanf(window, "%d:%d-%d:%d", &sh, &sm, &eh, &em) != 4 ||
+	    sh < 0 || sh > 23 || sm < 0 || sm > 59 || eh < 0 || eh > 23 ||
+	    em < 0 || em > 59) {
+		pv_log(WARN, "ignoring bad download window '%s'", window);
+		return 0;
+	}
+
+	t = time(NULL);
+	if (!localtime_r(&t, &tm))
+		return 0;
+
+	start = sh * 3600 + sm * 60;
+	end = eh * 3600 + em * 60;
+	now = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+
+	if (start == end)
+		return 0;
+
+	if (start < end) {
+		if (now >= start && now < end)
+			return 0;
+	} else if (now >= start || now < end)
+		return 0;
+
+	return now < start ? start - now : 24 * 3600 - now + start;
+}
+
+static bool trail_download_window_closed(struct pv_update *u)
+{
+	char msg[UPDATE_PROGRESS_STATUS_MSG_SIZE];
+	int wait = trail_download_window_wait();
+
+	if (!wait)
+		return false;
+
+	// partial objects and their resume files are kept for later
+	pv_log(INFO, "download window closed, opens in %d seconds", wait);
+	SNPRINTF_WTRUNC(msg, sizeof(msg),
+			"Download window %s closed, opens in %d minutes",
+			pv_config_get_str(PV_UPDATER_DOWNLOAD_WINDOW),
+			(wait + 59) / 60);
+	pv_update_set_status_msg(u, UPDATE_DOWNLOAD_PAUSED, msg);
+
+	return true;
+}
+
 struct progress_update {
 	struct pv_update *u;
 	struct pv_object *o;
+	// data is hashed while it is still in the page cache
+	struct pv_resume *hash;
+	int fd;
+};
+
+// bytes downloaded by each running job, shared with the job processes
+static uint64_t *trail_download_slots = NULL;
+// slot of the current job process, -1 in the main process
+static int trail_download_slot = -1;
+// set by a job process that ran out of space, only the parent sets status
+static bool trail_download_no_space = false;
+
+/*
+ * Token bucket for PV_UPDATER_DOWNLOAD_RATE (KiB/s). It lives in shared
+ * memory, so the download jobs draw from the same bucket whatever number of
+ * them is running. Whoever overdraws it sleeps in the progress callback,
+ * which stalls thttp's reads and lets TCP flow control slow down the sender.
+ * The bytes drawn in the last second are kept to report the current rate.
+ */
+struct trail_rate {
+	uint64_t rate;
+	int64_t tokens;
+	int64_t last;
+	int64_t throttled;
+	int64_t period;
+	uint64_t period_bytes;
+	uint64_t current;
 };
 
+static struct trail_rate *trail_rate = NULL;
+
+static int64_t trail_rate_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void trail_rate_init(void)
+{
+	int rate = pv_config_get_int(PV_UPDATER_DOWNLOAD_RATE);
+
+	if (!trail_rate) {
+		trail_rate = mmap(NULL, sizeof(struct trail_rate),
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (trail_rate == MAP_FAILED) {
+			trail_rate = NULL;
+			pv_log(WARN, "could not map download rate limiter: %s",
+			       strerror(errno));
+			return;
+		}
+	}
+
+	memset(trail_rate, 0, sizeof(struct trail_rate));
+	if (rate <= 0)
+		return;
+
+	trail_rate->rate = (uint64_t)rate * 1024;
+	trail_rate->tokens = trail_rate->rate;
+	trail_rate->last = trail_rate_now();
+	trail_rate->period = trail_rate->last;
+}
+
+// adds the tokens for the time elapsed since whoever refilled last
+static void trail_rate_refill(struct trail_rate *r, int64_t now)
+{
+	int64_t last = __atomic_load_n(&r->last, __ATOMIC_RELAXED);
+	int64_t elapsed, tokens;
+
+	if (now <= last || !__atomic_compare_exchange_n(&r->last, &last, now,
+							false, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+		return;
+
+	// allow bursts of up to one second worth of data
+	elapsed = now - last;
+	if (elapsed > 1000000LL)
+		elapsed = 1000000LL;
+	tokens = __atomic_add_fetch(&r->tokens,
+				    elapsed * (int64_t)r->rate / 1000000LL,
+				    __ATOMIC_RELAXED);
+	while (tokens > (int64_t)r->rate &&
+	       !__atomic_compare_exchange_n(&r->tokens, &tokens, r->rate, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void trail_rate_account(struct trail_rate *r, int64_t now,
+			       ssize_t bytes)
+{
+	int64_t period = __atomic_load_n(&r->period, __ATOMIC_RELAXED);
+	uint64_t total;
+
+	total = __atomic_add_fetch(&r->period_bytes, bytes, __ATOMIC_RELAXED);
+	if (now - period < 1000000LL ||
+	    !__atomic_compare_exchange_n(&r->period, &period, now, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_sub_fetch(&r->period_bytes, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->current, total * 1000000LL / (now - period),
+			 __ATOMIC_RELAXED);
+}
+
+static void trail_rate_throttle(ssize_t bytes)
+{
+	struct trail_rate *r = trail_rate;
+	int64_t now, wait;
+
+	if (!r || !r->rate || bytes <= 0)
+		return;
+
+	now = trail_rate_now();
+	trail_rate_refill(r, now);
+	trail_rate_account(r, now, bytes);
+
+	wait = __atomic_sub_fetch(&r->tokens, bytes, __ATOMIC_RELAXED);
+	if (wait >= 0)
+		return;
+
+	// sleep in slices so the main process keeps kicking the watchdog
+	wait = -wait * 1000000LL / (int64_t)r->rate;
+	while (wait > 0) {
+		usleep(wait > 1000000LL ? 1000000 : wait);
+		wait -= 1000000LL;
+		if (trail_download_slot < 0)
+			pv_wdt_kick();
+	}
+	__atomic_store_n(&r->throttled, trail_rate_now(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the download rate in B/s measured over the last second, and
+ * whether any download had to wait for the limiter during that time.
+ */
+static uint64_t trail_rate_get(bool *throttled)
+{
+	struct trail_rate *r = trail_rate;
+	int64_t now = trail_rate_now();
+
+	*throttled = false;
+	if (!r || !r->rate)
+		return 0;
+
+	*throttled = now - __atomic_load_n(&r->throttled, __ATOMIC_RELAXED) <
+		     2000000LL;
+
+	// nothing came in for a while
+	if (now - __atomic_load_n(&r->period, __ATOMIC_RELAXED) > 2000000LL)
+		return 0;
+
+	return __atomic_load_n(&r->current, __ATOMIC_RELAXED);
+}
+
+// patches can only be applied if we still have the object they are against
+static bool trail_delta_usable(struct pv_object *o)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!o->delta_base || !o->delta_geturl || !o->delta_sha256 ||
+	    o->delta_size <= 0)
+		return false;
+
+	pv_paths_storage_object(path, PATH_MAX, o->delta_base);
+
+	return !stat(path, &st);
+}
+
+static bool trail_comp_usable(struct pv_object *o)
+{
+	return o->comp_format && o->comp_geturl && o->comp_sha256 &&
+	       o->comp_size > 0;
+}
+
+/*
+ * Picks the file an object is downloaded into, in the same order as
+ * trail_fetch_object() tries them, and returns how many bytes go into it.
+ * Chunked objects are downloaded into many files in the chunk store, path
+ * is left empty and only the missing chunks are counted.
+ */
+static off_t trail_fetch_target(struct pantavisor *pv, struct pv_object *o,
+				char *path, size_t len)
+{
+	path[0] = '\0';
+
+	if (!obj_is_kernel_pvk(pv, o)) {
+		if (trail_delta_usable(o)) {
+			SNPRINTF_WTRUNC(path, len, DELTA_OBJ_FMT, o->objpath);
+			return o->delta_size;
+		}
+		if (o->chunks_index)
+			return o->chunks_size;
+		if (trail_comp_usable(o)) {
+			SNPRINTF_WTRUNC(path, len, COMP_OBJ_FMT, o->objpath,
+					o->comp_format);
+			return o->comp_size;
+		}
+	}
+
+	SNPRINTF_WTRUNC(path, len, "%s", o->objpath);
+	return o->size;
+}
+
 static uint64_t get_update_size(struct pv_update *u)
 {
+	struct pantavisor *pv = pv_get_instance();
 	uint64_t size = 0;
+	off_t obj_size;
 	struct stat st;
 	struct pv_object *curr = NULL;
 
+	char obj_path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+
 	pv_objects_iter_begin(u->pending, curr)
 	{
-		if (stat(curr->objpath, &st) < 0)
-			size += curr->size;
+		if (stat(curr->objpath, &st) == 0)
+			continue;
+
+		obj_size = trail_fetch_target(pv, curr, obj_path,
+					      sizeof(obj_path));
+		size += obj_size;
+		if (!obj_path[0])
+			continue;
+
+		// partial downloads are resumed, only count what is left
+		SNPRINTF_WTRUNC(tmp_path, sizeof(tmp_path), MMC_TMP_OBJ_FMT,
+				obj_path);
+		if (stat(tmp_path, &st) == 0 && st.st_size <= obj_size)
+			size -= st.st_size;
 	}
 	pv_objects_iter_end;
 
@@ -1588,38 +2027,121 @@ static void trail_download_object_progress(ssize_t written, ssize_t chunk_size,
 		return;
 	}
 
+	if (pu->hash && pv_resume_update(pu->hash, pu->fd))
+		pv_log(WARN, "could not hash object %s: %s", o->name,
+		       strerror(errno));
+
+	trail_rate_throttle(chunk_size);
+
+	// job processes report to the scheduler instead
+	if (trail_download_slot >= 0) {
+		trail_download_slots[trail_download_slot] += chunk_size;
+		return;
+	}
+
 	u->total.total_downloaded += chunk_size;
 	pv_update_set_status(u, UPDATE_DOWNLOAD_PROGRESS);
 }
 
-static int trail_download_object(struct pantavisor *pv, struct pv_object *obj,
-				 const char **crtfiles)
+static bool trail_use_volatile_tmp(void)
 {
-	int ret = 0;
-	int volatile_tmp_fd = -1, fd = -1, obj_fd = -1;
-	int bytes, n;
-	int is_kernel_pvk;
-	int use_volatile_tmp = 0;
+	return pv_config_get_bool(PV_UPDATER_USE_TMP_OBJECTS) &&
+	       (!strcmp(pv_config_get_str(PV_STORAGE_FSTYPE), "jffs2") ||
+		!strcmp(pv_config_get_str(PV_STORAGE_FSTYPE), "ubifs"));
+}
+
+// reserves the blocks of a staged object without changing its size
+static int trail_reserve(int fd, off_t size)
+{
+	if (size <= 0 || !fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size))
+		return 0;
+
+	// not every filesystem can do it, they will fail when writing
+	if (errno == EOPNOTSUPP || errno == ENOSYS)
+		return 0;
+
+	return -1;
+}
+
+/*
+ * Opens a file to stage an object that is not downloaded but built locally.
+ * Such files cannot be resumed, so they are unnamed where the filesystem
+ * supports it and a crash does not leave them behind.
+ */
+static int trail_stage_open(struct pv_object *obj, char *tmp_path,
+			    size_t size, bool *anon)
+{
+	char dir[PATH_MAX];
+	int fd = -1;
+
+	SNPRINTF_WTRUNC(tmp_path, size, MMC_TMP_OBJ_FMT, obj->objpath);
+	pv_resume_remove(tmp_path);
+
+	*anon = false;
+	if (!access("/proc/self/fd", F_OK)) {
+		SNPRINTF_WTRUNC(dir, sizeof(dir), "%s", obj->objpath);
+		fd = open(dirname(dir), O_TMPFILE | O_RDWR, 0644);
+	}
+
+	if (fd >= 0) {
+		*anon = true;
+		// give the space reserved for the named file back
+		pv_fs_path_remove(tmp_path, false);
+	} else {
+		fd = open(tmp_path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	}
+
+	if (fd < 0) {
+		pv_log(ERROR, "open failed for %s: %s", tmp_path,
+		       strerror(errno));
+		return -1;
+	}
+
+	if (trail_reserve(fd, obj->size)) {
+		pv_log(ERROR, "could not reserve %jd bytes for %s: %s",
+		       (intmax_t)obj->size, obj->id, strerror(errno));
+		close(fd);
+		if (!*anon)
+			pv_fs_path_remove(tmp_path, false);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int trail_stage_commit(int fd, const char *tmp_path, bool anon,
+			      const char *obj_path)
+{
+	char proc_path[64];
+
+	fsync(fd);
+
+	if (!anon)
+		return pv_fs_path_rename(tmp_path, obj_path);
+
+	SNPRINTF_WTRUNC(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, proc_path, AT_FDCWD, obj_path,
+		   AT_SYMLINK_FOLLOW))
+		return -1;
+
+	pv_fs_path_sync(obj_path);
+	return 0;
+}
+
+/*
+ * Builds a GET request for an object url. Free with
+ * trail_download_request_free().
+ */
+static thttp_request_t *trail_download_request_new(const char *url,
+						   const char **crtfiles)
+{
+	int n;
 	int size = -1;
-	char *tmp_sha;
 	char *host = 0;
-	char *start = 0, *port = 0, *end = 0;
-	char mmc_tmp_obj_path[PATH_MAX];
-	char volatile_tmp_obj_path[] = VOLATILE_TMP_OBJ_PATH;
-	unsigned char buf[4096];
-	unsigned char cloud_sha[32] = { 0 };
-	unsigned char local_sha[32];
-	struct stat st;
-	mbedtls_sha256_context sha256_ctx;
-	thttp_response_t *res = 0;
+	const char *start = 0, *port = 0;
+	char *end = 0;
 	thttp_request_tls_t *tls_req = 0;
 	thttp_request_t *req = 0;
-	struct progress_update progress_update = {
-		.u = pv->update,
-		.o = obj,
-	};
-	if (!obj)
-		goto out;
 
 	tls_req = thttp_request_tls_new_0();
 	tls_req->crtfiles = (char **)crtfiles;
@@ -1631,26 +2153,14 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj,
 	req->proto = THTTP_PROTO_HTTP;
 	req->proto_version = THTTP_PROTO_VERSION_10;
 
-	is_kernel_pvk = obj_is_kernel_pvk(pv, obj);
-	if (!is_kernel_pvk && stat(obj->objpath, &st) == 0) {
-		pv_log(DEBUG, "file exists (%s)", obj->objpath);
-		ret = 1;
-		goto out;
-	}
-
-	if (obj->geturl == NULL) {
-		pv_log(INFO, "there is no get url defined");
-		goto out;
-	}
-
 	// SSL is mandatory
-	if (strncmp(obj->geturl, "https://", 8) != 0) {
-		pv_log(INFO, "object url (%s) is invalid", obj->geturl);
-		goto out;
+	if (strncmp(url, "https://", 8) != 0) {
+		pv_log(INFO, "object url (%s) is invalid", url);
+		goto err;
 	}
 	req->port = 443;
 
-	start = obj->geturl + 8;
+	start = url + 8;
 	port = strchr(start, ':');
 	if (port) {
 		int p = strtol(++port, &end, 0);
@@ -1691,15 +2201,117 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj,
 
 	req->path = end;
 
-	if (pv_config_get_bool(PV_UPDATER_USE_TMP_OBJECTS) &&
-	    (!strcmp(pv_config_get_str(PV_STORAGE_FSTYPE), "jffs2") ||
-	     !strcmp(pv_config_get_str(PV_STORAGE_FSTYPE), "ubifs")))
-		use_volatile_tmp = 1;
+	return req;
 
-	// temporary path where we will store the file until validated
-	SNPRINTF_WTRUNC(mmc_tmp_obj_path, sizeof(mmc_tmp_obj_path),
-			MMC_TMP_OBJ_FMT, obj->objpath);
-	obj_fd = open(mmc_tmp_obj_path, O_CREAT | O_RDWR, 0644);
+err:
+	thttp_request_free(req);
+	return NULL;
+}
+
+static void trail_download_request_free(thttp_request_t *req)
+{
+	if (!req)
+		return;
+
+	if (req->host)
+		free(req->host);
+	thttp_request_free(req);
+}
+
+/*
+ * Objects are fetched through kept-alive connections unless there is a
+ * proxy in between. libthttp is used then, or if no request could be sent
+ * that way. Returns as pv_httpconn_get_file() does.
+ */
+static int trail_download_get(thttp_request_t *req, const char *url,
+			      const char **crtfiles, off_t offset, int fd,
+			      struct progress_update *pu, char *err,
+			      int err_len)
+{
+	char range[64];
+	char *headers[] = { range };
+	thttp_response_t *res;
+	int code;
+
+	if (!req->host_proxy) {
+		code = pv_httpconn_get_file(url, crtfiles, offset, fd,
+					    trail_download_object_progress, pu,
+					    err, err_len);
+		if (code >= 0)
+			return code;
+		lseek(fd, offset, SEEK_SET);
+	}
+
+	if (offset) {
+		SNPRINTF_WTRUNC(range, sizeof(range), "Range: bytes=%jd-",
+				(intmax_t)offset);
+		thttp_add_headers(req, headers, 1);
+	}
+
+	res = thttp_request_do_file_with_cb(
+		req, fd, trail_download_object_progress, pu);
+	if (!res)
+		return -1;
+
+	code = res->code;
+	snprintf(err, err_len, "%s", res->body ? res->body : "");
+	thttp_response_free(res);
+
+	return code;
+}
+
+static int trail_download_object(struct pantavisor *pv, struct pv_object *obj,
+				 const char **crtfiles)
+{
+	int ret = 0;
+	int volatile_tmp_fd = -1, fd = -1, obj_fd = -1;
+	int is_kernel_pvk;
+	int use_volatile_tmp = 0;
+	char *tmp_sha;
+	char mmc_tmp_obj_path[PATH_MAX];
+	char volatile_tmp_obj_path[] = VOLATILE_TMP_OBJ_PATH;
+	int resumable = 0;
+	int code;
+	char err[256];
+	unsigned char cloud_sha[32] = { 0 };
+	unsigned char local_sha[32];
+	struct stat st;
+	struct pv_resume resume;
+	thttp_request_t *req = 0;
+	struct progress_update progress_update = {
+		.u = pv->update,
+		.o = obj,
+	};
+
+	// freed on the way out, whatever path is taken
+	resume.len = 0;
+	mbedtls_sha256_init(&resume.ctx);
+
+	if (!obj)
+		goto out;
+
+	is_kernel_pvk = obj_is_kernel_pvk(pv, obj);
+	if (!is_kernel_pvk && stat(obj->objpath, &st) == 0) {
+		pv_log(DEBUG, "file exists (%s)", obj->objpath);
+		ret = 1;
+		goto out;
+	}
+
+	if (obj->geturl == NULL) {
+		pv_log(INFO, "there is no get url defined");
+		goto out;
+	}
+
+	req = trail_download_request_new(obj->geturl, crtfiles);
+	if (!req)
+		goto out;
+
+	use_volatile_tmp = trail_use_volatile_tmp();
+
+	// temporary path where we will store the file until validated
+	SNPRINTF_WTRUNC(mmc_tmp_obj_path, sizeof(mmc_tmp_obj_path),
+			MMC_TMP_OBJ_FMT, obj->objpath);
+	obj_fd = open(mmc_tmp_obj_path, O_CREAT | O_RDWR, 0644);
 	if (obj_fd < 0) {
 		pv_log(ERROR, "open failed for %s: %s", mmc_tmp_obj_path,
 		       strerror(errno));
@@ -1722,119 +2334,1097 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj,
 		fd = volatile_tmp_fd;
 	}
 
-	// download to tmp
-	lseek(fd, 0, SEEK_SET);
-	pv_log(INFO, "downloading object to tmp path (%s)", mmc_tmp_obj_path);
-	res = thttp_request_do_file_with_cb(
-		req, fd, trail_download_object_progress, &progress_update);
-	if (!res) {
-		pv_log(WARN,
-		       "'%s' could not be downloaded: could not be initialized",
-		       obj->id);
-		pv_fs_path_remove(mmc_tmp_obj_path, false);
+	// only downloads straight to storage can be resumed
+	resumable = !use_volatile_tmp && !is_kernel_pvk;
+	if (resumable)
+		pv_resume_load(&resume, mmc_tmp_obj_path, fd);
+	else
+		pv_resume_reset(&resume);
+
+	// anything after the resume point did not make it to disk for sure
+	if (resumable && ftruncate(fd, resume.len)) {
+		pv_log(ERROR, "could not truncate %s: %s", mmc_tmp_obj_path,
+		       strerror(errno));
 		goto out;
-	} else if (!res->code) {
-		pv_log(WARN, "'%s' could not be downloaded: got no response",
-		       obj->id);
-		pv_fs_path_remove(mmc_tmp_obj_path, false);
+	}
+
+	// better fail now than after downloading most of it, the truncate
+	// above would have released an earlier reservation
+	if (!is_kernel_pvk && trail_reserve(obj_fd, obj->size)) {
+		char msg[UPDATE_PROGRESS_STATUS_MSG_SIZE];
+
+		pv_log(ERROR, "could not reserve %jd bytes for %s: %s",
+		       (intmax_t)obj->size, obj->id, strerror(errno));
+		SNPRINTF_WTRUNC(msg, sizeof(msg),
+				"Could not reserve %jd B for object %s",
+				(intmax_t)obj->size, obj->id);
+		if (trail_download_slot >= 0)
+			trail_download_no_space = true;
+		else
+			pv_update_set_status_msg(pv->update, UPDATE_NO_SPACE,
+						 msg);
+		// nothing to resume, do not leave an empty file behind
+		if (!resume.len) {
+			pv_fs_path_remove(mmc_tmp_obj_path, false);
+			pv_resume_remove(mmc_tmp_obj_path);
+		}
 		goto out;
-	} else if (res->code != THTTP_STATUS_OK) {
-		pv_log(WARN,
-		       "'%s' could not be downloaded: returned HTTP error (code=%d; body='%s')",
-		       obj->id, res->code, res->body);
-		pv_fs_path_remove(mmc_tmp_obj_path, false);
+	}
+
+	if (resume.len && resume.len >= obj->size) {
+		pv_log(INFO, "object already downloaded to tmp path (%s)",
+		       mmc_tmp_obj_path);
+		goto verify;
+	}
+
+	if (resume.len)
+		pv_log(INFO, "resuming download of %s at %jd bytes", obj->id,
+		       (intmax_t)resume.len);
+
+	// download to tmp
+	lseek(fd, resume.len, SEEK_SET);
+	progress_update.hash = &resume;
+	progress_update.fd = fd;
+	pv_log(INFO, "downloading object to tmp path (%s)", mmc_tmp_obj_path);
+	code = trail_download_get(req, obj->geturl, crtfiles, resume.len, fd,
+				  &progress_update, err, sizeof(err));
+	if (code != THTTP_STATUS_OK && code != HTTP_STATUS_PARTIAL_CONTENT) {
+		if (code < 0) {
+			pv_log(WARN,
+			       "'%s' could not be downloaded: could not be initialized",
+			       obj->id);
+		} else if (!code) {
+			pv_log(WARN,
+			       "'%s' could not be downloaded: got no response",
+			       obj->id);
+		} else {
+			pv_log(WARN,
+			       "'%s' could not be downloaded: returned HTTP error (code=%d; body='%s')",
+			       obj->id, code, err);
+		}
+
+		// keep what we got for the next attempt
+		if (resumable && code != HTTP_STATUS_RANGE &&
+		    !fsync(fd) && !pv_resume_update(&resume, fd) &&
+		    resume.len) {
+			pv_resume_save(&resume, mmc_tmp_obj_path);
+			pv_log(INFO, "kept %jd bytes of %s to resume later",
+			       (intmax_t)resume.len, obj->id);
+		} else {
+			pv_fs_path_remove(mmc_tmp_obj_path, false);
+			pv_resume_remove(mmc_tmp_obj_path);
+		}
 		goto out;
 	}
 
+	if (resume.len && code == THTTP_STATUS_OK) {
+		pv_log(INFO, "server sent the whole object, discarding %jd bytes",
+		       (intmax_t)resume.len);
+		if (pv_resume_discard(&resume, fd)) {
+			pv_log(ERROR, "could not discard partial object: %s",
+			       strerror(errno));
+			pv_fs_path_remove(mmc_tmp_obj_path, false);
+			pv_resume_remove(mmc_tmp_obj_path);
+			goto out;
+		}
+	}
+
+	// hash whatever the progress callback did not get to see
+	pv_resume_update(&resume, fd);
+
 	if (use_volatile_tmp) {
 		pv_log(INFO, "copying %s to tmp path (%s)",
 		       volatile_tmp_obj_path, mmc_tmp_obj_path);
-		pv_fs_file_copy_fd(volatile_tmp_fd, obj_fd, true);
 		fd = obj_fd;
+		if (pv_fs_file_copy_fd(volatile_tmp_fd, obj_fd, true) < 0) {
+			pv_log(ERROR, "could not copy %s: %s",
+			       volatile_tmp_obj_path, strerror(errno));
+			remove(mmc_tmp_obj_path);
+			pv_resume_remove(mmc_tmp_obj_path);
+			goto out;
+		}
 	}
 	pv_log(DEBUG, "downloaded object to tmp path (%s)", mmc_tmp_obj_path);
 	fsync(fd);
 	pv_fs_path_sync(mmc_tmp_obj_path);
 
-	// verify file downloaded correctly before syncing to disk
-	lseek(fd, 0, SEEK_SET);
-	mbedtls_sha256_init(&sha256_ctx);
-	mbedtls_sha256_starts(&sha256_ctx, 0);
+verify:
+	// the data was hashed as it was downloaded, so this only reads what
+	// is left, if anything
+	pv_resume_update(&resume, fd);
+	mbedtls_sha256_finish(&resume.ctx, local_sha);
+	pv_resume_remove(mmc_tmp_obj_path);
+
+	tmp_sha = obj->sha256;
+	for (int i = 0, j = 0; i < (int)strlen(tmp_sha); i = i + 2, j++) {
+		char byte[3];
+		strncpy(byte, tmp_sha + i, 2);
+		byte[2] = 0;
+		cloud_sha[j] = strtoul(byte, NULL, 16);
+	}
+
+	// compare hashes FIXME: retry if fail
+	for (int i = 0; i < 32; i++) {
+		if (cloud_sha[i] != local_sha[i]) {
+			pv_log(WARN, "sha256 mismatch with local object");
+			remove(mmc_tmp_obj_path);
+			goto out;
+		}
+	}
+
+	pv_log(DEBUG, "renaming %s to %s...", mmc_tmp_obj_path, obj->objpath);
+	if (pv_fs_path_rename(mmc_tmp_obj_path, obj->objpath) < 0) {
+		pv_log(ERROR, "could not rename: %s", strerror(errno));
+	}
+
+	ret = 1;
+out:
+	mbedtls_sha256_free(&resume.ctx);
+	if (fd)
+		close(fd);
+	trail_download_request_free(req);
+
+	return ret;
+}
+
+// writes buf to a staged object and adds it to its hash
+static int trail_stage_write(int fd, unsigned char *buf, size_t len,
+			     mbedtls_sha256_context *ctx)
+{
+	if (pv_fs_file_write_nointr(fd, (char *)buf, len) != (ssize_t)len)
+		return -1;
+
+	mbedtls_sha256_update(ctx, buf, len);
+	return 0;
+}
+
+static int trail_stage_read(int in_fd, unsigned char *buf, size_t len)
+{
+	ssize_t bytes;
+
+	do {
+		bytes = read(in_fd, buf, len);
+	} while (bytes < 0 && errno == EINTR);
+
+	return bytes;
+}
+
+struct trail_stage_sink {
+	int fd;
+	mbedtls_sha256_context *ctx;
+};
+
+static int trail_stage_sink_write(void *opaque, unsigned char *buf,
+				  size_t len)
+{
+	struct trail_stage_sink *sink = opaque;
+
+	return trail_stage_write(sink->fd, buf, len, sink->ctx);
+}
+
+// inflates gzip data from in_fd into a staged object
+static int trail_stage_gunzip(int in_fd, int fd, mbedtls_sha256_context *ctx)
+{
+	struct trail_stage_sink sink = { .fd = fd, .ctx = ctx };
+	FILE *in;
+	int ret, dup_fd;
+
+	// in_fd stays open for the caller to close
+	dup_fd = dup(in_fd);
+	if (dup_fd < 0)
+		return -1;
+
+	in = fdopen(dup_fd, "r");
+	if (!in) {
+		close(dup_fd);
+		return -1;
+	}
+
+	ret = pv_zlib_uncompress_to(in, trail_stage_sink_write, &sink);
+	if (ret != Z_OK)
+		pv_log(WARN, "could not inflate object: zlib error %d", ret);
+
+	fclose(in);
+
+	return ret == Z_OK ? 0 : -1;
+}
+
+static int trail_stage_copy(int in_fd, int fd, mbedtls_sha256_context *ctx)
+{
+	unsigned char buf[64 * 1024];
+	int bytes;
+
+	while ((bytes = trail_stage_read(in_fd, buf, sizeof(buf))) > 0) {
+		if (trail_stage_write(fd, buf, bytes, ctx))
+			return -1;
+	}
+
+	return bytes;
+}
+
+/*
+ * A command whose output is staged. SIGCHLD stays blocked while it runs, so
+ * its exit status can be collected before the object is committed.
+ */
+struct trail_stage_cmd {
+	pid_t pid;
+	sigset_t oldmask;
+};
+
+// runs cmd and returns the read end of its stdout
+static int trail_stage_run(const char *cmd, struct trail_stage_cmd *c)
+{
+	char buf[2 * PATH_MAX + 128];
+	int out[2];
+
+	if (pipe(out)) {
+		pv_log(ERROR, "could not create pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	if (pvsignals_block_chld(&c->oldmask)) {
+		pv_log(ERROR, "could not block SIGCHLD: %s", strerror(errno));
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+
+	SNPRINTF_WTRUNC(buf, sizeof(buf), "%s", cmd);
+	c->pid = tsh_run_io(buf, 0, NULL, NULL, out, NULL);
+	if (c->pid < 0) {
+		pv_log(WARN, "could not run '%s'", cmd);
+		pvsignals_setmask(&c->oldmask);
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+	close(out[1]);
+
+	return out[0];
+}
+
+// reaps the command, returns 0 only if it exited with status 0
+static int trail_stage_wait(struct trail_stage_cmd *c)
+{
+	int status = 0;
+	pid_t pid;
+
+	do {
+		pid = waitpid(c->pid, &status, 0);
+	} while (pid < 0 && errno == EINTR);
+
+	pvsignals_setmask(&c->oldmask);
+
+	if (pid < 0) {
+		pv_log(WARN, "could not wait for %d: %s", c->pid,
+		       strerror(errno));
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pv_log(WARN, "command %d failed with status %d", c->pid,
+		       status);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stages obj from the data read from in_fd, gunzipped if asked to, hashing
+ * it on the way. in_fd is closed. If in_fd is the output of cmd, the command
+ * has to succeed too. The object only makes it to the pool if the hash
+ * matches.
+ */
+static int trail_stage_stream(struct pv_object *obj, int in_fd, bool gunzip,
+			      struct trail_stage_cmd *cmd)
+{
+	int ret = 0, fd;
+	char tmp_path[PATH_MAX];
+	char hex[65];
+	unsigned char sha[32];
+	bool anon;
+	mbedtls_sha256_context ctx;
+
+	fd = trail_stage_open(obj, tmp_path, sizeof(tmp_path), &anon);
+	if (fd < 0) {
+		close(in_fd);
+		if (cmd)
+			trail_stage_wait(cmd);
+		return 0;
+	}
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+
+	ret = gunzip ? trail_stage_gunzip(in_fd, fd, &ctx) :
+		       trail_stage_copy(in_fd, fd, &ctx);
+
+	mbedtls_sha256_finish(&ctx, sha);
+	mbedtls_sha256_free(&ctx);
+
+	if (ret)
+		pv_log(WARN, "could not stage %s: %s", obj->id,
+		       strerror(errno));
+
+	// closed first, so a command we stopped reading from gets SIGPIPE
+	close(in_fd);
+	if (cmd && trail_stage_wait(cmd))
+		ret = -1;
+
+	if (ret) {
+		ret = 0;
+		goto out;
+	}
+
+	// a failed or truncated stream cannot produce the right hash
+	for (int i = 0; i < 32; i++)
+		SNPRINTF_WTRUNC(hex + 2 * i, 3, "%02x", sha[i]);
+	if (!obj->sha256 || strcasecmp(hex, obj->sha256)) {
+		pv_log(WARN, "sha256 mismatch with staged object %s", obj->id);
+		goto out;
+	}
+
+	if (trail_stage_commit(fd, tmp_path, anon, obj->objpath) < 0) {
+		pv_log(ERROR, "could not commit %s: %s", obj->objpath,
+		       strerror(errno));
+		goto out;
+	}
+
+	ret = 1;
+out:
+	close(fd);
+	if (!ret && !anon)
+		pv_fs_path_remove(tmp_path, false);
+
+	return ret;
+}
+
+// rebuilds obj from its base object and the downloaded patch
+static int trail_delta_apply(struct pv_object *obj, const char *base_path,
+			     const char *delta_path)
+{
+	int ret = 0, in_fd;
+	char cmd[2 * PATH_MAX + sizeof(DELTA_ZSTD_CMD)];
+	struct trail_stage_cmd c;
+
+	SNPRINTF_WTRUNC(cmd, sizeof(cmd), DELTA_ZSTD_CMD, base_path,
+			delta_path);
+	in_fd = trail_stage_run(cmd, &c);
+	if (in_fd >= 0)
+		ret = trail_stage_stream(obj, in_fd, false, &c);
+
+	pv_fs_path_remove(delta_path, false);
+
+	return ret;
+}
+
+/*
+ * Returns 1 if obj was rebuilt from a patch, 0 if it has to be downloaded in
+ * full and -1 if the patch could not be downloaded.
+ */
+static int trail_download_delta(struct pantavisor *pv, struct pv_object *obj,
+				const char **crtfiles)
+{
+	char base_path[PATH_MAX];
+	char delta_path[PATH_MAX];
+	struct stat st;
+	struct pv_object delta;
+
+	if (!stat(obj->objpath, &st) || !trail_delta_usable(obj) ||
+	    obj_is_kernel_pvk(pv, obj))
+		return 0;
+
+	pv_paths_storage_object(base_path, PATH_MAX, obj->delta_base);
+	SNPRINTF_WTRUNC(delta_path, sizeof(delta_path), DELTA_OBJ_FMT,
+			obj->objpath);
+
+	// the patch goes through the same resumable and verified download
+	memset(&delta, 0, sizeof(delta));
+	delta.name = obj->name;
+	delta.id = obj->id;
+	delta.geturl = obj->delta_geturl;
+	delta.objpath = delta_path;
+	delta.size = obj->delta_size;
+	delta.sha256 = obj->delta_sha256;
+
+	pv_log(INFO, "downloading %jd bytes delta of '%s' against '%s'",
+	       (intmax_t)obj->delta_size, obj->id, obj->delta_base);
+
+	if (!trail_download_object(pv, &delta, crtfiles))
+		return -1;
+
+	if (!trail_delta_apply(obj, base_path, delta_path)) {
+		pv_log(WARN, "could not apply delta, downloading '%s' in full",
+		       obj->id);
+		return 0;
+	}
+
+	pv_log(INFO, "rebuilt '%s' from delta", obj->id);
+
+	return 1;
+}
+
+/*
+ * Objects can also be described by an index of content-defined chunks (see
+ * chunks.h). Chunks are kept once in the chunk store and the index of every
+ * object built from them is kept next to it as <obj>.idx. Chunks of a new
+ * object are taken from the store or from a local object whose index lists
+ * them, and only the rest is downloaded into the store.
+ *
+ * Objects are still whole files, as they are hard linked into the trails and
+ * used from there. Where the filesystem supports it, the block aligned part
+ * of each chunk is cloned from where it is kept instead of copied, so chunks
+ * shared between objects and the store take their blocks only once. A
+ * downloaded chunk that could not be cloned is dropped from the store once
+ * its object is built, as it would take its space twice. GC removes the
+ * chunks that no index references anymore.
+ */
+#define CHUNK_FETCHED (1 << 0)
+#define CHUNK_CLONED (1 << 1)
+
+/*
+ * Chunks of every local object that has an index, sorted by id. They are
+ * collected once per update, before any object is downloaded, and the paths
+ * of their objects are kept in trail_chunks_seed_paths.
+ */
+static struct pv_chunks trail_chunks_seeds = { 0 };
+static struct dl_list trail_chunks_seed_paths =
+	DL_LIST_HEAD_INIT(trail_chunks_seed_paths);
+
+static void trail_chunks_seeds_free(void)
+{
+	pv_chunks_free(&trail_chunks_seeds);
+	pv_storage_free_subdir(&trail_chunks_seed_paths);
+}
+
+static void trail_chunks_load_seeds(void)
+{
+	char path[PATH_MAX];
+	struct pv_path *o, *tmp, *p;
+	struct dl_list objects;
+	struct stat st;
+	size_t len;
+
+	trail_chunks_seeds_free();
+
+	dl_list_init(&objects);
+	if (pv_storage_get_objects(&objects))
+		goto out;
+
+	dl_list_for_each_safe(o, tmp, &objects, struct pv_path, list)
+	{
+		len = strlen(o->path);
+		if (len <= strlen(CHUNK_INDEX_EXT) ||
+		    strcmp(o->path + len - strlen(CHUNK_INDEX_EXT),
+			   CHUNK_INDEX_EXT))
+			continue;
+
+		o->path[len - strlen(CHUNK_INDEX_EXT)] = '\0';
+		pv_paths_storage_object(path, PATH_MAX, o->path);
+		if (stat(path, &st))
+			continue;
+
+		p = calloc(1, sizeof(struct pv_path));
+		if (!p)
+			break;
+		p->path = strdup(path);
+		dl_list_init(&p->list);
+		dl_list_add_tail(&trail_chunks_seed_paths, &p->list);
+
+		// a broken index only loses what it had parsed so far
+		pv_chunks_load_index(&trail_chunks_seeds, p->path);
+	}
+out:
+	pv_storage_free_subdir(&objects);
+
+	pv_chunks_sort(&trail_chunks_seeds);
+}
+
+static bool trail_chunks_in_store(struct pv_chunk *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	pv_paths_storage_chunk(path, PATH_MAX, c->id);
+
+	return !stat(path, &st) && st.st_size == c->size;
+}
+
+// the index is only taken if it matches the checksum from the metadata
+static char *trail_chunks_get_index(struct pv_object *obj,
+				    const char **crtfiles)
+{
+	char *index = NULL;
+	char hex[65];
+	unsigned char sha[32];
+	thttp_request_t *req;
+	thttp_response_t *res = NULL;
+	mbedtls_sha256_context ctx;
+
+	req = trail_download_request_new(obj->chunks_geturl, crtfiles);
+	if (!req)
+		return NULL;
+
+	res = thttp_request_do(req);
+	if (!res || res->code != THTTP_STATUS_OK || !res->body) {
+		pv_log(WARN, "could not get chunk index of '%s' (code=%d)",
+		       obj->id, res ? res->code : 0);
+		goto out;
+	}
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+	mbedtls_sha256_update(&ctx, (unsigned char *)res->body,
+			      strlen(res->body));
+	mbedtls_sha256_finish(&ctx, sha);
+	mbedtls_sha256_free(&ctx);
+
+	for (int i = 0; i < 32; i++)
+		SNPRINTF_WTRUNC(hex + 2 * i, 3, "%02x", sha[i]);
+	if (strcasecmp(hex, obj->chunks_sha256)) {
+		pv_log(WARN, "sha256 mismatch with chunk index of '%s'",
+		       obj->id);
+		goto out;
+	}
+
+	index = strdup(res->body);
+out:
+	if (res)
+		thttp_response_free(res);
+	trail_download_request_free(req);
+
+	return index;
+}
+
+static bool trail_chunks_usable(struct pantavisor *pv, struct pv_object *o)
+{
+	return pv_config_get_bool(PV_UPDATER_CHUNKS) && o->chunks_geturl &&
+	       o->chunks_sha256 && o->chunks_store && !trail_delta_usable(o) &&
+	       !obj_is_kernel_pvk(pv, o);
+}
+
+/*
+ * Gets the index of every object that can be built from chunks and works
+ * out how much of it has to be downloaded, so the update size only counts
+ * the missing chunks.
+ */
+static void trail_chunks_plan(struct pantavisor *pv)
+{
+	struct pv_chunks chunks = { 0 };
+	const char **crtfiles = pv_ph_get_certs(pv);
+	struct pv_object *o = NULL;
+	struct stat st;
+	off_t missing;
+	int reused;
+
+	trail_chunks_seeds_free();
+
+	if (!pv_config_get_bool(PV_UPDATER_CHUNKS))
+		return;
+
+	trail_chunks_load_seeds();
+
+	pv_objects_iter_begin(pv->update->pending, o)
+	{
+		if (o->chunks_index || !stat(o->objpath, &st) ||
+		    !trail_chunks_usable(pv, o))
+			continue;
+
+		o->chunks_index = trail_chunks_get_index(o, crtfiles);
+		if (!o->chunks_index ||
+		    pv_chunks_parse(&chunks, o->chunks_index, NULL)) {
+			pv_log(WARN, "no usable chunk index for '%s'", o->id);
+			if (o->chunks_index)
+				free(o->chunks_index);
+			o->chunks_index = NULL;
+			pv_chunks_free(&chunks);
+			continue;
+		}
+
+		missing = 0;
+		reused = 0;
+		for (int i = 0; i < chunks.len; i++) {
+			if (trail_chunks_in_store(&chunks.c[i]) ||
+			    pv_chunks_find(&trail_chunks_seeds, &chunks.c[i]))
+				reused++;
+			else
+				missing += chunks.c[i].size;
+		}
+		o->chunks_size = missing;
+
+		pv_log(INFO, "'%s' has %d chunks, %d found locally", o->id,
+		       chunks.len, reused);
+		pv_chunks_free(&chunks);
+	}
+	pv_objects_iter_end;
+}
+
+static int trail_chunks_fetch(struct pantavisor *pv, struct pv_object *obj,
+			      struct pv_chunk *c, const char **crtfiles)
+{
+	char path[PATH_MAX];
+	char dir[PATH_MAX];
+	char url[PATH_MAX];
+	struct pv_object chunk;
+
+	pv_paths_storage_chunk(path, PATH_MAX, c->id);
+	SNPRINTF_WTRUNC(dir, sizeof(dir), "%s", path);
+	if (pv_fs_mkdir_p(dirname(dir), 0755)) {
+		pv_log(ERROR, "could not create %s: %s", dir, strerror(errno));
+		return 0;
+	}
+	SNPRINTF_WTRUNC(url, sizeof(url), "%s/%s", obj->chunks_store, c->id);
+
+	// chunks go through the same resumable and verified download
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.name = obj->name;
+	chunk.id = c->id;
+	chunk.geturl = url;
+	chunk.objpath = path;
+	chunk.size = c->size;
+	chunk.sha256 = c->id;
+
+	return trail_download_object(pv, &chunk, crtfiles);
+}
+
+// hashes size bytes of src at offset, writing them to dst at dst_off if write
+static int trail_chunks_copy(int dst, off_t dst_off, int src, off_t offset,
+			     off_t size, bool write,
+			     mbedtls_sha256_context *ctx)
+{
+	unsigned char buf[64 * 1024];
+	ssize_t bytes;
+
+	while (size > 0) {
+		bytes = pread(src, buf,
+			      size < (off_t)sizeof(buf) ? size : sizeof(buf),
+			      offset);
+		if (bytes <= 0)
+			return -1;
+		if (write && pwrite(dst, buf, bytes, dst_off) != bytes)
+			return -1;
+		mbedtls_sha256_update(ctx, buf, bytes);
+		offset += bytes;
+		dst_off += bytes;
+		size -= bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Puts size bytes of src at offset into dst at dst_off. The whole blocks in
+ * the middle are cloned if both offsets sit at the same place within a block
+ * and the filesystem can do it, the rest is copied. Everything is hashed, as
+ * the object is checked as a whole. Returns the bytes cloned or -1.
+ */
+static off_t trail_chunks_put(int dst, off_t dst_off, const char *src,
+			      off_t offset, off_t size, blksize_t bs,
+			      mbedtls_sha256_context *ctx)
+{
+	struct file_clone_range range;
+	off_t head = 0, clone = 0;
+	int fd, ret = -1;
+
+	fd = open(src, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (bs > 0 && !((offset - dst_off) % bs)) {
+		head = (bs - dst_off % bs) % bs;
+		if (head > size)
+			head = size;
+		clone = (size - head) / bs * bs;
+	}
+
+	if (trail_chunks_copy(dst, dst_off, fd, offset, head, true, ctx))
+		goto out;
+
+	if (clone) {
+		range.src_fd = fd;
+		range.src_offset = offset + head;
+		range.src_length = clone;
+		range.dest_offset = dst_off + head;
+		if (ioctl(dst, FICLONERANGE, &range))
+			clone = 0;
+	}
+
+	// cloned blocks are only read to be hashed
+	if (clone &&
+	    trail_chunks_copy(dst, dst_off + head, fd, offset + head, clone,
+			      false, ctx))
+		goto out;
+
+	if (trail_chunks_copy(dst, dst_off + head + clone, fd,
+			      offset + head + clone, size - head - clone, true,
+			      ctx))
+		goto out;
+
+	ret = 0;
+out:
+	close(fd);
+	return ret ? -1 : clone;
+}
+
+static int trail_chunks_assemble(struct pv_object *obj,
+				 struct pv_chunks *chunks, char *flags)
+{
+	int ret = 0, fd;
+	char tmp_path[PATH_MAX];
+	char path[PATH_MAX];
+	char hex[65];
+	unsigned char sha[32];
+	bool anon;
+	off_t dst_off = 0, cloned;
+	struct pv_chunk *c;
+	struct stat st;
+	mbedtls_sha256_context ctx;
+
+	fd = trail_stage_open(obj, tmp_path, sizeof(tmp_path), &anon);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st))
+		st.st_blksize = 0;
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+
+	for (int i = 0; i < chunks->len; i++) {
+		c = &chunks->c[i];
+		if (c->seed) {
+			cloned = trail_chunks_put(fd, dst_off, c->seed,
+						  c->offset, c->size,
+						  st.st_blksize, &ctx);
+		} else {
+			pv_paths_storage_chunk(path, PATH_MAX, c->id);
+			cloned = trail_chunks_put(fd, dst_off, path, 0,
+						  c->size, st.st_blksize, &ctx);
+		}
+		if (cloned < 0) {
+			pv_log(WARN, "could not copy chunk %s: %s", c->id,
+			       strerror(errno));
+			ret = -1;
+			break;
+		}
+		if (cloned)
+			flags[i] |= CHUNK_CLONED;
+		dst_off += c->size;
+	}
+
+	mbedtls_sha256_finish(&ctx, sha);
+	mbedtls_sha256_free(&ctx);
+
+	if (ret)
+		goto out;
+	ret = -1;
+
+	for (int i = 0; i < 32; i++)
+		SNPRINTF_WTRUNC(hex + 2 * i, 3, "%02x", sha[i]);
+	if (!obj->sha256 || strcasecmp(hex, obj->sha256)) {
+		pv_log(WARN, "sha256 mismatch with object built from chunks");
+		goto out;
+	}
+
+	if (trail_stage_commit(fd, tmp_path, anon, obj->objpath) < 0) {
+		pv_log(ERROR, "could not commit %s: %s", obj->objpath,
+		       strerror(errno));
+		goto out;
+	}
+
+	ret = 0;
+out:
+	close(fd);
+	if (ret && !anon)
+		pv_fs_path_remove(tmp_path, false);
+
+	return !ret;
+}
+
+// keeps the index so the next updates can reuse the chunks of obj
+static void trail_chunks_save_index(struct pv_object *obj)
+{
+	char path[PATH_MAX];
+
+	if (!obj->chunks_index)
+		return;
+
+	SNPRINTF_WTRUNC(path, sizeof(path), CHUNK_INDEX_FMT, obj->objpath);
+	if (pv_fs_file_save(path, obj->chunks_index, 0644))
+		pv_log(WARN, "could not save chunk index %s: %s", path,
+		       strerror(errno));
+}
+
+/*
+ * Returns 1 if obj was built from chunks, 0 if it has to be downloaded in
+ * full and -1 if some chunk could not be downloaded. Chunks downloaded
+ * before a failure stay in the store, GC keeps them while the update is
+ * pending.
+ */
+static int trail_download_chunks(struct pantavisor *pv, struct pv_object *obj,
+				 const char **crtfiles)
+{
+	int ret = 0;
+	char path[PATH_MAX];
+	char *flags = NULL;
+	struct stat st;
+	struct pv_chunks chunks = { 0 };
+	struct pv_chunk *c, *seed;
+
+	// only objects planned by trail_chunks_plan()
+	if (!obj->chunks_index || !stat(obj->objpath, &st))
+		return 0;
+
+	if (pv_chunks_parse(&chunks, obj->chunks_index, NULL))
+		goto out;
+
+	flags = calloc(chunks.len, sizeof(char));
+	if (!flags)
+		goto out;
+
+	for (int i = 0; i < chunks.len; i++) {
+		c = &chunks.c[i];
+		if (trail_chunks_in_store(c))
+			continue;
+
+		seed = pv_chunks_find(&trail_chunks_seeds, c);
+		if (seed) {
+			c->seed = seed->seed;
+			c->offset = seed->offset;
+			continue;
+		}
+
+		if (!trail_chunks_fetch(pv, obj, c, crtfiles)) {
+			ret = -1;
+			goto out;
+		}
+		flags[i] |= CHUNK_FETCHED;
+	}
+
+	if (!trail_chunks_assemble(obj, &chunks, flags)) {
+		pv_log(WARN, "could not build '%s' from chunks", obj->id);
+		goto out;
+	}
+
+	trail_chunks_save_index(obj);
+
+	ret = 1;
+out:
+	for (int i = 0; flags && ret >= 0 && i < chunks.len; i++) {
+		if (!(flags[i] & CHUNK_FETCHED) ||
+		    (ret > 0 && flags[i] & CHUNK_CLONED))
+			continue;
+		pv_paths_storage_chunk(path, PATH_MAX, chunks.c[i].id);
+		pv_fs_path_remove(path, false);
+	}
+	if (flags)
+		free(flags);
+	pv_chunks_free(&chunks);
+
+	return ret;
+}
+
+/*
+ * Returns 1 if obj was decompressed from its compressed copy, 0 if it has to
+ * be downloaded as is and -1 if the compressed copy could not be downloaded.
+ */
+static int trail_download_comp(struct pantavisor *pv, struct pv_object *obj,
+			       const char **crtfiles)
+{
+	int ret = 0, in_fd;
+	char comp_path[PATH_MAX];
+	char cmd[PATH_MAX + sizeof(COMP_ZSTD_CMD)];
+	struct trail_stage_cmd c;
+	bool gunzip;
+	struct stat st;
+	struct pv_object comp;
+
+	if (!stat(obj->objpath, &st) || !trail_comp_usable(obj) ||
+	    obj_is_kernel_pvk(pv, obj))
+		return 0;
+
+	SNPRINTF_WTRUNC(comp_path, sizeof(comp_path), COMP_OBJ_FMT,
+			obj->objpath, obj->comp_format);
+
+	// the compressed copy goes through the usual download first
+	memset(&comp, 0, sizeof(comp));
+	comp.name = obj->name;
+	comp.id = obj->id;
+	comp.geturl = obj->comp_geturl;
+	comp.objpath = comp_path;
+	comp.size = obj->comp_size;
+	comp.sha256 = obj->comp_sha256;
+
+	pv_log(INFO, "downloading %s compressed '%s' (%jd of %jd bytes)",
+	       obj->comp_format, obj->id, (intmax_t)obj->comp_size,
+	       (intmax_t)obj->size);
+
+	if (!trail_download_object(pv, &comp, crtfiles))
+		return -1;
+
+	gunzip = !strcmp(obj->comp_format, "gzip");
+	if (gunzip) {
+		in_fd = open(comp_path, O_RDONLY);
+	} else {
+		SNPRINTF_WTRUNC(cmd, sizeof(cmd), COMP_ZSTD_CMD, comp_path);
+		in_fd = trail_stage_run(cmd, &c);
+	}
+
+	if (in_fd >= 0)
+		ret = trail_stage_stream(obj, in_fd, gunzip,
+					 gunzip ? NULL : &c);
+
+	pv_fs_path_remove(comp_path, false);
+
+	if (!ret)
+		pv_log(WARN, "could not decompress '%s', downloading it as is",
+		       obj->id);
+
+	return ret;
+}
+
+static int trail_fetch_object(struct pantavisor *pv, struct pv_object *obj,
+			      const char **crtfiles)
+{
+	int ret;
+
+	ret = trail_download_delta(pv, obj, crtfiles);
+	if (ret)
+		return ret > 0;
+
+	ret = trail_download_chunks(pv, obj, crtfiles);
+	if (ret)
+		return ret > 0;
+
+	ret = trail_download_comp(pv, obj, crtfiles);
+	if (!ret)
+		ret = trail_download_object(pv, obj, crtfiles) ? 1 : -1;
+
+	// objects fetched whole can still seed the chunks of later updates
+	if (ret > 0)
+		trail_chunks_save_index(obj);
+
+	return ret > 0;
+}
+
+/*
+ * Objects are linked into the trail as soon as they are verified. Linking
+ * only adds directory entries, so their directories are synced once after
+ * the last link instead of once per file.
+ */
+static struct dl_list trail_link_dirs = DL_LIST_HEAD_INIT(trail_link_dirs);
+
+static void trail_link_dir_add(const char *path)
+{
+	char buf[PATH_MAX];
+	char *dir;
+	struct pv_path *p, *tmp;
+
+	SNPRINTF_WTRUNC(buf, sizeof(buf), "%s", path);
+	dir = dirname(buf);
 
-	while ((bytes = read(fd, buf, 4096)) > 0) {
-		mbedtls_sha256_update(&sha256_ctx, buf, bytes);
+	dl_list_for_each_safe(p, tmp, &trail_link_dirs, struct pv_path, list)
+	{
+		if (!strcmp(p->path, dir))
+			return;
 	}
 
-	mbedtls_sha256_finish(&sha256_ctx, local_sha);
-	mbedtls_sha256_free(&sha256_ctx);
-
-	tmp_sha = obj->sha256;
-	for (int i = 0, j = 0; i < (int)strlen(tmp_sha); i = i + 2, j++) {
-		char byte[3];
-		strncpy(byte, tmp_sha + i, 2);
-		byte[2] = 0;
-		cloud_sha[j] = strtoul(byte, NULL, 16);
+	p = calloc(1, sizeof(struct pv_path));
+	if (!p)
+		return;
+	p->path = strdup(dir);
+	if (!p->path) {
+		free(p);
+		return;
 	}
+	dl_list_init(&p->list);
+	dl_list_add_tail(&trail_link_dirs, &p->list);
+}
 
-	// compare hashes FIXME: retry if fail
-	for (int i = 0; i < 32; i++) {
-		if (cloud_sha[i] != local_sha[i]) {
-			pv_log(WARN, "sha256 mismatch with local object");
-			remove(mmc_tmp_obj_path);
-			goto out;
+static void trail_link_dirs_sync(void)
+{
+	int fd;
+	struct pv_path *p, *tmp;
+
+	dl_list_for_each_safe(p, tmp, &trail_link_dirs, struct pv_path, list)
+	{
+		fd = open(p->path, O_RDONLY | O_DIRECTORY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
 		}
+		dl_list_del(&p->list);
+		free(p->path);
+		free(p);
 	}
+}
 
-	pv_log(DEBUG, "renaming %s to %s...", mmc_tmp_obj_path, obj->objpath);
-	if (pv_fs_path_rename(mmc_tmp_obj_path, obj->objpath) < 0) {
-		pv_log(ERROR, "could not rename: %s", strerror(errno));
+static int trail_link_object(struct pv_object *obj)
+{
+	struct stat st;
+	char *ext;
+
+	pv_fs_mkbasedir_p(obj->relpath, 0775);
+	ext = strrchr(obj->relpath, '.');
+	if (ext && (strcmp(ext, ".bind") == 0)) {
+		// copies are renamed into place once synced, so one of the
+		// right size is the result of an earlier call
+		if (!stat(obj->relpath, &st) &&
+		    st.st_size == pv_fs_path_get_size(obj->objpath))
+			return 0;
+		pv_log(INFO, "copying bind volume '%s' from '%s'",
+		       obj->relpath, obj->objpath);
+		if (pv_fs_file_copy(obj->objpath, obj->relpath, 0644) < 0) {
+			pv_log(ERROR, "could not copy objects");
+			return -1;
+		}
+		return 0;
+	}
+	if (link(obj->objpath, obj->relpath) < 0) {
+		if (errno != EEXIST) {
+			pv_log(ERROR, "unable to link %s, errno=%d",
+			       obj->relpath, errno);
+			return -1;
+		}
+	} else {
+		trail_link_dir_add(obj->relpath);
+		pv_log(DEBUG, "linked %s to %s", obj->relpath, obj->objpath);
 	}
 
-	ret = 1;
-out:
-	if (fd)
-		close(fd);
-	if (host)
-		free(host);
-	if (req)
-		thttp_request_free(req);
-	if (res)
-		thttp_response_free(res);
+	return 0;
+}
 
-	return ret;
+// links every pending object that shares the storage object of o
+static int trail_link_object_all(struct pv_update *u, struct pv_object *o)
+{
+	struct pv_object *curr = NULL;
+
+	pv_objects_iter_begin(u->pending, curr)
+	{
+		if (strcmp(curr->objpath, o->objpath))
+			continue;
+		if (trail_link_object(curr))
+			return -1;
+	}
+	pv_objects_iter_end;
+
+	return 0;
 }
 
 static int trail_link_objects(struct pantavisor *pv)
 {
 	struct pv_object *obj = NULL;
-	char *ext;
 
+	// most objects were already linked while downloading
 	pv_objects_iter_begin(pv->update->pending, obj)
 	{
-		pv_fs_mkbasedir_p(obj->relpath, 0775);
-		ext = strrchr(obj->relpath, '.');
-		if (ext && (strcmp(ext, ".bind") == 0)) {
-			pv_log(INFO, "copying bind volume '%s' from '%s'",
-			       obj->relpath, obj->objpath);
-			if (pv_fs_file_copy(obj->objpath, obj->relpath, 0644) <
-			    0)
-				pv_log(ERROR, "could not copy objects");
-			continue;
-		}
-		if (link(obj->objpath, obj->relpath) < 0) {
-			if (errno != EEXIST) {
-				pv_log(ERROR, "unable to link %s, errno=%d",
-				       obj->relpath, errno);
-				return -1;
-			}
-		} else {
-			pv_fs_path_sync(obj->relpath);
-			pv_log(DEBUG, "linked %s to %s", obj->relpath,
-			       obj->objpath);
-		}
+		if (trail_link_object(obj))
+			return -1;
 	}
 	pv_objects_iter_end;
 
+	trail_link_dirs_sync();
+
 	return pv_storage_meta_link_boot(pv, pv->update->pending);
 }
 
@@ -1861,24 +3451,496 @@ static int trail_check_update_size(struct pantavisor *pv)
 	return 0;
 }
 
+/*
+ * Reserves the space of every file to download up front, so a full disk is
+ * reported before any transfer starts and not after most of it. Only the
+ * file each object is actually fetched through is reserved: the patch or
+ * the compressed copy if there is one, the object itself otherwise. Chunks
+ * are reserved as they are downloaded.
+ */
+static int trail_reserve_objects(struct pantavisor *pv)
+{
+	int fd, ret = 0;
+	char obj_path[PATH_MAX];
+	char path[PATH_MAX];
+	char msg[UPDATE_PROGRESS_STATUS_MSG_SIZE];
+	struct stat st;
+	struct pv_object *o = NULL;
+	off_t size, chunked = 0;
+
+	if (trail_use_volatile_tmp())
+		return 0;
+
+	pv_objects_iter_begin(pv->update->pending, o)
+	{
+		if (!stat(o->objpath, &st) || obj_is_kernel_pvk(pv, o))
+			continue;
+
+		// chunked objects need their missing chunks and the object
+		size = trail_fetch_target(pv, o, obj_path, sizeof(obj_path));
+		if (!obj_path[0]) {
+			chunked += size + o->size;
+			continue;
+		}
+
+		SNPRINTF_WTRUNC(path, sizeof(path), MMC_TMP_OBJ_FMT, obj_path);
+		fd = open(path, O_CREAT | O_RDWR, 0644);
+		if (fd < 0)
+			continue;
+
+		ret = trail_reserve(fd, size);
+		if (ret && errno == ENOSPC) {
+			pv_storage_gc_run_needed(size);
+			ret = trail_reserve(fd, size);
+		}
+		close(fd);
+
+		if (ret) {
+			pv_log(ERROR, "could not reserve %jd bytes for %s: %s",
+			       (intmax_t)size, o->id, strerror(errno));
+			SNPRINTF_WTRUNC(msg, sizeof(msg),
+					"Could not reserve %jd B for object %s",
+					(intmax_t)size, o->id);
+			pv_update_set_status_msg(pv->update, UPDATE_NO_SPACE,
+						 msg);
+			return -1;
+		}
+	}
+	pv_objects_iter_end;
+
+	/*
+	 * Chunks go into many files that are not known yet, so there is no
+	 * file to reserve their space in. Only check it is free, after the
+	 * reservations above have taken theirs.
+	 */
+	if (chunked && pv_storage_gc_run_needed(chunked) < chunked) {
+		pv_log(ERROR, "could not find %jd bytes for chunked objects",
+		       (intmax_t)chunked);
+		SNPRINTF_WTRUNC(msg, sizeof(msg),
+				"Could not reserve %jd B for chunked objects",
+				(intmax_t)chunked);
+		pv_update_set_status_msg(pv->update, UPDATE_NO_SPACE, msg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Objects are fetched by up to PV_UPDATER_DOWNLOAD_JOBS processes at once.
+ * Each job runs in a forked process and sends its result back through a
+ * pipe: an optional payload followed by a status byte, '1' on success, 'S'
+ * if the job ran out of space and '0' on any other failure. Jobs never touch
+ * the update status, which would write the progress to disk and to the hub;
+ * the parent sets it from these bytes and the progress slots.
+ */
+struct trail_download_job {
+	struct pv_object *o;
+	pid_t pid;
+	int fd;
+	int slot;
+	char *res;
+	int len;
+};
+
+typedef int (*trail_download_work_f)(struct pantavisor *pv,
+				     struct pv_object *o, int fd);
+typedef int (*trail_download_done_f)(struct pantavisor *pv,
+				     struct trail_download_job *job);
+
+/*
+ * Object metadata fields sent back by meta jobs, in order, each followed by a
+ * '\0'. Sizes are sent as decimal strings.
+ */
+static const struct {
+	size_t off;
+	bool is_size;
+} trail_download_meta_fields[] = {
+	{ offsetof(struct pv_object, size), true },
+	{ offsetof(struct pv_object, sha256), false },
+	{ offsetof(struct pv_object, geturl), false },
+	{ offsetof(struct pv_object, delta_base), false },
+	{ offsetof(struct pv_object, delta_sha256), false },
+	{ offsetof(struct pv_object, delta_geturl), false },
+	{ offsetof(struct pv_object, delta_size), true },
+	{ offsetof(struct pv_object, chunks_geturl), false },
+	{ offsetof(struct pv_object, chunks_sha256), false },
+	{ offsetof(struct pv_object, chunks_store), false },
+	{ offsetof(struct pv_object, comp_format), false },
+	{ offsetof(struct pv_object, comp_sha256), false },
+	{ offsetof(struct pv_object, comp_geturl), false },
+	{ offsetof(struct pv_object, comp_size), true },
+};
+
+#define TRAIL_DOWNLOAD_META_FIELDS                                             \
+	(sizeof(trail_download_meta_fields) /                                  \
+	 sizeof(trail_download_meta_fields[0]))
+
+static int trail_download_meta_work(struct pantavisor *pv, struct pv_object *o,
+				    int fd)
+{
+	char *field, *str;
+
+	if (!trail_download_get_meta(pv, o))
+		return 0;
+
+	for (size_t i = 0; i < TRAIL_DOWNLOAD_META_FIELDS; i++) {
+		field = (char *)o + trail_download_meta_fields[i].off;
+		if (trail_download_meta_fields[i].is_size) {
+			if (dprintf(fd, "%jd%c", (intmax_t) * (off_t *)field,
+				    '\0') < 0)
+				return 0;
+			continue;
+		}
+
+		str = *(char **)field;
+		if (dprintf(fd, "%s%c", str ? str : "", '\0') < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int trail_download_meta_done(struct pantavisor *pv,
+				    struct trail_download_job *job)
+{
+	char *cur = job->res;
+	char *end = job->res + job->len;
+	char *field, **str;
+	size_t len;
+
+	for (size_t i = 0; i < TRAIL_DOWNLOAD_META_FIELDS; i++) {
+		if (cur >= end)
+			return 0;
+		len = strnlen(cur, end - cur);
+
+		field = (char *)job->o + trail_download_meta_fields[i].off;
+		if (trail_download_meta_fields[i].is_size) {
+			*(off_t *)field = atoll(cur);
+		} else {
+			str = (char **)field;
+			if (*str)
+				free(*str);
+			*str = (len && cur + len < end) ? strndup(cur, len) :
+							   NULL;
+		}
+
+		cur += len + 1;
+	}
+
+	return 1;
+}
+
+static int trail_download_object_work(struct pantavisor *pv,
+				      struct pv_object *o, int fd)
+{
+	return trail_fetch_object(pv, o, pv_ph_get_certs(pv));
+}
+
+// link what a job verified while the next jobs keep downloading
+static int trail_download_object_done(struct pantavisor *pv,
+				      struct trail_download_job *job)
+{
+	return !trail_link_object_all(pv->update, job->o);
+}
+
+// the same object can be listed more than once, only download it once
+static bool trail_download_is_dup(struct pv_update *u, struct pv_object *o)
+{
+	struct pv_object *curr = NULL;
+
+	pv_objects_iter_begin(u->pending, curr)
+	{
+		if (curr == o)
+			return false;
+		if (!strcmp(curr->objpath, o->objpath))
+			return true;
+	}
+	pv_objects_iter_end;
+
+	return false;
+}
+
+static int trail_download_spawn(struct pantavisor *pv,
+				struct trail_download_job *job,
+				trail_download_work_f work)
+{
+	int pfd[2];
+
+	if (pipe(pfd)) {
+		pv_log(ERROR, "could not create job pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	trail_download_slots[job->slot] = 0;
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		pv_log(ERROR, "could not fork download job: %s",
+		       strerror(errno));
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+
+	if (job->pid == 0) {
+		close(pfd[0]);
+		trail_download_slot = job->slot;
+
+		int ok = work(pv, job->o, pfd[1]);
+		const char *st = ok ? "1" : "0";
+		if (!ok && trail_download_no_space)
+			st = "S";
+		if (write(pfd[1], st, 1) < 0)
+			ok = 0;
+
+		close(pfd[1]);
+		_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(pfd[1]);
+	job->fd = pfd[0];
+	job->res = NULL;
+	job->len = 0;
+
+	return 0;
+}
+
+/*
+ * Returns 1 while the job is running, 0 when it succeeded, -2 if it ran out
+ * of space and -1 on any other failure.
+ */
+static int trail_download_collect(struct pantavisor *pv,
+				  struct trail_download_job *job,
+				  trail_download_done_f done)
+{
+	char buf[512];
+	ssize_t n;
+	int ret = -1;
+
+	n = read(job->fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 1;
+
+	if (n > 0) {
+		char *res = realloc(job->res, job->len + n);
+		if (res) {
+			memcpy(res + job->len, buf, n);
+			job->res = res;
+			job->len += n;
+			return 1;
+		}
+	}
+
+	// the job is done, its status is the last byte it sent
+	if (n == 0 && job->len > 0 && job->res[job->len - 1] == '1') {
+		job->len--;
+		ret = (!done || done(pv, job)) ? 0 : -1;
+	} else if (n == 0 && job->len > 0 && job->res[job->len - 1] == 'S') {
+		ret = -2;
+	}
+
+	close(job->fd);
+	// init may have reaped it already
+	waitpid(job->pid, NULL, WNOHANG);
+	if (job->res)
+		free(job->res);
+
+	job->o = NULL;
+	job->fd = -1;
+	job->res = NULL;
+
+	return ret;
+}
+
+// stops a job that is still running and forgets its result
+static void trail_download_kill(struct trail_download_job *job)
+{
+	kill(job->pid, SIGKILL);
+	close(job->fd);
+	// init may have reaped it already
+	waitpid(job->pid, NULL, WNOHANG);
+	if (job->res)
+		free(job->res);
+
+	job->o = NULL;
+	job->fd = -1;
+	job->res = NULL;
+}
+
+static struct pv_object *trail_download_next(struct pv_update *u,
+					     struct dl_list **pos, bool dedup)
+{
+	struct dl_list *head = &u->pending->objects;
+	struct pv_object *o;
+
+	while (*pos != head) {
+		o = dl_list_entry(*pos, struct pv_object, list);
+		*pos = (*pos)->next;
+		if (!dedup || !trail_download_is_dup(u, o))
+			return o;
+	}
+
+	return NULL;
+}
+
+static int trail_download_run(struct pantavisor *pv, int jobs,
+			      trail_download_work_f work,
+			      trail_download_done_f done, bool dedup)
+{
+	struct pv_update *u = pv->update;
+	struct trail_download_job job[TRAIL_DOWNLOAD_MAX_JOBS];
+	struct pollfd pfd[TRAIL_DOWNLOAD_MAX_JOBS];
+	struct dl_list *pos = u->pending->objects.next;
+	struct pv_object *next;
+	uint64_t finished = u->total.total_downloaded;
+	int running = 0, failed = 0, paused = 0;
+	struct pv_object *no_space = NULL;
+
+	if (jobs > TRAIL_DOWNLOAD_MAX_JOBS)
+		jobs = TRAIL_DOWNLOAD_MAX_JOBS;
+
+	trail_download_slots = mmap(NULL, sizeof(uint64_t) * jobs,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (trail_download_slots == MAP_FAILED) {
+		trail_download_slots = NULL;
+		pv_log(ERROR, "could not map download progress: %s",
+		       strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < jobs; i++)
+		job[i] = (struct trail_download_job){ .fd = -1, .slot = i };
+
+	next = trail_download_next(u, &pos, dedup);
+	while (running || (next && !failed && !paused)) {
+		// let running jobs finish if the download window just closed
+		if (next && !paused && trail_download_window_closed(u))
+			paused = 1;
+
+		// fill the free slots, unless something already went wrong
+		for (int i = 0; i < jobs && next && !failed && !paused; i++) {
+			if (job[i].o)
+				continue;
+
+			job[i].o = next;
+			if (trail_download_spawn(pv, &job[i], work)) {
+				job[i].o = NULL;
+				failed = 1;
+				break;
+			}
+			running++;
+			next = trail_download_next(u, &pos, dedup);
+		}
+
+		int n = 0;
+		for (int i = 0; i < jobs; i++) {
+			if (!job[i].o)
+				continue;
+			pfd[n].fd = job[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			n++;
+		}
+
+		if (!n)
+			break;
+
+		// nothing can be collected without poll, give up on the jobs
+		if (poll(pfd, n, TRAIL_DOWNLOAD_POLL_MS) < 0 && errno != EINTR) {
+			pv_log(ERROR, "could not poll download jobs: %s",
+			       strerror(errno));
+			for (int i = 0; i < jobs; i++) {
+				if (job[i].o)
+					trail_download_kill(&job[i]);
+			}
+			pv_update_set_status(u, UPDATE_INTERNAL_ERROR);
+			failed = -1;
+			break;
+		}
+
+		uint64_t active = 0;
+		for (int i = 0, p = 0; i < jobs; i++) {
+			if (!job[i].o)
+				continue;
+
+			if (pfd[p++].revents) {
+				struct pv_object *o = job[i].o;
+				int ret = trail_download_collect(pv, &job[i],
+								 done);
+				if (ret < 0) {
+					pv_log(WARN, "job for object %s failed",
+					       o->id);
+					failed = 1;
+				}
+				if (ret == -2)
+					no_space = o;
+				if (ret <= 0) {
+					finished += trail_download_slots[i];
+					running--;
+					continue;
+				}
+			}
+
+			active += trail_download_slots[i];
+		}
+
+		u->total.total_downloaded = finished + active;
+		u->total.current_time = time(NULL);
+	}
+
+	munmap(trail_download_slots, sizeof(uint64_t) * jobs);
+	trail_download_slots = NULL;
+
+	if (failed > 0 && no_space) {
+		char msg[UPDATE_PROGRESS_STATUS_MSG_SIZE];
+
+		SNPRINTF_WTRUNC(msg, sizeof(msg),
+				"Could not reserve space for object %s",
+				no_space->id);
+		pv_update_set_status_msg(u, UPDATE_NO_SPACE, msg);
+	} else if (failed > 0) {
+		pv_update_set_status(u, UPDATE_RETRY_DOWNLOAD);
+	}
+	if (failed)
+		return -1;
+
+	return paused;
+}
+
 static int trail_download_objects(struct pantavisor *pv)
 {
 	struct pv_update *u = pv->update;
 	struct pv_object *o = NULL;
 	const char **crtfiles = pv_ph_get_certs(pv);
+	int jobs = pv_config_get_int(PV_UPDATER_DOWNLOAD_JOBS);
+	int ret;
 
-	pv_objects_iter_begin(u->pending, o)
-	{
-		if (!trail_download_get_meta(pv, o)) {
-			pv_update_set_status(pv->update, UPDATE_RETRY_DOWNLOAD);
+	if (jobs > 1) {
+		ret = trail_download_run(pv, jobs, trail_download_meta_work,
+					 trail_download_meta_done, false);
+		if (ret) {
 			u->total.total_downloaded = 0;
 			return -1;
 		}
+	} else {
+		pv_objects_iter_begin(u->pending, o)
+		{
+			if (!trail_download_get_meta(pv, o)) {
+				pv_update_set_status(pv->update,
+						     UPDATE_RETRY_DOWNLOAD);
+				u->total.total_downloaded = 0;
+				return -1;
+			}
+		}
+		pv_objects_iter_end;
 	}
-	pv_objects_iter_end;
+
+	trail_chunks_plan(pv);
 
 	// check size and collect garbage if needed
-	if (trail_check_update_size(pv))
+	if (trail_check_update_size(pv) || trail_reserve_objects(pv))
 		return -1;
 
 	u->total.total_size = get_update_size(u);
@@ -1887,18 +3949,39 @@ static int trail_download_objects(struct pantavisor *pv)
 	u->total.current_time = time(NULL);
 	pv_update_set_status(pv->update, UPDATE_DOWNLOAD_PROGRESS);
 
-	pv_objects_iter_begin(u->pending, o)
-	{
-		if (!trail_download_object(pv, o, crtfiles)) {
-			pv_update_set_status(pv->update, UPDATE_RETRY_DOWNLOAD);
+	trail_rate_init();
+
+	if (jobs > 1) {
+		ret = trail_download_run(pv, jobs, trail_download_object_work,
+					 trail_download_object_done, true);
+		if (ret) {
 			u->total.total_downloaded = 0;
 			return -1;
 		}
+	} else {
+		pv_objects_iter_begin(u->pending, o)
+		{
+			if (trail_download_window_closed(u)) {
+				u->total.total_downloaded = 0;
+				return -1;
+			}
+			if (!trail_fetch_object(pv, o, crtfiles) ||
+			    trail_link_object(o)) {
+				if (u->status != UPDATE_NO_SPACE)
+					pv_update_set_status(
+						pv->update,
+						UPDATE_RETRY_DOWNLOAD);
+				u->total.total_downloaded = 0;
+				return -1;
+			}
+		}
+		pv_objects_iter_end;
 	}
 
+	trail_link_dirs_sync();
+
 	u->total.current_time = time(NULL);
 	pv_update_set_status(pv->update, UPDATE_DOWNLOAD_PROGRESS);
-	pv_objects_iter_end;
 	return 0;
 }
 
@@ -1965,10 +4048,14 @@ int pv_update_download(struct pantavisor *pv)
 
 	pv_log(DEBUG, "downloading update...");
 
+	if (trail_download_window_closed(pv->update))
+		goto out;
+
 	if (pv_update_check_download_retry(pv->update))
 		goto out;
 
 	ret = trail_download_objects(pv);
+	trail_chunks_seeds_free();
 	if (ret < 0) {
 		pv_log(WARN, "unable to download objects");
 		goto out;
@@ -2001,6 +4088,9 @@ int pv_update_install(struct pantavisor *pv)
 		goto out;
 	}
 
+	pv_storage_refs_add_rev(update->rev);
+	pv_storage_catalog_size_rev(update->rev);
+
 	if (!pv_storage_meta_expand_jsons(pv, pending)) {
 		pv_log(ERROR,
 		       "unable to install platform and pantavisor jsons");
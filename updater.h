@@ -74,7 +74,8 @@ enum update_status {
 	UPDATE_TESTING_REBOOT,
 	UPDATE_TESTING_NONREBOOT,
 	UPDATE_DOWNLOAD_PROGRESS,
-	UPDATE_ROLLEDBACK
+	UPDATE_ROLLEDBACK,
+	UPDATE_DOWNLOAD_PAUSED
 };
 
 struct download_info {
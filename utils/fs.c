@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "fs.h"
 #include "tsh.h"
 
@@ -266,9 +270,29 @@ ssize_t pv_fs_file_copy_fd(int src, int dst, bool close_src)
 	ssize_t read_bytes = 0;
 	ssize_t write_bytes = 0;
 
+	// let the kernel do the copy when both ends support it
+	while (read_bytes = copy_file_range(src, NULL, dst, NULL, SSIZE_MAX, 0),
+	       read_bytes > 0)
+		write_bytes += read_bytes;
+
+	// a failure half way leaves dst short, do not report a copy. If the
+	// kernel cannot copy between these files, fall back to read/write
+	if (read_bytes < 0 &&
+	    (write_bytes > 0 || (errno != ENOSYS && errno != EXDEV &&
+				 errno != EINVAL && errno != EOPNOTSUPP))) {
+		write_bytes = -1;
+		goto out;
+	}
+
+	// copy_file_range reports nothing to copy for some pseudo files, so
+	// only skip the read/write loop when something was copied
+	if (write_bytes > 0)
+		goto out;
+
 	while (read_bytes = read(src, buf, 4096), read_bytes > 0)
 		write_bytes += write(dst, buf, read_bytes);
 
+out:
 	if (close_src)
 		close_fd(&src);
 
@@ -293,7 +317,8 @@ int pv_fs_file_copy(const char *src, const char *dst, mode_t mode)
 	if (src_fd < 0)
 		goto out;
 
-	pv_fs_file_copy_fd(src_fd, tmp_fd, true);
+	if (pv_fs_file_copy_fd(src_fd, tmp_fd, false) < 0 || fsync(tmp_fd))
+		goto out;
 	close_fd(&tmp_fd);
 
 	ret = pv_fs_path_rename(tmp_path, dst);
@@ -181,23 +181,16 @@ char *pv_json_get_value(const char *buf, const char *key, jsmntok_t *tok,
 	return NULL;
 }
 
-char *pv_json_format(const char *buf, int len)
+int pv_json_format_to(char *dst, const char *buf, int len)
 {
-	char *json_string = NULL;
 	int idx = 0;
 	int json_str_idx = 0;
 
-	if (len > 0) //We make enough room for worst case.
-		json_string =
-			calloc((len * 6) + 1, sizeof(char)); //Add 1 for '\0'.
-
-	if (!json_string)
-		goto out;
 	while (len > idx) {
 		if (char_is_json_special(buf[idx])) {
 			struct json_format json_fmt = {
 				.src = buf,
-				.dst = json_string,
+				.dst = dst,
 				.off_dst = &json_str_idx,
 				.off_src = &idx,
 				.ch = buf[idx],
@@ -205,9 +198,24 @@ char *pv_json_format(const char *buf, int len)
 			};
 			json_fmt.format(&json_fmt);
 		} else
-			json_string[json_str_idx++] = buf[idx];
+			dst[json_str_idx++] = buf[idx];
 		idx++;
 	}
+
+	return json_str_idx;
+}
+
+char *pv_json_format(const char *buf, int len)
+{
+	char *json_string = NULL;
+
+	if (len > 0) //We make enough room for worst case.
+		json_string =
+			calloc((len * 6) + 1, sizeof(char)); //Add 1 for '\0'.
+
+	if (!json_string)
+		goto out;
+	pv_json_format_to(json_string, buf, len);
 out:
 	if (json_string) {
 		char *shrinked = realloc(json_string, strlen(json_string) + 1);
@@ -33,6 +33,8 @@ int pv_json_get_key_count(const char *buf, const char *key, jsmntok_t *tok,
 			  int tokc);
 char *pv_json_get_one_str(const char *buf, jsmntok_t **tok);
 char *pv_json_format(const char *buf, int len);
+// dst must have room for len * 6 bytes, returns the number of bytes written
+int pv_json_format_to(char *dst, const char *buf, int len);
 int pv_json_get_value_int(const char *buf, const char *key, jsmntok_t *tok,
 			  int tokc);
 char *pv_json_get_value(const char *buf, const char *key, jsmntok_t *tok,
@@ -72,7 +72,8 @@
    level is supplied, Z_VERSION_ERROR if the version of zlib.h and the
    version of the library linked do not match, or Z_ERRNO if there is
    an error reading or writing the files. */
-int pv_zlib_compress(FILE *source, FILE *dest, int level)
+static int pv_zlib_deflate(FILE *source, FILE *dest, int level,
+			   int window_bits)
 {
 	int ret, flush;
 	unsigned have;
@@ -84,7 +85,8 @@ int pv_zlib_compress(FILE *source, FILE *dest, int level)
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
 	strm.opaque = Z_NULL;
-	ret = deflateInit(&strm, level);
+	ret = deflateInit2(&strm, level, Z_DEFLATED, window_bits, 8,
+			   Z_DEFAULT_STRATEGY);
 	if (ret != Z_OK)
 		return ret;
 
@@ -123,13 +125,26 @@ int pv_zlib_compress(FILE *source, FILE *dest, int level)
 	return Z_OK;
 }
 
-/* Decompress from file source to file dest until stream ends or EOF.
-   inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
+int pv_zlib_compress(FILE *source, FILE *dest, int level)
+{
+	return pv_zlib_deflate(source, dest, level, MAX_WBITS);
+}
+
+/* Same as pv_zlib_compress, but with a gzip header and trailer so the
+   result can be read by gzip and by pv_zlib_uncompress */
+int pv_zlib_gzip(FILE *source, FILE *dest, int level)
+{
+	return pv_zlib_deflate(source, dest, level, 16 + MAX_WBITS);
+}
+
+/* Decompress from file source until EOF, handing the output to write().
+   Concatenated gzip members are inflated one after the other, as gzip
+   does. Returns Z_OK on success, Z_MEM_ERROR if memory could not be
    allocated for processing, Z_DATA_ERROR if the deflate data is
    invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
    the version of the library linked do not match, or Z_ERRNO if there
-   is an error reading or writing the files. */
-int pv_zlib_uncompress(FILE *source, FILE *dest)
+   is an error reading the source or write() fails. */
+int pv_zlib_uncompress_to(FILE *source, pv_zlib_write_fn write, void *opaque)
 {
 	int ret;
 	unsigned have;
@@ -147,7 +162,7 @@ int pv_zlib_uncompress(FILE *source, FILE *dest)
 	if (ret != Z_OK)
 		return ret;
 
-	/* decompress until deflate stream ends or end of file */
+	/* decompress until end of file */
 	do {
 		strm.avail_in = fread(in, 1, CHUNK, source);
 		if (ferror(source)) {
@@ -158,8 +173,15 @@ int pv_zlib_uncompress(FILE *source, FILE *dest)
 			break;
 		strm.next_in = in;
 
-		/* run inflate() on input until output buffer not full */
+		/* run inflate() on input until output buffer not full and
+		   all members in the input are done */
 		do {
+			if (ret == Z_STREAM_END) {
+				if (strm.avail_in == 0)
+					break;
+				(void)inflateReset(&strm);
+			}
+
 			strm.avail_out = CHUNK;
 			strm.next_out = out;
 			ret = inflate(&strm, Z_NO_FLUSH);
@@ -176,21 +198,35 @@ int pv_zlib_uncompress(FILE *source, FILE *dest)
 			}
 
 			have = CHUNK - strm.avail_out;
-			if (fwrite(out, 1, have, dest) != have ||
-			    ferror(dest)) {
+			if (have && write(opaque, out, have)) {
 				(void)inflateEnd(&strm);
 				return Z_ERRNO;
 			}
-		} while (strm.avail_out == 0);
-
-		/* done when inflate() says it's done */
-	} while (ret != Z_STREAM_END);
+		} while (strm.avail_out == 0 || strm.avail_in);
+	} while (1);
 
 	/* clean up and return */
 	(void)inflateEnd(&strm);
 	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
+static int pv_zlib_fwrite(void *opaque, unsigned char *buf, size_t len)
+{
+	FILE *dest = opaque;
+
+	if (fwrite(buf, 1, len, dest) != len || ferror(dest))
+		return -1;
+
+	return 0;
+}
+
+/* Decompress from file source to file dest until EOF, see
+   pv_zlib_uncompress_to() for the return values. */
+int pv_zlib_uncompress(FILE *source, FILE *dest)
+{
+	return pv_zlib_uncompress_to(source, pv_zlib_fwrite, dest);
+}
+
 /* report a zlib or i/o error */
 void pv_zlib_report_error(int ret, FILE *src, FILE *dst)
 {
@@ -23,8 +23,12 @@
 #define PVZLIB_H
 #include <stdio.h>
 
+typedef int (*pv_zlib_write_fn)(void *opaque, unsigned char *buf, size_t len);
+
 int pv_zlib_compress(FILE *source, FILE *dest, int level);
+int pv_zlib_gzip(FILE *source, FILE *dest, int level);
 int pv_zlib_uncompress(FILE *source, FILE *dest);
+int pv_zlib_uncompress_to(FILE *source, pv_zlib_write_fn write, void *opaque);
 void pv_zlib_report_error(int ret, FILE *src, FILE *dst);
 
 #endif